@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,23 @@
 #include <libgen.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "dfs_protocol.h"
+#include "dfs_tar.h"
+#include "dfs_crc32c.h"
+#include "dfs_gzip.h"
+#include "dfs_deflate.h"
+#include "dfs_sha256.h"
+#include "dfs_session.h"
+#include "dfs_index.h"
+#include "dfs_filter.h"
 
 #define BUFFER_SIZE 4096
 #define COMMAND_SIZE 1024
@@ -23,43 +41,221 @@
 #define S4_PORT 8389
 #define MAX_PENDING 10
 #define S1_BASE_DIR "~/S1"
+#define S1_CACHE_DIR "~/.S1_cache"   /* materialized downltar archive of the .c files */
+#define S1_PARTIAL_DIR "~/.S1_partial"   /* .c uploads in progress, kept for resuming */
+#define S1_INDEX_FILE "~/.S1_index"      /* namespace index snapshot, plus a journal of later changes */
+#define POOL_MAX_IDLE 8           // Most warm connections kept per backend
+#define POOL_MIN_IDLE 1           // Warm connections kept even when demand drops
+#define POOL_IDLE_TIMEOUT 60      // Seconds before an idle connection is closed
+#define POOL_PING_AFTER 5         // Seconds idle before a connection is health-checked
+#define POOL_PING_TIMEOUT_MS 1000
+#define S1_WORKER_THREADS 16      // Default workers running commands in --epoll mode
+#define MAX_EVENTS 64
+#define LIST_DEADLINE_MS 2000     // How long dispfnames waits for S2/S3/S4 before answering without them
+#define CONNECT_TIMEOUT_MS 1000   // Backend connect attempts give up after this
+#define LIST_BATCH_SIZE 16384     // Bytes of names sent to the client per listing frame
+#define TAR_MERGE_BUFFER (1024 * 1024)  // Members up to this size are gathered and sent in one piece
+#define TAR_MERGE_CHUNK (64 * 1024)     // Bytes read from a source archive at a time
+#define TAR_META_MAX (64 * 1024)        // Most pax data read for one member
+#define INDEX_RETRY_INTERVAL 10         // Seconds between attempts to load a server the index lacks
+#define INDEX_RESYNC_INTERVAL 600       // Seconds before a loaded server's inventory is read again
+#define INDEX_SAVE_INTERVAL 60          // Seconds between snapshots of a changed index
+#define WATCH_RETRY_INTERVAL 10         // Seconds between attempts to watch a backend's presence filter
+
+// Pool of warm connections to one backend (idle sockets ordered oldest first)
+typedef struct {
+    int sockets[POOL_MAX_IDLE];
+    time_t last_used[POOL_MAX_IDLE];
+    int idle_count;
+    int in_use;
+    int demand;          // Peak concurrent use in the current window
+    time_t window_start;
+    pthread_mutex_t lock;  // Shared by worker threads in --epoll mode
+} ConnectionPool;
 
 // Server information structure
 typedef struct {
     char ip[16];
     int port;
+    ConnectionPool pool;
 } ServerInfo;
 
+// Where a connection is in reading its next command (--epoll mode)
+typedef enum {
+    CONN_READ_HEADER,
+    CONN_READ_COMMAND,
+    CONN_DISCARD_COMMAND,  // Command too long; skip it, then reject it
+    CONN_BUSY              // Handed to a worker thread
+} ConnectionState;
+
+// Per-client state machine driven by the event loop
+typedef struct ClientConnection {
+    int fd;
+    ConnectionState state;
+    unsigned char header_raw[DFS_HEADER_SIZE];
+    size_t header_got;
+    DfsHeader request;
+    char command[COMMAND_SIZE];
+    uint64_t command_got;
+    int oversized;
+    struct ClientConnection *next;   // Link in the work or completion queue
+} ClientConnection;
+
+// Queue of connections passed between the event loop and the workers
+typedef struct {
+    ClientConnection *head;
+    ClientConnection *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} ConnectionQueue;
+
+// Listing entries waiting to be sent to the client as one DATA frame
+typedef struct {
+    char data[LIST_BATCH_SIZE];
+    size_t len;
+} ListingBatch;
+
+// Combined downltar output shared by the threads fetching each archive
+typedef struct {
+    pthread_mutex_t lock;       // Held while one whole member is written to the client
+    int client_socket;
+    uint32_t request_id;
+    uint64_t total;             // Bytes and CRC32C of the merged stream so far
+    uint32_t crc;
+    int failed;                 // Set once any archive or the client breaks
+    int members;
+    const char *scope;          // Directory under ~/S1 to archive ("" for the whole store)
+    const char *option;         // Incremental option passed to every archive ("" for full)
+    const char *manifest;
+    uint64_t manifest_len;
+    char *deletions;            // Deleted names gathered from every trailer
+    size_t deletions_len;
+} TarMerge;
+
+// Archive compressed between the socketpair it is written into and the client
+typedef struct {
+    int archive_socket;         // Reader end of the socketpair
+    int client_socket;
+    int result;                 // dfs_gzip_archive() outcome
+} TarGzipJob;
+
+// One archive feeding a combined downltar
+typedef struct {
+    TarMerge *merge;
+    const char *type;
+    int server_type;            // 1 for the local .c tree
+    int local_socket;           // Writer end of the socketpair for the local tree
+    char error[BUFFER_SIZE];    // Why this archive failed, empty otherwise
+} TarSource;
+
 // Function prototypes
 void process_client(int client_socket);
+void dispatch_client_command(char *command, int client_socket, const DfsHeader *request);
+void run_event_loop(int server_socket, int worker_count);
+int advance_connection(ClientConnection *conn);
+void *command_worker(void *arg);
+void queue_push(ConnectionQueue *queue, ClientConnection *conn);
+ClientConnection *queue_pop(ConnectionQueue *queue);
+ClientConnection *queue_take_all(ConnectionQueue *queue);
+int set_nonblocking(int fd, int enabled);
 int create_directory_path(const char *path);
 int connect_to_server(const char *server_ip, int port);
-int handle_upload_command(char *command, int client_socket);
-int handle_download_command(char *command, int client_socket);
-int handle_remove_command(char *command, int client_socket);
-int handle_download_tar_command(char *command, int client_socket);
-int handle_display_filenames_command(char *command, int client_socket);
-void transfer_file_to_server(const char *filename, const char *dest_path, int server_type);
-int send_file_to_client(const char *filepath, int client_socket);
-int receive_file_from_client(const char *filepath, int client_socket);
+ServerInfo *get_server_info(int server_type);
+int acquire_backend_connection(int server_type);
+void release_backend_connection(int server_type, int sock, int reusable);
+int is_connection_healthy(int sock, time_t idle_for);
+void shrink_pool(ConnectionPool *pool, time_t now);
+int handle_upload_command(char *command, int client_socket, const DfsHeader *request);
+int handle_download_command(char *command, int client_socket, const DfsHeader *request);
+int handle_remove_command(char *command, int client_socket, const DfsHeader *request);
+int handle_stat_command(char *command, int client_socket, const DfsHeader *request);
+int handle_download_tar_command(char *command, int client_socket, const DfsHeader *request);
+int handle_combined_tar(const char *filetypes, const char *scope, const char *option, const char *manifest,
+                        uint64_t manifest_len, int client_socket, const DfsHeader *request);
+int stream_local_tar(int sock, uint32_t request_id, const char *scope, const char *option, const char *manifest);
+int relay_backend_tar(const char *filetype, const char *scope, const char *option, const char *manifest,
+                      uint64_t manifest_len, int client_socket, const DfsHeader *request);
+void build_create_tar_command(char *command, size_t size, const char *filetype, int server_type,
+                              const char *scope, const char *option);
+void *gzip_tar_worker(void *arg);
+void *tar_source_worker(void *arg);
+void *local_tar_writer(void *arg);
+int finish_combined_tar(TarMerge *merge, TarSource *sources, int source_count, const DfsHeader *request);
+int merge_emit(TarMerge *merge, const void *buf, size_t len);
+int merge_trailer(TarSource *source, int sock, const DfsHeader *frame, uint64_t received, uint32_t crc);
+int read_tar_source(TarSource *source, int sock);
+int handle_display_filenames_command(char *command, int client_socket, const DfsHeader *request);
+int relay_file_to_server(const char *filename, const char *dest_path, int server_type, int level,
+                         const char *options, int client_socket, const DfsHeader *request, int *stored,
+                         DfsIndexFile *file);
+int send_file_to_client(const char *filepath, int level, const DfsRange *range, int client_socket,
+                        const DfsHeader *request);
+int receive_file_from_client(const char *filepath, int client_socket, const DfsHeader *data);
+int receive_multipart_upload(const char *command, const char *filepath, const char *session, int client_socket,
+                             const DfsHeader *request);
+void update_tar_cache(const char *filepath, int appended);
+void *index_rebuild_worker(void *arg);
+int load_index_inventory(int server_type);
+void index_local_file(const char *filepath);
+void index_backend_file(const char *filepath, int server_type, int stored, const DfsIndexFile *file);
+void *filter_watch_worker(void *arg);
+void note_backend_upload(const char *filepath, int server_type);
+int is_known_missing(const char *filepath, int server_type);
 void expand_path(const char *path, char *expanded_path);
 int is_path_in_s1(const char *path);
 char* get_file_extension(const char *filename);
 void handle_client_disconnect(int signal);
-int retrieve_file_from_server(const char *filename, int server_type);
+int relay_file_from_server(const char *filename, int server_type, int level, const DfsRange *range,
+                           int client_socket, const DfsHeader *request);
 void get_corresponding_server_path(const char *s1_path, char *server_path, int server_type);
-int list_files_in_directory(const char *path, char *file_list, int client_socket);
+int list_files_in_directory(const char *path, int cursor_rank, const char *cursor_name,
+                            int client_socket, const DfsHeader *request);
+char **collect_sorted_page(const char *dirpath, const char *extension, const char *after, int limit, int *count);
+int compare_strings(const void *a, const void *b);
+int get_listing_rank(const char *type);
+int batch_append(ListingBatch *batch, const char *line, int client_socket, const DfsHeader *request);
+
+// File types in listing order; .c lives in S1, the rest in S2, S3 and S4
+const char *listing_types[4] = {"c", "pdf", "txt", "zip"};
 
 // Global variables for server connections
-ServerInfo s2_info = {"127.0.0.1", S2_PORT};
-ServerInfo s3_info = {"127.0.0.1", S3_PORT};
-ServerInfo s4_info = {"127.0.0.1", S4_PORT};
+ServerInfo s2_info = {"127.0.0.1", S2_PORT, {.lock = PTHREAD_MUTEX_INITIALIZER}};
+ServerInfo s3_info = {"127.0.0.1", S3_PORT, {.lock = PTHREAD_MUTEX_INITIALIZER}};
+ServerInfo s4_info = {"127.0.0.1", S4_PORT, {.lock = PTHREAD_MUTEX_INITIALIZER}};
+
+// Event loop queues: commands waiting for a worker, and connections handed back
+ConnectionQueue work_queue = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+ConnectionQueue done_queue = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+int done_event_fd = -1;
+
+// Every file S1 serves, kept in anonymous shared memory that forked children and workers all update
+DfsIndex namespace_index;
 
-int main() {
+// Copies of S2, S3 and S4's presence filters, kept current by a watch thread per server
+DfsFilter *backend_filters[DFS_INDEX_SERVERS + 1];
+
+int main(int argc, char *argv[]) {
     int server_socket, client_socket;
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_addr_size;
     pid_t child_pid;
+    int event_mode = 0;
+    int worker_count = S1_WORKER_THREADS;
+
+    // Optional event-driven mode: S1 --epoll [--workers N]
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--epoll") == 0) {
+            event_mode = 1;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+            if (worker_count < 1) {
+                worker_count = 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--epoll] [--workers N]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Create socket
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -98,6 +294,39 @@ int main() {
 
     printf("S1 server started. Listening on port %d...\n", S1_PORT);
 
+    // Serve from the last snapshot straight away while the servers' inventories are read again
+    char s1_base[MAX_FILEPATH];
+    char index_file[MAX_FILEPATH];
+    expand_path(S1_BASE_DIR, s1_base);
+    expand_path(S1_INDEX_FILE, index_file);
+    if (dfs_index_open(&namespace_index, index_file, s1_base) == 0) {
+        pthread_t rebuilder;
+        if (pthread_create(&rebuilder, NULL, index_rebuild_worker, NULL) == 0) {
+            pthread_detach(rebuilder);
+        }
+    } else {
+        perror("Error opening namespace index; every lookup goes to the servers");
+    }
+
+    // Follow each backend's presence filter, so a missing file is answered without asking
+    for (int server_type = 2; server_type <= DFS_INDEX_SERVERS; server_type++) {
+        pthread_t watcher;
+        backend_filters[server_type] = dfs_filter_create();
+        if (backend_filters[server_type] &&
+            pthread_create(&watcher, NULL, filter_watch_worker, (void *)(intptr_t)server_type) == 0) {
+            pthread_detach(watcher);
+        }
+    }
+
+    // A client vanishing mid-sendfile must not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    if (event_mode) {
+        run_event_loop(server_socket, worker_count);
+        close(server_socket);
+        return 0;
+    }
+
     // Set up signal handler for child processes
     signal(SIGCHLD, handle_client_disconnect);
 
@@ -151,16 +380,16 @@ void handle_client_disconnect(int signal) {
 // Function to process client requests
 void process_client(int client_socket) {
     char command[COMMAND_SIZE];
-    int bytes_received;
+    DfsHeader request;
+    int status;
 
-    // Enter infinite loop to process client commands
+    // Enter loop to process framed client commands until the client disconnects
     while (1) {
-        // Receive command from client
-        memset(command, 0, COMMAND_SIZE);
-        bytes_received = recv(client_socket, command, COMMAND_SIZE - 1, 0);
+        // Receive command header from client
+        status = dfs_recv_header(client_socket, &request);
         
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
+        if (status != 0) {
+            if (status == 1) {
                 printf("Client disconnected.\n");
             } else {
                 perror("Error receiving command");
@@ -168,39 +397,317 @@ void process_client(int client_socket) {
             break;
         }
 
-        command[bytes_received] = '\0';
-        printf("Received command: %s\n", command);
+        // Receive command text
+        if (dfs_recv_payload(client_socket, &request, command, COMMAND_SIZE) != 0) {
+            if (errno != EMSGSIZE) {
+                perror("Error receiving command");
+                break;
+            }
+            dfs_reply(client_socket, &request, DFS_STATUS_INVALID, "ERROR: Command too long");
+            continue;
+        }
+        printf("Received command [%u]: %s\n", request.request_id, command);
 
         // Process command
-        if (strncmp(command, "uploadf ", 8) == 0) {
-            handle_upload_command(command, client_socket);
-        } else if (strncmp(command, "downlf ", 7) == 0) {
-            handle_download_command(command, client_socket);
-        } else if (strncmp(command, "removef ", 8) == 0) {
-            handle_remove_command(command, client_socket);
-        } else if (strncmp(command, "downltar ", 9) == 0) {
-            handle_download_tar_command(command, client_socket);
-        } else if (strncmp(command, "dispfnames ", 11) == 0) {
-            handle_display_filenames_command(command, client_socket);
-        } else {
+        dispatch_client_command(command, client_socket, &request);
+    }
+}
+
+// Function to run one client command through its handler
+void dispatch_client_command(char *command, int client_socket, const DfsHeader *request) {
+    switch (request->opcode) {
+        case DFS_OP_UPLOADF:
+            handle_upload_command(command, client_socket, request);
+            break;
+        case DFS_OP_DOWNLF:
+            handle_download_command(command, client_socket, request);
+            break;
+        case DFS_OP_REMOVEF:
+            handle_remove_command(command, client_socket, request);
+            break;
+        case DFS_OP_DOWNLTAR:
+            handle_download_tar_command(command, client_socket, request);
+            break;
+        case DFS_OP_DISPFNAMES:
+            handle_display_filenames_command(command, client_socket, request);
+            break;
+        case DFS_OP_STATF:
+            handle_stat_command(command, client_socket, request);
+            break;
+        default:
             // Invalid command
-            char response[] = "ERROR: Invalid command";
-            send(client_socket, response, strlen(response), 0);
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Invalid command");
+            break;
+    }
+}
+
+// Function to serve all clients from one epoll loop, with commands run by worker threads
+void run_event_loop(int server_socket, int worker_count) {
+    int epoll_fd = epoll_create1(0);
+    done_event_fd = eventfd(0, EFD_NONBLOCK);
+    if (epoll_fd < 0 || done_event_fd < 0 || set_nonblocking(server_socket, 1) != 0) {
+        perror("Error setting up event loop");
+        exit(EXIT_FAILURE);
+    }
+
+    // The listening socket and the worker wake-up fd are told apart by a NULL/&fd pointer
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev);
+    ev.data.ptr = &done_event_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_event_fd, &ev);
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, command_worker, NULL) != 0) {
+            perror("Error starting worker thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+
+    printf("S1: Event loop running with %d worker threads\n", worker_count);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for events");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                // Accept everything pending on the listening socket
+                while (1) {
+                    struct sockaddr_in client_addr;
+                    socklen_t client_addr_size = sizeof(client_addr);
+                    int client_socket = accept4(server_socket, (struct sockaddr *)&client_addr,
+                                                &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (client_socket < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                            perror("Error accepting connection");
+                        }
+                        break;
+                    }
+
+                    ClientConnection *conn = calloc(1, sizeof(ClientConnection));
+                    if (!conn) {
+                        close(client_socket);
+                        continue;
+                    }
+                    conn->fd = client_socket;
+                    conn->state = CONN_READ_HEADER;
+
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.ptr = conn;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) != 0) {
+                        close(client_socket);
+                        free(conn);
+                        continue;
+                    }
+                    printf("New client connected: %s:%d\n",
+                           inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+                }
+            } else if (events[i].data.ptr == &done_event_fd) {
+                // Workers finished; watch those connections for their next command
+                uint64_t count;
+                while (read(done_event_fd, &count, sizeof(count)) > 0);
+
+                ClientConnection *conn = queue_take_all(&done_queue);
+                while (conn) {
+                    ClientConnection *next = conn->next;
+                    conn->state = CONN_READ_HEADER;
+                    conn->header_got = 0;
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.ptr = conn;
+                    if (set_nonblocking(conn->fd, 1) != 0 ||
+                        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) != 0) {
+                        close(conn->fd);
+                        free(conn);
+                    }
+                    conn = next;
+                }
+            } else {
+                ClientConnection *conn = events[i].data.ptr;
+                int result = advance_connection(conn);
+                if (result < 0) {
+                    // Closing the fd also removes it from the epoll set
+                    close(conn->fd);
+                    free(conn);
+                } else if (result == 1) {
+                    // A whole command arrived; a worker runs it with blocking I/O
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    set_nonblocking(conn->fd, 0);
+                    conn->state = CONN_BUSY;
+                    queue_push(&work_queue, conn);
+                }
+            }
+        }
+    }
+
+    close(epoll_fd);
+}
+
+// Function to read as much of the next command as is available
+// (returns 1 when a full command is ready, 0 to wait for more, -1 to close)
+int advance_connection(ClientConnection *conn) {
+    while (1) {
+        char scratch[BUFFER_SIZE];
+        void *dest;
+        size_t want;
+
+        if (conn->state == CONN_READ_HEADER) {
+            dest = conn->header_raw + conn->header_got;
+            want = DFS_HEADER_SIZE - conn->header_got;
+        } else if (conn->state == CONN_READ_COMMAND) {
+            dest = conn->command + conn->command_got;
+            want = conn->request.payload_len - conn->command_got;
+        } else if (conn->state == CONN_DISCARD_COMMAND) {
+            uint64_t left = conn->request.payload_len - conn->command_got;
+            dest = scratch;
+            want = left < BUFFER_SIZE ? left : BUFFER_SIZE;
+        } else {
+            return 0;
+        }
+
+        if (want > 0) {
+            ssize_t received = recv(conn->fd, dest, want, 0);
+            if (received < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                perror("Error receiving command");
+                return -1;
+            }
+            if (received == 0) {
+                if (conn->state != CONN_READ_HEADER || conn->header_got != 0) {
+                    fprintf(stderr, "Client disconnected mid-command\n");
+                } else {
+                    printf("Client disconnected.\n");
+                }
+                return -1;
+            }
+
+            if (conn->state == CONN_READ_HEADER) {
+                conn->header_got += received;
+            } else {
+                conn->command_got += received;
+            }
+            if ((size_t)received < want) {
+                continue;
+            }
+        }
+
+        if (conn->state == CONN_READ_HEADER) {
+            if (dfs_decode_header(conn->header_raw, &conn->request) != 0) {
+                perror("Error receiving command");
+                return -1;
+            }
+            conn->command_got = 0;
+            conn->oversized = conn->request.payload_len >= COMMAND_SIZE;
+            conn->state = conn->oversized ? CONN_DISCARD_COMMAND : CONN_READ_COMMAND;
+        } else if (conn->command_got == conn->request.payload_len) {
+            conn->command[conn->oversized ? 0 : conn->command_got] = '\0';
+            return 1;
+        }
+    }
+}
+
+// Function run by each worker thread: execute queued commands one at a time
+void *command_worker(void *arg) {
+    (void)arg;
+    while (1) {
+        ClientConnection *conn = queue_pop(&work_queue);
+
+        if (conn->oversized) {
+            dfs_reply(conn->fd, &conn->request, DFS_STATUS_INVALID, "ERROR: Command too long");
+        } else {
+            printf("Received command [%u]: %s\n", conn->request.request_id, conn->command);
+            dispatch_client_command(conn->command, conn->fd, &conn->request);
+        }
+
+        // Hand the connection back to the event loop for its next command
+        queue_push(&done_queue, conn);
+        uint64_t one = 1;
+        if (write(done_event_fd, &one, sizeof(one)) < 0) {
+            perror("Error waking event loop");
         }
     }
+    return NULL;
+}
+
+// Function to append a connection to a queue and wake one waiter
+void queue_push(ConnectionQueue *queue, ClientConnection *conn) {
+    pthread_mutex_lock(&queue->lock);
+    conn->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = conn;
+    } else {
+        queue->head = conn;
+    }
+    queue->tail = conn;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Function to wait for the next connection on a queue
+ClientConnection *queue_pop(ConnectionQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->head) {
+        pthread_cond_wait(&queue->ready, &queue->lock);
+    }
+
+    ClientConnection *conn = queue->head;
+    queue->head = conn->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    conn->next = NULL;
+    pthread_mutex_unlock(&queue->lock);
+    return conn;
+}
+
+// Function to take every connection currently on a queue without waiting
+ClientConnection *queue_take_all(ConnectionQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    ClientConnection *conn = queue->head;
+    queue->head = NULL;
+    queue->tail = NULL;
+    pthread_mutex_unlock(&queue->lock);
+    return conn;
+}
+
+// Function to switch a socket between blocking and non-blocking mode
+int set_nonblocking(int fd, int enabled) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
 }
 
 // Function to handle uploadf command
-int handle_upload_command(char *command, int client_socket) {
+int handle_upload_command(char *command, int client_socket, const DfsHeader *request) {
     char filename[MAX_FILENAME];
     char dest_path[MAX_FILEPATH];
+    char offer[16] = "";
     char response[BUFFER_SIZE];
     char *ext;
     
-    // Parse command
-    if (sscanf(command, "uploadf %s %s", filename, dest_path) != 2) {
+    // Parse command: uploadf <filename> <dest_path> [z=<level>] [sha256=<hex>] [resume=<session>]
+    //                [multipart=<size>|part=<offset>|commit]
+    if (sscanf(command, "uploadf %255s %1023s %15s", filename, dest_path, offer) < 2) {
         snprintf(response, BUFFER_SIZE, "ERROR: Invalid uploadf command syntax");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -211,14 +718,14 @@ int handle_upload_command(char *command, int client_socket) {
     // Verify path is within S1
     if (!is_path_in_s1(expanded_path)) {
         snprintf(response, BUFFER_SIZE, "ERROR: Destination path must be within ~/S1");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
     // Create directory path if it doesn't exist
     if (create_directory_path(expanded_path) != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: Failed to create destination directory");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
         return -1;
     }
 
@@ -226,7 +733,7 @@ int handle_upload_command(char *command, int client_socket) {
     ext = get_file_extension(filename);
     if (!ext) {
         snprintf(response, BUFFER_SIZE, "ERROR: File must have an extension");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -234,26 +741,95 @@ int handle_upload_command(char *command, int client_socket) {
     if (strcmp(ext, "c") != 0 && strcmp(ext, "pdf") != 0 && 
         strcmp(ext, "txt") != 0 && strcmp(ext, "zip") != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file type. Only .c, .pdf, .txt, and .zip are allowed");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
-    // Send acknowledgment to client for file transfer
-    snprintf(response, BUFFER_SIZE, "READY_TO_RECEIVE");
-    send(client_socket, response, strlen(response), 0);
-
     // Prepare full path for file
     char filepath[MAX_FILEPATH];
     snprintf(filepath, MAX_FILEPATH, "%s/%s", expanded_path, basename(filename));
 
-    // Receive file from client
-    if (receive_file_from_client(filepath, client_socket) != 0) {
-        return -1;
-    }
+    // The client may offer to compress the body; already-compressed types are taken raw
+    int level = dfs_deflate_worthwhile(filename) ? dfs_deflate_parse_offer(offer) : 0;
+
+    // A broken upload can be continued by naming its session again
+    char resume_id[DFS_SESSION_ID_LEN + 1];
+    int resuming = dfs_session_find_id(command, resume_id);
+
+    // A multipart upload goes as several commands: open, one per part, then commit
+    uint64_t total;
+    uint64_t part_offset;
+    int multipart = dfs_session_find_multipart(command, &total);
+    int part = dfs_session_find_part(command, &part_offset);
+    int commit = dfs_session_is_commit(command);
 
     // Transfer file to appropriate server based on extension
     if (strcmp(ext, "c") == 0) {
-        // Keep .c files in S1
+        if (multipart || part || commit) {
+            return receive_multipart_upload(command, filepath, resuming ? resume_id : NULL, client_socket, request);
+        }
+
+        // The body goes to a part file first and is renamed into place once complete
+        char partial_dir[MAX_FILEPATH];
+        char session_id[DFS_SESSION_ID_LEN + 1];
+        char part_path[MAX_FILEPATH];
+        uint64_t offset;
+        expand_path(S1_PARTIAL_DIR, partial_dir);
+        if (dfs_session_open(partial_dir, resuming ? resume_id : NULL, session_id, part_path,
+                             sizeof(part_path), &offset) != 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to store uploaded file");
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+            return -1;
+        }
+
+        // Send acknowledgment to client for file transfer, accepting any compression offered and
+        // naming the session and the bytes already held
+        int used = snprintf(response, BUFFER_SIZE, "READY_TO_RECEIVE");
+        if (level > 0) {
+            used += snprintf(response + used, BUFFER_SIZE - used, " z=%d", level);
+        }
+        snprintf(response + used, BUFFER_SIZE - used, " session=%s offset=%llu", session_id,
+                 (unsigned long long)offset);
+        dfs_reply(client_socket, request, DFS_STATUS_READY, response);
+
+        // Client follows up with a DATA frame carrying the rest of the file body
+        DfsHeader data;
+        if (dfs_recv_header(client_socket, &data) != 0) {
+            perror("Error receiving file header from client");
+            return -1;
+        }
+        if (data.opcode != DFS_OP_DATA) {
+            // Read past whatever came instead, so the client's next command is read from its start
+            dfs_discard(client_socket, data.payload_len);
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Expected the file body");
+            return -1;
+        }
+
+        // Keep .c files in S1, extending the cached archive when the file is new. The client's digest
+        // covers every attempt that went into the part file; one that does not match starts over
+        struct stat existing;
+        char hex[DFS_SHA256_HEX_LEN + 1];
+        int replaced = stat(filepath, &existing) == 0;
+        int received = receive_file_from_client(part_path, client_socket, &data);
+        if (received == 0 &&
+            dfs_session_verify(part_path, dfs_sha256_find_word(command, hex) ? hex : NULL) != 0) {
+            unlink(part_path);
+            received = DFS_CHECKSUM_MISMATCH;
+        }
+        if (received == 0 && rename(part_path, filepath) != 0) {
+            perror("Error moving uploaded file into place");
+            received = -1;
+        }
+        if (received == 0) {
+            update_tar_cache(filepath, !replaced);
+            index_local_file(filepath);
+        }
+        if (received != 0) {
+            snprintf(response, BUFFER_SIZE, received == DFS_CHECKSUM_MISMATCH ? "ERROR: Checksum mismatch"
+                                                                              : "ERROR: Failed to store uploaded file");
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+            return -1;
+        }
         snprintf(response, BUFFER_SIZE, "SUCCESS: File uploaded successfully to S1");
     } else {
         int server_type = 0;
@@ -266,32 +842,66 @@ int handle_upload_command(char *command, int client_socket) {
             server_type = 4;  // S4
         }
         
-        // Transfer file to appropriate server
-        transfer_file_to_server(filepath, dest_path, server_type);
-        
-        // Delete file from S1 after transfer
-        if (remove(filepath) != 0) {
-            perror("Warning: Failed to delete file from S1 after transfer");
+        // The client's content digest, session and multipart step go on to the server, which keeps
+        // the part file
+        char options[192] = "";
+        char hex[DFS_SHA256_HEX_LEN + 1];
+        int used = 0;
+        if (dfs_sha256_find_word(command, hex)) {
+            used += snprintf(options + used, sizeof(options) - used, " sha256=%s", hex);
+        }
+        if (resuming) {
+            used += snprintf(options + used, sizeof(options) - used, " resume=%s", resume_id);
+        }
+        if (multipart) {
+            snprintf(options + used, sizeof(options) - used, " multipart=%llu", (unsigned long long)total);
+        } else if (part) {
+            snprintf(options + used, sizeof(options) - used, " part=%llu", (unsigned long long)part_offset);
+        } else if (commit) {
+            snprintf(options + used, sizeof(options) - used, " commit");
+        }
+
+        // Stream the body straight through to the server without staging it here; a server that
+        // already holds content with the client's digest stores it without the body
+        int stored;
+        DfsIndexFile file;
+        int relayed = relay_file_to_server(filepath, dest_path, server_type, level, options,
+                                           client_socket, request, &stored, &file);
+
+        // The index learns what the server now holds at the path from its answer, before the client
+        // can ask for the file; opening a multipart upload or storing one part leaves the path as it was
+        if (!multipart && !part && stored != 0) {
+            note_backend_upload(filepath, server_type);
+            index_backend_file(filepath, server_type, stored, &file);
+        }
+        if (relayed < 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to transfer file to S%d", server_type);
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+            return -1;
+        }
+        if (relayed == 1) {
+            // The server answered for itself (no body wanted, or the body refused); the client has that answer
+            return 0;
         }
-        
         snprintf(response, BUFFER_SIZE, "SUCCESS: File uploaded successfully");
     }
 
     // Send success response to client
-    send(client_socket, response, strlen(response), 0);
+    dfs_reply(client_socket, request, DFS_STATUS_OK, response);
     return 0;
 }
 
 // Function to handle downlf command
-int handle_download_command(char *command, int client_socket) {
+int handle_download_command(char *command, int client_socket, const DfsHeader *request) {
     char filepath[MAX_FILEPATH];
+    char offer[16] = "";
     char response[BUFFER_SIZE];
     char *ext;
     
-    // Parse command
-    if (sscanf(command, "downlf %s", filepath) != 1) {
+    // Parse command: downlf <filepath> [z=<level>] [range=<first>-<last>|<first>-|-<n>] [split]
+    if (sscanf(command, "downlf %1023s %15s", filepath, offer) < 1) {
         snprintf(response, BUFFER_SIZE, "ERROR: Invalid downlf command syntax");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -302,7 +912,7 @@ int handle_download_command(char *command, int client_socket) {
     // Verify path is within S1
     if (!is_path_in_s1(expanded_path)) {
         snprintf(response, BUFFER_SIZE, "ERROR: File path must be within ~/S1");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -310,7 +920,7 @@ int handle_download_command(char *command, int client_socket) {
     ext = get_file_extension(expanded_path);
     if (!ext) {
         snprintf(response, BUFFER_SIZE, "ERROR: File must have an extension");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -318,25 +928,45 @@ int handle_download_command(char *command, int client_socket) {
     if (strcmp(ext, "c") != 0 && strcmp(ext, "pdf") != 0 && 
         strcmp(ext, "txt") != 0 && strcmp(ext, "zip") != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file type. Only .c, .pdf, .txt, and .zip are allowed");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+        return -1;
+    }
+
+    // Compress the body if the client can take it and the type is worth it
+    int level = dfs_deflate_worthwhile(expanded_path) ? dfs_deflate_parse_offer(offer) : 0;
+
+    // A byte range (also how a client resumes a download) is read where the file is kept
+    DfsRange range;
+    if (dfs_session_parse_range(command, &range) != 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Invalid range");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
+    // A client that would fetch a large file in ranges says "split"; such a file gets the statf answer
+    // instead of its body, so smaller ones cost no extra round trip
+    char stat_command[COMMAND_SIZE];
+    int split = dfs_session_wants_split(command) && !range.suffix && range.first == 0 &&
+                range.last == DFS_RANGE_TO_END &&
+                snprintf(stat_command, COMMAND_SIZE, "statf %s", filepath) < COMMAND_SIZE;
+
     // Process based on file type
     if (strcmp(ext, "c") == 0) {
-        // Check if file exists in S1
-        if (access(expanded_path, F_OK) != 0) {
+        // Check if file exists in S1, from the index when it can tell
+        int indexed = dfs_index_lookup(&namespace_index, expanded_path, 1, NULL);
+        if (indexed == 0 || (indexed < 0 && access(expanded_path, F_OK) != 0)) {
             snprintf(response, BUFFER_SIZE, "ERROR: File not found");
-            send(client_socket, response, strlen(response), 0);
+            dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, response);
             return -1;
         }
         
-        // Send acknowledgment to client for file transfer
-        snprintf(response, BUFFER_SIZE, "READY_TO_SEND");
-        send(client_socket, response, strlen(response), 0);
+        struct stat st;
+        if (split && stat(expanded_path, &st) == 0 && (uint64_t)st.st_size >= DFS_PARALLEL_MIN_SIZE) {
+            return handle_stat_command(stat_command, client_socket, request);
+        }
         
         // Send file to client
-        return send_file_to_client(expanded_path, client_socket);
+        return send_file_to_client(expanded_path, level, &range, client_socket, request);
     } else {
         // Determine server type
         int server_type = 0;
@@ -349,39 +979,35 @@ int handle_download_command(char *command, int client_socket) {
             server_type = 4;  // S4
         }
         
-        // Retrieve file from appropriate server
-        if (retrieve_file_from_server(expanded_path, server_type) != 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to retrieve file from server");
-            send(client_socket, response, strlen(response), 0);
+        // A file the index or the server's presence filter knows is not there is answered without asking
+        if (is_known_missing(expanded_path, server_type)) {
+            snprintf(response, BUFFER_SIZE, "ERROR: File not found");
+            dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, response);
             return -1;
         }
         
-        // Send acknowledgment to client for file transfer
-        snprintf(response, BUFFER_SIZE, "READY_TO_SEND");
-        send(client_socket, response, strlen(response), 0);
-        
-        // Send file to client
-        int result = send_file_to_client(expanded_path, client_socket);
-        
-        // Delete temporary file after sending
-        if (remove(expanded_path) != 0) {
-            perror("Warning: Failed to delete temporary file after sending");
+        // The index tells the size without asking; when it cannot, the server is asked through statf
+        DfsIndexFile file;
+        if (split && (dfs_index_lookup(&namespace_index, expanded_path, server_type, &file) != 1 ||
+                      file.size >= DFS_PARALLEL_MIN_SIZE)) {
+            return handle_stat_command(stat_command, client_socket, request);
         }
         
-        return result;
+        // Stream the file from the appropriate server straight to the client
+        return relay_file_from_server(expanded_path, server_type, level, &range, client_socket, request);
     }
 }
 
 // Function to handle removef command
-int handle_remove_command(char *command, int client_socket) {
+int handle_remove_command(char *command, int client_socket, const DfsHeader *request) {
     char filepath[MAX_FILEPATH];
     char response[BUFFER_SIZE];
     char *ext;
     
     // Parse command
-    if (sscanf(command, "removef %s", filepath) != 1) {
+    if (sscanf(command, "removef %1023s", filepath) != 1) {
         snprintf(response, BUFFER_SIZE, "ERROR: Invalid removef command syntax");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -392,7 +1018,7 @@ int handle_remove_command(char *command, int client_socket) {
     // Verify path is within S1
     if (!is_path_in_s1(expanded_path)) {
         snprintf(response, BUFFER_SIZE, "ERROR: File path must be within ~/S1");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -400,7 +1026,7 @@ int handle_remove_command(char *command, int client_socket) {
     ext = get_file_extension(expanded_path);
     if (!ext) {
         snprintf(response, BUFFER_SIZE, "ERROR: File must have an extension");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -408,7 +1034,7 @@ int handle_remove_command(char *command, int client_socket) {
     if (strcmp(ext, "c") != 0 && strcmp(ext, "pdf") != 0 && 
         strcmp(ext, "txt") != 0 && strcmp(ext, "zip") != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file type. Only .c, .pdf, .txt, and .zip are allowed");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -416,481 +1042,887 @@ int handle_remove_command(char *command, int client_socket) {
     if (strcmp(ext, "c") == 0) {
         // Remove .c file from S1
         if (remove(expanded_path) != 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to remove file - %s", strerror(errno));
-            send(client_socket, response, strlen(response), 0);
+            int error = errno;
+            if (error == ENOENT) {
+                dfs_index_remove(&namespace_index, expanded_path, 1);
+            }
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to remove file - %s", strerror(error));
+            dfs_reply(client_socket, request, error == ENOENT ? DFS_STATUS_NOT_FOUND : DFS_STATUS_ERROR, response);
             return -1;
         }
+        update_tar_cache(expanded_path, 0);
+        dfs_index_remove(&namespace_index, expanded_path, 1);
     } else {
         // Determine server type and send remove command
         int server_type = 0;
-        int server_socket = -1;
         
         if (strcmp(ext, "pdf") == 0) {
             server_type = 2;  // S2
-            server_socket = connect_to_server(s2_info.ip, s2_info.port);
         } else if (strcmp(ext, "txt") == 0) {
             server_type = 3;  // S3
-            server_socket = connect_to_server(s3_info.ip, s3_info.port);
         } else if (strcmp(ext, "zip") == 0) {
             server_type = 4;  // S4
-            server_socket = connect_to_server(s4_info.ip, s4_info.port);
         }
         
-        if (server_socket < 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server");
-            send(client_socket, response, strlen(response), 0);
+        // A file the index or the server's presence filter knows is not there is answered without asking
+        if (is_known_missing(expanded_path, server_type)) {
+            snprintf(response, BUFFER_SIZE, "ERROR: File not found");
+            dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, response);
             return -1;
         }
         
-        // Convert S1 path to server path
+        // Convert S1 path to server path; one cut short could name another file, so it is refused
         char server_path[MAX_FILEPATH];
+        char server_command[COMMAND_SIZE];
         get_corresponding_server_path(expanded_path, server_path, server_type);
+        if (snprintf(server_command, COMMAND_SIZE, "REMOVE %s", server_path) >= COMMAND_SIZE) {
+            snprintf(response, BUFFER_SIZE, "ERROR: File path too long");
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+            return -1;
+        }
         
-        // Send remove command to server
-        char server_command[COMMAND_SIZE];
-        snprintf(server_command, COMMAND_SIZE, "REMOVE %s", server_path);
+        int server_socket = acquire_backend_connection(server_type);
+        if (server_socket < 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server");
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+            return -1;
+        }
         
-        if (send(server_socket, server_command, strlen(server_command), 0) < 0) {
+        // Send remove command to server
+        if (dfs_send_message(server_socket, DFS_OP_REMOVE, DFS_STATUS_OK,
+                             dfs_next_request_id(), server_command) != 0) {
             snprintf(response, BUFFER_SIZE, "ERROR: Failed to send command to server");
-            close(server_socket);
-            send(client_socket, response, strlen(response), 0);
+            release_backend_connection(server_type, server_socket, 0);
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
             return -1;
         }
         
         // Receive response from server
-        memset(response, 0, BUFFER_SIZE);
-        if (recv(server_socket, response, BUFFER_SIZE - 1, 0) <= 0) {
+        DfsHeader reply;
+        if (dfs_recv_header(server_socket, &reply) != 0 ||
+            dfs_recv_payload(server_socket, &reply, response, BUFFER_SIZE) != 0) {
             snprintf(response, BUFFER_SIZE, "ERROR: Failed to receive response from server");
-            close(server_socket);
-            send(client_socket, response, strlen(response), 0);
+            release_backend_connection(server_type, server_socket, 0);
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
             return -1;
         }
         
-        close(server_socket);
+        release_backend_connection(server_type, server_socket, 1);
         
-        if (strncmp(response, "SUCCESS", 7) != 0) {
-            send(client_socket, response, strlen(response), 0);
+        // Removed, or already gone: either way the index drops it
+        if (reply.status == DFS_STATUS_OK || reply.status == DFS_STATUS_NOT_FOUND) {
+            dfs_index_remove(&namespace_index, expanded_path, server_type);
+        }
+        if (reply.status != DFS_STATUS_OK) {
+            dfs_reply(client_socket, request, reply.status, response);
             return -1;
         }
     }
 
     // Send success response to client
     snprintf(response, BUFFER_SIZE, "SUCCESS: File removed successfully");
-    send(client_socket, response, strlen(response), 0);
+    dfs_reply(client_socket, request, DFS_STATUS_OK, response);
     return 0;
 }
 
+// Function to handle statf command: the size and digest of a file, so a client can fetch it in ranges
+int handle_stat_command(char *command, int client_socket, const DfsHeader *request) {
+    char filepath[MAX_FILEPATH];
+    char response[BUFFER_SIZE];
+    char *ext;
+    
+    // Parse command: statf <filepath>
+    if (sscanf(command, "statf %1023s", filepath) != 1) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Invalid statf command syntax");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+        return -1;
+    }
+
+    // Expand file path
+    char expanded_path[MAX_FILEPATH];
+    expand_path(filepath, expanded_path);
+    
+    // Verify path is within S1
+    if (!is_path_in_s1(expanded_path)) {
+        snprintf(response, BUFFER_SIZE, "ERROR: File path must be within ~/S1");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+        return -1;
+    }
+
+    // Determine file type
+    ext = get_file_extension(expanded_path);
+    if (!ext || (strcmp(ext, "c") != 0 && strcmp(ext, "pdf") != 0 &&
+                 strcmp(ext, "txt") != 0 && strcmp(ext, "zip") != 0)) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file type. Only .c, .pdf, .txt, and .zip are allowed");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+        return -1;
+    }
+
+    // Determine server type; a downlf that may be split comes through here, so a missing file is
+    // answered from the index or the server's presence filter
+    int server_type = 1;
+    
+    if (strcmp(ext, "pdf") == 0) {
+        server_type = 2;  // S2
+    } else if (strcmp(ext, "txt") == 0) {
+        server_type = 3;  // S3
+    } else if (strcmp(ext, "zip") == 0) {
+        server_type = 4;  // S4
+    }
+    
+    if (is_known_missing(expanded_path, server_type)) {
+        snprintf(response, BUFFER_SIZE, "ERROR: File not found");
+        dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, response);
+        return -1;
+    }
+
+    if (server_type == 1) {
+        // .c files are kept here without a digest, so hash the file, but only when it is large enough
+        // to be fetched in ranges; a smaller one goes over one stream checked by its CRC32C
+        char hex[DFS_SHA256_HEX_LEN + 1] = "-";
+        struct stat st;
+        int fd = open(expanded_path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: File not found");
+            dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, response);
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        if ((uint64_t)st.st_size >= DFS_PARALLEL_MIN_SIZE && dfs_sha256_file(fd, hex) != 0) {
+            snprintf(hex, sizeof(hex), "-");
+        }
+        close(fd);
+        snprintf(response, BUFFER_SIZE, "%llu %s", (unsigned long long)st.st_size, hex);
+        dfs_reply(client_socket, request, DFS_STATUS_OK, response);
+        return 0;
+    }
+
+    // Convert S1 path to server path
+    char server_path[MAX_FILEPATH];
+    char server_command[COMMAND_SIZE];
+    get_corresponding_server_path(expanded_path, server_path, server_type);
+    if (snprintf(server_command, COMMAND_SIZE, "STAT %s", server_path) >= COMMAND_SIZE) {
+        snprintf(response, BUFFER_SIZE, "ERROR: File path too long");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+        return -1;
+    }
+
+    // Ask the server holding the file
+    int server_socket = acquire_backend_connection(server_type);
+    if (server_socket < 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server");
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+        return -1;
+    }
+    
+    // The server's answer goes to the client as it is
+    DfsHeader reply;
+    if (dfs_send_message(server_socket, DFS_OP_STAT, DFS_STATUS_OK,
+                         dfs_next_request_id(), server_command) != 0 ||
+        dfs_recv_header(server_socket, &reply) != 0 ||
+        dfs_recv_payload(server_socket, &reply, response, BUFFER_SIZE) != 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to receive response from server");
+        release_backend_connection(server_type, server_socket, 0);
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+        return -1;
+    }
+    
+    release_backend_connection(server_type, server_socket, 1);
+    dfs_reply(client_socket, request, reply.status, response);
+    return reply.status == DFS_STATUS_OK ? 0 : -1;
+}
+
 // Function to handle downltar command
-int handle_download_tar_command(char *command, int client_socket) {
+int handle_download_tar_command(char *command, int client_socket, const DfsHeader *request) {
     char filetype[BUFFER_SIZE];
+    char dirpath[MAX_FILEPATH] = "";
+    char option[64] = "";
+    char words[3][MAX_FILEPATH];
     char buffer[BUFFER_SIZE] = {0};
-    char cmd[BUFFER_SIZE] = {0};
-    
-    // Parse command
-    if (sscanf(command, "downltar %s", filetype) != 1) {
+    int compress = 0;
+    
+    // Parse command: downltar <filetype> [<dirpath>] [since=<time>|manifest] [gzip]
+    int count = sscanf(command, "downltar %63s %1023s %1023s %1023s", filetype, words[0], words[1], words[2]);
+    int valid = count >= 1;
+    for (int i = 0; valid && i < count - 1; i++) {
+        if (strcmp(words[i], "gzip") == 0 && !compress) {
+            compress = 1;
+        } else if ((words[i][0] == '~' || words[i][0] == '/') && dirpath[0] == '\0') {
+            strcpy(dirpath, words[i]);   // sscanf kept every word within MAX_FILEPATH
+        } else if (option[0] == '\0' && strlen(words[i]) < sizeof(option)) {
+            snprintf(option, sizeof(option), "%s", words[i]);
+        } else {
+            valid = 0;
+        }
+    }
+    if (!valid) {
         snprintf(buffer, BUFFER_SIZE, "ERROR: Invalid downltar command syntax");
-        send(client_socket, buffer, strlen(buffer), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, buffer);
         return -1;
     }
 
-    printf("[DOWNLTAR] Processing request for filetype: %s\n", filetype);
-    
-    if (strcmp(filetype, "c") == 0) {
-        printf("[C FILES] Handling C files download\n");
-        char s1_path[MAX_FILEPATH];
-        expand_path(S1_BASE_DIR, s1_path);
-        printf("[C FILES] S1 path: %s\n", s1_path);
-        
-        snprintf(cmd, BUFFER_SIZE, "find \"%s\" -name \"*.c\" -type f | tar -cf - -T - 2>/dev/null", s1_path);
-        printf("[C FILES] Command to execute: %s\n", cmd);
-        
-        FILE *tar_pipe = popen(cmd, "r");
-        if (!tar_pipe) {
-            printf("[C FILES ERROR] Failed to open tar pipe\n");
-            send(client_socket, "TAR_CREATION_FAILED", 19, 0);
+    // A directory limits every archive to that subtree of ~/S1 (and its mirror on S2, S3, S4)
+    char scope[MAX_FILEPATH] = "";
+    if (dirpath[0] != '\0') {
+        char s1_base[MAX_FILEPATH];
+        char root[MAX_FILEPATH];
+        char prefix[MAX_FILEPATH];
+        expand_path(S1_BASE_DIR, s1_base);
+        expand_path(dirpath, scope);
+        int scoped = dfs_tar_scope(s1_base, scope, root, prefix, MAX_FILEPATH);
+        if (scoped < 0) {
+            snprintf(buffer, BUFFER_SIZE, "ERROR: Path must be within ~/S1");
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, buffer);
             return -1;
         }
-        printf("[C FILES] Tar pipe opened successfully\n");
-        
-        long filesize = 0;
-        char temp_buffer[BUFFER_SIZE];
-        size_t bytes_read;
-        
-        printf("[C FILES] Calculating tar size...\n");
-        while ((bytes_read = fread(temp_buffer, 1, BUFFER_SIZE, tar_pipe)) > 0) {
-            filesize += bytes_read;
+        if (scoped == 0) {
+            scope[0] = '\0';
         }
-        pclose(tar_pipe);
-        printf("[C FILES] Calculated tar size: %ld bytes\n", filesize);
-        
-        if (filesize == 0) {
-            printf("[C FILES ERROR] No C files found\n");
-            send(client_socket, "NO_FILES", 8, 0);
+    }
+
+    printf("[DOWNLTAR] Processing request for filetype: %s %s %s%s\n", filetype, dirpath, option,
+           compress ? " (gzip)" : "");
+
+    // An incremental request names a time, or sends the client's manifest right after the command
+    char *manifest = NULL;
+    uint64_t manifest_len = 0;
+    if (option[0] != '\0') {
+        DfsTarFilter filter = {-1, NULL, 0, NULL};
+        int parsed = dfs_tar_parse_option(option, &filter);
+        if (parsed < 0) {
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Invalid downltar option");
             return -1;
         }
-        
-        printf("[C FILES] Reopening tar pipe for transfer\n");
-        tar_pipe = popen(cmd, "r");
-        if (!tar_pipe) {
-            printf("[C FILES ERROR] Failed to reopen tar pipe\n");
-            send(client_socket, "TAR_CREATION_FAILED", 19, 0);
+        if (parsed == 1 && (manifest = dfs_tar_recv_manifest(client_socket, &manifest_len)) == NULL) {
+            printf("[DOWNLTAR ERROR] Failed to read manifest\n");
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, "ERROR: Failed to read manifest");
             return -1;
         }
-        
-        snprintf(buffer, BUFFER_SIZE, "%ld", filesize);
-        printf("[C FILES] Sending file size: %s\n", buffer);
-        if (send(client_socket, buffer, strlen(buffer), 0) <= 0) {
-            printf("[C FILES ERROR] Failed to send file size\n");
-            pclose(tar_pipe);
-            return -1;
-        }
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        printf("[C FILES] Waiting for client acknowledgement...\n");
-        if (recv(client_socket, buffer, BUFFER_SIZE, 0) <= 0) {
-            printf("[C FILES ERROR] Failed to get client ack\n");
-            pclose(tar_pipe);
-            return -1;
-        }
-        printf("[C FILES] Received client ack: %s\n", buffer);
-        
-        size_t total_sent = 0;
-        printf("[C FILES] Starting data transfer...\n");
-        while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, tar_pipe)) > 0) {
-            printf("[C FILES] Read %zu bytes from pipe\n", bytes_read);
-            size_t bytes_sent = 0;
-            while (bytes_sent < bytes_read) {
-                int sent = send(client_socket, buffer + bytes_sent, bytes_read - bytes_sent, 0);
-                if (sent <= 0) {
-                    printf("[C FILES ERROR] Failed during transfer at %zu/%ld bytes\n", 
-                           total_sent + bytes_sent, filesize);
-                    pclose(tar_pipe);
-                    return -1;
-                }
-                bytes_sent += sent;
-                printf("[C FILES] Sent %d bytes (chunk progress: %zu/%zu)\n", 
-                       sent, bytes_sent, bytes_read);
-            }
-            total_sent += bytes_read;
-            printf("[C FILES] Total sent: %zu/%ld bytes (%.1f%%)\n", 
-                   total_sent, filesize, (total_sent*100.0)/filesize);
-            memset(buffer, 0, BUFFER_SIZE);
-        }
-        
-        printf("[C FILES] Transfer complete. Total bytes sent: %zu\n", total_sent);
-        pclose(tar_pipe);
-        return 0;
-    } 
-    else if (strcmp(filetype, "pdf") == 0) {
-        printf("[PDF FILES] Handling PDF files download\n");
-        printf("[PDF FILES] Connecting to S2 server...\n");
-        int server_socket = connect_to_server(s2_info.ip, s2_info.port);
-        if (server_socket < 0) {
-            printf("[PDF FILES ERROR] Failed to connect to S2 server\n");
-            send(client_socket, "SERVER_CONNECTION_FAILED", 24, 0);
-            return -1;
-        }
-        printf("[PDF FILES] Connected to S2 server\n");
-        
-        snprintf(buffer, BUFFER_SIZE, "CREATETAR %s", filetype);
-        printf("[PDF FILES] Sending command to S2: %s\n", buffer);
-        if (send(server_socket, buffer, strlen(buffer), 0) <= 0) {
-            printf("[PDF FILES ERROR] Failed to send command to S2\n");
-            close(server_socket);
-            send(client_socket, "SERVER_CONNECTION_FAILED", 24, 0);
+    }
+
+    // A gzip archive is built as usual into a socketpair and compressed on its way to the client
+    int archive_socket = client_socket;
+    int pair[2];
+    pthread_t compressor;
+    TarGzipJob job = {-1, client_socket, -1};
+    if (compress) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+            perror("[DOWNLTAR ERROR] socketpair");
+            free(manifest);
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, "TAR_CREATION_FAILED");
             return -1;
         }
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        printf("[PDF FILES] Waiting for response from S2...\n");
-        int recv_bytes = recv(server_socket, buffer, BUFFER_SIZE - 1, 0);
-        printf("[PDF FILES] Received %d bytes from S2: %s\n", recv_bytes, buffer);
-
-        if (strcmp(buffer, "TAR_CREATION_FAILED") == 0) {
-            printf("[PDF FILES ERROR] S2 reported tar creation failed\n");
-            close(server_socket);
-            send(client_socket, "TAR_CREATION_FAILED", 19, 0);
+        job.archive_socket = pair[0];
+        if (pthread_create(&compressor, NULL, gzip_tar_worker, &job) != 0) {
+            close(pair[0]);
+            close(pair[1]);
+            free(manifest);
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, "TAR_CREATION_FAILED");
             return -1;
         }
-        
-        long filesize = atol(buffer);
-        printf("[PDF FILES] S2 reported tar size: %ld bytes\n", filesize);
-        if (filesize <= 0) {
-            printf("[PDF FILES ERROR] Invalid file size from S2\n");
-            close(server_socket);
-            send(client_socket, "TAR_CREATION_FAILED", 19, 0);
-            return -1;
+        archive_socket = pair[1];
+    }
+
+    int result;
+    if (strcmp(filetype, "all") == 0 || strchr(filetype, ',') != NULL) {
+        // "all" or a comma-separated list merges several archives into one
+        result = handle_combined_tar(filetype, scope, option, manifest, manifest_len, archive_socket, request);
+    } else if (strcmp(filetype, "c") == 0) {
+        printf("[C FILES] Handling C files download\n");
+        int files = stream_local_tar(archive_socket, request->request_id, scope, option, manifest);
+        if (files < 0) {
+            printf("[C FILES ERROR] Failed to stream archive\n");
+            dfs_reply(archive_socket, request, DFS_STATUS_ERROR, "TAR_CREATION_FAILED");
+        } else if (files == 0) {
+            printf("[C FILES ERROR] No C files found\n");
+            dfs_reply(archive_socket, request, DFS_STATUS_NO_FILES, "NO_FILES");
+        } else {
+            printf("[C FILES] Transfer complete. Members sent: %d\n", files);
         }
-        
-        snprintf(buffer, BUFFER_SIZE, "%ld", filesize);
-        printf("[PDF FILES] Sending size to client: %s\n", buffer);
-        if (send(client_socket, buffer, strlen(buffer), 0) <= 0) {
-            printf("[PDF FILES ERROR] Failed to send size to client\n");
-            close(server_socket);
+        result = files > 0 ? 0 : -1;
+    } else if (strcmp(filetype, "pdf") == 0 || strcmp(filetype, "txt") == 0 ||
+               strcmp(filetype, "zip") == 0) {
+        result = relay_backend_tar(filetype, scope, option, manifest, manifest_len, archive_socket, request);
+    } else {
+        printf("[ERROR] Unsupported file type: %s\n", filetype);
+        dfs_reply(archive_socket, request, DFS_STATUS_INVALID, "ERROR: Unsupported file type");
+        result = -1;
+    }
+
+    if (compress) {
+        // Closing our end tells the compressor the archive is complete
+        close(pair[1]);
+        pthread_join(compressor, NULL);
+        printf("[DOWNLTAR] Compressed archive %s\n", job.result == 0 ? "sent" : "not sent");
+        result = result == 0 && job.result == 0 ? 0 : -1;
+    }
+
+    free(manifest);
+    return result;
+}
+
+// Thread function gzipping the archive written into the socketpair onto the client socket
+void *gzip_tar_worker(void *arg) {
+    TarGzipJob *job = arg;
+    job->result = dfs_gzip_archive(job->archive_socket, job->client_socket, DFS_GZIP_LEVEL);
+    // Until this end closes, a producer still writing would block forever
+    close(job->archive_socket);
+    return NULL;
+}
+
+// Function to archive the local .c tree onto a socket: cached in full, streamed when scoped or incremental
+int stream_local_tar(int sock, uint32_t request_id, const char *scope, const char *option, const char *manifest) {
+    char s1_path[MAX_FILEPATH];
+    char cache_dir[MAX_FILEPATH];
+    char root[MAX_FILEPATH];
+    char prefix[MAX_FILEPATH];
+    expand_path(S1_BASE_DIR, s1_path);
+    expand_path(S1_CACHE_DIR, cache_dir);
+
+    int scoped = dfs_tar_scope(s1_path, scope[0] != '\0' ? scope : NULL, root, prefix, MAX_FILEPATH);
+    if (scoped < 0) {
+        return -1;
+    }
+    if (!scoped && option[0] == '\0') {
+        // Serve the cached archive, building it on first use
+        return dfs_tar_cache_send(sock, request_id, cache_dir, s1_path, "c", "S1");
+    }
+
+    // Only the subtree, or only new or changed members with deletions listed in the trailer
+    DfsTarFilter filter = {-1, NULL, 0, NULL};
+    char deletion_log[MAX_FILEPATH + sizeof("/c.deleted")];
+    char *manifest_copy = NULL;
+    snprintf(deletion_log, sizeof(deletion_log), "%s/c.deleted", cache_dir);
+    filter.deletion_log = deletion_log;
+    dfs_tar_parse_option(option, &filter);
+    if (manifest && ((manifest_copy = strdup(manifest)) == NULL ||
+                     dfs_tar_load_manifest(&filter, manifest_copy) != 0)) {
+        free(manifest_copy);
+        return -1;
+    }
+    int files = dfs_tar_stream(sock, request_id, root, "c", prefix, &filter);
+    dfs_tar_free_filter(&filter);
+    free(manifest_copy);
+    return files;
+}
+
+// Function to build the CREATETAR command for a backend, mapping the scope onto its tree
+void build_create_tar_command(char *command, size_t size, const char *filetype, int server_type,
+                              const char *scope, const char *option) {
+    char server_path[MAX_FILEPATH] = "";
+    if (scope[0] != '\0') {
+        get_corresponding_server_path(scope, server_path, server_type);
+    }
+    snprintf(command, size, "CREATETAR %s %s %s", filetype, server_path, option);
+}
+
+// Function to relay one backend's archive to the client chunk by chunk
+int relay_backend_tar(const char *filetype, const char *scope, const char *option, const char *manifest,
+                      uint64_t manifest_len, int client_socket, const DfsHeader *request) {
+    char buffer[BUFFER_SIZE];
+    int server_type = strcmp(filetype, "pdf") == 0 ? 2 : (strcmp(filetype, "txt") == 0 ? 3 : 4);
+
+    printf("[%s FILES] Connecting to S%d server...\n", filetype, server_type);
+    int server_socket = acquire_backend_connection(server_type);
+    if (server_socket < 0) {
+        printf("[%s FILES ERROR] Failed to connect to S%d server\n", filetype, server_type);
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, "SERVER_CONNECTION_FAILED");
+        return -1;
+    }
+    
+    build_create_tar_command(buffer, BUFFER_SIZE, filetype, server_type, scope, option);
+    printf("[%s FILES] Sending command to S%d: %s\n", filetype, server_type, buffer);
+    uint32_t backend_request = dfs_next_request_id();
+    if (dfs_send_message(server_socket, DFS_OP_CREATETAR, DFS_STATUS_OK, backend_request, buffer) != 0 ||
+        (manifest && dfs_send_frame(server_socket, DFS_OP_DATA, DFS_STATUS_OK, backend_request,
+                                    manifest, manifest_len) != 0)) {
+        printf("[%s FILES ERROR] Failed to send command to S%d\n", filetype, server_type);
+        release_backend_connection(server_type, server_socket, 0);
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, "SERVER_CONNECTION_FAILED");
+        return -1;
+    }
+    
+    DfsHeader reply;
+    if (dfs_recv_header(server_socket, &reply) != 0) {
+        printf("[%s FILES ERROR] No response from S%d\n", filetype, server_type);
+        release_backend_connection(server_type, server_socket, 0);
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, "TAR_CREATION_FAILED");
+        return -1;
+    }
+    
+    // Forward each archive chunk as it arrives, under the client's request ID
+    uint64_t total_relayed = 0;
+    while (reply.opcode == DFS_OP_DATA && reply.status == DFS_STATUS_READY) {
+        if (dfs_send_header(client_socket, DFS_OP_DATA, DFS_STATUS_READY, request->request_id,
+                            reply.payload_len) != 0 ||
+            dfs_relay(server_socket, client_socket, reply.payload_len) != 0) {
+            // The rest of the archive is still on its way, so the connection is spent
+            printf("[%s FILES ERROR] Transfer from S%d interrupted\n", filetype, server_type);
+            release_backend_connection(server_type, server_socket, 0);
             return -1;
         }
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        printf("[PDF FILES] Waiting for client ready signal...\n");
-        if (recv(client_socket, buffer, BUFFER_SIZE, 0) <= 0) {
-            printf("[PDF FILES ERROR] Failed to get client ready signal\n");
-            close(server_socket);
+        total_relayed += reply.payload_len;
+
+        if (dfs_recv_header(server_socket, &reply) != 0) {
+            printf("[%s FILES ERROR] S%d stream ended early\n", filetype, server_type);
+            release_backend_connection(server_type, server_socket, 0);
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, "TAR_CREATION_FAILED");
             return -1;
         }
-        printf("[PDF FILES] Received client ready: %s\n", buffer);
-        send(server_socket, buffer, strlen(buffer), 0);
-        
-        size_t bytes_received = 0;
-        size_t total_received = 0;
-        printf("[PDF FILES] Starting data transfer from S2...\n");
-        printf("[PDF FILES] File size is %ld...\n", filesize);
-        
-        while (total_received < filesize) {
-            memset(buffer, 0, BUFFER_SIZE);
-            bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-            printf("[PDF FILES] Received %zu bytes from S2\n", bytes_received);
-            
-            if (bytes_received <= 0) {
-                printf("[PDF FILES ERROR] Connection closed by S2 at %zu/%ld bytes\n", 
-                       total_received, filesize);
-                break;
-            }
-            
-            size_t bytes_sent = 0;
-            while (bytes_sent < bytes_received) {
-                int sent = send(client_socket, buffer + bytes_sent, bytes_received - bytes_sent, 0);
-                if (sent <= 0) {
-                    printf("[PDF FILES ERROR] Failed to send to client at %zu/%ld bytes\n", 
-                           total_received + bytes_sent, filesize);
-                    close(server_socket);
-                    return -1;
-                }
-                bytes_sent += sent;
-                printf("[PDF FILES] Sent %d bytes to client\n", sent);
-            }
-            
-            total_received += bytes_received;
-            printf("[PDF FILES] Transfer progress: %zu/%ld bytes (%.1f%%)\n", 
-                   total_received, filesize, (total_received*100.0)/filesize);
+    }
+
+    if (reply.opcode == DFS_OP_DATA && reply.status == DFS_STATUS_OK) {
+        // The trailer (size, CRC32C, deletions) goes through untouched for the client to verify
+        printf("[%s FILES] Transfer complete. Total bytes: %llu\n", filetype, (unsigned long long)total_relayed);
+        int relayed = -1;
+        if (dfs_send_header(client_socket, DFS_OP_DATA, DFS_STATUS_OK, request->request_id,
+                            reply.payload_len) == 0) {
+            relayed = dfs_relay(server_socket, client_socket, reply.payload_len);
         }
-        
-        printf("[PDF FILES] Transfer complete. Total bytes: %zu/%ld\n", total_received, filesize);
-        close(server_socket);
-        return 0;
+        release_backend_connection(server_type, server_socket, relayed == 0 || relayed == DFS_RELAY_SINK_FAILED);
+        return relayed == 0 ? 0 : -1;
     }
-    else if (strcmp(filetype, "txt") == 0) {
-        printf("[TXT FILES] Handling TXT files download\n");
-        printf("[TXT FILES] Connecting to S3 server...\n");
-        int server_socket = connect_to_server(s3_info.ip, s3_info.port);
-        if (server_socket < 0) {
-            printf("[TXT FILES ERROR] Failed to connect to S3 server\n");
-            send(client_socket, "SERVER_CONNECTION_FAILED", 24, 0);
+
+    // Pass the backend's verdict (NO_FILES, TAR_CREATION_FAILED, ...) through
+    int reusable = 1;
+    if (dfs_recv_payload(server_socket, &reply, buffer, BUFFER_SIZE) != 0) {
+        snprintf(buffer, BUFFER_SIZE, "TAR_CREATION_FAILED");
+        reusable = errno == EMSGSIZE;
+    }
+    printf("[%s FILES ERROR] S%d reported: %s\n", filetype, server_type, buffer);
+    release_backend_connection(server_type, server_socket, reusable);
+    dfs_reply(client_socket, request, reply.status == DFS_STATUS_OK ? DFS_STATUS_ERROR : reply.status, buffer);
+    return -1;
+}
+
+// Function to handle downltar for several types at once ("all" or a list like "pdf,txt")
+int handle_combined_tar(const char *filetypes, const char *scope, const char *option, const char *manifest,
+                        uint64_t manifest_len, int client_socket, const DfsHeader *request) {
+    TarSource sources[4];
+    int source_count = 0;
+
+    // Work out which archives to merge, each type at most once
+    char list[BUFFER_SIZE];
+    snprintf(list, BUFFER_SIZE, "%s", strcmp(filetypes, "all") == 0 ? "c,pdf,txt,zip" : filetypes);
+    char *saveptr;
+    for (char *type = strtok_r(list, ",", &saveptr); type; type = strtok_r(NULL, ",", &saveptr)) {
+        int rank = get_listing_rank(type);
+        if (rank < 0) {
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Unsupported file type");
             return -1;
         }
-        printf("[TXT FILES] Connected to S3 server\n");
-        
-        snprintf(buffer, BUFFER_SIZE, "CREATETAR %s", filetype);
-        printf("[TXT FILES] Sending command to S3: %s\n", buffer);
-        if (send(server_socket, buffer, strlen(buffer), 0) <= 0) {
-            printf("[TXT FILES ERROR] Failed to send command to S3\n");
-            close(server_socket);
-            send(client_socket, "SERVER_CONNECTION_FAILED", 24, 0);
-            return -1;
+        int duplicate = 0;
+        for (int i = 0; i < source_count; i++) {
+            duplicate |= strcmp(sources[i].type, listing_types[rank]) == 0;
         }
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        printf("[TXT FILES] Waiting for response from S3...\n");
-        int recv_bytes = recv(server_socket, buffer, BUFFER_SIZE - 1, 0);
-        printf("[TXT FILES] Received %d bytes from S3: %s\n", recv_bytes, buffer);
-
-        if (strcmp(buffer, "TAR_CREATION_FAILED") == 0) {
-            printf("[TXT FILES ERROR] S3 reported tar creation failed\n");
-            close(server_socket);
-            send(client_socket, "TAR_CREATION_FAILED", 19, 0);
-            return -1;
+        if (!duplicate) {
+            sources[source_count].type = listing_types[rank];
+            sources[source_count].server_type = rank + 1;   // c -> S1, pdf -> S2, txt -> S3, zip -> S4
+            source_count++;
         }
-        
-        long filesize = atol(buffer);
-        printf("[TXT FILES] S3 reported tar size: %ld bytes\n", filesize);
-        if (filesize <= 0) {
-            printf("[TXT FILES ERROR] Invalid file size from S3\n");
-            close(server_socket);
-            send(client_socket, "TAR_CREATION_FAILED", 19, 0);
-            return -1;
-        }
-        
-        snprintf(buffer, BUFFER_SIZE, "%ld", filesize);
-        printf("[TXT FILES] Sending size to client: %s\n", buffer);
-        if (send(client_socket, buffer, strlen(buffer), 0) <= 0) {
-            printf("[TXT FILES ERROR] Failed to send size to client\n");
-            close(server_socket);
-            return -1;
+    }
+    if (source_count == 0) {
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Invalid downltar command syntax");
+        return -1;
+    }
+
+    TarMerge merge = {PTHREAD_MUTEX_INITIALIZER, client_socket, request->request_id, 0, 0, 0, 0,
+                      scope, option, manifest, manifest_len, NULL, 0};
+    pthread_t threads[4];
+    int started[4] = {0};
+    printf("[ALL FILES] Merging %d archives for %s\n", source_count, filetypes);
+
+    // Every archive is fetched at once; the slowest one bounds the whole transfer
+    for (int i = 0; i < source_count; i++) {
+        sources[i].merge = &merge;
+        sources[i].error[0] = '\0';
+        started[i] = pthread_create(&threads[i], NULL, tar_source_worker, &sources[i]) == 0;
+        if (!started[i]) {
+            snprintf(sources[i].error, BUFFER_SIZE, "TAR_CREATION_FAILED");
+            __atomic_store_n(&merge.failed, 1, __ATOMIC_RELAXED);
         }
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        printf("[TXT FILES] Waiting for client ready signal...\n");
-        if (recv(client_socket, buffer, BUFFER_SIZE, 0) <= 0) {
-            printf("[TXT FILES ERROR] Failed to get client ready signal\n");
-            close(server_socket);
-            return -1;
+    }
+    for (int i = 0; i < source_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
         }
-        printf("[TXT FILES] Received client ready: %s\n", buffer);
-        send(server_socket, buffer, strlen(buffer), 0);
-        
-        size_t bytes_received = 0;
-        size_t total_received = 0;
-        printf("[TXT FILES] Starting data transfer from S3...\n");
-        printf("[TXT FILES] File size is %ld...\n", filesize);
-        
-        while (total_received < filesize) {
-            memset(buffer, 0, BUFFER_SIZE);
-            bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-            printf("[TXT FILES] Received %zu bytes from S3\n", bytes_received);
-            
-            if (bytes_received <= 0) {
-                printf("[TXT FILES ERROR] Connection closed by S3 at %zu/%ld bytes\n", 
-                       total_received, filesize);
-                break;
-            }
-            
-            size_t bytes_sent = 0;
-            while (bytes_sent < bytes_received) {
-                int sent = send(client_socket, buffer + bytes_sent, bytes_received - bytes_sent, 0);
-                if (sent <= 0) {
-                    printf("[TXT FILES ERROR] Failed to send to client at %zu/%ld bytes\n", 
-                           total_received + bytes_sent, filesize);
-                    close(server_socket);
-                    return -1;
-                }
-                bytes_sent += sent;
-                printf("[TXT FILES] Sent %d bytes to client\n", sent);
+    }
+    pthread_mutex_destroy(&merge.lock);
+
+    int result = finish_combined_tar(&merge, sources, source_count, request);
+    free(merge.deletions);
+    return result;
+}
+
+// Function to close a combined downltar: the first error, NO_FILES, or the merged trailer
+int finish_combined_tar(TarMerge *merge, TarSource *sources, int source_count, const DfsHeader *request) {
+    int client_socket = merge->client_socket;
+
+    if (merge->failed) {
+        // Whatever was already sent is worthless without the trailer; say which archive broke
+        for (int i = 0; i < source_count; i++) {
+            if (sources[i].error[0] != '\0') {
+                printf("[ALL FILES ERROR] %s archive failed: %s\n", sources[i].type, sources[i].error);
+                dfs_reply(client_socket, request, DFS_STATUS_ERROR, sources[i].error);
+                return -1;
             }
-            
-            total_received += bytes_received;
-            printf("[TXT FILES] Transfer progress: %zu/%ld bytes (%.1f%%)\n", 
-                   total_received, filesize, (total_received*100.0)/filesize);
         }
-        
-        printf("[TXT FILES] Transfer complete. Total bytes: %zu/%ld\n", total_received, filesize);
-        close(server_socket);
-        return 0;
+        return -1;
     }
-    else if (strcmp(filetype, "zip") == 0) {
-        printf("[ZIP FILES] Handling ZIP files download\n");
-        printf("[ZIP FILES] Connecting to S4 server...\n");
-        int server_socket = connect_to_server(s4_info.ip, s4_info.port);
-        if (server_socket < 0) {
-            printf("[ZIP FILES ERROR] Failed to connect to S4 server\n");
-            send(client_socket, "SERVER_CONNECTION_FAILED", 24, 0);
-            return -1;
+
+    if (merge->members == 0 && merge->deletions_len == 0) {
+        printf("[ALL FILES ERROR] No files found\n");
+        dfs_reply(client_socket, request, DFS_STATUS_NO_FILES, "NO_FILES");
+        return -1;
+    }
+
+    // One end-of-archive marker for the merged stream, then its own trailer
+    static const char end_marker[1024];
+    char summary[64];
+    merge->crc = dfs_crc32c(merge->crc, end_marker, sizeof(end_marker));
+    merge->total += sizeof(end_marker);
+    snprintf(summary, sizeof(summary), "%llu %08x\n", (unsigned long long)merge->total, merge->crc);
+    size_t summary_len = strlen(summary);
+    if (dfs_send_frame(client_socket, DFS_OP_DATA, DFS_STATUS_READY, request->request_id,
+                       end_marker, sizeof(end_marker)) != 0 ||
+        dfs_send_header(client_socket, DFS_OP_DATA, DFS_STATUS_OK, request->request_id,
+                        summary_len + merge->deletions_len) != 0 ||
+        dfs_send_all(client_socket, summary, summary_len) != 0 ||
+        (merge->deletions_len > 0 && dfs_send_all(client_socket, merge->deletions, merge->deletions_len) != 0)) {
+        return -1;
+    }
+
+    printf("[ALL FILES] Transfer complete. %d files, %llu bytes\n", merge->members,
+           (unsigned long long)merge->total);
+    return 0;
+}
+
+// Thread function fetching one archive for a combined downltar
+void *tar_source_worker(void *arg) {
+    TarSource *source = arg;
+
+    if (source->server_type == 1) {
+        // The local tree is archived by a writer thread into a socketpair, so it reads like a backend
+        int pair[2];
+        pthread_t writer;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+            snprintf(source->error, BUFFER_SIZE, "TAR_CREATION_FAILED");
+            __atomic_store_n(&source->merge->failed, 1, __ATOMIC_RELAXED);
+            return NULL;
         }
-        printf("[ZIP FILES] Connected to S4 server\n");
-        
-        snprintf(buffer, BUFFER_SIZE, "CREATETAR %s", filetype);
-        printf("[ZIP FILES] Sending command to S4: %s\n", buffer);
-        if (send(server_socket, buffer, strlen(buffer), 0) <= 0) {
-            printf("[ZIP FILES ERROR] Failed to send command to S4\n");
-            close(server_socket);
-            send(client_socket, "SERVER_CONNECTION_FAILED", 24, 0);
-            return -1;
+        source->local_socket = pair[1];
+        if (pthread_create(&writer, NULL, local_tar_writer, source) != 0) {
+            close(pair[0]);
+            close(pair[1]);
+            snprintf(source->error, BUFFER_SIZE, "TAR_CREATION_FAILED");
+            __atomic_store_n(&source->merge->failed, 1, __ATOMIC_RELAXED);
+            return NULL;
         }
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        printf("[ZIP FILES] Waiting for response from S4...\n");
-        int recv_bytes = recv(server_socket, buffer, BUFFER_SIZE - 1, 0);
-        printf("[ZIP FILES] Received %d bytes from S4: %s\n", recv_bytes, buffer);
-
-        if (strcmp(buffer, "TAR_CREATION_FAILED") == 0) {
-            printf("[ZIP FILES ERROR] S4 reported tar creation failed\n");
-            close(server_socket);
-            send(client_socket, "TAR_CREATION_FAILED", 19, 0);
-            return -1;
+        read_tar_source(source, pair[0]);
+        close(pair[0]);
+        pthread_join(writer, NULL);
+        return NULL;
+    }
+
+    int server_socket = acquire_backend_connection(source->server_type);
+    if (server_socket < 0) {
+        snprintf(source->error, BUFFER_SIZE, "SERVER_CONNECTION_FAILED");
+        __atomic_store_n(&source->merge->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    char command[BUFFER_SIZE];
+    TarMerge *merge = source->merge;
+    uint32_t backend_request = dfs_next_request_id();
+    build_create_tar_command(command, BUFFER_SIZE, source->type, source->server_type, merge->scope, merge->option);
+    if (dfs_send_message(server_socket, DFS_OP_CREATETAR, DFS_STATUS_OK, backend_request, command) != 0 ||
+        (merge->manifest && dfs_send_frame(server_socket, DFS_OP_DATA, DFS_STATUS_OK, backend_request,
+                                           merge->manifest, merge->manifest_len) != 0)) {
+        release_backend_connection(source->server_type, server_socket, 0);
+        snprintf(source->error, BUFFER_SIZE, "SERVER_CONNECTION_FAILED");
+        __atomic_store_n(&source->merge->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    // Only a stream read to its last frame leaves the connection in sync
+    int result = read_tar_source(source, server_socket);
+    release_backend_connection(source->server_type, server_socket, result == 0);
+    return NULL;
+}
+
+// Thread function writing the local .c archive into its socketpair
+void *local_tar_writer(void *arg) {
+    TarSource *source = arg;
+    int files = stream_local_tar(source->local_socket, 0, source->merge->scope, source->merge->option,
+                                 source->merge->manifest);
+    if (files <= 0) {
+        dfs_send_message(source->local_socket, DFS_OP_CREATETAR,
+                         files == 0 ? DFS_STATUS_NO_FILES : DFS_STATUS_ERROR, 0,
+                         files == 0 ? "NO_FILES" : "TAR_CREATION_FAILED");
+    }
+    close(source->local_socket);
+    return NULL;
+}
+
+// Function to write merged archive bytes to the client; caller holds merge->lock
+int merge_emit(TarMerge *merge, const void *buf, size_t len) {
+    if (__atomic_load_n(&merge->failed, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    if (dfs_send_frame(merge->client_socket, DFS_OP_DATA, DFS_STATUS_READY, merge->request_id, buf, len) != 0) {
+        __atomic_store_n(&merge->failed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    merge->crc = dfs_crc32c(merge->crc, buf, len);
+    merge->total += len;
+    return 0;
+}
+
+// Function to check one source's trailer and collect the deletions it reports
+int merge_trailer(TarSource *source, int sock, const DfsHeader *frame, uint64_t received, uint32_t crc) {
+    TarMerge *merge = source->merge;
+    char *trailer = frame->payload_len <= DFS_TAR_MANIFEST_MAX ? malloc(frame->payload_len + 1) : NULL;
+    if (!trailer || dfs_recv_all(sock, trailer, frame->payload_len) != 0) {
+        free(trailer);
+        snprintf(source->error, BUFFER_SIZE, "TAR_CREATION_FAILED");
+        return -1;
+    }
+    trailer[frame->payload_len] = '\0';
+
+    unsigned long long size;
+    unsigned int expected;
+    if (sscanf(trailer, "%llu %x", &size, &expected) != 2 || size != received || expected != crc) {
+        free(trailer);
+        snprintf(source->error, BUFFER_SIZE, "ERROR: %s archive arrived corrupt", source->type);
+        return -1;
+    }
+
+    // Everything after the first line is deleted names, passed on in the merged trailer
+    char *names = strchr(trailer, '\n');
+    size_t names_len = names ? strlen(names + 1) : 0;
+    int result = 0;
+    if (names_len > 0) {
+        pthread_mutex_lock(&merge->lock);
+        char *grown = realloc(merge->deletions, merge->deletions_len + names_len);
+        if (grown) {
+            memcpy(grown + merge->deletions_len, names + 1, names_len);
+            merge->deletions = grown;
+            merge->deletions_len += names_len;
+        } else {
+            snprintf(source->error, BUFFER_SIZE, "TAR_CREATION_FAILED");
+            result = -1;
         }
-        
-        long filesize = atol(buffer);
-        printf("[ZIP FILES] S4 reported tar size: %ld bytes\n", filesize);
-        if (filesize <= 0) {
-            printf("[ZIP FILES ERROR] Invalid file size from S4\n");
-            close(server_socket);
-            send(client_socket, "TAR_CREATION_FAILED", 19, 0);
-            return -1;
+        pthread_mutex_unlock(&merge->lock);
+    }
+    free(trailer);
+    return result;
+}
+
+// Function to split one source's archive into whole members and pass them to the client
+int read_tar_source(TarSource *source, int sock) {
+    TarMerge *merge = source->merge;
+    unsigned char *member = malloc(TAR_MERGE_BUFFER);
+    unsigned char *chunk = malloc(TAR_MERGE_CHUNK);
+    if (!member || !chunk) {
+        free(member);
+        free(chunk);
+        snprintf(source->error, BUFFER_SIZE, "TAR_CREATION_FAILED");
+        __atomic_store_n(&merge->failed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    // Parser state: what the next bytes are, how many are still due, what the member holds so far
+    enum { TAR_AT_HEADER, TAR_IN_META, TAR_IN_BODY, TAR_AT_END } state = TAR_AT_HEADER;
+    uint64_t need = DFS_TAR_BLOCK_SIZE;
+    size_t used = 0;
+    size_t meta_start = 0;
+    uint64_t meta_size = 0;
+    char meta_type = 0;
+    uint64_t pax_size = 0;
+    int has_pax_size = 0;
+    int streaming = 0;          // member too big to gather; merge->lock held while it passes through
+    int aborted = 0;            // the merged stream is dead; stop without blaming this source
+    uint64_t received = 0;
+    uint32_t crc = 0;
+    int result = -1;
+
+    while (!__atomic_load_n(&merge->failed, __ATOMIC_RELAXED)) {
+        DfsHeader frame;
+        if (dfs_recv_header(sock, &frame) != 0) {
+            snprintf(source->error, BUFFER_SIZE, "TAR_CREATION_FAILED");
+            break;
         }
-        
-        snprintf(buffer, BUFFER_SIZE, "%ld", filesize);
-        printf("[ZIP FILES] Sending size to client: %s\n", buffer);
-        if (send(client_socket, buffer, strlen(buffer), 0) <= 0) {
-            printf("[ZIP FILES ERROR] Failed to send size to client\n");
-            close(server_socket);
-            return -1;
+
+        if (frame.opcode == DFS_OP_DATA && frame.status == DFS_STATUS_OK) {
+            // Trailer: everything must have arrived intact and ended on a member boundary
+            if (state != TAR_AT_END && received > 0) {
+                snprintf(source->error, BUFFER_SIZE, "ERROR: %s archive arrived corrupt", source->type);
+                break;
+            }
+            result = merge_trailer(source, sock, &frame, received, crc);
+            break;
         }
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        printf("[ZIP FILES] Waiting for client ready signal...\n");
-        if (recv(client_socket, buffer, BUFFER_SIZE, 0) <= 0) {
-            printf("[ZIP FILES ERROR] Failed to get client ready signal\n");
-            close(server_socket);
-            return -1;
+
+        if (frame.opcode != DFS_OP_DATA || frame.status != DFS_STATUS_READY) {
+            char message[BUFFER_SIZE];
+            if (dfs_recv_payload(sock, &frame, message, BUFFER_SIZE) != 0) {
+                snprintf(source->error, BUFFER_SIZE, "TAR_CREATION_FAILED");
+            } else if (frame.status == DFS_STATUS_NO_FILES) {
+                result = 0;
+            } else {
+                snprintf(source->error, BUFFER_SIZE, "%s", message);
+            }
+            break;
         }
-        printf("[ZIP FILES] Received client ready: %s\n", buffer);
-        send(server_socket, buffer, strlen(buffer), 0);
-        
-        size_t bytes_received = 0;
-        size_t total_received = 0;
-        printf("[ZIP FILES] Starting data transfer from S4...\n");
-        printf("[ZIP FILES] File size is %ld...\n", filesize);
-        
-        while (total_received < filesize) {
-            memset(buffer, 0, BUFFER_SIZE);
-            bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-            printf("[ZIP FILES] Received %zu bytes from S4\n", bytes_received);
-            
-            if (bytes_received <= 0) {
-                printf("[ZIP FILES ERROR] Connection closed by S4 at %zu/%ld bytes\n", 
-                       total_received, filesize);
+
+        uint64_t remaining = frame.payload_len;
+        while (remaining > 0 && source->error[0] == '\0' && !aborted) {
+            size_t len = remaining < TAR_MERGE_CHUNK ? remaining : TAR_MERGE_CHUNK;
+            if (dfs_recv_all(sock, chunk, len) != 0) {
+                snprintf(source->error, BUFFER_SIZE, "TAR_CREATION_FAILED");
                 break;
             }
-            
-            size_t bytes_sent = 0;
-            while (bytes_sent < bytes_received) {
-                int sent = send(client_socket, buffer + bytes_sent, bytes_received - bytes_sent, 0);
-                if (sent <= 0) {
-                    printf("[ZIP FILES ERROR] Failed to send to client at %zu/%ld bytes\n", 
-                           total_received + bytes_sent, filesize);
-                    close(server_socket);
-                    return -1;
+            crc = dfs_crc32c(crc, chunk, len);
+            received += len;
+            remaining -= len;
+
+            size_t offset = 0;
+            while (offset < len && source->error[0] == '\0' && !aborted) {
+                size_t take = len - offset < need ? len - offset : need;
+
+                if (state == TAR_AT_END) {
+                    // End-of-archive padding; the merged stream gets its own marker
+                    offset = len;
+                    continue;
+                }
+                if (state == TAR_IN_BODY && streaming) {
+                    if (merge_emit(merge, chunk + offset, take) != 0) {
+                        aborted = 1;
+                    }
+                } else if (used + take > TAR_MERGE_BUFFER) {
+                    snprintf(source->error, BUFFER_SIZE, "ERROR: %s archive has an oversized header", source->type);
+                    continue;
+                } else {
+                    memcpy(member + used, chunk + offset, take);
+                    used += take;
+                }
+                offset += take;
+                need -= take;
+                if (need > 0) {
+                    continue;
+                }
+
+                if (state == TAR_AT_HEADER) {
+                    char typeflag;
+                    uint64_t size;
+                    int parsed = dfs_tar_parse_header(member + used - DFS_TAR_BLOCK_SIZE, &typeflag, &size);
+                    if (parsed < 0 || (parsed == 1 && used > DFS_TAR_BLOCK_SIZE)) {
+                        snprintf(source->error, BUFFER_SIZE, "ERROR: %s archive arrived corrupt", source->type);
+                    } else if (parsed == 1) {
+                        state = TAR_AT_END;
+                        used = 0;
+                        need = UINT64_MAX;
+                    } else if (typeflag == 'x' || typeflag == 'g' || typeflag == 'L' || typeflag == 'K') {
+                        // Extended headers travel with the member they describe
+                        state = TAR_IN_META;
+                        meta_type = typeflag;
+                        meta_start = used;
+                        meta_size = size;
+                        need = (size + DFS_TAR_BLOCK_SIZE - 1) / DFS_TAR_BLOCK_SIZE * DFS_TAR_BLOCK_SIZE;
+                    } else {
+                        if (has_pax_size) {
+                            size = pax_size;
+                            has_pax_size = 0;
+                        }
+                        need = (size + DFS_TAR_BLOCK_SIZE - 1) / DFS_TAR_BLOCK_SIZE * DFS_TAR_BLOCK_SIZE;
+                        state = TAR_IN_BODY;
+                        if (used + need > TAR_MERGE_BUFFER) {
+                            // Too big to gather: hold the client for this member and pass it through
+                            pthread_mutex_lock(&merge->lock);
+                            streaming = 1;
+                            if (merge_emit(merge, member, used) != 0) {
+                                aborted = 1;
+                            }
+                            used = 0;
+                        }
+                    }
+                } else if (state == TAR_IN_META) {
+                    if (meta_type == 'x') {
+                        char records[TAR_META_MAX + 1];
+                        size_t records_len = meta_size < TAR_META_MAX ? meta_size : TAR_META_MAX;
+                        memcpy(records, member + meta_start, records_len);
+                        records[records_len] = '\0';
+                        has_pax_size = dfs_tar_pax_size(records, records_len, &pax_size);
+                    }
+                    state = TAR_AT_HEADER;
+                    need = DFS_TAR_BLOCK_SIZE;
+                }
+
+                if (state == TAR_IN_BODY && need == 0) {
+                    // Member complete: send it whole unless it already went through
+                    if (!streaming) {
+                        pthread_mutex_lock(&merge->lock);
+                        if (merge_emit(merge, member, used) != 0) {
+                            aborted = 1;
+                        }
+                    }
+                    merge->members++;
+                    pthread_mutex_unlock(&merge->lock);
+                    streaming = 0;
+                    used = 0;
+                    state = TAR_AT_HEADER;
+                    need = DFS_TAR_BLOCK_SIZE;
                 }
-                bytes_sent += sent;
-                printf("[ZIP FILES] Sent %d bytes to client\n", sent);
             }
-            
-            total_received += bytes_received;
-            printf("[ZIP FILES] Transfer progress: %zu/%ld bytes (%.1f%%)\n", 
-                   total_received, filesize, (total_received*100.0)/filesize);
         }
-        
-        printf("[ZIP FILES] Transfer complete. Total bytes: %zu/%ld\n", total_received, filesize);
-        close(server_socket);
-        return 0;
+        if (source->error[0] != '\0' || aborted) {
+            break;
+        }
     }
-    else {
-        printf("[ERROR] Unsupported file type: %s\n", filetype);
-        send(client_socket, "ERROR: Unsupported file type", 28, 0);
-        return -1;
+
+    if (streaming) {
+        pthread_mutex_unlock(&merge->lock);
+    }
+    free(member);
+    free(chunk);
+    if (result != 0) {
+        __atomic_store_n(&merge->failed, 1, __ATOMIC_RELAXED);
     }
+    return result;
 }
 
 // Function to handle dispfnames command
-int handle_display_filenames_command(char *command, int client_socket) {
+int handle_display_filenames_command(char *command, int client_socket, const DfsHeader *request) {
     char path[MAX_FILEPATH];
+    char cursor[MAX_FILEPATH] = "";
     char response[BUFFER_SIZE];
     
-    // Parse command
-    if (sscanf(command, "dispfnames %s", path) != 1) {
+    // Parse command: dispfnames <path> [<cursor>]
+    if (sscanf(command, "dispfnames %1023s %1023s", path, cursor) < 1) {
         snprintf(response, BUFFER_SIZE, "ERROR: Invalid dispfnames command syntax");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
+    // A cursor names the last entry already listed, as <type>:<name>, or just <type>: to start at a type
+    int cursor_rank = -1;
+    const char *cursor_name = NULL;
+    if (cursor[0] != '\0') {
+        char *colon = strchr(cursor, ':');
+        if (colon) {
+            *colon = '\0';
+            cursor_rank = get_listing_rank(cursor);
+            cursor_name = colon[1] != '\0' ? colon + 1 : NULL;
+        }
+        if (cursor_rank < 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Invalid listing cursor");
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+            return -1;
+        }
+    }
+
     // Expand path
     char expanded_path[MAX_FILEPATH];
     expand_path(path, expanded_path);
@@ -898,7 +1930,7 @@ int handle_display_filenames_command(char *command, int client_socket) {
     // Verify path is within S1
     if (!is_path_in_s1(expanded_path)) {
         snprintf(response, BUFFER_SIZE, "ERROR: Path must be within ~/S1");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -906,154 +1938,326 @@ int handle_display_filenames_command(char *command, int client_socket) {
     struct stat st;
     if (stat(expanded_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
         snprintf(response, BUFFER_SIZE, "ERROR: Directory not found or is not a directory");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, response);
         return -1;
     }
 
-    // Buffer to store file list
-    char file_list[BUFFER_SIZE * 4];
-    memset(file_list, 0, BUFFER_SIZE * 4);
-
-    // List files in directory
-    if (list_files_in_directory(expanded_path, file_list, client_socket) != 0) {
+    // Stream one page of the listing
+    if (list_files_in_directory(expanded_path, cursor_rank, cursor_name, client_socket, request) != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: Failed to list files");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
         return -1;
     }
 
     return 0;
 }
 
-// Function to list files in a directory
-int list_files_in_directory(const char *path, char *file_list, int client_socket) {
-    // Get .c files from S1
-    DIR *dir = opendir(path);
+// Function to collect, in order, the first limit names with an extension that sort after 'after'
+// (a max-heap of the best names so far keeps memory bounded however large the directory is)
+char **collect_sorted_page(const char *dirpath, const char *extension, const char *after, int limit, int *count) {
+    *count = 0;
+    DIR *dir = opendir(dirpath);
     if (!dir) {
-        return -1;
+        return NULL;
     }
 
-    // Temporary files to store sorted file lists
-    char c_files[BUFFER_SIZE] = "";
-    char pdf_files[BUFFER_SIZE] = "";
-    char txt_files[BUFFER_SIZE] = "";
-    char zip_files[BUFFER_SIZE] = "";
-    
-    // Get .c files from S1
+    char **heap = malloc((limit > 0 ? limit : 1) * sizeof(char *));
+    if (!heap) {
+        closedir(dir);
+        return NULL;
+    }
+    int size = 0;
+
     struct dirent *entry;
     while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            char *ext = get_file_extension(entry->d_name);
-            if (ext && strcmp(ext, "c") == 0) {
-                strcat(c_files, entry->d_name);
-                strcat(c_files, "\n");
+        if (entry->d_type != DT_REG) {
+            continue;
+        }
+        char *ext = get_file_extension(entry->d_name);
+        if (!ext || strcmp(ext, extension) != 0 || (after && strcmp(entry->d_name, after) <= 0)) {
+            continue;
+        }
+        
+        if (size < limit) {
+            // Room left: sift the new name up
+            char *name = strdup(entry->d_name);
+            if (!name) {
+                continue;
+            }
+            int i = size++;
+            while (i > 0 && strcmp(heap[(i - 1) / 2], name) < 0) {
+                heap[i] = heap[(i - 1) / 2];
+                i = (i - 1) / 2;
             }
+            heap[i] = name;
+        } else if (limit > 0 && strcmp(entry->d_name, heap[0]) < 0) {
+            // Smaller than the largest name kept: replace it and sift down
+            char *name = strdup(entry->d_name);
+            if (!name) {
+                continue;
+            }
+            free(heap[0]);
+            int i = 0;
+            while (1) {
+                int child = 2 * i + 1;
+                if (child >= size) {
+                    break;
+                }
+                if (child + 1 < size && strcmp(heap[child + 1], heap[child]) > 0) {
+                    child++;
+                }
+                if (strcmp(heap[child], name) <= 0) {
+                    break;
+                }
+                heap[i] = heap[child];
+                i = child;
+            }
+            heap[i] = name;
         }
     }
     closedir(dir);
 
-    // Connect to servers to get file lists
-    int server_socket;
-    char server_command[COMMAND_SIZE];
-    char response[BUFFER_SIZE];
-    char server_path[MAX_FILEPATH];
-    
-    // Get .pdf files from S2
-    server_socket = connect_to_server(s2_info.ip, s2_info.port);
-    if (server_socket >= 0) {
-        get_corresponding_server_path(path, server_path, 2);
-        snprintf(server_command, COMMAND_SIZE, "LIST %s pdf", server_path);
-        
-        if (send(server_socket, server_command, strlen(server_command), 0) >= 0) {
-            memset(response, 0, BUFFER_SIZE);
-            if (recv(server_socket, response, BUFFER_SIZE - 1, 0) > 0) {
-                strcpy(pdf_files, response);
-            }
+    qsort(heap, size, sizeof(char *), compare_strings);
+    *count = size;
+    return heap;
+}
+
+// Compare function for qsort
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Function to give a file type its place in listings (.c, .pdf, .txt, .zip), or -1
+int get_listing_rank(const char *type) {
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(type, listing_types[i]) == 0) {
+            return i;
         }
-        close(server_socket);
     }
-    
-    // Get .txt files from S3
-    server_socket = connect_to_server(s3_info.ip, s3_info.port);
-    if (server_socket >= 0) {
-        get_corresponding_server_path(path, server_path, 3);
-        snprintf(server_command, COMMAND_SIZE, "LIST %s txt", server_path);
-        
-        if (send(server_socket, server_command, strlen(server_command), 0) >= 0) {
-            memset(response, 0, BUFFER_SIZE);
-            if (recv(server_socket, response, BUFFER_SIZE - 1, 0) > 0) {
-                strcpy(txt_files, response);
-            }
+    return -1;
+}
+
+// Function to add one line to a listing batch, sending the batch on when it is full
+int batch_append(ListingBatch *batch, const char *line, int client_socket, const DfsHeader *request) {
+    size_t len = strlen(line);
+    if (batch->len + len + 1 > LIST_BATCH_SIZE) {
+        if (dfs_send_frame(client_socket, DFS_OP_DATA, DFS_STATUS_READY, request->request_id,
+                           batch->data, batch->len) != 0) {
+            return -1;
         }
-        close(server_socket);
+        batch->len = 0;
     }
-    
-    // Get .zip files from S4
-    server_socket = connect_to_server(s4_info.ip, s4_info.port);
-    if (server_socket >= 0) {
-        get_corresponding_server_path(path, server_path, 4);
-        snprintf(server_command, COMMAND_SIZE, "LIST %s zip", server_path);
-        
-        if (send(server_socket, server_command, strlen(server_command), 0) >= 0) {
-            memset(response, 0, BUFFER_SIZE);
-            if (recv(server_socket, response, BUFFER_SIZE - 1, 0) > 0) {
-                strcpy(zip_files, response);
+    memcpy(batch->data + batch->len, line, len);
+    batch->data[batch->len + len] = '\n';
+    batch->len += len + 1;
+    return 0;
+}
+
+// Function to read one backend's page of names and append them to the listing
+// (returns 0 with the stream fully consumed, -1 if the connection broke)
+static int stream_backend_listing(int server_socket, uint64_t len, int *remaining, int rank,
+                                  ListingBatch *batch, char *last_name, int *last_rank,
+                                  int client_socket, const DfsHeader *request) {
+    char chunk[BUFFER_SIZE];
+    char line[MAX_FILENAME];
+    size_t line_len = 0;
+
+    while (len > 0) {
+        size_t want = len < BUFFER_SIZE ? len : BUFFER_SIZE;
+        if (dfs_recv_all(server_socket, chunk, want) != 0) {
+            return -1;
+        }
+        len -= want;
+
+        for (size_t i = 0; i < want; i++) {
+            if (chunk[i] != '\n') {
+                if (line_len < MAX_FILENAME - 1) {
+                    line[line_len++] = chunk[i];
+                }
+                continue;
+            }
+            line[line_len] = '\0';
+            line_len = 0;
+
+            // Names past the end of the page are read and dropped to keep the stream in sync
+            if (*remaining > 0) {
+                batch_append(batch, line, client_socket, request);
+                strcpy(last_name, line);
+                *last_rank = rank;
+                (*remaining)--;
             }
         }
-        close(server_socket);
     }
+    return 0;
+}
+
+// Function to list one page of a directory: .c names from S1, then .pdf/.txt/.zip from S2/S3/S4,
+// streamed to the client in batches and closed with the cursor for the next page. Servers the
+// namespace index holds in full are answered from it; only the others are asked
+int list_files_in_directory(const char *path, int cursor_rank, const char *cursor_name,
+                            int client_socket, const DfsHeader *request) {
+    ListingBatch batch;
+    batch.len = 0;
+    int remaining = DFS_LIST_PAGE_SIZE;
+    char last_name[MAX_FILENAME] = "";
+    int last_rank = -1;
+
+    // Get .c files from S1 unless the cursor is already past them
+    if (cursor_rank <= 0) {
+        int count = 0;
+        const char *after = cursor_rank == 0 ? cursor_name : NULL;
+        char **names = dfs_index_page(&namespace_index, path, 1, after, remaining, &count);
+        if (!names) {
+            names = collect_sorted_page(path, "c", after, remaining, &count);
+        }
+        if (!names) {
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            batch_append(&batch, names[i], client_socket, request);
+            snprintf(last_name, MAX_FILENAME, "%s", names[i]);
+            last_rank = 0;
+            free(names[i]);
+        }
+        free(names);
+        remaining -= count;
+    }
+
+    // Ask every backend the page still needs at once; rank i + 1 is served by S(i + 2)
+    int sockets[3] = {-1, -1, -1};
+    int requested[3] = {0, 0, 0};
+    char **indexed[3] = {NULL, NULL, NULL};
+    int indexed_count[3] = {0, 0, 0};
+    for (int i = 0; i < 3 && remaining > 0; i++) {
+        int rank = i + 1;
+        int server_type = i + 2;
+        if (rank < cursor_rank) {
+            continue;
+        }
+        requested[i] = 1;
 
-    // Combine file lists
-    strcpy(file_list, c_files);
-    strcat(file_list, pdf_files);
-    strcat(file_list, txt_files);
-    strcat(file_list, zip_files);
+        indexed[i] = dfs_index_page(&namespace_index, path, server_type, rank == cursor_rank ? cursor_name : NULL,
+                                    remaining, &indexed_count[i]);
+        if (indexed[i]) {
+            continue;
+        }
 
-    // Send combined list to client
-    char ready_msg[] = "FILES_COMING";
-    send(client_socket, ready_msg, strlen(ready_msg), 0);
-    
-    // Wait for client acknowledgment
-    memset(response, 0, BUFFER_SIZE);
-    if (recv(client_socket, response, BUFFER_SIZE - 1, 0) <= 0 || 
-        strcmp(response, "READY") != 0) {
-        return -1;
+        char server_command[COMMAND_SIZE];
+        char server_path[MAX_FILEPATH];
+        get_corresponding_server_path(path, server_path, server_type);
+        if (snprintf(server_command, COMMAND_SIZE, "LIST %s %s %s %d", server_path, listing_types[rank],
+                     rank == cursor_rank && cursor_name ? cursor_name : "-", remaining) >= COMMAND_SIZE) {
+            // A path and cursor too long for the command leave this server out, as if it were down
+            continue;
+        }
+
+        sockets[i] = acquire_backend_connection(server_type);
+        if (sockets[i] >= 0 &&
+            dfs_send_message(sockets[i], DFS_OP_LIST, DFS_STATUS_OK,
+                             dfs_next_request_id(), server_command) != 0) {
+            release_backend_connection(server_type, sockets[i], 0);
+            sockets[i] = -1;
+        }
     }
-    
-    // Send file list
-    if (strlen(file_list) == 0) {
-        char no_files[] = "No files found in this directory";
-        send(client_socket, no_files, strlen(no_files), 0);
-    } else {
-        send(client_socket, file_list, strlen(file_list), 0);
+
+    // Consume replies in type order; later ones wait in their socket buffers meanwhile. A server that
+    // does not answer has its type skipped and named in the notice, and the others are still merged
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char notice[192] = "";
+    size_t notice_len = 0;
+    for (int i = 0; i < 3; i++) {
+        int server_type = i + 2;
+        if (!requested[i]) {
+            continue;
+        }
+
+        if (indexed[i]) {
+            for (int k = 0; k < indexed_count[i]; k++) {
+                if (remaining > 0) {
+                    batch_append(&batch, indexed[i][k], client_socket, request);
+                    snprintf(last_name, MAX_FILENAME, "%s", indexed[i][k]);
+                    last_rank = i + 1;
+                    remaining--;
+                }
+                free(indexed[i][k]);
+            }
+            free(indexed[i]);
+            continue;
+        }
+
+        int answered = 0;
+        if (sockets[i] >= 0) {
+            if (remaining == 0) {
+                // Page already full; closing is cheaper than draining the reply
+                release_backend_connection(server_type, sockets[i], 0);
+                continue;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            long wait_ms = elapsed_ms < LIST_DEADLINE_MS ? LIST_DEADLINE_MS - elapsed_ms : 0;
+            struct pollfd pfd = {sockets[i], POLLIN, 0};
+            DfsHeader reply;
+            int reusable = 0;
+
+            // Replies that arrived while an earlier backend was awaited still count
+            if (poll(&pfd, 1, wait_ms) == 1 &&
+                dfs_recv_header(sockets[i], &reply) == 0) {
+                if (reply.opcode == DFS_OP_DATA && reply.status == DFS_STATUS_OK) {
+                    reusable = stream_backend_listing(sockets[i], reply.payload_len, &remaining, i + 1,
+                                                      &batch, last_name, &last_rank,
+                                                      client_socket, request) == 0;
+                    answered = reusable;
+                } else {
+                    reusable = dfs_discard(sockets[i], reply.payload_len) == 0;
+                }
+            } else {
+                fprintf(stderr, "S%d did not answer LIST within %d ms\n", server_type, LIST_DEADLINE_MS);
+            }
+            // A late reply would desync a pooled socket, so unanswered ones are closed
+            release_backend_connection(server_type, sockets[i], reusable);
+        }
+
+        if (!answered) {
+            int added = snprintf(notice + notice_len, sizeof(notice) - notice_len,
+                                 "%sS%d unavailable: .%s files not listed", notice_len > 0 ? "; " : "",
+                                 server_type, listing_types[i + 1]);
+            if (added > 0 && (size_t)added < sizeof(notice) - notice_len) {
+                notice_len += added;
+            }
+        }
     }
-    
-    return 0;
-}
 
-// Function to transfer file to another server
-void transfer_file_to_server(const char *filename, const char *dest_path, int server_type) {
-    int server_socket = -1;
-    
-    // Connect to appropriate server
-    switch (server_type) {
-        case 2:  // S2
-            server_socket = connect_to_server(s2_info.ip, s2_info.port);
-            break;
-        case 3:  // S3
-            server_socket = connect_to_server(s3_info.ip, s3_info.port);
-            break;
-        case 4:  // S4
-            server_socket = connect_to_server(s4_info.ip, s4_info.port);
-            break;
-        default:
-            return;
+    // Flush the last batch, then tell the client where the next page starts
+    if (batch.len > 0 &&
+        dfs_send_frame(client_socket, DFS_OP_DATA, DFS_STATUS_READY, request->request_id,
+                       batch.data, batch.len) != 0) {
+        return -1;
     }
-    
-    if (server_socket < 0) {
-        perror("Error connecting to server");
-        return;
+
+    // Servers that did not answer are named on a line after the cursor
+    char cursor[MAX_FILENAME + 200] = "";
+    if (remaining == 0 && last_rank >= 0) {
+        snprintf(cursor, sizeof(cursor), "%s:%s", listing_types[last_rank], last_name);
     }
-    
+    if (notice_len > 0) {
+        size_t len = strlen(cursor);
+        snprintf(cursor + len, sizeof(cursor) - len, "\n%s", notice);
+    }
+    return dfs_send_message(client_socket, DFS_OP_DATA, DFS_STATUS_OK, request->request_id, cursor);
+}
+
+// Function to stream an upload from the client straight to another server (returns 1 when the upload
+// was answered without taking a body, by the server or for a command too long to send, that answer
+// already passed to the client).
+// stored is set to 1 when the server's answer describes a file it stored, then held in file; 0 when
+// the path is as it was; and -1 when the server's connection broke and what it holds is not known.
+int relay_file_to_server(const char *filename, const char *dest_path, int server_type, int level,
+                         const char *options, int client_socket, const DfsHeader *request, int *stored,
+                         DfsIndexFile *file) {
+    *stored = 0;
+
     // Prepare server destination path
     char server_dest_path[MAX_FILEPATH];
     char *modified_path = strdup(dest_path);
@@ -1066,222 +2270,711 @@ void transfer_file_to_server(const char *filename, const char *dest_path, int se
         memcpy(s1_pos, server_name, 2);
     }
     
-    strcpy(server_dest_path, modified_path);
-    free(modified_path);
+    strcpy(server_dest_path, modified_path);
+    free(modified_path);
+    
+    // Build the upload command, passing on the client's compression offer and other options. A command
+    // cut short would lose those options, and the server would store the body unverified or unpublished
+    char server_command[COMMAND_SIZE];
+    int length;
+    if (level > 0) {
+        length = snprintf(server_command, COMMAND_SIZE, "RECEIVE %s %s z=%d%s", basename((char *)filename),
+                          server_dest_path, level, options);
+    } else {
+        length = snprintf(server_command, COMMAND_SIZE, "RECEIVE %s %s%s", basename((char *)filename),
+                          server_dest_path, options);
+    }
+    if (length < 0 || length >= COMMAND_SIZE) {
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Path too long");
+        return 1;
+    }
+    
+    // Connect to appropriate server
+    int server_socket = acquire_backend_connection(server_type);
+    
+    if (server_socket < 0) {
+        perror("Error connecting to server");
+        return -1;
+    }
     
     // Send upload command to server
-    char server_command[COMMAND_SIZE];
-    snprintf(server_command, COMMAND_SIZE, "RECEIVE %s %s", basename((char *)filename), server_dest_path);
-    
-    if (send(server_socket, server_command, strlen(server_command), 0) < 0) {
+    uint32_t request_id = dfs_next_request_id();
+    if (dfs_send_message(server_socket, DFS_OP_RECEIVE, DFS_STATUS_OK, request_id, server_command) != 0) {
         perror("Error sending command to server");
-        close(server_socket);
-        return;
+        release_backend_connection(server_type, server_socket, 0);
+        return -1;
     }
     
-    // Wait for server response
+    // Wait for the server before asking the client for the body
     char response[BUFFER_SIZE];
-    memset(response, 0, BUFFER_SIZE);
+    DfsHeader reply;
     
-    if (recv(server_socket, response, BUFFER_SIZE - 1, 0) <= 0 || 
-        strcmp(response, "READY_TO_RECEIVE") != 0) {
+    if (dfs_recv_header(server_socket, &reply) != 0 ||
+        dfs_recv_payload(server_socket, &reply, response, BUFFER_SIZE) != 0) {
         perror("Error receiving response from server");
-        close(server_socket);
-        return;
+        release_backend_connection(server_type, server_socket, 0);
+        return -1;
     }
-    
-    // Send file to server
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("Error opening file");
-        close(server_socket);
-        return;
+    if (reply.status != DFS_STATUS_READY) {
+        // Stored from content the server already had, a multipart upload opened or committed, or
+        // refused: the client never sends a body and gets the server's answer as it is
+        if (reply.status == DFS_STATUS_OK) {
+            // The description is for the index; the client gets the answer without it
+            char *described = strstr(response, " size=");
+            *stored = dfs_index_parse_description(response, file) == 0 ? 1 : -1;
+            if (described) {
+                *described = '\0';
+            }
+        }
+        release_backend_connection(server_type, server_socket, 1);
+        dfs_reply(client_socket, request, reply.status, response);
+        return 1;
     }
     
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
+    // The server's answer settles the offer (only what it can inflate is sent compressed) and names
+    // the session and offset the client continues from, so it goes to the client as it is
+    char *accepted = strstr(response, " z=");
+    dfs_reply(client_socket, request, DFS_STATUS_READY, response);
     
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-        if (send(server_socket, buffer, bytes_read, 0) < 0) {
-            perror("Error sending file to server");
-            fclose(fp);
-            close(server_socket);
-            return;
-        }
+    // Client follows up with a DATA frame carrying the file body
+    DfsHeader data;
+    if (dfs_recv_header(client_socket, &data) != 0) {
+        perror("Error receiving file header from client");
+        release_backend_connection(server_type, server_socket, 0);
+        return -1;
+    }
+    if (data.opcode != DFS_OP_DATA) {
+        // Read past whatever came instead, so the client's next command is read from its start
+        fprintf(stderr, "Expected the file body from the client, got opcode %u\n", data.opcode);
+        release_backend_connection(server_type, server_socket, 0);
+        dfs_discard(client_socket, data.payload_len);
+        return -1;
     }
     
-    fclose(fp);
-    close(server_socket);
-}
-
-// Function to retrieve file from another server
-int retrieve_file_from_server(const char *filename, int server_type) {
-    int server_socket = -1;
-    
-    // Connect to appropriate server
-    switch (server_type) {
-        case 2:  // S2
-            server_socket = connect_to_server(s2_info.ip, s2_info.port);
-            break;
-        case 3:  // S3
-            server_socket = connect_to_server(s3_info.ip, s3_info.port);
-            break;
-        case 4:  // S4
-            server_socket = connect_to_server(s4_info.ip, s4_info.port);
-            break;
-        default:
+    int relayed;
+    if (data.flags & DFS_FLAG_DEFLATE) {
+        // Compressed frames go through untouched; the server inflates them
+        if (!accepted) {
+            dfs_recv_deflate_to_file(client_socket, &data, NULL);
+            release_backend_connection(server_type, server_socket, 0);
             return -1;
+        }
+        relayed = dfs_relay_deflate(client_socket, server_socket, &data, request_id);
+    } else {
+        // Forward the same length so the server can stream against it
+        if (dfs_send_header(server_socket, DFS_OP_DATA, DFS_STATUS_OK, request_id, data.payload_len) != 0) {
+            uint32_t crc;
+            perror("Error sending file header to server");
+            release_backend_connection(server_type, server_socket, 0);
+            dfs_discard(client_socket, data.payload_len);
+            dfs_recv_checksum(client_socket, &crc);
+            return -1;
+        }
+        relayed = dfs_relay(client_socket, server_socket, data.payload_len);
     }
     
-    if (server_socket < 0) {
-        perror("Error connecting to server");
+    // The client's checksum follows the body; the server checks it against the bytes it stored
+    if (relayed == 0 || relayed == DFS_RELAY_SINK_FAILED) {
+        int passed = dfs_relay_checksum(client_socket, server_socket, request_id);
+        if (passed != 0 && (relayed == 0 || passed != DFS_RELAY_SINK_FAILED)) {
+            relayed = passed;
+        }
+    }
+    if (relayed != 0) {
+        // Client body was drained only if the server side is what failed; a server cut off from the
+        // client never had the whole body to store
+        fprintf(stderr, "Error relaying file to S%d: %s\n", server_type,
+                relayed == DFS_RELAY_SINK_FAILED ? "server connection lost" : "client connection lost");
+        if (relayed == DFS_RELAY_SINK_FAILED) {
+            *stored = -1;
+        }
+        release_backend_connection(server_type, server_socket, 0);
+        return -1;
+    }
+    
+    // The server replies only once the file is on stable storage
+    if (dfs_recv_header(server_socket, &reply) != 0 ||
+        dfs_recv_payload(server_socket, &reply, response, BUFFER_SIZE) != 0) {
+        fprintf(stderr, "Error storing file on S%d\n", server_type);
+        *stored = -1;
+        release_backend_connection(server_type, server_socket, 0);
         return -1;
     }
+    if (reply.status != DFS_STATUS_OK) {
+        // A body the server refused (such as one that failed its checksum) is reported as it is
+        fprintf(stderr, "Error storing file on S%d: %s\n", server_type, response);
+        release_backend_connection(server_type, server_socket, 1);
+        dfs_reply(client_socket, request, reply.status, response);
+        return 1;
+    }
+    
+    *stored = dfs_index_parse_description(response, file) == 0 ? 1 : -1;
+    release_backend_connection(server_type, server_socket, 1);
+    return 0;
+}
+
+// Function to stream a file, or a range of it, from another server straight to the client
+int relay_file_from_server(const char *filename, int server_type, int level, const DfsRange *range,
+                           int client_socket, const DfsHeader *request) {
+    char response[BUFFER_SIZE];
     
     // Prepare server file path
     char server_filepath[MAX_FILEPATH];
     get_corresponding_server_path(filename, server_filepath, server_type);
     
-    // Send download command to server
+    // Build the download command; with an offer the server may answer in compressed frames, and a
+    // range is passed on so only those bytes leave the server
     char server_command[COMMAND_SIZE];
-    snprintf(server_command, COMMAND_SIZE, "SEND %s", server_filepath);
-    
-    if (send(server_socket, server_command, strlen(server_command), 0) < 0) {
-        perror("Error sending command to server");
-        close(server_socket);
+    int used = snprintf(server_command, COMMAND_SIZE, "SEND %s", server_filepath);
+    if (used >= 0 && used < COMMAND_SIZE && level > 0) {
+        int added = snprintf(server_command + used, COMMAND_SIZE - used, " z=%d", level);
+        used = added < 0 ? added : used + added;
+    }
+    if (used >= 0 && used < COMMAND_SIZE) {
+        int added = dfs_session_format_range(range, server_command + used, COMMAND_SIZE - used);
+        used = added < 0 ? added : used + added;
+    }
+    if (used < 0 || used >= COMMAND_SIZE) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Path too long");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
     
-    // Wait for server response
-    char response[BUFFER_SIZE];
-    memset(response, 0, BUFFER_SIZE);
+    // Connect to appropriate server
+    int server_socket = acquire_backend_connection(server_type);
     
-    if (recv(server_socket, response, BUFFER_SIZE - 1, 0) <= 0 || 
-        strncmp(response, "READY_TO_SEND", 13) != 0) {
-        perror("Error receiving response from server");
-        close(server_socket);
+    if (server_socket < 0) {
+        perror("Error connecting to server");
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to retrieve file from server");
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
         return -1;
     }
     
-    // Create directory path if needed
-    char *dir_path = strdup(filename);
-    char *last_slash = strrchr(dir_path, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        create_directory_path(dir_path);
-    }
-    free(dir_path);
-    
-    // Receive file from server
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("Error creating file");
-        close(server_socket);
+    DfsHeader reply;
+    if (dfs_send_message(server_socket, DFS_OP_SEND, DFS_STATUS_OK,
+                         dfs_next_request_id(), server_command) != 0 ||
+        dfs_recv_header(server_socket, &reply) != 0) {
+        fprintf(stderr, "Error requesting file from S%d\n", server_type);
+        release_backend_connection(server_type, server_socket, 0);
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to retrieve file from server");
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
         return -1;
     }
     
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
+    // Pass the server's error on to the client
+    int compressed = reply.opcode == DFS_OP_DATA && (reply.flags & DFS_FLAG_DEFLATE);
+    if (reply.opcode != DFS_OP_DATA || (reply.status != DFS_STATUS_OK && !compressed)) {
+        int reusable = dfs_recv_payload(server_socket, &reply, response, BUFFER_SIZE) == 0;
+        release_backend_connection(server_type, server_socket, reusable);
+        if (!reusable) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to retrieve file from server");
+        }
+        dfs_reply(client_socket, request, reply.status == DFS_STATUS_OK ? DFS_STATUS_ERROR : reply.status,
+                  response);
+        return -1;
+    }
     
-    while ((bytes_read = recv(server_socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        if (fwrite(buffer, 1, bytes_read, fp) != bytes_read) {
-            perror("Error writing to file");
-            fclose(fp);
-            close(server_socket);
-            remove(filename);
+    // Compressed frames go to the client as they are, to be inflated there
+    int relayed;
+    if (compressed) {
+        relayed = dfs_relay_deflate(server_socket, client_socket, &reply, request->request_id);
+    } else {
+        // The client sees the first byte one server round trip after asking
+        if (dfs_send_header(client_socket, DFS_OP_DATA, DFS_STATUS_OK, request->request_id,
+                            reply.payload_len) != 0) {
+            uint32_t crc;
+            perror("Error sending file header to client");
+            release_backend_connection(server_type, server_socket,
+                                       dfs_discard(server_socket, reply.payload_len) == 0 &&
+                                       dfs_recv_checksum(server_socket, &crc) == 0);
             return -1;
         }
-        
-        // Check if end of file
-        if (bytes_read < BUFFER_SIZE) {
-            break;
-        }
+        relayed = dfs_relay(server_socket, client_socket, reply.payload_len);
     }
     
-    fclose(fp);
-    close(server_socket);
-    
-    if (bytes_read < 0) {
-        perror("Error receiving file from server");
-        remove(filename);
+    // The server's checksum follows the body for the client to check what it received
+    if (relayed == 0 || relayed == DFS_RELAY_SINK_FAILED) {
+        int passed = dfs_relay_checksum(server_socket, client_socket, request->request_id);
+        if (passed != 0 && (relayed == 0 || passed != DFS_RELAY_SINK_FAILED)) {
+            relayed = passed;
+        }
+    }
+    if (relayed != 0) {
+        // A lost client leaves the server stream drained and reusable
+        fprintf(stderr, "Error relaying file from S%d\n", server_type);
+        release_backend_connection(server_type, server_socket, relayed == DFS_RELAY_SINK_FAILED);
         return -1;
     }
     
+    release_backend_connection(server_type, server_socket, 1);
     return 0;
 }
 
-// Function to send file to client
-int send_file_to_client(const char *filepath, int client_socket) {
+// Function to send file, or just a range of it, to client
+int send_file_to_client(const char *filepath, int level, const DfsRange *range, int client_socket,
+                        const DfsHeader *request) {
     FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
+    struct stat st;
+    if (!fp || fstat(fileno(fp), &st) != 0) {
         char response[BUFFER_SIZE];
         snprintf(response, BUFFER_SIZE, "ERROR: File not found or cannot be opened");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, response);
+        if (fp) {
+            fclose(fp);
+        }
         return -1;
     }
     
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
+    uint64_t offset, length;
+    if (dfs_session_resolve_range(range, st.st_size, &offset, &length) != 0 ||
+        lseek(fileno(fp), offset, SEEK_SET) < 0) {
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Range is beyond the end of the file");
+        fclose(fp);
+        return -1;
+    }
     
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-        if (send(client_socket, buffer, bytes_read, 0) < 0) {
-            perror("Error sending file to client");
-            fclose(fp);
-            return -1;
-        }
+    // Announce the range's length, then stream the body, or compress it as the client offered. The whole
+    // file goes out with the checksum stored when it arrived; anything else is summed as it is read
+    uint32_t stored;
+    int whole = offset == 0 && length == (uint64_t)st.st_size && dfs_crc32c_get_attr(fileno(fp), &stored) == 0;
+    int sent = level > 0 ? dfs_send_file_deflate(client_socket, DFS_OP_DATA, request->request_id, fileno(fp),
+                                                 length, level)
+                         : dfs_send_body(client_socket, request->request_id, fileno(fp), length,
+                                         whole ? &stored : NULL);
+    if (sent != 0) {
+        perror("Error sending file to client");
+        fclose(fp);
+        return -1;
     }
     
     fclose(fp);
     return 0;
 }
 
-// Function to receive file from client
-int receive_file_from_client(const char *filepath, int client_socket) {
-    // Create directory path if needed
-    char *dir_path = strdup(filepath);
-    char *last_slash = strrchr(dir_path, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        create_directory_path(dir_path);
+// Function to keep the cached .c archive in step with a stored or removed file
+void update_tar_cache(const char *filepath, int appended) {
+    char base_dir[MAX_FILEPATH];
+    char cache_dir[MAX_FILEPATH];
+    expand_path(S1_BASE_DIR, base_dir);
+    expand_path(S1_CACHE_DIR, cache_dir);
+
+    // A new file extends the archive; anything else makes it stale
+    if (appended) {
+        dfs_tar_cache_append(cache_dir, base_dir, "c", "S1", filepath);
+    } else {
+        dfs_tar_cache_invalidate(cache_dir, "c");
+    }
+}
+
+// Function to load the namespace index from the local tree and each backend's inventory, then keep it
+// in step: servers that could not be read are tried again, and every server is read again now and then.
+// The index is written to its snapshot after a load and every INDEX_SAVE_INTERVAL while it changes.
+void *index_rebuild_worker(void *arg) {
+    time_t loaded[DFS_INDEX_SERVERS + 1] = {0};
+    time_t saved = time(NULL);
+    (void)arg;
+
+    while (1) {
+        int reloaded = 0;
+        for (int server_type = 1; server_type <= DFS_INDEX_SERVERS; server_type++) {
+            time_t now = time(NULL);
+            if (loaded[server_type] != 0 && now - loaded[server_type] < INDEX_RESYNC_INTERVAL &&
+                dfs_index_ready(&namespace_index, server_type)) {
+                continue;
+            }
+            if (load_index_inventory(server_type) == 0) {
+                loaded[server_type] = now;
+                reloaded = 1;
+            }
+        }
+        if (reloaded || time(NULL) - saved >= INDEX_SAVE_INTERVAL) {
+            if (dfs_index_save(&namespace_index) != 0) {
+                perror("Error saving namespace index snapshot");
+            }
+            saved = time(NULL);
+        }
+        sleep(INDEX_RETRY_INTERVAL);
     }
-    free(dir_path);
-    
-    FILE *fp = fopen(filepath, "wb");
-    if (!fp) {
-        char response[BUFFER_SIZE];
-        snprintf(response, BUFFER_SIZE, "ERROR: Failed to create file");
-        send(client_socket, response, strlen(response), 0);
+    return NULL;
+}
+
+// Function to read one server's whole inventory into the index (returns 0 once it is loaded)
+int load_index_inventory(int server_type) {
+    char s1_base[MAX_FILEPATH];
+    expand_path(S1_BASE_DIR, s1_base);
+
+    // An upload or removal while the inventory was read may be missing from it, so read it again
+    for (int attempt = 0; attempt < 3; attempt++) {
+        uint64_t epoch = dfs_index_epoch(&namespace_index, server_type);
+        DfsIndexBatch batch;
+        int result;
+        dfs_index_batch_init(&batch);
+
+        if (server_type == 1) {
+            result = dfs_index_scan(&batch, s1_base, s1_base, "c");
+        } else {
+            // A connection of its own: pooled ones are copied into every forked child
+            ServerInfo *info = get_server_info(server_type);
+            char server_base[MAX_FILEPATH];
+            char server_command[COMMAND_SIZE];
+            get_corresponding_server_path(s1_base, server_base, server_type);
+            if (snprintf(server_command, COMMAND_SIZE, "INVENTORY %s", server_base) >= COMMAND_SIZE) {
+                dfs_index_batch_free(&batch);
+                return -1;
+            }
+
+            int sock = connect_to_server(info->ip, info->port);
+            result = sock < 0 ||
+                     dfs_send_message(sock, DFS_OP_INVENTORY, DFS_STATUS_OK, dfs_next_request_id(),
+                                      server_command) != 0 ||
+                     dfs_index_recv_inventory(sock, &batch) != 0 ? -1 : 0;
+            if (sock >= 0) {
+                close(sock);
+            }
+        }
+
+        if (result == 0) {
+            result = dfs_index_replace(&namespace_index, server_type, &batch, epoch);
+        }
+        if (result == 0) {
+            printf("Namespace index loaded %zu files from S%d\n", batch.count, server_type);
+        }
+        dfs_index_batch_free(&batch);
+        if (result != 1) {
+            return result;
+        }
+    }
+    return -1;
+}
+
+// Function to record a .c file just stored in S1 in the namespace index
+void index_local_file(const char *filepath) {
+    struct stat st;
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        dfs_index_invalidate(&namespace_index, 1);
+        return;
+    }
+    DfsIndexFile file = {st.st_size, st.st_mtime, 0, 0};
+    file.has_crc = dfs_crc32c_get_attr(fd, &file.crc) == 0;
+    close(fd);
+    dfs_index_put(&namespace_index, filepath, 1, &file);
+}
+
+// Function to record in the namespace index what a backend stored at a path, as its answer to the
+// upload described it
+void index_backend_file(const char *filepath, int server_type, int stored, const DfsIndexFile *file) {
+    if (stored > 0) {
+        dfs_index_put(&namespace_index, filepath, server_type, file);
+    } else if (stored < 0) {
+        // Not knowing what was stored, the index stops answering for this server until it reloads
+        dfs_index_invalidate(&namespace_index, server_type);
+    }
+}
+
+// Function to follow one backend's presence filter over a WATCH connection of its own, connecting
+// again whenever it breaks; until it has a snapshot the copy answers nothing
+void *filter_watch_worker(void *arg) {
+    int server_type = (int)(intptr_t)arg;
+    ServerInfo *info = get_server_info(server_type);
+
+    while (1) {
+        int sock = connect_to_server(info->ip, info->port);
+        if (sock >= 0 &&
+            dfs_send_message(sock, DFS_OP_WATCH, DFS_STATUS_OK, dfs_next_request_id(), "WATCH") == 0) {
+            printf("Watching the presence filter of S%d\n", server_type);
+            dfs_filter_follow(backend_filters[server_type], sock);
+            printf("Lost the presence filter of S%d\n", server_type);
+        }
+        if (sock >= 0) {
+            close(sock);
+        }
+        sleep(WATCH_RETRY_INTERVAL);
+    }
+    return NULL;
+}
+
+// Function to mark a file just relayed to a backend as present until the backend's own change arrives
+void note_backend_upload(const char *filepath, int server_type) {
+    char s1_base[MAX_FILEPATH];
+    expand_path(S1_BASE_DIR, s1_base);
+    dfs_filter_note(backend_filters[server_type], s1_base, filepath);
+}
+
+// Function to check whether a file is known not to be stored, from the namespace index or, when the
+// index cannot tell, the server's presence filter
+int is_known_missing(const char *filepath, int server_type) {
+    int indexed = dfs_index_lookup(&namespace_index, filepath, server_type, NULL);
+    if (indexed >= 0 || server_type == 1) {
+        return indexed == 0;
+    }
+    char s1_base[MAX_FILEPATH];
+    expand_path(S1_BASE_DIR, s1_base);
+    return dfs_filter_check(backend_filters[server_type], s1_base, filepath) == 0;
+}
+
+// Function to append a file body from the client to a file. A body that does not match its checksum
+// is cut off again, so a retry resumes from the last bytes known to be good
+int receive_file_from_client(const char *filepath, int client_socket, const DfsHeader *data) {
+    FILE *fp = fopen(filepath, "ab");
+    struct stat st;
+    int compressed = data->flags & DFS_FLAG_DEFLATE;
+    if (!fp || fstat(fileno(fp), &st) != 0) {
+        // Drain the body so the connection stays in sync
+        if (compressed) {
+            dfs_recv_deflate_to_file(client_socket, data, NULL);
+        } else {
+            uint32_t crc;
+            dfs_discard(client_socket, data->payload_len);
+            dfs_recv_checksum(client_socket, &crc);
+        }
+        if (fp) {
+            fclose(fp);
+        }
         return -1;
     }
     
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
+    // Whatever arrives is kept, so a broken upload can resume after it
+    int received = compressed ? dfs_recv_deflate_to_file(client_socket, data, fp)
+                              : dfs_recv_body(client_socket, fp, data->payload_len);
+    if (received == DFS_CHECKSUM_MISMATCH) {
+        fprintf(stderr, "Checksum mismatch receiving %s\n", filepath);
+        if (fflush(fp) != 0 || ftruncate(fileno(fp), st.st_size) != 0) {
+            perror("Error discarding corrupt data");
+        }
+    } else if (received != 0) {
+        perror("Error receiving file from client");
+    }
     
-    while ((bytes_read = recv(client_socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        if (fwrite(buffer, 1, bytes_read, fp) != bytes_read) {
-            perror("Error writing to file");
-            fclose(fp);
-            remove(filepath);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0) {
+        perror("Error writing to file");
+        return -1;
+    }
+    
+    return received;
+}
+
+// Function to take one step of a multipart .c upload: open it with the part file reserved at full size,
+// write a part where it belongs, or publish the part file once it hashes to the client's digest
+int receive_multipart_upload(const char *command, const char *filepath, const char *session, int client_socket,
+                             const DfsHeader *request) {
+    char response[BUFFER_SIZE];
+    char partial_dir[MAX_FILEPATH];
+    char session_id[DFS_SESSION_ID_LEN + 1];
+    char part_path[MAX_FILEPATH];
+    uint64_t total;
+    uint64_t part_offset;
+    expand_path(S1_PARTIAL_DIR, partial_dir);
+
+    if (dfs_session_find_multipart(command, &total)) {
+        if (dfs_session_begin(partial_dir, total, session_id, part_path, sizeof(part_path)) != 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to store uploaded file");
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
             return -1;
         }
-        
-        // Check if end of file
-        if (bytes_read < BUFFER_SIZE) {
-            break;
+        snprintf(response, BUFFER_SIZE, "MULTIPART session=%s", session_id);
+        dfs_reply(client_socket, request, DFS_STATUS_OK, response);
+        return 0;
+    }
+
+    // Parts and the commit name a session that has to exist
+    if (!session || dfs_session_lookup(partial_dir, session, part_path, sizeof(part_path)) != 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Unknown upload session");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+        return -1;
+    }
+
+    if (dfs_session_find_part(command, &part_offset)) {
+        snprintf(response, BUFFER_SIZE, "READY_TO_RECEIVE session=%s offset=%llu", session,
+                 (unsigned long long)part_offset);
+        dfs_reply(client_socket, request, DFS_STATUS_READY, response);
+
+        DfsHeader data;
+        if (dfs_recv_header(client_socket, &data) != 0) {
+            perror("Error receiving part header from client");
+            return -1;
+        }
+        if (data.opcode != DFS_OP_DATA) {
+            // Read past whatever came instead, so the client's next command is read from its start
+            dfs_discard(client_socket, data.payload_len);
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Expected the part body");
+            return -1;
+        }
+        int stored = dfs_session_receive_part(client_socket, &data, part_path, part_offset);
+        if (stored != 0) {
+            snprintf(response, BUFFER_SIZE, stored == DFS_CHECKSUM_MISMATCH ? "ERROR: Checksum mismatch"
+                                                                            : "ERROR: Failed to store part");
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+            return -1;
         }
+        snprintf(response, BUFFER_SIZE, "SUCCESS: Part stored");
+        dfs_reply(client_socket, request, DFS_STATUS_OK, response);
+        return 0;
     }
-    
-    fclose(fp);
-    
-    if (bytes_read < 0) {
-        perror("Error receiving file from client");
-        remove(filepath);
+
+    // Commit: a part file that does not match the digest is dropped, the upload has to start over
+    char hex[DFS_SHA256_HEX_LEN + 1];
+    struct stat existing;
+    int replaced = stat(filepath, &existing) == 0;
+    if (!dfs_sha256_find_word(command, hex) || dfs_session_verify(part_path, hex) != 0) {
+        unlink(part_path);
+        snprintf(response, BUFFER_SIZE, "ERROR: Uploaded parts do not match the file");
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
         return -1;
     }
-    
+    if (rename(part_path, filepath) != 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to store uploaded file");
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+        return -1;
+    }
+    update_tar_cache(filepath, !replaced);
+    index_local_file(filepath);
+    snprintf(response, BUFFER_SIZE, "SUCCESS: File uploaded successfully to S1");
+    dfs_reply(client_socket, request, DFS_STATUS_OK, response);
     return 0;
 }
 
+// Function to get the connection details of a backend
+ServerInfo *get_server_info(int server_type) {
+    switch (server_type) {
+        case 2:  // S2
+            return &s2_info;
+        case 3:  // S3
+            return &s3_info;
+        case 4:  // S4
+            return &s4_info;
+        default:
+            return NULL;
+    }
+}
+
+// Function to take a warm connection to a backend from its pool, or open one
+int acquire_backend_connection(int server_type) {
+    ServerInfo *info = get_server_info(server_type);
+    if (!info) {
+        return -1;
+    }
+
+    ConnectionPool *pool = &info->pool;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    shrink_pool(pool, now);
+
+    pool->in_use++;
+    if (pool->in_use > pool->demand) {
+        pool->demand = pool->in_use;
+    }
+
+    // Most recently used connections are the most likely to still be alive
+    while (pool->idle_count > 0) {
+        pool->idle_count--;
+        int candidate = pool->sockets[pool->idle_count];
+        time_t idle_for = now - pool->last_used[pool->idle_count];
+
+        // The health check may take a round trip, so do it without the lock
+        pthread_mutex_unlock(&pool->lock);
+        if (is_connection_healthy(candidate, idle_for)) {
+            return candidate;
+        }
+        close(candidate);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // Grow the pool when nothing warm is available
+    int sock = connect_to_server(info->ip, info->port);
+    if (sock < 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->in_use--;
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    return sock;
+}
+
+// Function to hand a backend connection back to its pool
+void release_backend_connection(int server_type, int sock, int reusable) {
+    ServerInfo *info = get_server_info(server_type);
+    if (!info) {
+        close(sock);
+        return;
+    }
+
+    ConnectionPool *pool = &info->pool;
+    pthread_mutex_lock(&pool->lock);
+    pool->in_use--;
+
+    // Connections left mid-transfer cannot be reused
+    if (!reusable || pool->idle_count >= POOL_MAX_IDLE) {
+        pthread_mutex_unlock(&pool->lock);
+        close(sock);
+        return;
+    }
+
+    time_t now = time(NULL);
+    pool->sockets[pool->idle_count] = sock;
+    pool->last_used[pool->idle_count] = now;
+    pool->idle_count++;
+    shrink_pool(pool, now);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to check that an idle pooled connection is still usable
+int is_connection_healthy(int sock, time_t idle_for) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    DfsHeader reply;
+    char payload[16];
+
+    // Backends never speak unprompted, so a readable socket is closed or broken
+    if (poll(&pfd, 1, 0) != 0) {
+        return 0;
+    }
+    if (idle_for < POOL_PING_AFTER) {
+        return 1;
+    }
+
+    // Long-idle connections get a round trip to prove the backend still answers
+    if (dfs_send_message(sock, DFS_OP_PING, DFS_STATUS_OK, dfs_next_request_id(), "PING") != 0) {
+        return 0;
+    }
+    pfd.revents = 0;
+    if (poll(&pfd, 1, POOL_PING_TIMEOUT_MS) != 1 ||
+        dfs_recv_header(sock, &reply) != 0 ||
+        dfs_recv_payload(sock, &reply, payload, sizeof(payload)) != 0) {
+        return 0;
+    }
+    return reply.status == DFS_STATUS_OK;
+}
+
+// Function to close idle connections the pool no longer needs (caller holds the lock)
+void shrink_pool(ConnectionPool *pool, time_t now) {
+    // Demand is the peak concurrent use seen during the last idle window
+    if (now - pool->window_start >= POOL_IDLE_TIMEOUT) {
+        pool->demand = pool->in_use;
+        pool->window_start = now;
+    }
+
+    int keep = pool->demand > POOL_MIN_IDLE ? pool->demand : POOL_MIN_IDLE;
+    int drop = 0;
+
+    // Oldest connections sit at the front; expire them first, then any surplus
+    while (drop < pool->idle_count &&
+           (now - pool->last_used[drop] >= POOL_IDLE_TIMEOUT || pool->idle_count - drop > keep)) {
+        close(pool->sockets[drop]);
+        drop++;
+    }
+
+    if (drop > 0) {
+        pool->idle_count -= drop;
+        memmove(pool->sockets, pool->sockets + drop, pool->idle_count * sizeof(int));
+        memmove(pool->last_used, pool->last_used + drop, pool->idle_count * sizeof(time_t));
+    }
+}
+
 // Function to connect to another server
 int connect_to_server(const char *server_ip, int port) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -1301,11 +2994,33 @@ int connect_to_server(const char *server_ip, int port) {
         return -1;
     }
     
+    // Connect without blocking so an unreachable backend costs at most CONNECT_TIMEOUT_MS
+    set_nonblocking(sock, 1);
     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        close(sock);
-        return -1;
+        struct pollfd pfd = {sock, POLLOUT, 0};
+        int error = errno;
+        socklen_t error_len = sizeof(error);
+        
+        if (error == EINPROGRESS) {
+            if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) != 1) {
+                error = ETIMEDOUT;
+            } else if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0) {
+                error = errno;
+            }
+        }
+        
+        if (error != 0) {
+            errno = error;
+            perror("Connection failed");
+            close(sock);
+            return -1;
+        }
     }
+    set_nonblocking(sock, 0);
+    
+    // Pooled connections carry many small request frames; don't let Nagle delay them
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
     
     return sock;
 }
@@ -10,6 +10,17 @@
 #include <dirent.h>
 #include <errno.h>
 #include <libgen.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "dfs_protocol.h"
+#include "dfs_tar.h"
+#include "dfs_blob.h"
+#include "dfs_session.h"
+#include "dfs_crc32c.h"
+#include "dfs_index.h"
+#include "dfs_filter.h"
 
 #define S2_PORT 8387
 #define BUFFER_SIZE 4096
@@ -18,23 +29,77 @@
 #define FILENAME_MAX_LEN 256
 #define MAX_CONNECTIONS 10
 #define S2_BASE_DIR "~/S2"
+#define S2_CACHE_DIR "~/.S2_cache"   /* materialized downltar archive */
+#define S2_BLOB_DIR "~/.S2_blobs"    /* one copy of each distinct file body */
+#define S2_WORKER_THREADS 8      // Default number of requests served in parallel
+#define PATH_LOCK_STRIPES 64     // Per-path locks, hashed so unrelated paths rarely share one
+#define MAX_EVENTS 64
+
+// Idle S1 connection with a request waiting, queued for a worker
+typedef struct ReadyConnection {
+    int sock;
+    struct ReadyConnection *next;
+} ReadyConnection;
+
+// WATCH connection handed to its own thread
+typedef struct {
+    int sock;
+    uint32_t request_id;
+} FilterWatch;
 
 // Function declarations
-void process_s1_request(int s1_socket);
-int receive_file(int socket, const char *filepath);
-int send_file(int socket, const char *filepath);
+void *request_worker(void *arg);
+void push_ready_connection(int sock);
+int pop_ready_connection(void);
+pthread_rwlock_t *path_lock(const char *path);
+int process_s1_request(int s1_socket);
+int start_filter_watch(int s1_socket, const DfsHeader *request);
+void *filter_watch_worker(void *arg);
+void handle_s1_command(int s1_socket, const DfsHeader *request, char *command);
+int receive_file(int socket, const char *filepath, uint64_t filesize);
+void update_tar_cache(const char *filepath, int appended);
+void record_tar_deletion(const char *filepath);
+void record_presence(const char *filepath, int stored);
+void *presence_reload_worker(void *arg);
+int send_file(int socket, const char *filepath, const DfsRange *range, const DfsHeader *request);
 int create_directory_recursive(const char *path);
 void expand_tilde_path(const char *path, char *expanded);
 int is_valid_path(const char *path);
-void get_sorted_files(const char *dirpath, const char *extension, char *result);
-int create_tar_file(const char *extension, char *tarfile);
+char **collect_sorted_page(const char *dirpath, const char *extension, const char *after, int limit, int *count);
 char* get_file_extension(const char *filename);
 int compare_strings(const void *a, const void *b);
 
-int main() {
+// Connections are watched here between requests and re-armed by the worker that served them
+int epoll_fd = -1;
+
+// Queue of connections with a request ready to be read
+ReadyConnection *ready_head = NULL;
+ReadyConnection *ready_tail = NULL;
+pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+// Striped locks: writers of a path exclude its readers, other paths proceed in parallel
+pthread_rwlock_t path_locks[PATH_LOCK_STRIPES];
+
+// Which files are stored here, pushed to S1 over WATCH connections
+DfsFilter *presence_filter = NULL;
+
+int main(int argc, char *argv[]) {
     int server_socket, client_socket;
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_len = sizeof(client_addr);
+    int worker_count = S2_WORKER_THREADS;
+    
+    // Optional worker count: S2 --workers N
+    if (argc == 3 && strcmp(argv[1], "--workers") == 0) {
+        worker_count = atoi(argv[2]);
+        if (worker_count < 1) {
+            worker_count = 1;
+        }
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [--workers N]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
     
     // Create socket
     if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -77,22 +142,83 @@ int main() {
     expand_tilde_path(S2_BASE_DIR, expanded_base);
     create_directory_recursive(expanded_base);
     
-    // Accept and handle client connections
+    // Count the files already stored before S1 can watch them
+    presence_filter = dfs_filter_create();
+    int present = presence_filter ? dfs_filter_load(presence_filter, expanded_base, "pdf") : -1;
+    if (present < 0) {
+        printf("S2: Presence filter unavailable, S1 will ask for every file\n");
+    } else {
+        printf("S2: Presence filter holds %d files\n", present);
+        pthread_t reloader;
+        if (pthread_create(&reloader, NULL, presence_reload_worker, NULL) == 0) {
+            pthread_detach(reloader);
+        }
+    }
+    
+    // A peer closing mid-send must not take the whole server down
+    signal(SIGPIPE, SIG_IGN);
+    
+    for (int i = 0; i < PATH_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&path_locks[i], NULL);
+    }
+    
+    epoll_fd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = server_socket;
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) != 0) {
+        perror("S2: epoll setup failed");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+    
+    // Start the workers that run requests
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, request_worker, NULL) != 0) {
+            perror("S2: Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    printf("S2: Serving requests with %d worker threads\n", worker_count);
+    
+    // S1 keeps pooled connections open; each one is handed to a worker only when a request arrives
+    struct epoll_event events[MAX_EVENTS];
     while (1) {
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket < 0) {
-            perror("S2: Accept failed");
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                perror("S2: epoll_wait failed");
+            }
             continue;
         }
         
-        printf("S2: Connection accepted from %s:%d\n", 
-               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-        
-        // Process the client request
-        process_s1_request(client_socket);
-        
-        // Close the connection
-        close(client_socket);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.fd != server_socket) {
+                push_ready_connection(events[i].data.fd);
+                continue;
+            }
+            
+            client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
+            if (client_socket < 0) {
+                if (errno != EINTR) {
+                    perror("S2: Accept failed");
+                }
+                continue;
+            }
+            
+            printf("S2: Connection accepted from %s:%d\n", 
+                   inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+            
+            // One-shot so only one worker at a time ever reads a connection
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.fd = client_socket;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) != 0) {
+                perror("S2: Failed to watch connection");
+                close(client_socket);
+            }
+        }
     }
     
     // Close the server socket (never reached in this implementation)
@@ -100,33 +226,168 @@ int main() {
     return 0;
 }
 
-// Function to process requests from S1
-void process_s1_request(int s1_socket) {
+// Function run by each worker thread: serve one request, then re-arm its connection
+void *request_worker(void *arg) {
+    (void)arg;
+    while (1) {
+        int sock = pop_ready_connection();
+        int result = process_s1_request(sock);
+        
+        // A WATCH connection now belongs to its own thread
+        if (result == 1) {
+            continue;
+        }
+        if (result == 0) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.fd = sock;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &ev) == 0) {
+                continue;
+            }
+        }
+        
+        // Closing the socket also drops it from the epoll set
+        close(sock);
+    }
+    return NULL;
+}
+
+// Function to queue a connection whose next request is ready
+void push_ready_connection(int sock) {
+    ReadyConnection *conn = malloc(sizeof(ReadyConnection));
+    if (!conn) {
+        close(sock);
+        return;
+    }
+    conn->sock = sock;
+    conn->next = NULL;
+    
+    pthread_mutex_lock(&ready_lock);
+    if (ready_tail) {
+        ready_tail->next = conn;
+    } else {
+        ready_head = conn;
+    }
+    ready_tail = conn;
+    pthread_cond_signal(&ready_cond);
+    pthread_mutex_unlock(&ready_lock);
+}
+
+// Function to wait for the next connection with a request ready
+int pop_ready_connection(void) {
+    pthread_mutex_lock(&ready_lock);
+    while (!ready_head) {
+        pthread_cond_wait(&ready_cond, &ready_lock);
+    }
+    ReadyConnection *conn = ready_head;
+    ready_head = conn->next;
+    if (!ready_head) {
+        ready_tail = NULL;
+    }
+    pthread_mutex_unlock(&ready_lock);
+    
+    int sock = conn->sock;
+    free(conn);
+    return sock;
+}
+
+// Function to find the lock stripe guarding a path
+pthread_rwlock_t *path_lock(const char *path) {
+    // FNV-1a hash of the full path
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return &path_locks[hash % PATH_LOCK_STRIPES];
+}
+
+// Function to read and run one request from S1 (returns 0 to keep the connection, 1 once a WATCH
+// thread owns it, -1 once it is done)
+int process_s1_request(int s1_socket) {
     char command[CMD_SIZE];
-    int bytes_received = recv(s1_socket, command, CMD_SIZE - 1, 0);
+    DfsHeader request;
+    int status = dfs_recv_header(s1_socket, &request);
     
-    if (bytes_received <= 0) {
-        perror("S2: Error receiving command");
-        return;
+    if (status != 0) {
+        if (status < 0) {
+            perror("S2: Error receiving command");
+        }
+        return -1;
     }
     
-    command[bytes_received] = '\0';
-    printf("S2: Received command: %s\n", command);
+    if (dfs_recv_payload(s1_socket, &request, command, CMD_SIZE) != 0) {
+        if (errno != EMSGSIZE) {
+            perror("S2: Error receiving command");
+            return -1;
+        }
+        dfs_reply(s1_socket, &request, DFS_STATUS_INVALID, "ERROR: Command too long");
+        return 0;
+    }
     
+    printf("S2: Received command [%u]: %s\n", request.request_id, command);
+    if (request.opcode == DFS_OP_WATCH) {
+        return start_filter_watch(s1_socket, &request);
+    }
+    handle_s1_command(s1_socket, &request, command);
+    return 0;
+}
+
+// Function to move a WATCH connection out of the epoll set onto a thread of its own, since it
+// stays busy for as long as S1 keeps it open
+int start_filter_watch(int s1_socket, const DfsHeader *request) {
+    if (!presence_filter) {
+        dfs_reply(s1_socket, request, DFS_STATUS_ERROR, "ERROR: Presence filter unavailable");
+        return 0;
+    }
+    
+    FilterWatch *watch = malloc(sizeof(FilterWatch));
+    if (!watch) {
+        return -1;
+    }
+    watch->sock = s1_socket;
+    watch->request_id = request->request_id;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s1_socket, NULL);
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, filter_watch_worker, watch) != 0) {
+        perror("S2: Failed to start watch thread");
+        free(watch);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+// Function run by a watch thread: push the presence filter to S1 until it hangs up
+void *filter_watch_worker(void *arg) {
+    FilterWatch *watch = arg;
+    printf("S2: S1 is watching the presence filter\n");
+    dfs_filter_serve(presence_filter, watch->sock, watch->request_id);
+    printf("S2: Presence filter watch ended\n");
+    close(watch->sock);
+    free(watch);
+    return NULL;
+}
+
+// Function to execute a single command from S1
+void handle_s1_command(int s1_socket, const DfsHeader *request, char *command) {
     // Parse command
     char cmd_type[20] = {0};
     char arg1[PATH_MAX_LEN] = {0};
     char arg2[PATH_MAX_LEN] = {0};
     
-    sscanf(command, "%s %s %s", cmd_type, arg1, arg2);
+    sscanf(command, "%19s %1023s %1023s", cmd_type, arg1, arg2);
     
     // Handle different command types
-    if (strcmp(cmd_type, "RECEIVE") == 0) {
-        // Command format: RECEIVE <filename> <destination_path>
+    if (request->opcode == DFS_OP_RECEIVE) {
+        // Command format: RECEIVE <filename> <destination_path> [sha256=<hex>] [resume=<session>]
+        //                 [multipart=<size>|part=<offset>|commit]
         char filepath[PATH_MAX_LEN];
         char expanded_path[PATH_MAX_LEN];
+        char blob_store[PATH_MAX_LEN];
         
         expand_tilde_path(arg2, expanded_path);
+        expand_tilde_path(S2_BLOB_DIR, blob_store);
         snprintf(filepath, PATH_MAX_LEN, "%s/%s", expanded_path, arg1);
         
         // Create directory structure
@@ -138,64 +399,248 @@ void process_s1_request(int s1_socket) {
         }
         free(dir_path);
         
-        // Acknowledge ready to receive
-        send(s1_socket, "READY_TO_RECEIVE", 16, 0);
+        // Committing a multipart upload publishes its part file once it hashes to the client's digest
+        char hex[DFS_SHA256_HEX_LEN + 1];
+        char resume_id[DFS_SESSION_ID_LEN + 1];
+        char session_id[DFS_SESSION_ID_LEN + 1];
+        char part_path[PATH_MAX_LEN];
+        char stored[96] = "";
+        char reply[BUFFER_SIZE];
+        int has_digest = dfs_sha256_find_word(command, hex);
+        int resuming = dfs_session_find_id(command, resume_id);
+        if (dfs_session_is_commit(command)) {
+            if (!resuming || !has_digest ||
+                dfs_session_lookup(blob_store, resume_id, part_path, sizeof(part_path)) != 0) {
+                dfs_reply(s1_socket, request, DFS_STATUS_INVALID, "ERROR: Unknown upload session");
+                return;
+            }
+            pthread_rwlock_t *lock = path_lock(filepath);
+            pthread_rwlock_wrlock(lock);
+            struct stat existing;
+            int replaced = stat(filepath, &existing) == 0;
+            int committed = dfs_blob_commit(blob_store, part_path, filepath, hex);
+            if (committed == 0) {
+                update_tar_cache(filepath, !replaced);
+                if (!replaced) {
+                    record_presence(filepath, 1);
+                }
+                dfs_index_describe(filepath, stored, sizeof(stored));
+            }
+            pthread_rwlock_unlock(lock);
+            
+            if (committed == 0) {
+                printf("S2: Multipart upload committed to %s\n", filepath);
+                snprintf(reply, sizeof(reply), "SUCCESS: File received and stored successfully%s", stored);
+                dfs_reply(s1_socket, request, DFS_STATUS_OK, reply);
+            } else {
+                printf("S2: Failed to commit multipart upload\n");
+                dfs_reply(s1_socket, request, DFS_STATUS_ERROR, committed == DFS_BLOB_MISMATCH ?
+                          "ERROR: Uploaded parts do not match the file" : "ERROR: Failed to receive file");
+            }
+            return;
+        }
+        
+        // A body we already hold is stored by reference without being sent again
+        if (has_digest) {
+            pthread_rwlock_t *lock = path_lock(filepath);
+            pthread_rwlock_wrlock(lock);
+            struct stat existing;
+            int replaced = stat(filepath, &existing) == 0;
+            int linked = dfs_blob_link(blob_store, hex, filepath);
+            if (linked == 1) {
+                update_tar_cache(filepath, !replaced);
+                if (!replaced) {
+                    record_presence(filepath, 1);
+                }
+                dfs_index_describe(filepath, stored, sizeof(stored));
+            }
+            pthread_rwlock_unlock(lock);
+            
+            if (linked == 1) {
+                printf("S2: Stored %s from existing content %s\n", filepath, hex);
+                snprintf(reply, sizeof(reply), "SUCCESS: File stored from existing content%s", stored);
+                dfs_reply(s1_socket, request, DFS_STATUS_OK, reply);
+                return;
+            }
+        }
+        
+        // A multipart upload opens with its part file reserved at full size; the parts follow on
+        // other connections and are written where they belong
+        uint64_t total;
+        uint64_t part_offset;
+        if (dfs_session_find_multipart(command, &total)) {
+            if (dfs_session_begin(blob_store, total, session_id, part_path, sizeof(part_path)) != 0) {
+                perror("S2: Error creating upload session");
+                dfs_reply(s1_socket, request, DFS_STATUS_ERROR, "ERROR: Failed to receive file");
+                return;
+            }
+            char started[BUFFER_SIZE];
+            snprintf(started, sizeof(started), "MULTIPART session=%s", session_id);
+            dfs_reply(s1_socket, request, DFS_STATUS_OK, started);
+            return;
+        }
+        if (dfs_session_find_part(command, &part_offset)) {
+            if (!resuming || dfs_session_lookup(blob_store, resume_id, part_path, sizeof(part_path)) != 0) {
+                dfs_reply(s1_socket, request, DFS_STATUS_INVALID, "ERROR: Unknown upload session");
+                return;
+            }
+            char ready[BUFFER_SIZE];
+            snprintf(ready, sizeof(ready), "READY_TO_RECEIVE session=%s offset=%llu", resume_id,
+                     (unsigned long long)part_offset);
+            dfs_reply(s1_socket, request, DFS_STATUS_READY, ready);
+            
+            DfsHeader data;
+            if (dfs_recv_header(s1_socket, &data) != 0) {
+                printf("S2: Missing part data for %s\n", filepath);
+                return;
+            }
+            if (data.opcode != DFS_OP_DATA) {
+                // Read past whatever came instead, so S1's next command is read from its start
+                printf("S2: Missing part data for %s\n", filepath);
+                dfs_discard(s1_socket, data.payload_len);
+                dfs_reply(s1_socket, request, DFS_STATUS_INVALID, "ERROR: Expected the part body");
+                return;
+            }
+            int stored = dfs_session_receive_part(s1_socket, &data, part_path, part_offset);
+            if (stored == 0) {
+                dfs_reply(s1_socket, request, DFS_STATUS_OK, "SUCCESS: Part stored");
+            } else {
+                printf("S2: Failed to store part of %s\n", filepath);
+                dfs_reply(s1_socket, request, DFS_STATUS_ERROR, stored == DFS_CHECKSUM_MISMATCH ?
+                          "ERROR: Checksum mismatch" : "ERROR: Failed to store part");
+            }
+            return;
+        }
+        
+        // The body is received into a session's part file beside the blob store, continuing any
+        // earlier attempt, and moved into place once complete
+        uint64_t offset;
+        if (dfs_session_open(blob_store, resuming ? resume_id : NULL, session_id, part_path,
+                             sizeof(part_path), &offset) != 0) {
+            perror("S2: Error creating upload session");
+            dfs_reply(s1_socket, request, DFS_STATUS_ERROR, "ERROR: Failed to receive file");
+            return;
+        }
+        
+        // Acknowledge ready to receive, naming the session and the bytes it already holds
+        char ready[BUFFER_SIZE];
+        snprintf(ready, sizeof(ready), "READY_TO_RECEIVE session=%s offset=%llu", session_id,
+                 (unsigned long long)offset);
+        dfs_reply(s1_socket, request, DFS_STATUS_READY, ready);
+
+        // The rest of the body follows as a DATA frame
+        DfsHeader data;
+        if (dfs_recv_header(s1_socket, &data) != 0) {
+            printf("S2: Missing file data for %s\n", filepath);
+            return;
+        }
+        if (data.opcode != DFS_OP_DATA) {
+            // Read past whatever came instead, so S1's next command is read from its start
+            printf("S2: Missing file data for %s\n", filepath);
+            dfs_discard(s1_socket, data.payload_len);
+            dfs_reply(s1_socket, request, DFS_STATUS_INVALID, "ERROR: Expected the file body");
+            return;
+        }
+        int received = receive_file(s1_socket, part_path, data.payload_len);
+        
+        // Store it, keeping readers of this path out while it changes
+        pthread_rwlock_t *lock = path_lock(filepath);
+        pthread_rwlock_wrlock(lock);
+        struct stat existing;
+        int replaced = stat(filepath, &existing) == 0;
+        int committed = -1;
+        if (received == 0) {
+            // The digest the client named covers every attempt that went into the part file
+            committed = dfs_blob_commit(blob_store, part_path, filepath, has_digest ? hex : NULL);
+        }
+        if (committed == 0) {
+            update_tar_cache(filepath, !replaced);
+            if (!replaced) {
+                record_presence(filepath, 1);
+            }
+            dfs_index_describe(filepath, stored, sizeof(stored));
+        }
+        pthread_rwlock_unlock(lock);
         
-        // Receive the file
-        if (receive_file(s1_socket, filepath) == 0) {
+        if (committed == 0) {
             printf("S2: File successfully received and saved to %s\n", filepath);
+            snprintf(reply, sizeof(reply), "SUCCESS: File received and stored successfully%s", stored);
+            dfs_reply(s1_socket, request, DFS_STATUS_OK, reply);
         } else {
             printf("S2: Failed to receive file\n");
+            dfs_reply(s1_socket, request, DFS_STATUS_ERROR,
+                      received == DFS_CHECKSUM_MISMATCH || committed == DFS_BLOB_MISMATCH ?
+                      "ERROR: Checksum mismatch" : "ERROR: Failed to receive file");
         }
     }
-    else if (strcmp(cmd_type, "SEND") == 0) {
-        // Command format: SEND <filepath>
+    else if (request->opcode == DFS_OP_SEND) {
+        // Command format: SEND <filepath> [range=<first>-<last>|<first>-|-<n>]
         char expanded_path[PATH_MAX_LEN];
         expand_tilde_path(arg1, expanded_path);
         
         // Check if file exists
         if (access(expanded_path, F_OK) != 0) {
-            send(s1_socket, "ERROR: File not found", 21, 0);
+            dfs_reply(s1_socket, request, DFS_STATUS_NOT_FOUND, "ERROR: File not found");
             return;
         }
         
-        // Acknowledge ready to send
-        send(s1_socket, "READY_TO_SEND", 13, 0);
+        DfsRange range;
+        if (dfs_session_parse_range(command, &range) != 0) {
+            dfs_reply(s1_socket, request, DFS_STATUS_INVALID, "ERROR: Invalid range");
+            return;
+        }
         
-        // Send the file
-        if (send_file(s1_socket, expanded_path) == 0) {
+        // Send the file under a shared lock so a concurrent upload cannot tear it
+        pthread_rwlock_t *lock = path_lock(expanded_path);
+        pthread_rwlock_rdlock(lock);
+        int sent = send_file(s1_socket, expanded_path, &range, request);
+        pthread_rwlock_unlock(lock);
+        
+        if (sent == 0) {
             printf("S2: File successfully sent: %s\n", expanded_path);
         } else {
             printf("S2: Failed to send file\n");
         }
     }
-    else if (strcmp(cmd_type, "REMOVE") == 0) {
+    else if (request->opcode == DFS_OP_REMOVE) {
         // Command format: REMOVE <filepath>
         char expanded_path[PATH_MAX_LEN];
         expand_tilde_path(arg1, expanded_path);
         
         // Check if file exists
         if (access(expanded_path, F_OK) != 0) {
-            send(s1_socket, "ERROR: File not found", 21, 0);
+            dfs_reply(s1_socket, request, DFS_STATUS_NOT_FOUND, "ERROR: File not found");
             return;
         }
         
-        // Remove the file
-        if (remove(expanded_path) == 0) {
-            send(s1_socket, "SUCCESS: File removed", 21, 0);
+        // Remove the file; its content goes only once no other path refers to it
+        char blob_store[PATH_MAX_LEN];
+        expand_tilde_path(S2_BLOB_DIR, blob_store);
+        pthread_rwlock_t *lock = path_lock(expanded_path);
+        pthread_rwlock_wrlock(lock);
+        int removed = dfs_blob_release(blob_store, expanded_path);
+        if (removed == 0) {
+            update_tar_cache(expanded_path, 0);
+            record_tar_deletion(expanded_path);
+            record_presence(expanded_path, 0);
+        }
+        pthread_rwlock_unlock(lock);
+        
+        if (removed == 0) {
+            dfs_reply(s1_socket, request, DFS_STATUS_OK, "SUCCESS: File removed");
             printf("S2: File successfully removed: %s\n", expanded_path);
         } else {
             char error_msg[BUFFER_SIZE];
             snprintf(error_msg, BUFFER_SIZE, "ERROR: Failed to remove file - %s", strerror(errno));
-            send(s1_socket, error_msg, strlen(error_msg), 0);
+            dfs_reply(s1_socket, request, DFS_STATUS_ERROR, error_msg);
             printf("S2: Failed to remove file: %s\n", expanded_path);
         }
     }
-    else if (strcmp(cmd_type, "CREATETAR") == 0) {
-        // Command format: CREATETAR <filetype>
+    else if (request->opcode == DFS_OP_CREATETAR) {
+        // Command format: CREATETAR <filetype> [<dirpath>] [since=<time>|manifest]
         if (strcmp(arg1, "pdf") != 0) {
             printf("S2: Invalid filetype requested: %s\n", arg1);
-            send(s1_socket, "INVALID_FILETYPE", 16, 0);
+            dfs_reply(s1_socket, request, DFS_STATUS_INVALID, "INVALID_FILETYPE");
             return;
         }
 
@@ -203,160 +648,226 @@ void process_s1_request(int s1_socket) {
         expand_tilde_path(S2_BASE_DIR, s2_path);
         printf("S2: Looking for PDF files in: %s\n", s2_path);
 
-        // Create the tar command
-        char command[CMD_SIZE];
-        snprintf(command, CMD_SIZE, 
-                 "find \"%s\" -name \"*.pdf\" -type f | tar -cf - -T - 2>/dev/null", 
-                 s2_path);
-        printf("S2: Executing command: %s\n", command);
-
-        // First pass to calculate size
-        FILE *tar_pipe = popen(command, "r");
-        if (!tar_pipe) {
-            printf("S2: Failed to open pipe for tar creation\n");
-            send(s1_socket, "TAR_CREATION_FAILED", 19, 0);
-            return;
-        }
+        char cache_dir[PATH_MAX_LEN];
+        expand_tilde_path(S2_CACHE_DIR, cache_dir);
 
-        long filesize = 0;
-        char temp_buffer[BUFFER_SIZE];
-        size_t bytes_read;
-
-        while ((bytes_read = fread(temp_buffer, 1, BUFFER_SIZE, tar_pipe)) > 0) {
-            filesize += bytes_read;
+        // A directory (S1's path mapped onto ~/S2) limits the archive to that subtree
+        char dirpath[PATH_MAX_LEN] = "";
+        char option_arg[64] = "";
+        if (arg2[0] == '/') {
+            snprintf(dirpath, PATH_MAX_LEN, "%s", arg2);
+            sscanf(command, "%*s %*s %*s %63s", option_arg);
+        } else {
+            snprintf(option_arg, sizeof(option_arg), "%s", arg2);
         }
-        pclose(tar_pipe);
-
-        if (filesize == 0) {
-            printf("S2: No PDF files found to tar\n");
-            send(s1_socket, "NO_FILES", 8, 0);
+        char root[PATH_MAX_LEN];
+        char prefix[PATH_MAX_LEN];
+        int scoped = dfs_tar_scope(s2_path, dirpath[0] != '\0' ? dirpath : NULL, root, prefix, PATH_MAX_LEN);
+        if (scoped < 0) {
+            dfs_reply(s1_socket, request, DFS_STATUS_INVALID, "ERROR: Path must be within ~/S2");
             return;
         }
 
-        // Reopen pipe for actual transfer
-        tar_pipe = popen(command, "r");
-        if (!tar_pipe) {
-            printf("S2: Failed to reopen tar pipe\n");
-            send(s1_socket, "TAR_CREATION_FAILED", 19, 0);
+        // An option makes the archive incremental: since=<time>, or a manifest in a DATA frame
+        DfsTarFilter filter = {-1, NULL, 0, NULL};
+        char *manifest = NULL;
+        int option = option_arg[0] != '\0' ? dfs_tar_parse_option(option_arg, &filter) : 0;
+        if (option < 0) {
+            dfs_reply(s1_socket, request, DFS_STATUS_INVALID, "ERROR: Invalid downltar option");
             return;
         }
+        if (option == 1) {
+            uint64_t manifest_len;
+            manifest = dfs_tar_recv_manifest(s1_socket, &manifest_len);
+            if (!manifest || dfs_tar_load_manifest(&filter, manifest) != 0) {
+                printf("S2: Failed to read manifest\n");
+                free(manifest);
+                dfs_reply(s1_socket, request, DFS_STATUS_ERROR, "ERROR: Failed to read manifest");
+                return;
+            }
+        }
 
-        // Send size to client
-        char size_buffer[BUFFER_SIZE];
-        snprintf(size_buffer, BUFFER_SIZE, "%ld", filesize);
-        printf("S2: Sending file size: %s bytes\n", size_buffer);
-        if (send(s1_socket, size_buffer, strlen(size_buffer), 0) <= 0) {
-            printf("S2: Failed to send file size\n");
-            pclose(tar_pipe);
+        int files;
+        if (option_arg[0] != '\0' || scoped) {
+            // Only the subtree, or only new or changed members with deletions listed in the trailer
+            char deletion_log[PATH_MAX_LEN + sizeof("/pdf.deleted")];
+            snprintf(deletion_log, sizeof(deletion_log), "%s/pdf.deleted", cache_dir);
+            filter.deletion_log = deletion_log;
+            files = dfs_tar_stream(s1_socket, request->request_id, root, "pdf", prefix, &filter);
+            dfs_tar_free_filter(&filter);
+            free(manifest);
+        } else {
+            // Serve the cached archive, building it on first use
+            files = dfs_tar_cache_send(s1_socket, request->request_id, cache_dir, s2_path, "pdf", "S1");
+        }
+        if (files < 0) {
+            printf("S2: Failed to stream tar of %s\n", s2_path);
+            dfs_reply(s1_socket, request, DFS_STATUS_ERROR, "TAR_CREATION_FAILED");
             return;
         }
 
-        // Wait for client ready signal
-        char ready_buffer[BUFFER_SIZE] = {0};
-        if (recv(s1_socket, ready_buffer, BUFFER_SIZE - 1, 0) <= 0) {
-            printf("S2: Failed to get client ready signal\n");
-            pclose(tar_pipe);
+        if (files == 0) {
+            printf("S2: No PDF files found to tar\n");
+            dfs_reply(s1_socket, request, DFS_STATUS_NO_FILES, "NO_FILES");
             return;
         }
 
-        // Stream tar data to client
-        size_t total_sent = 0;
-        while ((bytes_read = fread(temp_buffer, 1, BUFFER_SIZE, tar_pipe)) > 0) {
-            size_t bytes_sent = 0;
-            while (bytes_sent < bytes_read) {
-                int sent = send(s1_socket, temp_buffer + bytes_sent, bytes_read - bytes_sent, 0);
-                if (sent <= 0) {
-                    printf("S2: Failed during data transfer at %zu/%ld bytes\n", 
-                           total_sent + bytes_sent, filesize);
-                    pclose(tar_pipe);
-                    return;
-                }
-                bytes_sent += sent;
-            }
-            total_sent += bytes_read;
+        printf("S2: Streamed %d files of tar data\n", files);
+    }
+    else if (request->opcode == DFS_OP_STAT) {
+        // Command format: STAT <filepath>
+        char expanded_path[PATH_MAX_LEN];
+        expand_tilde_path(arg1, expanded_path);
+        
+        // Size and digest are read together under a shared lock so they describe the same upload;
+        // the digest comes from the file's blob, so this costs no read of the body
+        char hex[DFS_SHA256_HEX_LEN + 1];
+        struct stat st;
+        pthread_rwlock_t *lock = path_lock(expanded_path);
+        pthread_rwlock_rdlock(lock);
+        int found = stat(expanded_path, &st) == 0 && S_ISREG(st.st_mode);
+        if (found && dfs_blob_digest(expanded_path, hex) != 0) {
+            snprintf(hex, sizeof(hex), "-");
         }
-
-        printf("S2: Sent %zu/%ld bytes of tar data\n", total_sent, filesize);
-        pclose(tar_pipe);
+        pthread_rwlock_unlock(lock);
+        
+        if (!found) {
+            dfs_reply(s1_socket, request, DFS_STATUS_NOT_FOUND, "ERROR: File not found");
+            return;
+        }
+        char response[BUFFER_SIZE];
+        snprintf(response, BUFFER_SIZE, "%llu %s", (unsigned long long)st.st_size, hex);
+        dfs_reply(s1_socket, request, DFS_STATUS_OK, response);
+    }
+    else if (request->opcode == DFS_OP_INVENTORY) {
+        // Command format: INVENTORY <path>; every .pdf file at or under it, for S1's namespace index
+        char expanded_path[PATH_MAX_LEN];
+        char base_dir[PATH_MAX_LEN];
+        expand_tilde_path(arg1, expanded_path);
+        expand_tilde_path(S2_BASE_DIR, base_dir);
+        
+        int files = dfs_index_send_inventory(s1_socket, request->request_id, base_dir, expanded_path, "pdf");
+        if (files < 0) {
+            char error_msg[BUFFER_SIZE];
+            snprintf(error_msg, BUFFER_SIZE, "ERROR: Failed to read inventory of %s", expanded_path);
+            dfs_reply(s1_socket, request, DFS_STATUS_ERROR, error_msg);
+            return;
+        }
+        printf("S2: Inventory sent for %s (%d files)\n", expanded_path, files);
+    }
+    else if (request->opcode == DFS_OP_PING) {
+        // Health check from S1's connection pool
+        dfs_reply(s1_socket, request, DFS_STATUS_OK, "PONG");
     }
-    else if (strcmp(cmd_type, "LIST") == 0) {
-        // Command format: LIST <dirpath> <extension>
+    else if (request->opcode == DFS_OP_LIST) {
+        // Command format: LIST <dirpath> <extension> [<after> <limit>]
         char expanded_path[PATH_MAX_LEN];
         expand_tilde_path(arg1, expanded_path);
         
         // Check if directory exists
         struct stat st;
         if (stat(expanded_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
-            send(s1_socket, "", 0, 0);  // Send empty response
+            // Send empty response
+            dfs_send_frame(s1_socket, DFS_OP_DATA, DFS_STATUS_OK, request->request_id, NULL, 0);
             return;
         }
         
-        // Get sorted list of files
-        char result[BUFFER_SIZE] = {0};
-        get_sorted_files(expanded_path, arg2, result);
+        // Optional paging: LIST <dirpath> <extension> <after|-> <limit>
+        char after[FILENAME_MAX_LEN] = "-";
+        int limit = DFS_LIST_PAGE_SIZE;
+        sscanf(command, "%*s %*s %*s %255s %d", after, &limit);
+        if (limit < 0 || limit > DFS_LIST_MAX_PAGE) {
+            limit = DFS_LIST_MAX_PAGE;
+        }
         
-        // Send the result
-        send(s1_socket, result, strlen(result), 0);
-        printf("S2: File list sent for directory: %s\n", expanded_path);
+        // Get the sorted page of files and stream it back
+        int count = 0;
+        char **names = collect_sorted_page(expanded_path, arg2, strcmp(after, "-") == 0 ? NULL : after,
+                                           limit, &count);
+        dfs_send_lines(s1_socket, DFS_OP_DATA, DFS_STATUS_OK, request->request_id, names, count);
+        for (int i = 0; i < count; i++) {
+            free(names[i]);
+        }
+        free(names);
+        printf("S2: File list sent for directory: %s (%d entries)\n", expanded_path, count);
     }
     else {
         // Unknown command
-        send(s1_socket, "ERROR: Unknown command", 22, 0);
+        dfs_reply(s1_socket, request, DFS_STATUS_INVALID, "ERROR: Unknown command");
         printf("S2: Unknown command received: %s\n", cmd_type);
     }
 }
 
-// Function to receive a file from socket
-int receive_file(int socket, const char *filepath) {
-    FILE *fp = fopen(filepath, "wb");
-    if (!fp) {
+// Function to append a file body of known length from socket to a file. A body that does not match
+// its checksum is cut off again, so a retry resumes from the last bytes known to be good
+int receive_file(int socket, const char *filepath, uint64_t filesize) {
+    FILE *fp = fopen(filepath, "ab");
+    struct stat st;
+    if (!fp || fstat(fileno(fp), &st) != 0) {
         perror("S2: Error opening file for writing");
+        dfs_discard(socket, filesize);
+        uint32_t crc;
+        dfs_recv_checksum(socket, &crc);
+        if (fp) {
+            fclose(fp);
+        }
         return -1;
     }
     
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    
-    while ((bytes_received = recv(socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        if (fwrite(buffer, 1, bytes_received, fp) != bytes_received) {
-            perror("S2: Error writing to file");
-            fclose(fp);
-            return -1;
-        }
-        
-        // Check if this is the end of the file
-        if (bytes_received < BUFFER_SIZE) {
-            break;
+    // Whatever arrives is kept, so a broken transfer can resume after it
+    int received = dfs_recv_body(socket, fp, filesize);
+    if (received == DFS_CHECKSUM_MISMATCH) {
+        printf("S2: Checksum mismatch receiving %s\n", filepath);
+        if (fflush(fp) != 0 || ftruncate(fileno(fp), st.st_size) != 0) {
+            perror("S2: Error discarding corrupt data");
         }
+    } else if (received != 0) {
+        perror("S2: Error receiving file data");
     }
     
-    fclose(fp);
+    // Make the file durable before S1 is told it is stored
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        perror("S2: Error syncing file");
+        received = -1;
+    }
     
-    if (bytes_received < 0) {
-        perror("S2: Error receiving file data");
-        return -1;
+    if (fclose(fp) != 0) {
+        perror("S2: Error writing to file");
+        received = -1;
     }
     
-    return 0;
+    return received;
 }
 
-// Function to send a file over socket
-int send_file(int socket, const char *filepath) {
+// Function to send a file, or just a range of it, over socket as a DATA frame and its checksum
+int send_file(int socket, const char *filepath, const DfsRange *range, const DfsHeader *request) {
     FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
+    struct stat st;
+    if (!fp || fstat(fileno(fp), &st) != 0) {
         perror("S2: Error opening file for reading");
+        dfs_reply(socket, request, DFS_STATUS_NOT_FOUND, "ERROR: File not found");
+        if (fp) {
+            fclose(fp);
+        }
         return -1;
     }
     
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
+    // Only the bytes asked for are read, straight from where the range starts
+    uint64_t offset, length;
+    if (dfs_session_resolve_range(range, st.st_size, &offset, &length) != 0 ||
+        lseek(fileno(fp), offset, SEEK_SET) < 0) {
+        dfs_reply(socket, request, DFS_STATUS_INVALID, "ERROR: Range is beyond the end of the file");
+        fclose(fp);
+        return -1;
+    }
     
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-        if (send(socket, buffer, bytes_read, 0) < 0) {
-            perror("S2: Error sending file data");
-            fclose(fp);
-            return -1;
-        }
+    // The whole file goes out with the checksum stored when it arrived; a range is summed as it is read
+    uint32_t stored;
+    int whole = offset == 0 && length == (uint64_t)st.st_size && dfs_crc32c_get_attr(fileno(fp), &stored) == 0;
+    if (dfs_send_body(socket, request->request_id, fileno(fp), length, whole ? &stored : NULL) != 0) {
+        perror("S2: Error sending file data");
+        fclose(fp);
+        return -1;
     }
     
     fclose(fp);
@@ -417,76 +928,121 @@ int is_valid_path(const char *path) {
     return strncmp(path, base_dir, strlen(base_dir)) == 0;
 }
 
-// Function to get sorted list of files with specific extension
-void get_sorted_files(const char *dirpath, const char *extension, char *result) {
+// Function to collect, in order, the first limit names with an extension that sort after 'after'
+// (a max-heap of the best names so far keeps memory bounded however large the directory is)
+char **collect_sorted_page(const char *dirpath, const char *extension, const char *after, int limit, int *count) {
+    *count = 0;
     DIR *dir = opendir(dirpath);
     if (!dir) {
-        return;
+        return NULL;
     }
     
-    // Dynamic array to store filenames
-    char **filenames = NULL;
-    int count = 0;
-    int capacity = 10;
-    
-    filenames = (char **)malloc(capacity * sizeof(char *));
-    if (!filenames) {
+    char **heap = malloc((limit > 0 ? limit : 1) * sizeof(char *));
+    if (!heap) {
         closedir(dir);
-        return;
+        return NULL;
     }
+    int size = 0;
     
     struct dirent *entry;
     while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            char *ext = get_file_extension(entry->d_name);
-            if (ext && strcmp(ext, extension) == 0) {
-                // Resize array if needed
-                if (count == capacity) {
-                    capacity *= 2;
-                    char **new_filenames = (char **)realloc(filenames, capacity * sizeof(char *));
-                    if (!new_filenames) {
-                        break;
-                    }
-                    filenames = new_filenames;
+        if (entry->d_type != DT_REG) {
+            continue;
+        }
+        char *ext = get_file_extension(entry->d_name);
+        if (!ext || strcmp(ext, extension) != 0 || (after && strcmp(entry->d_name, after) <= 0)) {
+            continue;
+        }
+        
+        if (size < limit) {
+            // Room left: sift the new name up
+            char *name = strdup(entry->d_name);
+            if (!name) {
+                continue;
+            }
+            int i = size++;
+            while (i > 0 && strcmp(heap[(i - 1) / 2], name) < 0) {
+                heap[i] = heap[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+            heap[i] = name;
+        } else if (limit > 0 && strcmp(entry->d_name, heap[0]) < 0) {
+            // Smaller than the largest name kept: replace it and sift down
+            char *name = strdup(entry->d_name);
+            if (!name) {
+                continue;
+            }
+            free(heap[0]);
+            int i = 0;
+            while (1) {
+                int child = 2 * i + 1;
+                if (child >= size) {
+                    break;
+                }
+                if (child + 1 < size && strcmp(heap[child + 1], heap[child]) > 0) {
+                    child++;
                 }
-                
-                // Store filename
-                filenames[count] = strdup(entry->d_name);
-                if (filenames[count]) {
-                    count++;
+                if (strcmp(heap[child], name) <= 0) {
+                    break;
                 }
+                heap[i] = heap[child];
+                i = child;
             }
+            heap[i] = name;
         }
     }
-    
     closedir(dir);
     
-    // Sort filenames alphabetically
-    qsort(filenames, count, sizeof(char *), compare_strings);
-    
-    // Combine into result string
-    result[0] = '\0';
-    for (int i = 0; i < count; i++) {
-        strcat(result, filenames[i]);
-        strcat(result, "\n");
-        free(filenames[i]);
+    qsort(heap, size, sizeof(char *), compare_strings);
+    *count = size;
+    return heap;
+}
+
+// Function to keep the cached archive in step with a stored or removed file
+void update_tar_cache(const char *filepath, int appended) {
+    char base_dir[PATH_MAX_LEN];
+    char cache_dir[PATH_MAX_LEN];
+    expand_tilde_path(S2_BASE_DIR, base_dir);
+    expand_tilde_path(S2_CACHE_DIR, cache_dir);
+
+    // A new file extends the archive; anything else makes it stale
+    if (appended) {
+        dfs_tar_cache_append(cache_dir, base_dir, "pdf", "S1", filepath);
+    } else {
+        dfs_tar_cache_invalidate(cache_dir, "pdf");
     }
-    
-    free(filenames);
 }
 
-// Function to create tar file of all files with specific extension
-int create_tar_file(const char *extension, char *tarfile) {
-    char expanded_base[PATH_MAX_LEN];
-    expand_tilde_path(S2_BASE_DIR, expanded_base);
-    
-    // Create tar command
-    char tar_command[CMD_SIZE];
-    snprintf(tar_command, CMD_SIZE, 
-             "find %s -name \"*.%s\" -type f -print0 | tar -cvf %s --null -T -", 
-             expanded_base, extension, tarfile);
-    
-    return system(tar_command);
+// Function to log a removed file so incremental archives can report it
+void record_tar_deletion(const char *filepath) {
+    char base_dir[PATH_MAX_LEN];
+    char cache_dir[PATH_MAX_LEN];
+    expand_tilde_path(S2_BASE_DIR, base_dir);
+    expand_tilde_path(S2_CACHE_DIR, cache_dir);
+    dfs_tar_log_deletion(cache_dir, base_dir, "pdf", "S1", filepath);
+}
+
+// Function run by the reload thread: count the stored files afresh now and then
+void *presence_reload_worker(void *arg) {
+    char base_dir[PATH_MAX_LEN];
+    (void)arg;
+    expand_tilde_path(S2_BASE_DIR, base_dir);
+    while (1) {
+        sleep(DFS_FILTER_RELOAD_INTERVAL);
+        dfs_filter_load(presence_filter, base_dir, "pdf");
+    }
+    return NULL;
+}
+
+// Function to count a newly stored file in the presence filter, or take a removed one out
+void record_presence(const char *filepath, int stored) {
+    char base_dir[PATH_MAX_LEN];
+    expand_tilde_path(S2_BASE_DIR, base_dir);
+    if (stored) {
+        dfs_filter_add(presence_filter, base_dir, filepath);
+    } else {
+        dfs_filter_remove(presence_filter, base_dir, filepath);
+    }
 }
 
 // Function to get file extension
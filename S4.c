@@ -12,6 +12,15 @@
 #include <libgen.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
+
+#include "dfs_protocol.h"
+#include "dfs_tar.h"
+#include "dfs_blob.h"
+#include "dfs_session.h"
+#include "dfs_crc32c.h"
+#include "dfs_index.h"
+#include "dfs_filter.h"
 
 #define BUFFER_SIZE 4096
 #define COMMAND_SIZE 1024
@@ -20,21 +29,34 @@
 #define MAX_PENDING 10
 #define S4_PORT 8389
 #define S4_BASE_DIR "~/S4"
+#define S4_CACHE_DIR "~/.S4_cache"   /* materialized downltar archive */
+#define S4_BLOB_DIR "~/.S4_blobs"    /* one copy of each distinct file body */
 
 // Function prototypes
 void handle_client_disconnect(int signal);
 void process_client_request(int client_socket);
 int create_directory_path(const char *path);
-int handle_receive_command(char *command, int client_socket);
-int handle_send_command(char *command, int client_socket);
-int handle_remove_command(char *command, int client_socket);
-int handle_list_command(char *command, int client_socket);
-int handle_create_tar_command(char *command, int client_socket);
-int send_file(const char *filepath, int client_socket);
-int receive_file(const char *filepath, int client_socket);
+int handle_receive_command(char *command, int client_socket, const DfsHeader *request);
+int handle_send_command(char *command, int client_socket, const DfsHeader *request);
+int handle_remove_command(char *command, int client_socket, const DfsHeader *request);
+int handle_list_command(char *command, int client_socket, const DfsHeader *request);
+int handle_create_tar_command(char *command, int client_socket, const DfsHeader *request);
+int handle_stat_command(char *command, int client_socket, const DfsHeader *request);
+int handle_inventory_command(char *command, int client_socket, const DfsHeader *request);
+int handle_watch_command(int client_socket, const DfsHeader *request);
+int send_file(const char *filepath, const DfsRange *range, int client_socket, const DfsHeader *request);
+int receive_file(const char *filepath, int client_socket, uint64_t filesize);
 void expand_path(const char *path, char *expanded_path);
+void update_tar_cache(const char *filepath, int appended);
+void record_tar_deletion(const char *filepath);
+void record_presence(const char *filepath, int stored);
+void *presence_reload_worker(void *arg);
 char* get_file_extension(const char *filename);
-int list_files_in_directory(const char *path, const char *extension, char *file_list);
+char **collect_sorted_page(const char *dirpath, const char *extension, const char *after, int limit, int *count);
+int compare_strings(const void *a, const void *b);
+
+// Which files are stored here, shared with every child and pushed to S1 over WATCH connections
+DfsFilter *presence_filter = NULL;
 
 int main() {
     int server_socket, client_socket;
@@ -79,6 +101,21 @@ int main() {
 
     printf("S4 server started. Listening on port %d...\n", S4_PORT);
 
+    // Count the files already stored before S1 can watch them
+    char base_dir[MAX_FILEPATH];
+    expand_path(S4_BASE_DIR, base_dir);
+    presence_filter = dfs_filter_create();
+    int present = presence_filter ? dfs_filter_load(presence_filter, base_dir, "zip") : -1;
+    if (present < 0) {
+        printf("Presence filter unavailable, S1 will ask for every file\n");
+    } else {
+        printf("Presence filter holds %d files\n", present);
+        pthread_t reloader;
+        if (pthread_create(&reloader, NULL, presence_reload_worker, NULL) == 0) {
+            pthread_detach(reloader);
+        }
+    }
+
     // Set up signal handler for child processes
     signal(SIGCHLD, handle_client_disconnect);
 
@@ -132,52 +169,83 @@ void handle_client_disconnect(int signal) {
 // Process client requests
 void process_client_request(int client_socket) {
     char command[COMMAND_SIZE];
-    int bytes_received;
+    DfsHeader request;
+    int status;
 
-    // Receive command from client (S1 server)
-    memset(command, 0, COMMAND_SIZE);
-    bytes_received = recv(client_socket, command, COMMAND_SIZE - 1, 0);
+    // Serve framed commands from S1 until it closes the connection
+    while (1) {
+        status = dfs_recv_header(client_socket, &request);
     
-    if (bytes_received <= 0) {
-        if (bytes_received == 0) {
-            printf("Client disconnected\n");
-        } else {
-            perror("Error receiving command");
+        if (status != 0) {
+            if (status == 1) {
+                printf("Client disconnected\n");
+            } else {
+                perror("Error receiving command");
+            }
+            return;
+        }
+
+        memset(command, 0, COMMAND_SIZE);
+        if (dfs_recv_payload(client_socket, &request, command, COMMAND_SIZE) != 0) {
+            if (errno != EMSGSIZE) {
+                perror("Error receiving command");
+                return;
+            }
+            dfs_reply(client_socket, &request, DFS_STATUS_INVALID, "ERROR: Command too long");
+            continue;
+        }
+        printf("Received command [%u]: %s\n", request.request_id, command);
+
+        // Process different command types
+        switch (request.opcode) {
+            case DFS_OP_RECEIVE:
+                handle_receive_command(command, client_socket, &request);
+                break;
+            case DFS_OP_SEND:
+                handle_send_command(command, client_socket, &request);
+                break;
+            case DFS_OP_REMOVE:
+                handle_remove_command(command, client_socket, &request);
+                break;
+            case DFS_OP_LIST:
+                handle_list_command(command, client_socket, &request);
+                break;
+            case DFS_OP_CREATETAR:
+                handle_create_tar_command(command, client_socket, &request);
+                break;
+            case DFS_OP_STAT:
+                handle_stat_command(command, client_socket, &request);
+                break;
+            case DFS_OP_INVENTORY:
+                handle_inventory_command(command, client_socket, &request);
+                break;
+            case DFS_OP_WATCH:
+                // The connection carries filter changes from now on
+                handle_watch_command(client_socket, &request);
+                return;
+            case DFS_OP_PING:
+                // Health check from S1's connection pool
+                dfs_reply(client_socket, &request, DFS_STATUS_OK, "PONG");
+                break;
+            default:
+                // Invalid command
+                dfs_reply(client_socket, &request, DFS_STATUS_INVALID, "ERROR: Invalid command");
+                break;
         }
-        return;
-    }
-
-    command[bytes_received] = '\0';
-    printf("Received command: %s\n", command);
-
-    // Process different command types
-    if (strncmp(command, "RECEIVE ", 8) == 0) {
-        handle_receive_command(command, client_socket);
-    } else if (strncmp(command, "SEND ", 5) == 0) {
-        handle_send_command(command, client_socket);
-    } else if (strncmp(command, "REMOVE ", 7) == 0) {
-        handle_remove_command(command, client_socket);
-    } else if (strncmp(command, "LIST ", 5) == 0) {
-        handle_list_command(command, client_socket);
-    } else if (strncmp(command, "CREATE_TAR ", 11) == 0) {
-        handle_create_tar_command(command, client_socket);
-    } else {
-        // Invalid command
-        char response[] = "ERROR: Invalid command";
-        send(client_socket, response, strlen(response), 0);
     }
 }
 
 // Handle RECEIVE command (upload file from S1 to S4)
-int handle_receive_command(char *command, int client_socket) {
+int handle_receive_command(char *command, int client_socket, const DfsHeader *request) {
     char filename[MAX_FILENAME];
     char dest_path[MAX_FILEPATH];
     char response[BUFFER_SIZE];
     
-    // Parse command
-    if (sscanf(command, "RECEIVE %s %s", filename, dest_path) != 2) {
+    // Parse command: RECEIVE <filename> <dest_path> [sha256=<hex>] [resume=<session>]
+    //                [multipart=<size>|part=<offset>|commit]
+    if (sscanf(command, "RECEIVE %255s %1023s", filename, dest_path) != 2) {
         snprintf(response, BUFFER_SIZE, "ERROR: Invalid RECEIVE command syntax");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -188,41 +256,176 @@ int handle_receive_command(char *command, int client_socket) {
     // Create directory path if it doesn't exist
     if (create_directory_path(expanded_path) != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: Failed to create destination directory");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
         return -1;
     }
 
     // Prepare full path for file
     char filepath[MAX_FILEPATH];
+    char blob_store[MAX_FILEPATH];
     snprintf(filepath, MAX_FILEPATH, "%s/%s", expanded_path, filename);
+    expand_path(S4_BLOB_DIR, blob_store);
+
+    // Committing a multipart upload publishes its part file once it hashes to the client's digest
+    char hex[DFS_SHA256_HEX_LEN + 1];
+    char resume_id[DFS_SESSION_ID_LEN + 1];
+    char session_id[DFS_SESSION_ID_LEN + 1];
+    char part_path[MAX_FILEPATH];
+    char stored[96] = "";
+    struct stat existing;
+    int has_digest = dfs_sha256_find_word(command, hex);
+    int resuming = dfs_session_find_id(command, resume_id);
+    if (dfs_session_is_commit(command)) {
+        if (!resuming || !has_digest ||
+            dfs_session_lookup(blob_store, resume_id, part_path, sizeof(part_path)) != 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Unknown upload session");
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+            return -1;
+        }
+        int replaced = stat(filepath, &existing) == 0;
+        int committed = dfs_blob_commit(blob_store, part_path, filepath, hex);
+        if (committed == 0) {
+            update_tar_cache(filepath, !replaced);
+            record_presence(filepath, 1);
+        }
+        if (committed != 0) {
+            snprintf(response, BUFFER_SIZE, committed == DFS_BLOB_MISMATCH ?
+                     "ERROR: Uploaded parts do not match the file" : "ERROR: Failed to receive file");
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+            return -1;
+        }
+        dfs_index_describe(filepath, stored, sizeof(stored));
+        snprintf(response, BUFFER_SIZE, "SUCCESS: File received and stored successfully%s", stored);
+        dfs_reply(client_socket, request, DFS_STATUS_OK, response);
+        return 0;
+    }
 
-    // Send ready signal to S1
-    snprintf(response, BUFFER_SIZE, "READY_TO_RECEIVE");
-    send(client_socket, response, strlen(response), 0);
+    // A body we already hold is stored by reference without being sent again
+    if (has_digest) {
+        int replaced = stat(filepath, &existing) == 0;
+        if (dfs_blob_link(blob_store, hex, filepath) == 1) {
+            update_tar_cache(filepath, !replaced);
+            record_presence(filepath, 1);
+            dfs_index_describe(filepath, stored, sizeof(stored));
+            snprintf(response, BUFFER_SIZE, "SUCCESS: File stored from existing content%s", stored);
+            dfs_reply(client_socket, request, DFS_STATUS_OK, response);
+            return 0;
+        }
+    }
+
+    // A multipart upload opens with its part file reserved at full size; the parts follow on
+    // other connections and are written where they belong
+    uint64_t total;
+    uint64_t part_offset;
+    if (dfs_session_find_multipart(command, &total)) {
+        if (dfs_session_begin(blob_store, total, session_id, part_path, sizeof(part_path)) != 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to receive file");
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+            return -1;
+        }
+        snprintf(response, BUFFER_SIZE, "MULTIPART session=%s", session_id);
+        dfs_reply(client_socket, request, DFS_STATUS_OK, response);
+        return 0;
+    }
+    if (dfs_session_find_part(command, &part_offset)) {
+        if (!resuming || dfs_session_lookup(blob_store, resume_id, part_path, sizeof(part_path)) != 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Unknown upload session");
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+            return -1;
+        }
+        snprintf(response, BUFFER_SIZE, "READY_TO_RECEIVE session=%s offset=%llu", resume_id,
+                 (unsigned long long)part_offset);
+        dfs_reply(client_socket, request, DFS_STATUS_READY, response);
+
+        DfsHeader data;
+        if (dfs_recv_header(client_socket, &data) != 0) {
+            perror("Error receiving part header");
+            return -1;
+        }
+        if (data.opcode != DFS_OP_DATA) {
+            // Read past whatever came instead, so S1's next command is read from its start
+            dfs_discard(client_socket, data.payload_len);
+            snprintf(response, BUFFER_SIZE, "ERROR: Expected the part body");
+            dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+            return -1;
+        }
+        int stored = dfs_session_receive_part(client_socket, &data, part_path, part_offset);
+        if (stored != 0) {
+            snprintf(response, BUFFER_SIZE, stored == DFS_CHECKSUM_MISMATCH ? "ERROR: Checksum mismatch"
+                                                                            : "ERROR: Failed to store part");
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+            return -1;
+        }
+        snprintf(response, BUFFER_SIZE, "SUCCESS: Part stored");
+        dfs_reply(client_socket, request, DFS_STATUS_OK, response);
+        return 0;
+    }
 
-    // Receive file from S1
-    if (receive_file(filepath, client_socket) != 0) {
+    // The body is received into a session's part file beside the blob store, continuing any
+    // earlier attempt, and moved into place once complete
+    uint64_t offset;
+    if (dfs_session_open(blob_store, resuming ? resume_id : NULL, session_id, part_path,
+                         sizeof(part_path), &offset) != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: Failed to receive file");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
         return -1;
     }
 
-    // Send success response
-    snprintf(response, BUFFER_SIZE, "SUCCESS: File received and stored successfully");
-    send(client_socket, response, strlen(response), 0);
+    // Send ready signal to S1, naming the session and the bytes it already holds
+    snprintf(response, BUFFER_SIZE, "READY_TO_RECEIVE session=%s offset=%llu", session_id,
+             (unsigned long long)offset);
+    dfs_reply(client_socket, request, DFS_STATUS_READY, response);
+
+    // The rest of the file body follows as a DATA frame
+    DfsHeader data;
+    if (dfs_recv_header(client_socket, &data) != 0) {
+        perror("Error receiving file header");
+        return -1;
+    }
+    if (data.opcode != DFS_OP_DATA) {
+        // Read past whatever came instead, so S1's next command is read from its start
+        dfs_discard(client_socket, data.payload_len);
+        snprintf(response, BUFFER_SIZE, "ERROR: Expected the file body");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+        return -1;
+    }
+
+    // Receive file from S1, store it, then bring the cached archive up to date
+    int replaced = stat(filepath, &existing) == 0;
+    int received = receive_file(part_path, client_socket, data.payload_len);
+    int committed = -1;
+    if (received == 0) {
+        // The digest the client named covers every attempt that went into the part file
+        committed = dfs_blob_commit(blob_store, part_path, filepath, has_digest ? hex : NULL);
+    }
+    if (committed == 0) {
+        update_tar_cache(filepath, !replaced);
+        record_presence(filepath, 1);
+    }
+    if (committed != 0) {
+        snprintf(response, BUFFER_SIZE, received == DFS_CHECKSUM_MISMATCH || committed == DFS_BLOB_MISMATCH ?
+                 "ERROR: Checksum mismatch" : "ERROR: Failed to receive file");
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+        return -1;
+    }
+
+    // Send success response, with what was stored for S1's index
+    dfs_index_describe(filepath, stored, sizeof(stored));
+    snprintf(response, BUFFER_SIZE, "SUCCESS: File received and stored successfully%s", stored);
+    dfs_reply(client_socket, request, DFS_STATUS_OK, response);
     
     return 0;
 }
 
 // Handle SEND command (send file from S4 to S1)
-int handle_send_command(char *command, int client_socket) {
+int handle_send_command(char *command, int client_socket, const DfsHeader *request) {
     char filepath[MAX_FILEPATH];
     char response[BUFFER_SIZE];
     
-    // Parse command
-    if (sscanf(command, "SEND %s", filepath) != 1) {
+    // Parse command: SEND <filepath> [range=<first>-<last>|<first>-|-<n>]
+    if (sscanf(command, "SEND %1023s", filepath) != 1) {
         snprintf(response, BUFFER_SIZE, "ERROR: Invalid SEND command syntax");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -233,27 +436,103 @@ int handle_send_command(char *command, int client_socket) {
     // Check if file exists
     if (access(expanded_path, F_OK) != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: File not found");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, response);
+        return -1;
+    }
+
+    DfsRange range;
+    if (dfs_session_parse_range(command, &range) != 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Invalid range");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+        return -1;
+    }
+
+    // Send file to S1, or just the range asked for
+    return send_file(expanded_path, &range, client_socket, request);
+}
+
+// Handle STAT command (size and content digest of a file in S4)
+int handle_stat_command(char *command, int client_socket, const DfsHeader *request) {
+    char filepath[MAX_FILEPATH];
+    char response[BUFFER_SIZE];
+    
+    // Parse command: STAT <filepath>
+    if (sscanf(command, "STAT %1023s", filepath) != 1) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Invalid STAT command syntax");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
+        return -1;
+    }
+
+    // Expand file path
+    char expanded_path[MAX_FILEPATH];
+    expand_path(filepath, expanded_path);
+
+    struct stat st;
+    if (stat(expanded_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        snprintf(response, BUFFER_SIZE, "ERROR: File not found");
+        dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, response);
+        return -1;
+    }
+
+    // The digest comes from the file's blob, so this costs no read of the body
+    char hex[DFS_SHA256_HEX_LEN + 1];
+    if (dfs_blob_digest(expanded_path, hex) != 0) {
+        snprintf(hex, sizeof(hex), "-");
+    }
+    snprintf(response, BUFFER_SIZE, "%llu %s", (unsigned long long)st.st_size, hex);
+    dfs_reply(client_socket, request, DFS_STATUS_OK, response);
+    return 0;
+}
+
+// Handle INVENTORY command (every .zip file at or under a path, for S1's namespace index)
+int handle_inventory_command(char *command, int client_socket, const DfsHeader *request) {
+    char path[MAX_FILEPATH];
+    char response[BUFFER_SIZE];
+    
+    // Parse command: INVENTORY <path>
+    if (sscanf(command, "INVENTORY %1023s", path) != 1) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Invalid INVENTORY command syntax");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
-    // Send ready signal to S1
-    snprintf(response, BUFFER_SIZE, "READY_TO_SEND");
-    send(client_socket, response, strlen(response), 0);
+    // Expand path
+    char expanded_path[MAX_FILEPATH];
+    char base_dir[MAX_FILEPATH];
+    expand_path(path, expanded_path);
+    expand_path(S4_BASE_DIR, base_dir);
+
+    int files = dfs_index_send_inventory(client_socket, request->request_id, base_dir, expanded_path, "zip");
+    if (files < 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to read inventory of %s", expanded_path);
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
+        return -1;
+    }
+    printf("Inventory sent for %s (%d files)\n", expanded_path, files);
+    return 0;
+}
 
-    // Send file to S1
-    return send_file(expanded_path, client_socket);
+// Handle WATCH command (push the presence filter to S1 until it hangs up)
+int handle_watch_command(int client_socket, const DfsHeader *request) {
+    if (!presence_filter) {
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, "ERROR: Presence filter unavailable");
+        return -1;
+    }
+    printf("S1 is watching the presence filter\n");
+    int result = dfs_filter_serve(presence_filter, client_socket, request->request_id);
+    printf("Presence filter watch ended\n");
+    return result;
 }
 
 // Handle REMOVE command (delete file in S4)
-int handle_remove_command(char *command, int client_socket) {
+int handle_remove_command(char *command, int client_socket, const DfsHeader *request) {
     char filepath[MAX_FILEPATH];
     char response[BUFFER_SIZE];
     
     // Parse command
     if (sscanf(command, "REMOVE %s", filepath) != 1) {
         snprintf(response, BUFFER_SIZE, "ERROR: Invalid REMOVE command syntax");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -261,22 +540,27 @@ int handle_remove_command(char *command, int client_socket) {
     char expanded_path[MAX_FILEPATH];
     expand_path(filepath, expanded_path);
 
-    // Remove file
-    if (remove(expanded_path) != 0) {
+    // Remove file; its content goes only once no other path refers to it
+    char blob_store[MAX_FILEPATH];
+    expand_path(S4_BLOB_DIR, blob_store);
+    if (dfs_blob_release(blob_store, expanded_path) != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: Failed to remove file - %s", strerror(errno));
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, errno == ENOENT ? DFS_STATUS_NOT_FOUND : DFS_STATUS_ERROR, response);
         return -1;
     }
+    update_tar_cache(expanded_path, 0);
+    record_tar_deletion(expanded_path);
+    record_presence(expanded_path, 0);
 
     // Send success response
     snprintf(response, BUFFER_SIZE, "SUCCESS: File removed successfully");
-    send(client_socket, response, strlen(response), 0);
+    dfs_reply(client_socket, request, DFS_STATUS_OK, response);
     
     return 0;
 }
 
-// Handle LIST command (list files in directory)
-int handle_list_command(char *command, int client_socket) {
+// Handle LIST command (list one page of files in directory)
+int handle_list_command(char *command, int client_socket, const DfsHeader *request) {
     char path[MAX_FILEPATH];
     char extension[10];
     char response[BUFFER_SIZE];
@@ -284,7 +568,7 @@ int handle_list_command(char *command, int client_socket) {
     // Parse command
     if (sscanf(command, "LIST %s %s", path, extension) != 2) {
         snprintf(response, BUFFER_SIZE, "ERROR: Invalid LIST command syntax");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
@@ -296,112 +580,209 @@ int handle_list_command(char *command, int client_socket) {
     struct stat st;
     if (stat(expanded_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
         // Directory doesn't exist, return empty list
-        send(client_socket, "", 0, 0);
+        dfs_send_frame(client_socket, DFS_OP_DATA, DFS_STATUS_OK, request->request_id, NULL, 0);
         return 0;
     }
 
-    // Get file list
-    char file_list[BUFFER_SIZE];
-    memset(file_list, 0, BUFFER_SIZE);
-    list_files_in_directory(expanded_path, extension, file_list);
+    // Optional paging: LIST <path> <extension> <after|-> <limit>
+    char after[MAX_FILENAME] = "-";
+    int limit = DFS_LIST_PAGE_SIZE;
+    sscanf(command, "LIST %*s %*s %255s %d", after, &limit);
+    if (limit < 0 || limit > DFS_LIST_MAX_PAGE) {
+        limit = DFS_LIST_MAX_PAGE;
+    }
 
-    // Send file list
-    send(client_socket, file_list, strlen(file_list), 0);
+    // Get the sorted page of files and stream it back
+    int count = 0;
+    char **files = collect_sorted_page(expanded_path, extension, strcmp(after, "-") == 0 ? NULL : after,
+                                       limit, &count);
+    dfs_send_lines(client_socket, DFS_OP_DATA, DFS_STATUS_OK, request->request_id, files, count);
+    for (int i = 0; i < count; i++) {
+        free(files[i]);
+    }
+    free(files);
     
     return 0;
 }
 
-// Handle CREATE_TAR command (create tar of zip files, called from downltar)
-int handle_create_tar_command(char *command, int client_socket) {
+// Handle CREATETAR command (create tar of zip files, called from downltar)
+int handle_create_tar_command(char *command, int client_socket, const DfsHeader *request) {
     char filetype[10];
+    char dirpath[MAX_FILEPATH] = "";
+    char option[64] = "";
     char response[BUFFER_SIZE];
-    char tar_filename[MAX_FILENAME] = "zip.tar";
     
-    // Parse command
-    if (sscanf(command, "CREATE_TAR %s", filetype) != 1) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Invalid CREATE_TAR command syntax");
-        send(client_socket, response, strlen(response), 0);
+    // Parse command: CREATETAR <filetype> [<dirpath>] [since=<time>|manifest]
+    if (sscanf(command, "CREATETAR %9s %1023s %63s", filetype, dirpath, option) < 1) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Invalid CREATETAR command syntax");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
+    if (dirpath[0] != '\0' && dirpath[0] != '/') {
+        // No directory given, so the second word is the option
+        snprintf(option, sizeof(option), "%s", dirpath);
+        dirpath[0] = '\0';
+    }
 
     // Validate file type
     if (strcmp(filetype, "zip") != 0) {
         snprintf(response, BUFFER_SIZE, "ERROR: S4 only handles zip files");
-        send(client_socket, response, strlen(response), 0);
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
-    // Create tar command - find all .zip files in S4 directory tree and create a tar
-    char tar_command[COMMAND_SIZE];
     char s4_dir[MAX_FILEPATH];
+    char cache_dir[MAX_FILEPATH];
     expand_path(S4_BASE_DIR, s4_dir);
-    
-    snprintf(tar_command, COMMAND_SIZE, 
-             "find %s -name \"*.zip\" -type f -print0 | tar -cvf %s --null -T -", 
-             s4_dir, tar_filename);
-    
-    // Execute tar command
-    if (system(tar_command) != 0) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Failed to create tar file");
-        send(client_socket, response, strlen(response), 0);
+    expand_path(S4_CACHE_DIR, cache_dir);
+
+    // A directory limits the archive to that subtree of ~/S4
+    char root[MAX_FILEPATH];
+    char prefix[MAX_FILEPATH];
+    int scoped = dfs_tar_scope(s4_dir, dirpath[0] != '\0' ? dirpath : NULL, root, prefix, MAX_FILEPATH);
+    if (scoped < 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Path must be within ~/S4");
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, response);
         return -1;
     }
 
-    // Verify tar file exists
-    if (access(tar_filename, F_OK) != 0) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Failed to create tar file");
-        send(client_socket, response, strlen(response), 0);
+    // An option makes the archive incremental: since=<time>, or a manifest in a DATA frame
+    DfsTarFilter filter = {-1, NULL, 0, NULL};
+    char *manifest = NULL;
+    int parsed = option[0] != '\0' ? dfs_tar_parse_option(option, &filter) : 0;
+    if (parsed < 0) {
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Invalid downltar option");
         return -1;
     }
+    if (parsed == 1) {
+        uint64_t manifest_len;
+        manifest = dfs_tar_recv_manifest(client_socket, &manifest_len);
+        if (!manifest || dfs_tar_load_manifest(&filter, manifest) != 0) {
+            free(manifest);
+            dfs_reply(client_socket, request, DFS_STATUS_ERROR, "ERROR: Failed to read manifest");
+            return -1;
+        }
+    }
 
-    // Send ready signal to S1
-    snprintf(response, BUFFER_SIZE, "READY_TO_SEND_TAR %s", tar_filename);
-    send(client_socket, response, strlen(response), 0);
-
-    // Wait for acknowledgment
-    memset(response, 0, BUFFER_SIZE);
-    if (recv(client_socket, response, BUFFER_SIZE - 1, 0) <= 0 || 
-        strcmp(response, "READY") != 0) {
-        remove(tar_filename);
+    int files;
+    if (option[0] != '\0' || scoped) {
+        // Only the subtree, or only new or changed members with deletions listed in the trailer
+        char deletion_log[MAX_FILEPATH + sizeof("/zip.deleted")];
+        snprintf(deletion_log, sizeof(deletion_log), "%s/zip.deleted", cache_dir);
+        filter.deletion_log = deletion_log;
+        files = dfs_tar_stream(client_socket, request->request_id, root, "zip", prefix, &filter);
+        dfs_tar_free_filter(&filter);
+        free(manifest);
+    } else {
+        // Serve the cached archive of the zip files in the S4 tree, building it on first use
+        files = dfs_tar_cache_send(client_socket, request->request_id, cache_dir, s4_dir, "zip", "S1");
+    }
+    if (files < 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to create tar file");
+        dfs_reply(client_socket, request, DFS_STATUS_ERROR, response);
         return -1;
     }
 
-    // Send tar file to S1
-    int result = send_file(tar_filename, client_socket);
-    
-    // Delete temporary tar file
-    if (remove(tar_filename) != 0) {
-        perror("Warning: Failed to delete temporary tar file");
+    if (files == 0) {
+        dfs_reply(client_socket, request, DFS_STATUS_NO_FILES, "NO_FILES");
+        return -1;
     }
     
-    return result;
+    return 0;
 }
 
-// Function to send file to socket
-int send_file(const char *filepath, int client_socket) {
+// Function to keep the cached archive in step with a stored or removed file
+void update_tar_cache(const char *filepath, int appended) {
+    char base_dir[MAX_FILEPATH];
+    char cache_dir[MAX_FILEPATH];
+    expand_path(S4_BASE_DIR, base_dir);
+    expand_path(S4_CACHE_DIR, cache_dir);
+
+    // A new file extends the archive; anything else makes it stale
+    if (appended) {
+        dfs_tar_cache_append(cache_dir, base_dir, "zip", "S1", filepath);
+    } else {
+        dfs_tar_cache_invalidate(cache_dir, "zip");
+    }
+}
+
+// Function to log a removed file so incremental archives can report it
+void record_tar_deletion(const char *filepath) {
+    char base_dir[MAX_FILEPATH];
+    char cache_dir[MAX_FILEPATH];
+    expand_path(S4_BASE_DIR, base_dir);
+    expand_path(S4_CACHE_DIR, cache_dir);
+    dfs_tar_log_deletion(cache_dir, base_dir, "zip", "S1", filepath);
+}
+
+// Function run by the reload thread: count the stored files afresh now and then
+void *presence_reload_worker(void *arg) {
+    char base_dir[MAX_FILEPATH];
+    (void)arg;
+    expand_path(S4_BASE_DIR, base_dir);
+    while (1) {
+        // SIGCHLD may land on this thread and cut the sleep short
+        unsigned int left = DFS_FILTER_RELOAD_INTERVAL;
+        while (left > 0) {
+            left = sleep(left);
+        }
+        dfs_filter_load(presence_filter, base_dir, "zip");
+    }
+    return NULL;
+}
+
+// Function to count a stored file in the presence filter, or take a removed one out
+void record_presence(const char *filepath, int stored) {
+    char base_dir[MAX_FILEPATH];
+    expand_path(S4_BASE_DIR, base_dir);
+
+    // Children store without a shared lock, so a replaced file is counted again: an extra count
+    // only costs S1 a round trip, while a missing one would hide the file
+    if (stored) {
+        dfs_filter_add(presence_filter, base_dir, filepath);
+    } else {
+        dfs_filter_remove(presence_filter, base_dir, filepath);
+    }
+}
+
+// Function to send file, or just a range of it, to socket as a DATA frame and its checksum
+int send_file(const char *filepath, const DfsRange *range, int client_socket, const DfsHeader *request) {
     FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
+    struct stat st;
+    if (!fp || fstat(fileno(fp), &st) != 0) {
         perror("Error opening file for sending");
+        dfs_reply(client_socket, request, DFS_STATUS_NOT_FOUND, "ERROR: File not found");
+        if (fp) {
+            fclose(fp);
+        }
         return -1;
     }
     
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
+    // Only the bytes asked for are read, straight from where the range starts
+    uint64_t offset, length;
+    if (dfs_session_resolve_range(range, st.st_size, &offset, &length) != 0 ||
+        lseek(fileno(fp), offset, SEEK_SET) < 0) {
+        dfs_reply(client_socket, request, DFS_STATUS_INVALID, "ERROR: Range is beyond the end of the file");
+        fclose(fp);
+        return -1;
+    }
     
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-        if (send(client_socket, buffer, bytes_read, 0) < 0) {
-            perror("Error sending file data");
-            fclose(fp);
-            return -1;
-        }
+    // The whole file goes out with the checksum stored when it arrived; a range is summed as it is read
+    uint32_t stored;
+    int whole = offset == 0 && length == (uint64_t)st.st_size && dfs_crc32c_get_attr(fileno(fp), &stored) == 0;
+    if (dfs_send_body(client_socket, request->request_id, fileno(fp), length, whole ? &stored : NULL) != 0) {
+        perror("Error sending file data");
+        fclose(fp);
+        return -1;
     }
     
     fclose(fp);
     return 0;
 }
 
-// Function to receive file from socket
-int receive_file(const char *filepath, int client_socket) {
+// Function to append a file body from socket to a file. A body that does not match its checksum is
+// cut off again, so a retry resumes from the last bytes known to be good
+int receive_file(const char *filepath, int client_socket, uint64_t filesize) {
     // Create directory path if needed
     char *dir_path = strdup(filepath);
     char *last_slash = strrchr(dir_path, '/');
@@ -411,36 +792,43 @@ int receive_file(const char *filepath, int client_socket) {
     }
     free(dir_path);
     
-    FILE *fp = fopen(filepath, "wb");
-    if (!fp) {
+    FILE *fp = fopen(filepath, "ab");
+    struct stat st;
+    if (!fp || fstat(fileno(fp), &st) != 0) {
         perror("Error creating file for receiving");
+        uint32_t crc;
+        dfs_discard(client_socket, filesize);
+        dfs_recv_checksum(client_socket, &crc);
+        if (fp) {
+            fclose(fp);
+        }
         return -1;
     }
     
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    
-    while ((bytes_read = recv(client_socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        if (fwrite(buffer, 1, bytes_read, fp) != bytes_read) {
-            perror("Error writing to file");
-            fclose(fp);
-            return -1;
-        }
-        
-        // Check if end of file (partial buffer means end of transfer)
-        if (bytes_read < BUFFER_SIZE) {
-            break;
+    // Read exactly the announced number of bytes, keeping whatever arrives so a broken
+    // transfer can resume after it
+    int received = dfs_recv_body(client_socket, fp, filesize);
+    if (received == DFS_CHECKSUM_MISMATCH) {
+        printf("Checksum mismatch receiving %s\n", filepath);
+        if (fflush(fp) != 0 || ftruncate(fileno(fp), st.st_size) != 0) {
+            perror("Error discarding corrupt data");
         }
+    } else if (received != 0) {
+        perror("Error receiving file data");
     }
     
-    fclose(fp);
+    // Make the file durable before S1 is told it is stored
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        perror("Error syncing file");
+        received = -1;
+    }
     
-    if (bytes_read < 0) {
-        perror("Error receiving file data");
-        return -1;
+    if (fclose(fp) != 0) {
+        perror("Error writing to file");
+        received = -1;
     }
     
-    return 0;
+    return received;
 }
 
 // Create directory path recursively
@@ -498,67 +886,77 @@ char* get_file_extension(const char *filename) {
     return dot + 1;
 }
 
-// List files in directory with specific extension
-int list_files_in_directory(const char *path, const char *extension, char *file_list) {
-    DIR *dir = opendir(path);
+// Function to collect, in order, the first limit names with an extension that sort after 'after'
+// (a max-heap of the best names so far keeps memory bounded however large the directory is)
+char **collect_sorted_page(const char *dirpath, const char *extension, const char *after, int limit, int *count) {
+    *count = 0;
+    DIR *dir = opendir(dirpath);
     if (!dir) {
-        return -1;
-    }
-    
-    struct dirent *entry;
-    struct dirent **namelist;
-    int n, count = 0;
-    
-    // Count number of matching files
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            char *ext = get_file_extension(entry->d_name);
-            if (ext && strcmp(ext, extension) == 0) {
-                count++;
-            }
-        }
+        return NULL;
     }
-    rewinddir(dir);
-    
-    // Allocate array for entries
-    char **files = malloc(count * sizeof(char *));
-    if (!files) {
+
+    char **heap = malloc((limit > 0 ? limit : 1) * sizeof(char *));
+    if (!heap) {
         closedir(dir);
-        return -1;
+        return NULL;
     }
-    
-    // Fill array with filenames
-    int i = 0;
+    int size = 0;
+
+    struct dirent *entry;
     while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            char *ext = get_file_extension(entry->d_name);
-            if (ext && strcmp(ext, extension) == 0 && i < count) {
-                files[i] = strdup(entry->d_name);
-                i++;
-            }
+        if (entry->d_type != DT_REG) {
+            continue;
         }
-    }
-    closedir(dir);
-    
-    // Sort files alphabetically
-    for (int j = 0; j < i - 1; j++) {
-        for (int k = j + 1; k < i; k++) {
-            if (strcmp(files[j], files[k]) > 0) {
-                char *temp = files[j];
-                files[j] = files[k];
-                files[k] = temp;
+        char *ext = get_file_extension(entry->d_name);
+        if (!ext || strcmp(ext, extension) != 0 || (after && strcmp(entry->d_name, after) <= 0)) {
+            continue;
+        }
+        
+        if (size < limit) {
+            // Room left: sift the new name up
+            char *name = strdup(entry->d_name);
+            if (!name) {
+                continue;
+            }
+            int i = size++;
+            while (i > 0 && strcmp(heap[(i - 1) / 2], name) < 0) {
+                heap[i] = heap[(i - 1) / 2];
+                i = (i - 1) / 2;
             }
+            heap[i] = name;
+        } else if (limit > 0 && strcmp(entry->d_name, heap[0]) < 0) {
+            // Smaller than the largest name kept: replace it and sift down
+            char *name = strdup(entry->d_name);
+            if (!name) {
+                continue;
+            }
+            free(heap[0]);
+            int i = 0;
+            while (1) {
+                int child = 2 * i + 1;
+                if (child >= size) {
+                    break;
+                }
+                if (child + 1 < size && strcmp(heap[child + 1], heap[child]) > 0) {
+                    child++;
+                }
+                if (strcmp(heap[child], name) <= 0) {
+                    break;
+                }
+                heap[i] = heap[child];
+                i = child;
+            }
+            heap[i] = name;
         }
     }
-    
-    // Build file list string
-    file_list[0] = '\0';
-    for (int j = 0; j < i; j++) {
-        strcat(file_list, files[j]);
-        strcat(file_list, "\n");
-        free(files[j]);
-    }
-    
-    free(files);
-    return 0;
+    closedir(dir);
+
+    qsort(heap, size, sizeof(char *), compare_strings);
+    *count = size;
+    return heap;
+}
+
+// Compare function for qsort
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
 }
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/xattr.h>
+
+#include "dfs_blob.h"
+#include "dfs_crc32c.h"
+
+#define BLOB_HASH_XATTR "user.dfs.sha256"
+#define BLOB_READ_BUFFER (256 * 1024)
+
+// Function to build the path of the blob with a digest
+static void blob_path(const char *store, const char *hex, char *path, size_t size) {
+    snprintf(path, size, "%s/%.2s/%s", store, hex, hex);
+}
+
+// Function to take the store lock (returns the lock descriptor)
+static int store_lock(const char *store) {
+    char lock_path[DFS_BLOB_PATH_MAX];
+    mkdir(store, 0755);
+    snprintf(lock_path, sizeof(lock_path), "%s/.lock", store);
+    int fd = open(lock_path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// Function to release the store lock
+static void store_unlock(int lock_fd) {
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+// Function to find the digest of the blob a stored path links to; -1 for a path outside the store
+static int path_digest(const char *path, char hex[DFS_SHA256_HEX_LEN + 1]) {
+    struct stat st;
+    if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink < 2) {
+        return -1;
+    }
+    return dfs_blob_digest(path, hex);
+}
+
+// Function to drop a blob once no stored path links to it any more
+static void collect_blob(const char *store, const char *hex) {
+    char blob[DFS_BLOB_PATH_MAX];
+    struct stat st;
+    blob_path(store, hex, blob, sizeof(blob));
+    if (stat(blob, &st) == 0 && st.st_nlink == 1) {
+        unlink(blob);
+    }
+}
+
+// Function to point a path at a blob, releasing whatever blob it pointed at before
+static int place_blob(const char *store, const char *hex, const char *blob, const char *path) {
+    struct stat blob_st, path_st;
+    if (stat(blob, &blob_st) != 0) {
+        return -1;
+    }
+    if (lstat(path, &path_st) == 0 && path_st.st_ino == blob_st.st_ino && path_st.st_dev == blob_st.st_dev) {
+        return 0;   // already this content
+    }
+    char old_hex[DFS_SHA256_HEX_LEN + 1];
+    int had_blob = path_digest(path, old_hex) == 0;
+
+    // Link beside the path and rename over it, so readers see the old or the new file
+    char link_path[DFS_BLOB_PATH_MAX];
+    snprintf(link_path, sizeof(link_path), "%s.dfs-link", path);
+    unlink(link_path);
+    if (link(blob, link_path) != 0) {
+        return -1;
+    }
+    if (rename(link_path, path) != 0) {
+        unlink(link_path);
+        return -1;
+    }
+    if (had_blob && strcmp(old_hex, hex) != 0) {
+        collect_blob(store, old_hex);
+    }
+    return 0;
+}
+
+// Function to compute a body's SHA-256 digest and CRC32C in a single pass over the file
+static int hash_body(int fd, char hex[DFS_SHA256_HEX_LEN + 1], uint32_t *crc) {
+    unsigned char *buffer = malloc(BLOB_READ_BUFFER);
+    if (!buffer) {
+        return -1;
+    }
+    DfsSha256 ctx;
+    dfs_sha256_init(&ctx);
+    uint32_t sum = 0;
+    int result = 0;
+    while (1) {
+        ssize_t bytes_read = read(fd, buffer, BLOB_READ_BUFFER);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            result = bytes_read < 0 ? -1 : 0;
+            break;
+        }
+        dfs_sha256_update(&ctx, buffer, bytes_read);
+        sum = dfs_crc32c(sum, buffer, bytes_read);
+    }
+    free(buffer);
+    dfs_sha256_hex(&ctx, hex);
+    *crc = sum;
+    return result;
+}
+
+// Function to store a received file (e.g. a finished upload part in the store) at a path, sharing
+// the blob of any identical body. With expect set, a body with another digest is refused
+// (DFS_BLOB_MISMATCH). The received file is gone afterwards whatever the outcome
+int dfs_blob_commit(const char *store, const char *received, const char *path, const char *expect) {
+    char hex[DFS_SHA256_HEX_LEN + 1];
+    uint32_t crc;
+    int fd = open(received, O_RDONLY);
+    if (fd < 0 || hash_body(fd, hex, &crc) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(received);
+        return -1;
+    }
+    // The checksum rides on the inode, so it follows the body into the blob or the renamed copy
+    dfs_crc32c_set_attr(fd, crc);
+    close(fd);
+    if (expect && strcmp(hex, expect) != 0) {
+        unlink(received);
+        return DFS_BLOB_MISMATCH;
+    }
+
+    int lock_fd = store_lock(store);
+    if (lock_fd < 0) {
+        unlink(received);
+        return -1;
+    }
+
+    char blob[DFS_BLOB_PATH_MAX];
+    char fan_dir[DFS_BLOB_PATH_MAX];
+    snprintf(fan_dir, sizeof(fan_dir), "%s/%.2s", store, hex);
+    mkdir(fan_dir, 0755);
+    blob_path(store, hex, blob, sizeof(blob));
+
+    int result;
+    if (link(received, blob) == 0) {
+        // A new body becomes the blob
+        setxattr(blob, BLOB_HASH_XATTR, hex, DFS_SHA256_HEX_LEN, 0);
+        result = place_blob(store, hex, blob, path);
+    } else if (errno == EEXIST) {
+        // Same body as a stored blob; freshen it so incremental archives pick up the new path
+        utimensat(AT_FDCWD, blob, NULL, 0);
+        int blob_fd = open(blob, O_RDONLY);
+        uint32_t stored;
+        if (blob_fd >= 0 && dfs_crc32c_get_attr(blob_fd, &stored) != 0) {
+            dfs_crc32c_set_attr(blob_fd, crc);   // stored before checksums were kept
+        }
+        if (blob_fd >= 0) {
+            close(blob_fd);
+        }
+        result = place_blob(store, hex, blob, path);
+    } else {
+        // The store cannot take it (e.g. another filesystem): keep a private copy
+        result = rename(received, path);
+    }
+    unlink(received);
+
+    store_unlock(lock_fd);
+    return result;
+}
+
+// Function to store a path from the blob with a digest, without the body.
+// Returns 1 if linked, 0 if there is no such blob, -1 on error
+int dfs_blob_link(const char *store, const char *hex, const char *path) {
+    int lock_fd = store_lock(store);
+    if (lock_fd < 0) {
+        return -1;
+    }
+
+    char blob[DFS_BLOB_PATH_MAX];
+    struct stat st;
+    int result = 0;
+    blob_path(store, hex, blob, sizeof(blob));
+    if (stat(blob, &st) == 0) {
+        utimensat(AT_FDCWD, blob, NULL, 0);
+        result = place_blob(store, hex, blob, path) == 0 ? 1 : -1;
+    }
+
+    store_unlock(lock_fd);
+    return result;
+}
+
+// Function to find the digest of a stored file's content, from its blob's attribute when it has one
+int dfs_blob_digest(const char *path, char hex[DFS_SHA256_HEX_LEN + 1]) {
+    ssize_t len = getxattr(path, BLOB_HASH_XATTR, hex, DFS_SHA256_HEX_LEN);
+    if (len == DFS_SHA256_HEX_LEN) {
+        hex[len] = '\0';
+        return 0;
+    }
+
+    // No attribute (e.g. the filesystem has none, or a private copy): hash the content instead
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int hashed = dfs_sha256_file(fd, hex);
+    close(fd);
+    return hashed;
+}
+
+// Function to remove a stored path, dropping its blob if it was the last reference
+// (errno is left from a failed unlink)
+int dfs_blob_release(const char *store, const char *path) {
+    int lock_fd = store_lock(store);
+    char hex[DFS_SHA256_HEX_LEN + 1];
+    int had_blob = path_digest(path, hex) == 0;
+
+    int result = unlink(path);
+    int saved_errno = errno;
+    if (result == 0 && had_blob) {
+        collect_blob(store, hex);
+    }
+
+    if (lock_fd >= 0) {
+        store_unlock(lock_fd);
+    }
+    errno = saved_errno;
+    return result;
+}
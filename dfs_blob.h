@@ -0,0 +1,35 @@
+#ifndef DFS_BLOB_H
+#define DFS_BLOB_H
+
+#include "dfs_sha256.h"
+
+/*
+ * Content-addressed storage for the file bodies held by S2, S3 and S4.
+ *
+ * Each distinct body is kept once in the server's blob store as
+ * <store>/<first two hex digits>/<sha256 hex>, and every stored path is a
+ * hard link to its blob, so the link count less one is the number of
+ * paths referring to it. Storing a path links it to the blob with its
+ * content (adding the blob if it is new); removing a path only drops that
+ * link, and the blob goes once no path refers to it. The digest is also
+ * kept in the blob's user.dfs.sha256 attribute so a path leads back to its
+ * blob without re-reading it, and a stored file's digest is known without
+ * hashing it. The CRC32C of the body is computed in the same pass and kept
+ * in user.dfs.crc32c (see dfs_crc32c.h) for the checksum frames of later
+ * downloads.
+ *
+ * The store has to be on the same filesystem as the tree it serves; when
+ * a blob cannot be linked the upload is simply kept as a private copy.
+ * Store changes are serialized by a lock file, across threads and forked
+ * processes alike.
+ */
+
+#define DFS_BLOB_PATH_MAX 4096
+#define DFS_BLOB_MISMATCH -2     /* committed body does not have the expected digest */
+
+int dfs_blob_commit(const char *store, const char *received, const char *path, const char *expect);
+int dfs_blob_link(const char *store, const char *hex, const char *path);
+int dfs_blob_release(const char *store, const char *path);
+int dfs_blob_digest(const char *path, char hex[DFS_SHA256_HEX_LEN + 1]);
+
+#endif
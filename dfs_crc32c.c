@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/xattr.h>
+
+#include "dfs_crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u   /* reflected Castagnoli polynomial */
+#define CRC32C_LANE 8192          /* bytes per lane of the interleaved hardware loop */
+#define CRC32C_FILE_BUFFER (256 * 1024)
+
+static uint32_t crc_table[8][256];
+static uint32_t x2n_table[32];    /* x^(2^n) modulo the polynomial */
+static uint32_t lane_shift[2];    /* x^(8 * CRC32C_LANE) and x^(16 * CRC32C_LANE) */
+static int crc_hardware;
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+// Function to multiply two polynomials modulo the CRC polynomial, both in reflected bit order
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t product = 0;
+    while (m != 0) {
+        if (a & m) {
+            product ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// Function to compute x^(8 * len) modulo the polynomial, the operator that appends len zero bytes
+static uint32_t shift_operator(uint64_t len) {
+    uint32_t op = 1u << 31;   /* x^0 */
+    for (unsigned k = 3; len != 0; len >>= 1, k++) {
+        if (len & 1) {
+            op = multmodp(x2n_table[k & 31], op);
+        }
+    }
+    return op;
+}
+
+// Function to build the slicing-by-8 lookup tables and pick the hardware path when the CPU has one
+static void build_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            uint32_t prev = crc_table[slice - 1][i];
+            crc_table[slice][i] = (prev >> 8) ^ crc_table[0][prev & 0xFF];
+        }
+    }
+
+    x2n_table[0] = 1u << 30;   /* x^1 */
+    for (int n = 1; n < 32; n++) {
+        x2n_table[n] = multmodp(x2n_table[n - 1], x2n_table[n - 1]);
+    }
+    lane_shift[0] = shift_operator(CRC32C_LANE);
+    lane_shift[1] = shift_operator(2 * (uint64_t)CRC32C_LANE);
+
+#ifdef CRC32C_HAVE_SSE42
+    crc_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// Function to advance the raw CRC register with the SSE4.2 crc32 instruction. The instruction has a
+// three-cycle latency but issues every cycle, so long buffers run as three independent lanes that are
+// joined by shifting the first two over the bytes that follow them
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    while (len >= 3 * CRC32C_LANE) {
+        uint64_t a = crc, b = 0, c = 0;
+        const unsigned char *end = p + CRC32C_LANE;
+        do {
+            uint64_t wa, wb, wc;
+            memcpy(&wa, p, 8);
+            memcpy(&wb, p + CRC32C_LANE, 8);
+            memcpy(&wc, p + 2 * CRC32C_LANE, 8);
+            a = _mm_crc32_u64(a, wa);
+            b = _mm_crc32_u64(b, wb);
+            c = _mm_crc32_u64(c, wc);
+            p += 8;
+        } while (p < end);
+        crc = multmodp(lane_shift[1], (uint32_t)a) ^ multmodp(lane_shift[0], (uint32_t)b) ^ (uint32_t)c;
+        p += 2 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+    uint64_t wide = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        wide = _mm_crc32_u64(wide, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)wide;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// Function to extend a CRC32C over another piece of the stream
+uint32_t dfs_crc32c(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    pthread_once(&crc_table_once, build_crc_table);
+    crc = ~crc;
+
+#ifdef CRC32C_HAVE_SSE42
+    if (crc_hardware) {
+        return ~crc32c_hardware(crc, p, len);
+    }
+#endif
+
+    // Eight bytes per step, assembled little-endian so the result is host independent
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return ~crc;
+}
+
+// Function to find the CRC32C of two pieces joined, given each piece's CRC and the second one's length
+uint32_t dfs_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    pthread_once(&crc_table_once, build_crc_table);
+    return multmodp(shift_operator(len2), crc1) ^ crc2;
+}
+
+// Function to compute the CRC32C of a whole file from its start (returns 0 on success)
+int dfs_crc32c_file(int fd, uint32_t *crc) {
+    unsigned char *buffer = malloc(CRC32C_FILE_BUFFER);
+    if (!buffer) {
+        return -1;
+    }
+    uint32_t sum = 0;
+    off_t offset = 0;
+    int result = 0;
+    while (1) {
+        ssize_t bytes_read = pread(fd, buffer, CRC32C_FILE_BUFFER, offset);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            result = bytes_read < 0 ? -1 : 0;
+            break;
+        }
+        sum = dfs_crc32c(sum, buffer, bytes_read);
+        offset += bytes_read;
+    }
+    free(buffer);
+    if (result == 0) {
+        *crc = sum;
+    }
+    return result;
+}
+
+// Function to read the CRC32C stored with a file (returns -1 when none was stored)
+int dfs_crc32c_get_attr(int fd, uint32_t *crc) {
+    char text[DFS_CRC32C_HEX_LEN + 1];
+    ssize_t len = fgetxattr(fd, DFS_CRC32C_XATTR, text, DFS_CRC32C_HEX_LEN);
+    if (len != DFS_CRC32C_HEX_LEN) {
+        return -1;
+    }
+    text[len] = '\0';
+    char *end;
+    unsigned long value = strtoul(text, &end, 16);
+    if (*end != '\0') {
+        return -1;
+    }
+    *crc = (uint32_t)value;
+    return 0;
+}
+
+// Function to store a file's CRC32C alongside it; best effort, a file without one is hashed when sent
+void dfs_crc32c_set_attr(int fd, uint32_t crc) {
+    char text[DFS_CRC32C_HEX_LEN + 1];
+    snprintf(text, sizeof(text), "%08x", crc);
+    fsetxattr(fd, DFS_CRC32C_XATTR, text, DFS_CRC32C_HEX_LEN, 0);
+}
@@ -0,0 +1,31 @@
+#ifndef DFS_CRC32C_H
+#define DFS_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC32C (Castagnoli), the checksum carried in downltar trailers and in the
+ * CHECKSUM frame that follows every uploadf/downlf body.
+ *
+ * Calls chain: start from 0 and feed each piece of the stream in order,
+ * passing the previous result back in as crc. On x86-64 CPUs with SSE4.2 the
+ * crc32 instruction is used (picked at run time); elsewhere a slicing-by-8
+ * table does the work. dfs_crc32c_combine() joins the CRCs of two adjacent
+ * pieces without touching their bytes.
+ *
+ * Servers keep the CRC of a stored file in its DFS_CRC32C_XATTR extended
+ * attribute as 8 lowercase hex digits, so a whole file can be sent with a
+ * checksum that was computed once when it arrived.
+ */
+
+#define DFS_CRC32C_XATTR "user.dfs.crc32c"
+#define DFS_CRC32C_HEX_LEN 8
+
+uint32_t dfs_crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t dfs_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+int dfs_crc32c_file(int fd, uint32_t *crc);
+int dfs_crc32c_get_attr(int fd, uint32_t *crc);
+void dfs_crc32c_set_attr(int fd, uint32_t crc);
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "dfs_deflate.h"
+#include "dfs_crc32c.h"
+
+#define DEFLATE_READ_BUFFER (64 * 1024)
+
+// Function to decide whether a file's type is worth compressing on the wire
+int dfs_deflate_worthwhile(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    return !dot || (strcmp(dot + 1, "pdf") != 0 && strcmp(dot + 1, "zip") != 0);
+}
+
+// Function to read a "z=<level>" offer (other words may follow); returns the level, or 0 when
+// the word is not a valid offer
+int dfs_deflate_parse_offer(const char *word) {
+    int level;
+    char extra;
+    int matched = sscanf(word, "z=%d%c", &level, &extra);
+    if (matched < 1 || (matched == 2 && extra != ' ') || level < 1 || level > 9) {
+        return 0;
+    }
+    return level;
+}
+
+// Function to send len bytes of a file from its current offset as a compressed run of DATA frames,
+// closed by the CHECKSUM frame of the uncompressed bytes
+int dfs_send_file_deflate(int sock, uint8_t opcode, uint32_t request_id, int fd, uint64_t len, int level) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit(&strm, level) != Z_OK) {
+        return -1;
+    }
+    unsigned char *input = malloc(DEFLATE_READ_BUFFER);
+    unsigned char *output = malloc(DFS_DEFLATE_CHUNK);
+    int result = input && output ? 0 : -1;
+    uint32_t crc = 0;
+
+    // A frame leaves whenever the output buffer fills; the rest goes in the final frame
+    int flush = Z_NO_FLUSH;
+    strm.next_out = output;
+    strm.avail_out = DFS_DEFLATE_CHUNK;
+    while (result == 0) {
+        if (strm.avail_in == 0 && flush == Z_NO_FLUSH) {
+            size_t want = len < DEFLATE_READ_BUFFER ? len : DEFLATE_READ_BUFFER;
+            ssize_t bytes_read = want > 0 ? read(fd, input, want) : 0;
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read < 0) {
+                result = -1;
+                break;
+            }
+            crc = dfs_crc32c(crc, input, bytes_read);
+            strm.next_in = input;
+            strm.avail_in = bytes_read;
+            len -= bytes_read;
+            flush = bytes_read == 0 ? Z_FINISH : Z_NO_FLUSH;
+        }
+        int rc = deflate(&strm, flush);
+        if (rc == Z_STREAM_ERROR) {
+            result = -1;
+            break;
+        }
+        if (rc == Z_STREAM_END || strm.avail_out == 0) {
+            size_t produced = DFS_DEFLATE_CHUNK - strm.avail_out;
+            uint16_t status = rc == Z_STREAM_END ? DFS_STATUS_OK : DFS_STATUS_READY;
+            if (dfs_send_header_flags(sock, opcode, status, request_id, DFS_FLAG_DEFLATE, produced) != 0 ||
+                (produced > 0 && dfs_send_all(sock, output, produced) != 0)) {
+                result = -1;
+                break;
+            }
+            if (rc == Z_STREAM_END) {
+                break;
+            }
+            strm.next_out = output;
+            strm.avail_out = DFS_DEFLATE_CHUNK;
+        }
+    }
+
+    if (result == 0 && dfs_send_checksum(sock, request_id, crc) != 0) {
+        result = -1;
+    }
+    deflateEnd(&strm);
+    free(input);
+    free(output);
+    return result;
+}
+
+// Function to inflate a compressed run of DATA frames into a file; first is the header already read.
+// A body that cannot be stored (or fp NULL) is still read to its CHECKSUM frame so the connection stays
+// in sync. Returns DFS_CHECKSUM_MISMATCH when the inflated bytes do not match it
+int dfs_recv_deflate_to_file(int sock, const DfsHeader *first, FILE *fp) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    int inflating = inflateInit(&strm) == Z_OK;
+    unsigned char *input = malloc(DEFLATE_READ_BUFFER);
+    unsigned char *output = malloc(DEFLATE_READ_BUFFER);
+    int result = fp && inflating && input && output ? 0 : -1;
+    int ended = 0;
+    int in_sync = 0;
+    uint32_t crc = 0;
+
+    DfsHeader frame = *first;
+    while (1) {
+        if (result != 0) {
+            if (dfs_discard(sock, frame.payload_len) != 0) {
+                break;
+            }
+        }
+        uint64_t remaining = result == 0 ? frame.payload_len : 0;
+        while (remaining > 0) {
+            size_t want = remaining < DEFLATE_READ_BUFFER ? remaining : DEFLATE_READ_BUFFER;
+            if (dfs_recv_all(sock, input, want) != 0) {
+                result = -1;
+                break;
+            }
+            remaining -= want;
+            if (result != 0 || ended) {
+                continue;
+            }
+
+            // Inflate until the piece is used up; a full output buffer means more is pending
+            strm.next_in = input;
+            strm.avail_in = want;
+            do {
+                strm.next_out = output;
+                strm.avail_out = DEFLATE_READ_BUFFER;
+                int rc = inflate(&strm, Z_NO_FLUSH);
+                if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                    result = -1;
+                    break;
+                }
+                size_t len = DEFLATE_READ_BUFFER - strm.avail_out;
+                crc = dfs_crc32c(crc, output, len);
+                if (len > 0 && fwrite(output, 1, len, fp) != len) {
+                    result = -1;
+                    break;
+                }
+                ended = rc == Z_STREAM_END;
+            } while (!ended && strm.avail_out == 0);
+        }
+        if (remaining > 0) {
+            break;   // connection lost mid-frame
+        }
+
+        if (frame.status == DFS_STATUS_OK) {
+            if (!ended) {
+                result = -1;   // truncated or corrupt stream
+            }
+            in_sync = 1;
+            break;
+        }
+        if (dfs_recv_header(sock, &frame) != 0 || frame.opcode != DFS_OP_DATA ||
+            !(frame.flags & DFS_FLAG_DEFLATE)) {
+            result = -1;
+            break;
+        }
+    }
+
+    uint32_t expected;
+    if (!in_sync || dfs_recv_checksum(sock, &expected) != 0) {
+        result = -1;
+    } else if (result == 0 && crc != expected) {
+        result = DFS_CHECKSUM_MISMATCH;
+    }
+
+    if (inflating) {
+        inflateEnd(&strm);
+    }
+    free(input);
+    free(output);
+    return result;
+}
+
+// Function to pass a compressed run of DATA frames on untouched under another request ID; the CHECKSUM
+// frame that follows is the caller's to relay (returns DFS_RELAY_SINK_FAILED if only the destination broke and the source was drained)
+int dfs_relay_deflate(int from_sock, int to_sock, const DfsHeader *first, uint32_t request_id) {
+    DfsHeader frame = *first;
+    int sink_failed = 0;
+    while (1) {
+        if (!sink_failed && dfs_send_header_flags(to_sock, DFS_OP_DATA, frame.status, request_id, frame.flags,
+                                                  frame.payload_len) != 0) {
+            sink_failed = 1;
+        }
+        if (sink_failed) {
+            if (dfs_discard(from_sock, frame.payload_len) != 0) {
+                return -1;
+            }
+        } else {
+            int relayed = dfs_relay(from_sock, to_sock, frame.payload_len);
+            if (relayed == DFS_RELAY_SINK_FAILED) {
+                sink_failed = 1;
+            } else if (relayed != 0) {
+                return -1;
+            }
+        }
+
+        if (frame.status == DFS_STATUS_OK) {
+            return sink_failed ? DFS_RELAY_SINK_FAILED : 0;
+        }
+        if (dfs_recv_header(from_sock, &frame) != 0 || frame.opcode != DFS_OP_DATA ||
+            !(frame.flags & DFS_FLAG_DEFLATE)) {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef DFS_DEFLATE_H
+#define DFS_DEFLATE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "dfs_protocol.h"
+
+/*
+ * Negotiated compression of uploadf/downlf bodies between w25clients, S1
+ * and S3.
+ *
+ * The side that will receive a body offers a zlib level with a "z=<level>"
+ * word on the command; the sender decides. A compressed body is a run of
+ * DATA frames flagged DFS_FLAG_DEFLATE, status READY for each piece of the
+ * zlib stream and OK for the last, instead of the single raw DATA frame.
+ * The CHECKSUM frame after the run covers the uncompressed bytes.
+ * S1 relays such frames as they are and only inflates bodies it stores
+ * itself, so the bytes are compressed once at the edge. Bodies of types
+ * that are compressed already (.pdf, .zip) are always sent raw.
+ */
+
+#define DFS_DEFLATE_FAST 1                 /* low latency: cheap enough to keep up with the link */
+#define DFS_DEFLATE_RATIO 9                /* smallest transfer for slow links */
+#define DFS_DEFLATE_CHUNK (256 * 1024)     /* compressed bytes per frame */
+
+int dfs_deflate_worthwhile(const char *filename);
+int dfs_deflate_parse_offer(const char *word);
+int dfs_send_file_deflate(int sock, uint8_t opcode, uint32_t request_id, int fd, uint64_t len, int level);
+int dfs_recv_deflate_to_file(int sock, const DfsHeader *first, FILE *fp);
+int dfs_relay_deflate(int from_sock, int to_sock, const DfsHeader *first, uint32_t request_id);
+
+#endif
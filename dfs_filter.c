@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "dfs_filter.h"
+#include "dfs_index.h"
+#include "dfs_protocol.h"
+
+#define FILTER_KEY_MAX 1024
+#define FILTER_FRAME_SIZE (64 * 1024)
+#define FILTER_PAIR_SIZE 5                /* index(4) value or delta(1) */
+#define FILTER_PAIRS_PER_FRAME ((FILTER_FRAME_SIZE - 1) / FILTER_PAIR_SIZE)
+#define FILTER_WAIT_SECONDS 1             /* how often a quiet WATCH sends an empty change frame */
+
+_Static_assert((DFS_FILTER_COUNTERS & (DFS_FILTER_COUNTERS - 1)) == 0, "counters must be a power of two");
+_Static_assert((DFS_FILTER_RECENT_BITS & (DFS_FILTER_RECENT_BITS - 1)) == 0, "recent bits must be a power of two");
+
+// Function to hash a key into the two halves double hashing steps with
+static void key_hashes(const char *key, uint32_t *h1, uint32_t *h2) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+
+    // FNV-1a's low bits are weak on short keys, so mix before splitting
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    *h1 = (uint32_t)h;
+    *h2 = (uint32_t)(h >> 32) | 1;   // Odd, so the k positions are distinct
+}
+
+// Function to find a key's positions in a table of size mask + 1
+static void key_positions(const char *key, uint32_t mask, uint32_t *positions) {
+    uint32_t h1, h2;
+    key_hashes(key, &h1, &h2);
+    for (int i = 0; i < DFS_FILTER_HASHES; i++) {
+        positions[i] = (h1 + (uint32_t)i * h2) & mask;
+    }
+}
+
+// Function to find a path's positions in a table of size mask + 1 (returns -1 if it has no key)
+static int path_positions(const char *base, const char *path, uint32_t mask, uint32_t *positions) {
+    char key[FILTER_KEY_MAX];
+    if (dfs_index_relative(base, path, key, sizeof(key)) != 0) {
+        return -1;
+    }
+    key_positions(key, mask, positions);
+    return 0;
+}
+
+// Function to map a zeroed filter that forked processes share
+DfsFilter *dfs_filter_create(void) {
+    DfsFilter *filter = mmap(NULL, sizeof(DfsFilter), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (filter == MAP_FAILED) {
+        return NULL;
+    }
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&filter->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&filter->changed, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    return filter;
+}
+
+// Function to step the counters of a key's positions, logging each change (caller holds the lock)
+static void change_counters(DfsFilter *filter, const uint32_t *positions, int delta) {
+    int changed = 0;
+    for (int i = 0; i < DFS_FILTER_HASHES; i++) {
+        uint8_t *counter = &filter->counters[positions[i]];
+
+        // A saturated counter no longer knows how many keys share it, so it stays put
+        if (*counter == UINT8_MAX || (delta < 0 && *counter == 0)) {
+            continue;
+        }
+        *counter += delta;
+        filter->log_index[filter->generation % DFS_FILTER_LOG] = positions[i];
+        filter->log_delta[filter->generation % DFS_FILTER_LOG] = (int8_t)delta;
+        filter->generation++;
+        changed = 1;
+    }
+    if (changed) {
+        pthread_cond_broadcast(&filter->changed);
+    }
+}
+
+// Function to count a newly stored file
+void dfs_filter_add(DfsFilter *filter, const char *base, const char *path) {
+    uint32_t positions[DFS_FILTER_HASHES];
+    if (!filter || path_positions(base, path, DFS_FILTER_COUNTERS - 1, positions) != 0) {
+        return;
+    }
+    pthread_mutex_lock(&filter->lock);
+    change_counters(filter, positions, 1);
+    pthread_mutex_unlock(&filter->lock);
+}
+
+// Function to take a removed file out of the filter
+void dfs_filter_remove(DfsFilter *filter, const char *base, const char *path) {
+    uint32_t positions[DFS_FILTER_HASHES];
+    if (!filter || path_positions(base, path, DFS_FILTER_COUNTERS - 1, positions) != 0) {
+        return;
+    }
+    pthread_mutex_lock(&filter->lock);
+    change_counters(filter, positions, -1);
+    pthread_mutex_unlock(&filter->lock);
+}
+
+// Function to count one more key in a table of counters, saturating
+static void count_key(uint8_t *counters, uint32_t position) {
+    if (counters[position] < UINT8_MAX) {
+        counters[position]++;
+    }
+}
+
+// Function to count every file with an extension under base afresh and put the counts in place,
+// so files changed behind the server's back are caught up with (returns the number of files)
+int dfs_filter_load(DfsFilter *filter, const char *base, const char *extension) {
+    pthread_mutex_lock(&filter->lock);
+    uint64_t start = filter->generation;
+    pthread_mutex_unlock(&filter->lock);
+
+    DfsIndexBatch batch;
+    dfs_index_batch_init(&batch);
+    uint8_t *counters = calloc(DFS_FILTER_COUNTERS, 1);
+    if (!counters || dfs_index_scan(&batch, base, base, extension) != 0) {
+        free(counters);
+        dfs_index_batch_free(&batch);
+        return -1;
+    }
+    for (size_t i = 0; i < batch.count; i++) {
+        uint32_t positions[DFS_FILTER_HASHES];
+        key_positions(batch.text + batch.records[i].path, DFS_FILTER_COUNTERS - 1, positions);
+        for (int j = 0; j < DFS_FILTER_HASHES; j++) {
+            count_key(counters, positions[j]);
+        }
+    }
+
+    // Files stored while the tree was walked may have been missed, so their counts are added again;
+    // removals are left out, since a count taken twice only costs S1 a round trip
+    int result = -1;
+    pthread_mutex_lock(&filter->lock);
+    if (filter->generation - start <= DFS_FILTER_LOG) {
+        for (uint64_t change = start; change < filter->generation; change++) {
+            if (filter->log_delta[change % DFS_FILTER_LOG] > 0) {
+                count_key(counters, filter->log_index[change % DFS_FILTER_LOG]);
+            }
+        }
+        memcpy(filter->counters, counters, DFS_FILTER_COUNTERS);
+        filter->loads++;
+        filter->ready = 1;
+        pthread_cond_broadcast(&filter->changed);
+        result = batch.count;
+    }
+    pthread_mutex_unlock(&filter->lock);
+
+    free(counters);
+    dfs_index_batch_free(&batch);
+    return result;
+}
+
+// Function to write one index/value pair into a frame
+static void put_pair(unsigned char *frame, size_t pair, uint32_t index, uint8_t value) {
+    unsigned char *p = frame + 1 + pair * FILTER_PAIR_SIZE;
+    p[0] = (unsigned char)(index >> 24);
+    p[1] = (unsigned char)(index >> 16);
+    p[2] = (unsigned char)(index >> 8);
+    p[3] = (unsigned char)index;
+    p[4] = value;
+}
+
+// Function to send a filter frame of a kind with a number of pairs
+static int send_filter_frame(int sock, uint32_t request_id, unsigned char *frame, char kind, size_t pairs) {
+    frame[0] = (unsigned char)kind;
+    return dfs_send_frame(sock, DFS_OP_DATA, DFS_STATUS_READY, request_id, frame, 1 + pairs * FILTER_PAIR_SIZE);
+}
+
+// Function to send a copy of the counters as a reset, the nonzero counters and an end mark
+static int send_snapshot(int sock, uint32_t request_id, const uint8_t *counters, unsigned char *frame) {
+    if (send_filter_frame(sock, request_id, frame, 'R', 0) != 0) {
+        return -1;
+    }
+    size_t pairs = 0;
+    for (uint32_t i = 0; i < DFS_FILTER_COUNTERS; i++) {
+        if (counters[i] == 0) {
+            continue;
+        }
+        put_pair(frame, pairs++, i, counters[i]);
+        if (pairs == FILTER_PAIRS_PER_FRAME) {
+            if (send_filter_frame(sock, request_id, frame, 'S', pairs) != 0) {
+                return -1;
+            }
+            pairs = 0;
+        }
+    }
+    if (pairs > 0 && send_filter_frame(sock, request_id, frame, 'S', pairs) != 0) {
+        return -1;
+    }
+    return send_filter_frame(sock, request_id, frame, 'E', 0);
+}
+
+// Function to check whether the watcher hung up (it never sends on a WATCH connection)
+static int watcher_gone(int sock) {
+    struct pollfd pfd = {sock, POLLIN | POLLRDHUP, 0};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+// Function to answer WATCH: a snapshot, then every change until the watcher goes away
+int dfs_filter_serve(DfsFilter *filter, int sock, uint32_t request_id) {
+    uint8_t *copy = malloc(DFS_FILTER_COUNTERS);
+    unsigned char *frame = malloc(FILTER_FRAME_SIZE);
+    if (!copy || !frame) {
+        free(copy);
+        free(frame);
+        return -1;
+    }
+
+    int result = 0;
+    int need_snapshot = 1;
+    uint64_t sent = 0;
+    uint64_t loads = 0;
+    while (result == 0) {
+        if (need_snapshot) {
+            pthread_mutex_lock(&filter->lock);
+            memcpy(copy, filter->counters, DFS_FILTER_COUNTERS);
+            sent = filter->generation;
+            loads = filter->loads;
+            pthread_mutex_unlock(&filter->lock);
+            result = send_snapshot(sock, request_id, copy, frame);
+            need_snapshot = 0;
+            continue;
+        }
+
+        // Wait for changes, looking at the connection now and then while it is quiet
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += FILTER_WAIT_SECONDS;
+        size_t pairs = 0;
+        int waited = 0;
+        pthread_mutex_lock(&filter->lock);
+        while (filter->generation == sent && filter->loads == loads && waited != ETIMEDOUT) {
+            waited = pthread_cond_timedwait(&filter->changed, &filter->lock, &deadline);
+        }
+        if (filter->loads != loads || filter->generation - sent > DFS_FILTER_LOG) {
+            need_snapshot = 1;
+        } else {
+            while (sent < filter->generation && pairs < FILTER_PAIRS_PER_FRAME) {
+                put_pair(frame, pairs++, filter->log_index[sent % DFS_FILTER_LOG],
+                         (uint8_t)filter->log_delta[sent % DFS_FILTER_LOG]);
+                sent++;
+            }
+        }
+        pthread_mutex_unlock(&filter->lock);
+
+        // A quiet second still sends an empty change frame, so S1 can tell a backend that went away
+        if (pairs > 0 || waited == ETIMEDOUT) {
+            result = send_filter_frame(sock, request_id, frame, 'A', pairs);
+        }
+        if (result == 0 && watcher_gone(sock)) {
+            break;
+        }
+    }
+    free(copy);
+    free(frame);
+    return result;
+}
+
+// Function to keep a copy of a backend's filter in step with its WATCH connection (returns once it breaks)
+int dfs_filter_follow(DfsFilter *filter, int sock) {
+    unsigned char *frame = malloc(FILTER_FRAME_SIZE);
+    if (!frame) {
+        return -1;
+    }
+
+    // The backend sends something every second, so a longer silence means it is gone
+    struct timeval silence = {DFS_FILTER_SILENCE, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &silence, sizeof(silence));
+
+    while (1) {
+        DfsHeader header;
+        if (dfs_recv_header(sock, &header) != 0) {
+            break;
+        }
+        if (header.opcode != DFS_OP_DATA || header.status != DFS_STATUS_READY || header.payload_len < 1 ||
+            header.payload_len > FILTER_FRAME_SIZE || (header.payload_len - 1) % FILTER_PAIR_SIZE != 0) {
+            // The backend's reason it will not serve the filter
+            dfs_discard(sock, header.payload_len);
+            break;
+        }
+        if (dfs_recv_all(sock, frame, header.payload_len) != 0) {
+            break;
+        }
+
+        size_t pairs = (header.payload_len - 1) / FILTER_PAIR_SIZE;
+        pthread_mutex_lock(&filter->lock);
+        if (frame[0] == 'R') {
+            filter->ready = 0;
+            memset(filter->counters, 0, DFS_FILTER_COUNTERS);
+        } else if (frame[0] == 'E') {
+            filter->ready = 1;
+        }
+        for (size_t i = 0; i < pairs && (frame[0] == 'S' || frame[0] == 'A'); i++) {
+            const unsigned char *p = frame + 1 + i * FILTER_PAIR_SIZE;
+            uint32_t index = ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]) &
+                             (DFS_FILTER_COUNTERS - 1);
+            if (frame[0] == 'S') {
+                filter->counters[index] = p[4];
+            } else {
+                filter->counters[index] += (int8_t)p[4];
+            }
+        }
+        pthread_mutex_unlock(&filter->lock);
+    }
+
+    pthread_mutex_lock(&filter->lock);
+    filter->ready = 0;
+    pthread_mutex_unlock(&filter->lock);
+    free(frame);
+    return -1;
+}
+
+// Function to age the recent filter: a window's marks move to the older half, then drop (caller holds the lock)
+static void rotate_recent(DfsFilter *filter, time_t now) {
+    if (now - filter->recent_since < DFS_FILTER_RECENT_WINDOW) {
+        return;
+    }
+    if (now - filter->recent_since < 2 * DFS_FILTER_RECENT_WINDOW) {
+        memcpy(filter->recent[1], filter->recent[0], sizeof(filter->recent[0]));
+    } else {
+        memset(filter->recent[1], 0, sizeof(filter->recent[1]));
+    }
+    memset(filter->recent[0], 0, sizeof(filter->recent[0]));
+    filter->recent_since = now;
+}
+
+// Function to mark a path as just stored, until the backend's change has had time to arrive
+void dfs_filter_note(DfsFilter *filter, const char *base, const char *path) {
+    uint32_t positions[DFS_FILTER_HASHES];
+    if (!filter || path_positions(base, path, DFS_FILTER_RECENT_BITS - 1, positions) != 0) {
+        return;
+    }
+    pthread_mutex_lock(&filter->lock);
+    rotate_recent(filter, time(NULL));
+    for (int i = 0; i < DFS_FILTER_HASHES; i++) {
+        filter->recent[0][positions[i] / 64] |= 1ULL << (positions[i] % 64);
+    }
+    pthread_mutex_unlock(&filter->lock);
+}
+
+// Function to check whether a recent half has every bit of a key set
+static int recent_has(const uint64_t *bits, const uint32_t *positions) {
+    for (int i = 0; i < DFS_FILTER_HASHES; i++) {
+        if (!(bits[positions[i] / 64] & (1ULL << (positions[i] % 64)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to check a path against a backend's filter (1 if it may be held, 0 if it is not, -1 if the filter cannot tell)
+int dfs_filter_check(DfsFilter *filter, const char *base, const char *path) {
+    uint32_t positions[DFS_FILTER_HASHES];
+    uint32_t recent_positions[DFS_FILTER_HASHES];
+    if (!filter || path_positions(base, path, DFS_FILTER_COUNTERS - 1, positions) != 0 ||
+        path_positions(base, path, DFS_FILTER_RECENT_BITS - 1, recent_positions) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&filter->lock);
+    int result = -1;
+    if (filter->ready) {
+        result = 1;
+        for (int i = 0; i < DFS_FILTER_HASHES && result; i++) {
+            result = filter->counters[positions[i]] != 0;
+        }
+        if (!result) {
+            rotate_recent(filter, time(NULL));
+            result = recent_has(filter->recent[0], recent_positions) || recent_has(filter->recent[1], recent_positions);
+        }
+    }
+    pthread_mutex_unlock(&filter->lock);
+    return result;
+}
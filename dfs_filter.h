@@ -0,0 +1,71 @@
+#ifndef DFS_FILTER_H
+#define DFS_FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Presence filter: which paths a backend holds, for answering a miss at S1.
+ *
+ * Each backend keeps a counting Bloom filter of its stored files, keyed on
+ * the path relative to its base directory (normalized as dfs_index.h does,
+ * so S1 hashes the same key under its own base). A file stored for the
+ * first time adds its key; a removed file takes it out again. Counters are
+ * 8 bits and saturate: a counter that reached 255 is never decremented, so
+ * the filter may answer "maybe" for a missing file but never "missing" for
+ * one that is held. Every DFS_FILTER_RELOAD_INTERVAL seconds the backend
+ * counts its tree afresh, so files changed behind its back (or counted
+ * twice) are caught up with, and each watcher is sent a new snapshot.
+ *
+ * WATCH (S1 -> S2/S3/S4) keeps one connection per backend open. The backend
+ * answers with DATA frames of status READY whose first payload byte says
+ * what follows: 'R' clears S1's copy, 'S' sets counters from
+ * "<index u32><value u8>" pairs (network byte order), 'E' ends the
+ * snapshot, and 'A' then carries each later change as "<index u32><delta
+ * i8>" pairs, or none at all once a second while nothing changes. A
+ * watcher that falls more than DFS_FILTER_LOG changes behind is sent a
+ * fresh snapshot. S1's copy is only answered from between an 'E' and the
+ * loss of the connection, or DFS_FILTER_SILENCE seconds without a frame.
+ *
+ * A change reaches S1 a moment after the backend made it, so S1 also marks
+ * every upload it relays in a small "recent" filter, kept for
+ * DFS_FILTER_RECENT_WINDOW to 2 * DFS_FILTER_RECENT_WINDOW seconds; a path
+ * is only missing when both filters say so. The filter lives in
+ * MAP_SHARED memory so forked children of S1 and S4 see the same copy.
+ */
+
+#define DFS_FILTER_COUNTERS (1 << 23)     /* about 2% false positives at a million files */
+#define DFS_FILTER_HASHES 4
+#define DFS_FILTER_LOG (1 << 16)          /* counter changes kept for a watcher to catch up from */
+#define DFS_FILTER_RECENT_BITS (1 << 16)
+#define DFS_FILTER_RECENT_WINDOW 5        /* seconds */
+#define DFS_FILTER_RELOAD_INTERVAL 600    /* seconds between fresh counts of a backend's tree */
+#define DFS_FILTER_SILENCE 5              /* seconds a watcher waits for a frame before giving up */
+
+// A counting filter with its change log, in shared memory
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int ready;                            // Set once the counters describe every stored file
+    uint64_t generation;                  // Counter changes made so far
+    uint64_t loads;                       // Times the counters were taken afresh from the tree
+    uint32_t log_index[DFS_FILTER_LOG];   // Change n is at n % DFS_FILTER_LOG
+    int8_t log_delta[DFS_FILTER_LOG];
+    time_t recent_since;
+    uint64_t recent[2][DFS_FILTER_RECENT_BITS / 64];
+    uint8_t counters[DFS_FILTER_COUNTERS];
+} DfsFilter;
+
+DfsFilter *dfs_filter_create(void);
+int dfs_filter_load(DfsFilter *filter, const char *base, const char *extension);
+void dfs_filter_add(DfsFilter *filter, const char *base, const char *path);
+void dfs_filter_remove(DfsFilter *filter, const char *base, const char *path);
+int dfs_filter_serve(DfsFilter *filter, int sock, uint32_t request_id);
+
+int dfs_filter_follow(DfsFilter *filter, int sock);
+void dfs_filter_note(DfsFilter *filter, const char *base, const char *path);
+int dfs_filter_check(DfsFilter *filter, const char *base, const char *path);
+
+#endif
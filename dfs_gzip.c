@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "dfs_gzip.h"
+#include "dfs_protocol.h"
+#include "dfs_crc32c.h"
+
+#define GZIP_WINDOW 32768                      /* deflate history carried from block to block */
+#define GZIP_TRAILER_MAX (64 * 1024 * 1024)    /* largest input trailer (size line plus deletions) */
+
+// Lifecycle of one block slot
+#define BLOCK_FREE   0
+#define BLOCK_FILLED 1
+#define BLOCK_DONE   2
+#define BLOCK_FAILED 3
+
+// One block of the archive and its compressed form
+typedef struct {
+    unsigned char *input;
+    size_t input_len;
+    unsigned char *dict;       /* last GZIP_WINDOW bytes of the block before */
+    size_t dict_len;
+    unsigned char *output;
+    size_t output_len;
+    size_t output_capacity;
+    uint32_t crc;              /* gzip CRC-32 of the input */
+    int state;
+} GzipBlock;
+
+// Blocks shared between the reading thread and the compressing threads
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;     /* a block is waiting to be compressed, or input ended */
+    pthread_cond_t done;       /* a block finished compressing */
+    GzipBlock *blocks;
+    int slots;
+    uint64_t filled_count;     /* blocks handed to the compressing threads */
+    uint64_t taken_count;      /* blocks a thread has started on */
+    int finished;
+    int level;
+} GzipPool;
+
+// Uncompressed archive arriving from the producer
+typedef struct {
+    int sock;
+    DfsHeader header;          /* current frame; the final one once ended is set */
+    uint64_t remaining;        /* payload of the current READY frame still unread */
+    uint64_t total;
+    uint32_t crc;
+    int ended;
+} GzipInput;
+
+// Compressed archive leaving for the client
+typedef struct {
+    int sock;
+    uint32_t request_id;
+    uint64_t total;
+    uint32_t crc;
+    int started;               /* gzip header already sent */
+} GzipOutput;
+
+// Function to deflate one block into its output buffer, ending on a byte boundary
+static int compress_block(z_stream *strm, GzipBlock *block) {
+    if (deflateReset(strm) != Z_OK ||
+        (block->dict_len > 0 && deflateSetDictionary(strm, block->dict, block->dict_len) != Z_OK)) {
+        return -1;
+    }
+    block->crc = crc32(0L, block->input, block->input_len);
+    block->output_len = 0;
+    strm->next_in = block->input;
+    strm->avail_in = block->input_len;
+
+    // The sync flush is complete once deflate leaves output space unused
+    do {
+        if (block->output_len == block->output_capacity) {
+            size_t capacity = block->output_capacity * 2;
+            unsigned char *output = realloc(block->output, capacity);
+            if (!output) {
+                return -1;
+            }
+            block->output = output;
+            block->output_capacity = capacity;
+        }
+        strm->next_out = block->output + block->output_len;
+        strm->avail_out = block->output_capacity - block->output_len;
+        int rc = deflate(strm, Z_SYNC_FLUSH);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            return -1;
+        }
+        block->output_len = block->output_capacity - strm->avail_out;
+    } while (strm->avail_out == 0);
+    return 0;
+}
+
+// Thread function compressing filled blocks in the order they were filled
+static void *gzip_worker(void *arg) {
+    GzipPool *pool = arg;
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    int ready = deflateInit2(&strm, pool->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->finished && pool->taken_count == pool->filled_count) {
+            pthread_cond_wait(&pool->filled, &pool->lock);
+        }
+        if (pool->taken_count == pool->filled_count) {
+            break;
+        }
+        GzipBlock *block = &pool->blocks[pool->taken_count++ % pool->slots];
+        pthread_mutex_unlock(&pool->lock);
+
+        int compressed = ready && compress_block(&strm, block) == 0;
+
+        pthread_mutex_lock(&pool->lock);
+        block->state = compressed ? BLOCK_DONE : BLOCK_FAILED;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (ready) {
+        deflateEnd(&strm);
+    }
+    return NULL;
+}
+
+// Function to read archive bytes until buf is full or the final frame arrives
+static int input_read(GzipInput *in, unsigned char *buf, size_t capacity, size_t *got) {
+    *got = 0;
+    while (*got < capacity && !in->ended) {
+        if (in->remaining == 0) {
+            if (dfs_recv_header(in->sock, &in->header) != 0) {
+                return -1;
+            }
+            if (in->header.opcode != DFS_OP_DATA || in->header.status != DFS_STATUS_READY) {
+                in->ended = 1;
+                break;
+            }
+            in->remaining = in->header.payload_len;
+            continue;
+        }
+        size_t want = capacity - *got < in->remaining ? capacity - *got : in->remaining;
+        if (dfs_recv_all(in->sock, buf + *got, want) != 0) {
+            return -1;
+        }
+        in->crc = dfs_crc32c(in->crc, buf + *got, want);
+        in->total += want;
+        in->remaining -= want;
+        *got += want;
+    }
+    return 0;
+}
+
+// Function to send compressed bytes as one READY chunk, led by the gzip header the first time
+static int output_send(GzipOutput *out, const unsigned char *data, size_t len) {
+    static const unsigned char gzip_header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    size_t head_len = out->started ? 0 : sizeof(gzip_header);
+    if (dfs_send_header(out->sock, DFS_OP_DATA, DFS_STATUS_READY, out->request_id, head_len + len) != 0 ||
+        (head_len > 0 && dfs_send_all(out->sock, gzip_header, head_len) != 0) ||
+        (len > 0 && dfs_send_all(out->sock, data, len) != 0)) {
+        return -1;
+    }
+    out->crc = dfs_crc32c(dfs_crc32c(out->crc, gzip_header, head_len), data, len);
+    out->total += head_len + len;
+    out->started = 1;
+    return 0;
+}
+
+// Function to wait for a block to be compressed and send it, folding it into the gzip CRC and size
+static int emit_block(GzipPool *pool, GzipOutput *out, uint64_t seq, uLong *gzip_crc, uint64_t *gzip_size) {
+    GzipBlock *block = &pool->blocks[seq % pool->slots];
+    pthread_mutex_lock(&pool->lock);
+    while (block->state == BLOCK_FILLED) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    int state = block->state;
+    pthread_mutex_unlock(&pool->lock);
+    if (state != BLOCK_DONE) {
+        return -1;
+    }
+
+    *gzip_crc = crc32_combine(*gzip_crc, block->crc, block->input_len);
+    *gzip_size += block->input_len;
+    block->state = BLOCK_FREE;
+    return output_send(out, block->output, block->output_len);
+}
+
+// Function to pass the producer's final frame to the client untouched
+static int forward_final(GzipInput *in, int to_sock) {
+    if (dfs_send_header(to_sock, in->header.opcode, in->header.status, in->header.request_id,
+                        in->header.payload_len) != 0) {
+        return -1;
+    }
+    return dfs_relay(in->sock, to_sock, in->header.payload_len) == 0 ? 0 : -1;
+}
+
+// Function to close the gzip member and send the trailer for the compressed bytes
+static int finish_archive(GzipInput *in, GzipOutput *out, uLong gzip_crc, uint64_t gzip_size) {
+    // The input trailer must describe exactly what was compressed
+    char *trailer = in->header.payload_len <= GZIP_TRAILER_MAX ? malloc(in->header.payload_len + 1) : NULL;
+    unsigned long long expected_size;
+    unsigned int expected_crc;
+    if (!trailer || dfs_recv_all(in->sock, trailer, in->header.payload_len) != 0) {
+        free(trailer);
+        return -1;
+    }
+    trailer[in->header.payload_len] = '\0';
+    if (sscanf(trailer, "%llu %x", &expected_size, &expected_crc) != 2 ||
+        expected_size != in->total || expected_crc != in->crc) {
+        free(trailer);
+        dfs_send_message(out->sock, DFS_OP_DOWNLTAR, DFS_STATUS_ERROR, out->request_id, "TAR_CREATION_FAILED");
+        return -1;
+    }
+
+    // An empty final block, then CRC-32 and length of the uncompressed archive, little-endian
+    unsigned char tail[10] = {0x03, 0x00};
+    for (int i = 0; i < 4; i++) {
+        tail[2 + i] = (gzip_crc >> (8 * i)) & 0xFF;
+        tail[6 + i] = (gzip_size >> (8 * i)) & 0xFF;
+    }
+    if (output_send(out, tail, sizeof(tail)) != 0) {
+        free(trailer);
+        return -1;
+    }
+
+    // Deleted member names carry over after the new size line
+    char summary[64];
+    const char *deletions = strchr(trailer, '\n');
+    deletions = deletions ? deletions + 1 : "";
+    snprintf(summary, sizeof(summary), "%llu %08x gzip\n", (unsigned long long)out->total, out->crc);
+    size_t summary_len = strlen(summary);
+    size_t deletions_len = strlen(deletions);
+    int result = dfs_send_header(out->sock, DFS_OP_DATA, DFS_STATUS_OK, out->request_id,
+                                 summary_len + deletions_len);
+    if (result == 0) {
+        result = dfs_send_all(out->sock, summary, summary_len);
+    }
+    if (result == 0 && deletions_len > 0) {
+        result = dfs_send_all(out->sock, deletions, deletions_len);
+    }
+    free(trailer);
+    return result;
+}
+
+// Function to gzip a chunked archive from one socket onto another; returns 0 once the compressed
+// archive and its trailer are sent, 1 if the producer's verdict (NO_FILES, ...) was passed on instead
+int dfs_gzip_archive(int from_sock, int to_sock, int level) {
+    GzipInput in = {from_sock, {0}, 0, 0, 0, 0};
+    GzipOutput out = {to_sock, 0, 0, 0, 0};
+
+    // Nothing is compressed unless an archive actually starts
+    if (dfs_recv_header(from_sock, &in.header) != 0) {
+        return -1;
+    }
+    if (in.header.opcode != DFS_OP_DATA || in.header.status != DFS_STATUS_READY) {
+        return forward_final(&in, to_sock) == 0 ? 1 : -1;
+    }
+    in.remaining = in.header.payload_len;
+    out.request_id = in.header.request_id;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cores < 1 ? 1 : (cores > DFS_GZIP_MAX_THREADS ? DFS_GZIP_MAX_THREADS : (int)cores);
+    GzipPool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                     NULL, thread_count * DFS_GZIP_SLOTS_PER_THREAD, 0, 0, 0, level};
+    if (pool.slots < 2) {
+        pool.slots = 2;   // a block's dictionary comes from the slot before it
+    }
+    int result = 0;
+    pool.blocks = calloc(pool.slots, sizeof(GzipBlock));
+    for (int i = 0; pool.blocks && i < pool.slots; i++) {
+        GzipBlock *block = &pool.blocks[i];
+        block->input = malloc(DFS_GZIP_BLOCK_SIZE);
+        block->dict = malloc(GZIP_WINDOW);
+        block->output_capacity = compressBound(DFS_GZIP_BLOCK_SIZE) + 64;
+        block->output = malloc(block->output_capacity);
+        if (!block->input || !block->dict || !block->output) {
+            result = -1;
+        }
+    }
+    if (!pool.blocks) {
+        result = -1;
+    }
+
+    pthread_t threads[DFS_GZIP_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; result == 0 && i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, gzip_worker, &pool) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        result = -1;
+    }
+
+    // Fill blocks in order; a slot is reused only after the block it held has been sent
+    uint64_t filled = 0;
+    uint64_t emitted = 0;
+    uLong gzip_crc = crc32(0L, Z_NULL, 0);
+    uint64_t gzip_size = 0;
+    while (result == 0 && !in.ended) {
+        if (filled >= (uint64_t)pool.slots) {
+            result = emit_block(&pool, &out, emitted++, &gzip_crc, &gzip_size);
+        }
+        GzipBlock *block = &pool.blocks[filled % pool.slots];
+        size_t got = 0;
+        if (result == 0) {
+            result = input_read(&in, block->input, DFS_GZIP_BLOCK_SIZE, &got);
+        }
+        if (result != 0 || got == 0) {
+            break;
+        }
+        block->input_len = got;
+        block->dict_len = 0;
+        if (filled > 0) {
+            GzipBlock *prev = &pool.blocks[(filled - 1) % pool.slots];
+            block->dict_len = prev->input_len < GZIP_WINDOW ? prev->input_len : GZIP_WINDOW;
+            memcpy(block->dict, prev->input + prev->input_len - block->dict_len, block->dict_len);
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        block->state = BLOCK_FILLED;
+        pool.filled_count = ++filled;
+        pthread_cond_signal(&pool.filled);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.finished = 1;
+    pthread_cond_broadcast(&pool.filled);
+    pthread_mutex_unlock(&pool.lock);
+    while (result == 0 && emitted < filled) {
+        result = emit_block(&pool, &out, emitted++, &gzip_crc, &gzip_size);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (result == 0) {
+        if (in.header.opcode == DFS_OP_DATA && in.header.status == DFS_STATUS_OK) {
+            result = finish_archive(&in, &out, gzip_crc, gzip_size);
+        } else {
+            // The archive broke off; its reason goes to the client in place of a trailer
+            forward_final(&in, to_sock);
+            result = -1;
+        }
+    } else {
+        dfs_send_message(to_sock, DFS_OP_DOWNLTAR, DFS_STATUS_ERROR, out.request_id, "TAR_CREATION_FAILED");
+    }
+
+    for (int i = 0; pool.blocks && i < pool.slots; i++) {
+        free(pool.blocks[i].input);
+        free(pool.blocks[i].dict);
+        free(pool.blocks[i].output);
+    }
+    free(pool.blocks);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.filled);
+    pthread_cond_destroy(&pool.done);
+    return result;
+}
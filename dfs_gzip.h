@@ -0,0 +1,28 @@
+#ifndef DFS_GZIP_H
+#define DFS_GZIP_H
+
+/*
+ * Block-parallel gzip for downltar archives, used by S1 when the client
+ * asks for a compressed archive.
+ *
+ * dfs_gzip_archive() reads a chunked archive (READY frames, then the OK
+ * trailer) from one socket and writes the same archive gzipped to another.
+ * The input is cut into DFS_GZIP_BLOCK_SIZE blocks that a pool of threads
+ * deflates at once, each primed with the last 32 KiB of the block before
+ * it and ended with a sync flush, so the blocks concatenate into a single
+ * gzip member any gunzip reads. At most DFS_GZIP_SLOTS_PER_THREAD blocks
+ * per thread are held, and they are sent in order as soon as each is done.
+ *
+ * The input trailer is checked against the bytes read; the output trailer
+ * is "<compressed bytes> <crc32c hex> gzip" followed by the same deleted
+ * member names. Any other final frame (NO_FILES, errors) is passed through.
+ */
+
+#define DFS_GZIP_BLOCK_SIZE (128 * 1024)   /* uncompressed bytes per block */
+#define DFS_GZIP_MAX_THREADS 8
+#define DFS_GZIP_SLOTS_PER_THREAD 2       /* blocks in flight per compressing thread */
+#define DFS_GZIP_LEVEL 6
+
+int dfs_gzip_archive(int from_sock, int to_sock, int level);
+
+#endif
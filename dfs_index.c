@@ -0,0 +1,1225 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dfs_index.h"
+#include "dfs_protocol.h"
+#include "dfs_crc32c.h"
+
+#define INDEX_MAGIC 0x44465349u       /* "DFSI" */
+#define INDEX_VERSION 2
+#define INDEX_PATH_MAX 1024
+#define INDEX_SLOTS (DFS_INDEX_MAX_FILES * 2)   /* hash slots per table, so a table is at most half full */
+#define INDEX_NONE UINT32_MAX
+#define INVENTORY_FRAME_SIZE (64 * 1024)
+
+// Journal record kinds
+#define JOURNAL_PUT 'P'
+#define JOURNAL_REMOVE 'R'
+#define JOURNAL_DROP 'D'              /* the server's entries are no longer answered for */
+
+// Shared state, at the start of the mapping
+struct DfsIndexHeader {
+    pthread_rwlock_t lock;
+    uint32_t count;                   // Entries in use
+    uint32_t entry_top;               // Entries ever handed out; freed ones are chained from free_entry
+    uint32_t free_entry;
+    uint32_t dir_count;
+    uint32_t empty_dirs;              // Directories whose files were all removed
+    uint64_t heap_used;
+    uint64_t heap_garbage;            // Name bytes left behind by removed entries
+    uint8_t ready[DFS_INDEX_SERVERS + 1];
+    uint64_t epoch[DFS_INDEX_SERVERS + 1];   // Bumped by every upload or removal on the server
+    uint64_t sequence;                // Changes journaled so far
+    uint64_t saved;                   // Changes the snapshot on disk covers
+};
+
+// One indexed file, chained with the other files of its directory
+struct DfsIndexEntry {
+    uint32_t name;                    // Heap offset of the file name
+    uint32_t dir;
+    uint32_t hash;                    // Of directory, server and name, placing it in the slots
+    uint32_t next;                    // Next file of the directory, or the next free entry
+    uint32_t prev;
+    uint16_t name_len;
+    uint8_t server;                   // 0 while the entry is free
+    uint8_t has_crc;
+    uint32_t crc;
+    uint64_t size;
+    int64_t mtime;
+};
+
+// A directory with indexed files in it (or that had some before the last rebuild)
+struct DfsIndexDir {
+    uint32_t path;                    // Heap offset of the path relative to the base, "" at the top
+    uint32_t hash;
+    uint32_t first;                   // First file, or INDEX_NONE
+    uint16_t len;
+    uint16_t unused;
+};
+
+// Snapshot file: this header, count records, then the text their paths are in
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint64_t text_len;
+    uint64_t sequence;                // Journal records it already holds
+    uint8_t ready[DFS_INDEX_SERVERS + 1];
+    uint8_t unused[3];
+};
+
+struct SnapshotRecord {
+    uint64_t size;
+    int64_t mtime;
+    uint32_t crc;
+    uint32_t path;                    // Text offset of the path relative to the base
+    uint16_t path_len;
+    uint8_t server;
+    uint8_t has_crc;
+    uint32_t unused;
+};
+
+// Journal record, followed by path_len bytes of path relative to the base
+struct JournalRecord {
+    uint64_t sequence;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t crc;
+    uint16_t path_len;
+    uint8_t kind;
+    uint8_t server;
+    uint8_t has_crc;
+    uint8_t unused[7];
+};
+
+_Static_assert(sizeof(struct DfsIndexEntry) == 48, "index entries are meant to be 48 bytes");
+_Static_assert(sizeof(struct SnapshotRecord) == 32, "snapshot records are meant to be 32 bytes");
+_Static_assert((INDEX_SLOTS & (INDEX_SLOTS - 1)) == 0, "slot tables must be a power of two");
+
+// A path relative to the base, with "." and repeated slashes taken out
+typedef struct {
+    char path[INDEX_PATH_MAX];
+    size_t dir_len;
+    size_t len;
+} IndexKey;
+
+// Function to normalize a relative path into a key (returns -1 for ".." or a path too long)
+static int make_key(const char *relative, IndexKey *key) {
+    const char *p = relative;
+    size_t len = 0;
+    key->dir_len = 0;
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        const char *end = strchr(p, '/');
+        if (!end) {
+            end = p + strlen(p);
+        }
+        size_t part = end - p;
+        if (part == 2 && p[0] == '.' && p[1] == '.') {
+            return -1;
+        }
+        if (!(part == 1 && p[0] == '.')) {
+            if (len + part + 2 > sizeof(key->path)) {
+                return -1;
+            }
+            if (len > 0) {
+                key->dir_len = len;
+                key->path[len++] = '/';
+            }
+            memcpy(key->path + len, p, part);
+            len += part;
+        }
+        p = end;
+    }
+    key->path[len] = '\0';
+    key->len = len;
+    return 0;
+}
+
+// Function to build the key of an absolute path under S1's base directory
+static int make_path_key(const DfsIndex *index, const char *path, IndexKey *key) {
+    size_t base_len = strlen(index->base);
+    if (strncmp(path, index->base, base_len) != 0 || (path[base_len] != '\0' && path[base_len] != '/')) {
+        return -1;
+    }
+    return make_key(path + base_len, key);
+}
+
+// Function to normalize a path under base into the relative form the index keys on
+int dfs_index_relative(const char *base, const char *path, char *relative, size_t size) {
+    IndexKey key;
+    size_t base_len = strlen(base);
+    if (strncmp(path, base, base_len) != 0 || (path[base_len] != '\0' && path[base_len] != '/') ||
+        make_key(path + base_len, &key) != 0 || key.len == 0 || key.len >= size) {
+        return -1;
+    }
+    memcpy(relative, key.path, key.len + 1);
+    return 0;
+}
+
+// Function to find the name part of a key
+static const char *key_name(const IndexKey *key) {
+    return key->path + (key->dir_len > 0 ? key->dir_len + 1 : 0);
+}
+
+// Function to check that a server number names one of S1 to S4
+static int valid_server(int server) {
+    return server >= 1 && server <= DFS_INDEX_SERVERS;
+}
+
+// Function to continue a 64-bit FNV-1a hash over some bytes
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Function to hash a directory path
+static uint32_t dir_hash(const char *path, size_t len) {
+    uint64_t hash = hash_bytes(0xcbf29ce484222325ULL, path, len);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Function to hash a file of a server in a directory
+static uint32_t entry_hash(uint32_t dir, int server, const char *name, size_t len) {
+    uint8_t owner = server;
+    uint64_t hash = hash_bytes(0xcbf29ce484222325ULL, &dir, sizeof(dir));
+    hash = hash_bytes(hash, &owner, 1);
+    hash = hash_bytes(hash, name, len);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Function to copy an entry's details out
+static void fill_file(const struct DfsIndexEntry *entry, DfsIndexFile *file) {
+    file->size = entry->size;
+    file->mtime = entry->mtime;
+    file->crc = entry->crc;
+    file->has_crc = entry->has_crc;
+}
+
+// Function to find a directory (returns INDEX_NONE when it holds nothing)
+static uint32_t find_dir(const DfsIndex *index, const char *path, size_t len) {
+    uint32_t hash = dir_hash(path, len);
+    for (uint32_t slot = hash & (INDEX_SLOTS - 1); index->dir_slots[slot] != 0; slot = (slot + 1) & (INDEX_SLOTS - 1)) {
+        const struct DfsIndexDir *dir = &index->dirs[index->dir_slots[slot] - 1];
+        if (dir->hash == hash && dir->len == len && memcmp(index->heap + dir->path, path, len) == 0) {
+            return index->dir_slots[slot] - 1;
+        }
+    }
+    return INDEX_NONE;
+}
+
+// Function to find a file's entry, and the slot it is in (returns INDEX_NONE when it is not held)
+static uint32_t find_entry(const DfsIndex *index, uint32_t dir, int server, const char *name, size_t len,
+                           uint32_t *slot_found) {
+    uint32_t hash = entry_hash(dir, server, name, len);
+    uint32_t slot = hash & (INDEX_SLOTS - 1);
+    for (; index->slots[slot] != 0; slot = (slot + 1) & (INDEX_SLOTS - 1)) {
+        const struct DfsIndexEntry *entry = &index->entries[index->slots[slot] - 1];
+        if (entry->hash == hash && entry->dir == dir && entry->server == server && entry->name_len == len &&
+            memcmp(index->heap + entry->name, name, len) == 0) {
+            break;
+        }
+    }
+    if (slot_found) {
+        *slot_found = slot;
+    }
+    return index->slots[slot] != 0 ? index->slots[slot] - 1 : INDEX_NONE;
+}
+
+// Function to look a key up (caller holds the lock)
+static uint32_t find_key(const DfsIndex *index, const IndexKey *key, int server) {
+    uint32_t dir = find_dir(index, key->path, key->dir_len);
+    if (dir == INDEX_NONE) {
+        return INDEX_NONE;
+    }
+    const char *name = key_name(key);
+    return find_entry(index, dir, server, name, key->len - (name - key->path), NULL);
+}
+
+// Function to copy text into the heap (returns its offset, or INDEX_NONE when the heap is full)
+static uint32_t heap_add(DfsIndex *index, const char *text, size_t len) {
+    struct DfsIndexHeader *header = index->header;
+    if (header->heap_used + len + 1 > DFS_INDEX_HEAP_SIZE) {
+        return INDEX_NONE;
+    }
+    uint32_t offset = header->heap_used;
+    memcpy(index->heap + offset, text, len);
+    index->heap[offset + len] = '\0';
+    header->heap_used += len + 1;
+    return offset;
+}
+
+// Function to find a directory, adding it when it is new (returns INDEX_NONE when out of room)
+static uint32_t add_dir(DfsIndex *index, const char *path, size_t len) {
+    uint32_t found = find_dir(index, path, len);
+    if (found != INDEX_NONE || index->header->dir_count >= DFS_INDEX_MAX_FILES) {
+        return found;
+    }
+    uint32_t offset = heap_add(index, path, len);
+    if (offset == INDEX_NONE) {
+        return INDEX_NONE;
+    }
+
+    uint32_t dir = index->header->dir_count++;
+    index->header->empty_dirs++;
+    index->dirs[dir].path = offset;
+    index->dirs[dir].hash = dir_hash(path, len);
+    index->dirs[dir].first = INDEX_NONE;
+    index->dirs[dir].len = len;
+    index->dirs[dir].unused = 0;
+    uint32_t slot = index->dirs[dir].hash & (INDEX_SLOTS - 1);
+    while (index->dir_slots[slot] != 0) {
+        slot = (slot + 1) & (INDEX_SLOTS - 1);
+    }
+    index->dir_slots[slot] = dir + 1;
+    return dir;
+}
+
+// Function to record a file (caller holds the write lock; returns -1 when out of room)
+static int insert_key(DfsIndex *index, const IndexKey *key, int server, const DfsIndexFile *file) {
+    struct DfsIndexHeader *header = index->header;
+    uint32_t dir = add_dir(index, key->path, key->dir_len);
+    if (dir == INDEX_NONE) {
+        return -1;
+    }
+    const char *name = key_name(key);
+    size_t name_len = key->len - (name - key->path);
+    uint32_t slot;
+    uint32_t found = find_entry(index, dir, server, name, name_len, &slot);
+
+    // A new file takes a free entry and goes at the head of its directory's chain
+    if (found == INDEX_NONE) {
+        if (header->free_entry == INDEX_NONE && header->entry_top >= DFS_INDEX_MAX_FILES) {
+            return -1;
+        }
+        uint32_t offset = heap_add(index, name, name_len);
+        if (offset == INDEX_NONE) {
+            return -1;
+        }
+        if (header->free_entry != INDEX_NONE) {
+            found = header->free_entry;
+            header->free_entry = index->entries[found].next;
+        } else {
+            found = header->entry_top++;
+        }
+        struct DfsIndexEntry *entry = &index->entries[found];
+        entry->name = offset;
+        entry->name_len = name_len;
+        entry->dir = dir;
+        entry->hash = entry_hash(dir, server, name, name_len);
+        entry->server = server;
+        entry->prev = INDEX_NONE;
+        entry->next = index->dirs[dir].first;
+        if (entry->next != INDEX_NONE) {
+            index->entries[entry->next].prev = found;
+        } else {
+            header->empty_dirs--;
+        }
+        index->dirs[dir].first = found;
+        index->slots[slot] = found + 1;
+        header->count++;
+    }
+
+    struct DfsIndexEntry *entry = &index->entries[found];
+    entry->size = file->size;
+    entry->mtime = file->mtime;
+    entry->crc = file->has_crc ? file->crc : 0;
+    entry->has_crc = file->has_crc != 0;
+    return 0;
+}
+
+// Function to drop an entry (caller holds the write lock)
+static void delete_entry(DfsIndex *index, uint32_t found) {
+    struct DfsIndexHeader *header = index->header;
+    struct DfsIndexEntry *entry = &index->entries[found];
+
+    // Out of its directory's chain
+    if (entry->prev != INDEX_NONE) {
+        index->entries[entry->prev].next = entry->next;
+    } else {
+        index->dirs[entry->dir].first = entry->next;
+    }
+    if (entry->next != INDEX_NONE) {
+        index->entries[entry->next].prev = entry->prev;
+    } else if (entry->prev == INDEX_NONE) {
+        header->empty_dirs++;
+    }
+
+    // Out of the slots, moving later entries of the probe run back so none is cut off from its hash
+    uint32_t hole = entry->hash & (INDEX_SLOTS - 1);
+    while (index->slots[hole] != found + 1) {
+        hole = (hole + 1) & (INDEX_SLOTS - 1);
+    }
+    for (uint32_t slot = (hole + 1) & (INDEX_SLOTS - 1); index->slots[slot] != 0;
+         slot = (slot + 1) & (INDEX_SLOTS - 1)) {
+        uint32_t home = index->entries[index->slots[slot] - 1].hash & (INDEX_SLOTS - 1);
+        int stays = hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot);
+        if (!stays) {
+            index->slots[hole] = index->slots[slot];
+            hole = slot;
+        }
+    }
+    index->slots[hole] = 0;
+
+    header->heap_garbage += entry->name_len + 1;
+    entry->server = 0;
+    entry->next = header->free_entry;
+    header->free_entry = found;
+    header->count--;
+}
+
+// Function to write an entry's path relative to the base into a buffer (returns its length)
+static size_t entry_path(const DfsIndex *index, const struct DfsIndexEntry *entry, char *path) {
+    const struct DfsIndexDir *dir = &index->dirs[entry->dir];
+    size_t len = 0;
+    if (dir->len > 0) {
+        memcpy(path, index->heap + dir->path, dir->len);
+        path[dir->len] = '/';
+        len = dir->len + 1;
+    }
+    memcpy(path + len, index->heap + entry->name, entry->name_len);
+    len += entry->name_len;
+    path[len] = '\0';
+    return len;
+}
+
+// Function to count the bytes every entry's path takes written out whole, each with its terminator
+static size_t paths_size(const DfsIndex *index) {
+    size_t size = 1;
+    for (uint32_t i = 0; i < index->header->entry_top; i++) {
+        const struct DfsIndexEntry *entry = &index->entries[i];
+        if (entry->server != 0) {
+            size += index->dirs[entry->dir].len + 1 + entry->name_len + 1;
+        }
+    }
+    return size;
+}
+
+// Function to build the tables again from the entries in use, leaving out removed names and empty
+// directories (caller holds the write lock)
+static int rebuild_tables(DfsIndex *index) {
+    struct DfsIndexHeader *header = index->header;
+    size_t count = header->count;
+    struct SnapshotRecord *records = malloc((count > 0 ? count : 1) * sizeof(*records));
+    char *text = malloc(paths_size(index));
+    if (!records || !text) {
+        free(records);
+        free(text);
+        return -1;
+    }
+    size_t used = 0;
+    size_t kept = 0;
+    for (uint32_t i = 0; i < header->entry_top; i++) {
+        const struct DfsIndexEntry *entry = &index->entries[i];
+        if (entry->server == 0) {
+            continue;
+        }
+        struct SnapshotRecord *record = &records[kept++];
+        record->path = used;
+        record->path_len = entry_path(index, entry, text + used);
+        record->server = entry->server;
+        record->has_crc = entry->has_crc;
+        record->crc = entry->crc;
+        record->size = entry->size;
+        record->mtime = entry->mtime;
+        used += record->path_len + 1;
+    }
+
+    memset(index->slots, 0, INDEX_SLOTS * sizeof(uint32_t));
+    memset(index->dir_slots, 0, INDEX_SLOTS * sizeof(uint32_t));
+    header->count = 0;
+    header->entry_top = 0;
+    header->free_entry = INDEX_NONE;
+    header->dir_count = 0;
+    header->empty_dirs = 0;
+    header->heap_used = 0;
+    header->heap_garbage = 0;
+
+    // Everything fitted before, so everything fits again
+    IndexKey key;
+    for (size_t i = 0; i < kept; i++) {
+        DfsIndexFile file = {records[i].size, records[i].mtime, records[i].crc, records[i].has_crc};
+        make_key(text + records[i].path, &key);
+        insert_key(index, &key, records[i].server, &file);
+    }
+    free(records);
+    free(text);
+    return 0;
+}
+
+// Function to record a file, rebuilding the tables once if they ran out of room (caller holds the
+// write lock)
+static int put_key(DfsIndex *index, const IndexKey *key, int server, const DfsIndexFile *file) {
+    if (insert_key(index, key, server, file) == 0) {
+        return 0;
+    }
+
+    // Only worth it when a quarter of the heap or the directories comes back, so rebuilds stay rare
+    struct DfsIndexHeader *header = index->header;
+    int reclaimable = header->heap_garbage * 4 >= header->heap_used ||
+                      (uint64_t)header->empty_dirs * 4 >= header->dir_count;
+    if (!reclaimable || rebuild_tables(index) != 0) {
+        return -1;
+    }
+    return insert_key(index, key, server, file);
+}
+
+// Function to build the journal's file name, or the one it is moved to while a snapshot is written
+static void journal_path(const DfsIndex *index, int old, char *path, size_t size) {
+    snprintf(path, size, "%s.journal%s", index->snapshot, old ? ".old" : "");
+}
+
+// Function to append a change to the journal (caller holds the write lock; returns -1 if it could
+// not be written, and the change would be lost with a restart)
+static int journal_append(DfsIndex *index, int kind, int server, const IndexKey *key, const DfsIndexFile *file) {
+    char path[INDEX_PATH_MAX + 64];
+    struct {
+        struct JournalRecord record;
+        char path[INDEX_PATH_MAX];
+    } change;
+    memset(&change.record, 0, sizeof(change.record));
+    change.record.sequence = ++index->header->sequence;
+    change.record.kind = kind;
+    change.record.server = server;
+    if (key) {
+        change.record.path_len = key->len;
+        memcpy(change.path, key->path, key->len);
+    }
+    if (file) {
+        change.record.size = file->size;
+        change.record.mtime = file->mtime;
+        change.record.crc = file->has_crc ? file->crc : 0;
+        change.record.has_crc = file->has_crc != 0;
+    }
+
+    // Opened by name each time, so forked children follow the journal when it is rotated
+    size_t len = sizeof(change.record) + change.record.path_len;
+    journal_path(index, 0, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t written = write(fd, &change, len);
+    close(fd);
+    return written == (ssize_t)len ? 0 : -1;
+}
+
+// Function to apply one journal file's changes past the snapshot (used while the index is opened)
+static void replay_journal(DfsIndex *index, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return;
+    }
+    struct DfsIndexHeader *header = index->header;
+    struct JournalRecord record;
+    char text[INDEX_PATH_MAX];
+    IndexKey key;
+
+    // A record cut short by a crash ends the journal
+    while (fread(&record, sizeof(record), 1, fp) == 1 && record.path_len < sizeof(text) &&
+           fread(text, 1, record.path_len, fp) == record.path_len) {
+        if (record.sequence <= header->sequence || !valid_server(record.server)) {
+            continue;
+        }
+        header->sequence = record.sequence;
+        text[record.path_len] = '\0';
+        if (record.kind == JOURNAL_DROP || make_key(text, &key) != 0 || key.len == 0) {
+            header->ready[record.server] = 0;
+        } else if (record.kind == JOURNAL_PUT) {
+            DfsIndexFile file = {record.size, record.mtime, record.crc, record.has_crc};
+            if (put_key(index, &key, record.server, &file) != 0) {
+                header->ready[record.server] = 0;
+            }
+        } else {
+            uint32_t found = find_key(index, &key, record.server);
+            if (found != INDEX_NONE) {
+                delete_entry(index, found);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+// Function to load the last snapshot (used while the index is opened; a missing or foreign one is
+// simply not used)
+static void load_snapshot(DfsIndex *index) {
+    int fd = open(index->snapshot, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size < (off_t)sizeof(struct SnapshotHeader)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    const struct SnapshotHeader *saved = map;
+    const struct SnapshotRecord *records = (const void *)(saved + 1);
+    const char *text = (const char *)(records + saved->count);
+    if (saved->magic == INDEX_MAGIC && saved->version == INDEX_VERSION && saved->count <= DFS_INDEX_MAX_FILES &&
+        sizeof(*saved) + saved->count * sizeof(*records) + saved->text_len == (uint64_t)st.st_size) {
+        struct DfsIndexHeader *header = index->header;
+        int complete = 1;
+        IndexKey key;
+        for (uint64_t i = 0; i < saved->count && complete; i++) {
+            const struct SnapshotRecord *record = &records[i];
+            DfsIndexFile file = {record->size, record->mtime, record->crc, record->has_crc};
+            complete = record->path + (uint64_t)record->path_len < saved->text_len &&
+                       text[record->path + record->path_len] == '\0' && valid_server(record->server) &&
+                       make_key(text + record->path, &key) == 0 && key.len > 0 &&
+                       put_key(index, &key, record->server, &file) == 0;
+        }
+
+        // A snapshot that cannot be read whole is not answered from
+        for (int server = 1; server <= DFS_INDEX_SERVERS && complete; server++) {
+            header->ready[server] = saved->ready[server];
+        }
+        header->sequence = saved->sequence;
+        header->saved = saved->sequence;
+    }
+    munmap(map, st.st_size);
+}
+
+// Function to set up the index in memory shared with forked children, starting from the last snapshot
+// and the changes journaled after it
+int dfs_index_open(DfsIndex *index, const char *snapshot, const char *base) {
+    memset(index, 0, sizeof(*index));
+    snprintf(index->base, sizeof(index->base), "%s", base);
+    snprintf(index->snapshot, sizeof(index->snapshot), "%s", snapshot);
+
+    // Anonymous pages are only backed once touched, so an empty index costs little
+    size_t header_size = (sizeof(struct DfsIndexHeader) + 4095) & ~(size_t)4095;
+    size_t entries_size = (size_t)DFS_INDEX_MAX_FILES * sizeof(struct DfsIndexEntry);
+    size_t dirs_size = (size_t)DFS_INDEX_MAX_FILES * sizeof(struct DfsIndexDir);
+    size_t slots_size = (size_t)INDEX_SLOTS * sizeof(uint32_t);
+    size_t size = header_size + entries_size + dirs_size + 2 * slots_size + DFS_INDEX_HEAP_SIZE;
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    struct DfsIndexHeader *header = (struct DfsIndexHeader *)map;
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&header->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    header->free_entry = INDEX_NONE;
+
+    index->header = header;
+    index->entries = (struct DfsIndexEntry *)(map + header_size);
+    index->dirs = (struct DfsIndexDir *)(map + header_size + entries_size);
+    index->slots = (uint32_t *)(map + header_size + entries_size + dirs_size);
+    index->dir_slots = (uint32_t *)(map + header_size + entries_size + dirs_size + slots_size);
+    index->heap = map + header_size + entries_size + dirs_size + 2 * slots_size;
+    index->map_size = size;
+
+    // Changes in the older journal were made before those in the current one
+    char path[INDEX_PATH_MAX + 64];
+    load_snapshot(index);
+    journal_path(index, 1, path, sizeof(path));
+    replay_journal(index, path);
+    journal_path(index, 0, path, sizeof(path));
+    replay_journal(index, path);
+    return 0;
+}
+
+// Function to write the index to its snapshot when it changed since the last one, then drop the
+// journal the snapshot covers (returns -1 when the snapshot could not be written)
+int dfs_index_save(DfsIndex *index) {
+    if (!index->header) {
+        return -1;
+    }
+    struct DfsIndexHeader *header = index->header;
+    char journal[INDEX_PATH_MAX + 64];
+    char old_journal[INDEX_PATH_MAX + 64];
+    char temp[INDEX_PATH_MAX + 64];
+    journal_path(index, 0, journal, sizeof(journal));
+    journal_path(index, 1, old_journal, sizeof(old_journal));
+    snprintf(temp, sizeof(temp), "%s.tmp", index->snapshot);
+
+    // Copied out under the read lock, which also keeps every writer off the journal while it is moved
+    pthread_rwlock_rdlock(&header->lock);
+    if (header->sequence == header->saved) {
+        pthread_rwlock_unlock(&header->lock);
+        return 0;
+    }
+    struct SnapshotHeader saved;
+    memset(&saved, 0, sizeof(saved));
+    saved.magic = INDEX_MAGIC;
+    saved.version = INDEX_VERSION;
+    saved.sequence = header->sequence;
+    memcpy(saved.ready, header->ready, sizeof(saved.ready));
+    struct SnapshotRecord *records = malloc((header->count > 0 ? header->count : 1) * sizeof(*records));
+    char *text = malloc(paths_size(index));
+    if (!records || !text) {
+        pthread_rwlock_unlock(&header->lock);
+        free(records);
+        free(text);
+        return -1;
+    }
+    for (uint32_t i = 0; i < header->entry_top; i++) {
+        const struct DfsIndexEntry *entry = &index->entries[i];
+        if (entry->server == 0) {
+            continue;
+        }
+        struct SnapshotRecord *record = &records[saved.count++];
+        memset(record, 0, sizeof(*record));
+        record->path = saved.text_len;
+        record->path_len = entry_path(index, entry, text + saved.text_len);
+        record->server = entry->server;
+        record->has_crc = entry->has_crc;
+        record->crc = entry->crc;
+        record->size = entry->size;
+        record->mtime = entry->mtime;
+        saved.text_len += record->path_len + 1;
+    }
+
+    // An older journal still there belongs to a snapshot that never got written; it stays until one is
+    if (access(old_journal, F_OK) != 0) {
+        rename(journal, old_journal);
+    }
+    pthread_rwlock_unlock(&header->lock);
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!fp && fd >= 0) {
+        close(fd);
+    }
+    int result = fp && fwrite(&saved, sizeof(saved), 1, fp) == 1 &&
+                 fwrite(records, sizeof(*records), saved.count, fp) == saved.count &&
+                 fwrite(text, 1, saved.text_len, fp) == saved.text_len &&
+                 fflush(fp) == 0 && fsync(fileno(fp)) == 0 ? 0 : -1;
+    if (fp && fclose(fp) != 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(temp, index->snapshot) == 0) {
+        unlink(old_journal);
+        pthread_rwlock_wrlock(&header->lock);
+        if (header->saved < saved.sequence) {
+            header->saved = saved.sequence;
+        }
+        pthread_rwlock_unlock(&header->lock);
+    } else {
+        unlink(temp);
+        result = -1;
+    }
+    free(records);
+    free(text);
+    return result;
+}
+
+// Function to tell whether a server's files can be answered from the index
+int dfs_index_ready(DfsIndex *index, int server) {
+    if (!index->header || !valid_server(server)) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&index->header->lock);
+    int ready = index->header->ready[server];
+    pthread_rwlock_unlock(&index->header->lock);
+    return ready;
+}
+
+// Function to read a server's change count, to be handed back to dfs_index_replace()
+uint64_t dfs_index_epoch(DfsIndex *index, int server) {
+    if (!index->header || !valid_server(server)) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&index->header->lock);
+    uint64_t epoch = index->header->epoch[server];
+    pthread_rwlock_unlock(&index->header->lock);
+    return epoch;
+}
+
+// Function to stop answering for a server until its files are loaded again
+void dfs_index_invalidate(DfsIndex *index, int server) {
+    if (!index->header || !valid_server(server)) {
+        return;
+    }
+    pthread_rwlock_wrlock(&index->header->lock);
+    if (index->header->ready[server]) {
+        index->header->ready[server] = 0;
+        journal_append(index, JOURNAL_DROP, server, NULL, NULL);
+    }
+    pthread_rwlock_unlock(&index->header->lock);
+}
+
+// Function to look a file up (returns 1 when held, 0 when not, -1 when the index cannot tell)
+int dfs_index_lookup(DfsIndex *index, const char *path, int server, DfsIndexFile *file) {
+    IndexKey key;
+    if (!index->header || !valid_server(server) || make_path_key(index, path, &key) != 0 || key.len == 0) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&index->header->lock);
+    int found = -1;
+    if (index->header->ready[server]) {
+        uint32_t entry = find_key(index, &key, server);
+        found = entry != INDEX_NONE;
+        if (found && file) {
+            fill_file(&index->entries[entry], file);
+        }
+    }
+    pthread_rwlock_unlock(&index->header->lock);
+    return found;
+}
+
+// Compare function for sorting names
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Function to collect, in order, up to limit names of a server's files in a directory that sort after
+// 'after' (returns NULL when the index cannot tell)
+char **dfs_index_page(DfsIndex *index, const char *dirpath, int server, const char *after, int limit, int *count) {
+    IndexKey key;
+    *count = 0;
+    if (!index->header || !valid_server(server) || make_path_key(index, dirpath, &key) != 0) {
+        return NULL;
+    }
+
+    pthread_rwlock_rdlock(&index->header->lock);
+    if (!index->header->ready[server]) {
+        pthread_rwlock_unlock(&index->header->lock);
+        return NULL;
+    }
+
+    // The directory's chain holds every server's files in no order; the smallest of this server's later
+    // names are kept in a max-heap of at most limit entries, so a page costs no more than its own size
+    const char **found = malloc((limit > 0 ? limit : 1) * sizeof(*found));
+    int found_count = 0;
+    uint32_t dir = found ? find_dir(index, key.path, key.len) : INDEX_NONE;
+    for (uint32_t i = dir != INDEX_NONE ? index->dirs[dir].first : INDEX_NONE; i != INDEX_NONE;
+         i = index->entries[i].next) {
+        const struct DfsIndexEntry *entry = &index->entries[i];
+        const char *name = index->heap + entry->name;
+        if (entry->server != server || (after && strcmp(name, after) <= 0)) {
+            continue;
+        }
+        if (found_count < limit) {
+            // Room left: sift the new name up
+            int at = found_count++;
+            while (at > 0 && strcmp(found[(at - 1) / 2], name) < 0) {
+                found[at] = found[(at - 1) / 2];
+                at = (at - 1) / 2;
+            }
+            found[at] = name;
+        } else if (limit > 0 && strcmp(name, found[0]) < 0) {
+            // Smaller than the largest name kept: replace it and sift down
+            int at = 0;
+            while (1) {
+                int child = 2 * at + 1;
+                if (child >= found_count) {
+                    break;
+                }
+                if (child + 1 < found_count && strcmp(found[child + 1], found[child]) > 0) {
+                    child++;
+                }
+                if (strcmp(found[child], name) <= 0) {
+                    break;
+                }
+                found[at] = found[child];
+                at = child;
+            }
+            found[at] = name;
+        }
+    }
+    if (found_count > 1) {
+        qsort(found, found_count, sizeof(*found), compare_names);
+    }
+
+    int size = 0;
+    char **names = found ? malloc((limit > 0 ? limit : 1) * sizeof(char *)) : NULL;
+    while (names && size < found_count) {
+        names[size] = strdup(found[size]);
+        if (!names[size]) {
+            break;
+        }
+        size++;
+    }
+    pthread_rwlock_unlock(&index->header->lock);
+
+    free(found);
+    *count = size;
+    return names;
+}
+
+// Function to record a stored file, or its new details when it was replaced
+int dfs_index_put(DfsIndex *index, const char *path, int server, const DfsIndexFile *file) {
+    IndexKey key;
+    if (!index->header || !valid_server(server)) {
+        return -1;
+    }
+    if (make_path_key(index, path, &key) != 0 || key.len == 0) {
+        // A file the index cannot place makes its listings untrustworthy
+        dfs_index_invalidate(index, server);
+        return -1;
+    }
+    struct DfsIndexHeader *header = index->header;
+
+    // Out of room, or unable to keep the change: leave the server to be asked directly until the
+    // next reload
+    pthread_rwlock_wrlock(&header->lock);
+    header->epoch[server]++;
+    int result = put_key(index, &key, server, file);
+    if (result == 0) {
+        result = journal_append(index, JOURNAL_PUT, server, &key, file);
+    }
+    if (result != 0 && header->ready[server]) {
+        header->ready[server] = 0;
+        journal_append(index, JOURNAL_DROP, server, NULL, NULL);
+    }
+    pthread_rwlock_unlock(&header->lock);
+    return result;
+}
+
+// Function to drop a removed file (returns 1 when the index did not hold it)
+int dfs_index_remove(DfsIndex *index, const char *path, int server) {
+    IndexKey key;
+    if (!index->header || !valid_server(server)) {
+        return -1;
+    }
+    if (make_path_key(index, path, &key) != 0 || key.len == 0) {
+        dfs_index_invalidate(index, server);
+        return -1;
+    }
+    struct DfsIndexHeader *header = index->header;
+
+    pthread_rwlock_wrlock(&header->lock);
+    header->epoch[server]++;
+    uint32_t found = find_key(index, &key, server);
+    if (found != INDEX_NONE) {
+        delete_entry(index, found);
+        if (journal_append(index, JOURNAL_REMOVE, server, &key, NULL) != 0 && header->ready[server]) {
+            header->ready[server] = 0;
+            journal_append(index, JOURNAL_DROP, server, NULL, NULL);
+        }
+    }
+    pthread_rwlock_unlock(&header->lock);
+    return found != INDEX_NONE ? 0 : 1;
+}
+
+// Function to make a batch the whole of a server's files (returns 1 when the server changed since
+// epoch was read, so the batch may be stale, and -1 when it does not fit)
+int dfs_index_replace(DfsIndex *index, int server, const DfsIndexBatch *batch, uint64_t epoch) {
+    if (!index->header || !valid_server(server)) {
+        return -1;
+    }
+    struct DfsIndexHeader *header = index->header;
+
+    pthread_rwlock_wrlock(&header->lock);
+    if (header->epoch[server] != epoch) {
+        pthread_rwlock_unlock(&header->lock);
+        return 1;
+    }
+
+    // The journal does not carry whole inventories: until the next snapshot, a restart reloads the server
+    for (uint32_t i = 0; i < header->entry_top; i++) {
+        if (index->entries[i].server == server) {
+            delete_entry(index, i);
+        }
+    }
+    int result = 0;
+    IndexKey key;
+    for (size_t i = 0; i < batch->count && result == 0; i++) {
+        if (make_key(batch->text + batch->records[i].path, &key) == 0 && key.len > 0) {
+            result = put_key(index, &key, server, &batch->records[i].file);
+        }
+    }
+    header->ready[server] = result == 0;
+    journal_append(index, JOURNAL_DROP, server, NULL, NULL);
+    pthread_rwlock_unlock(&header->lock);
+    return result;
+}
+
+// Function to prepare an empty batch
+void dfs_index_batch_init(DfsIndexBatch *batch) {
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Function to release a batch's memory
+void dfs_index_batch_free(DfsIndexBatch *batch) {
+    free(batch->records);
+    free(batch->text);
+    dfs_index_batch_init(batch);
+}
+
+// Function to add one file to a batch
+static int batch_add(DfsIndexBatch *batch, const char *path, const DfsIndexFile *file) {
+    size_t len = strlen(path) + 1;
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity > 0 ? batch->capacity * 2 : 256;
+        DfsIndexRecord *records = realloc(batch->records, capacity * sizeof(*records));
+        if (!records) {
+            return -1;
+        }
+        batch->records = records;
+        batch->capacity = capacity;
+    }
+    if (batch->text_len + len > batch->text_capacity) {
+        size_t capacity = batch->text_capacity > 0 ? batch->text_capacity * 2 : 64 * 1024;
+        while (capacity < batch->text_len + len) {
+            capacity *= 2;
+        }
+        char *text = realloc(batch->text, capacity);
+        if (!text) {
+            return -1;
+        }
+        batch->text = text;
+        batch->text_capacity = capacity;
+    }
+    memcpy(batch->text + batch->text_len, path, len);
+    batch->records[batch->count].path = batch->text_len;
+    batch->records[batch->count].file = *file;
+    batch->text_len += len;
+    batch->count++;
+    return 0;
+}
+
+// Function to check a file name's extension
+static int has_extension(const char *name, const char *extension) {
+    const char *dot = strrchr(name, '.');
+    return dot && dot != name && strcmp(dot + 1, extension) == 0;
+}
+
+// Function to add one regular file to a batch with its stored CRC32C, if it has one
+static int scan_file(DfsIndexBatch *batch, const char *path, const char *name, const struct stat *st) {
+    DfsIndexFile file = {st->st_size, st->st_mtime, 0, 0};
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        file.has_crc = dfs_crc32c_get_attr(fd, &file.crc) == 0;
+        close(fd);
+    }
+    return batch_add(batch, name, &file);
+}
+
+// Function to walk a directory tree, adding its regular files with the extension
+static int scan_directory(DfsIndexBatch *batch, const char *dir_path, const char *name_prefix,
+                          const char *extension) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char path[INDEX_PATH_MAX];
+        char name[INDEX_PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(path) ||
+            snprintf(name, sizeof(name), "%s%s%s", name_prefix, name_prefix[0] != '\0' ? "/" : "",
+                     entry->d_name) >= (int)sizeof(name) ||
+            lstat(path, &st) != 0) {
+            continue;
+        }
+
+        // Like the downltar walk: symlinks are neither followed nor listed
+        if (S_ISDIR(st.st_mode)) {
+            result = scan_directory(batch, path, name, extension);
+        } else if (S_ISREG(st.st_mode) && has_extension(entry->d_name, extension)) {
+            result = scan_file(batch, path, name, &st);
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+// Function to gather the files with an extension at or under a path within base, named relative to base
+int dfs_index_scan(DfsIndexBatch *batch, const char *base, const char *path, const char *extension) {
+    size_t base_len = strlen(base);
+    if (strncmp(path, base, base_len) != 0 || (path[base_len] != '\0' && path[base_len] != '/')) {
+        return -1;
+    }
+    const char *relative = path + base_len;
+    while (*relative == '/') {
+        relative++;
+    }
+
+    // A path that is not there has no files, which is an answer too
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        return scan_directory(batch, path, relative, extension);
+    }
+    const char *slash = strrchr(path, '/');
+    if (S_ISREG(st.st_mode) && has_extension(slash ? slash + 1 : path, extension)) {
+        return scan_file(batch, path, relative, &st);
+    }
+    return 0;
+}
+
+// Function to answer INVENTORY: the files with an extension at or under a path, as READY frames of
+// lines closed by an empty OK frame (returns the number of files, or -1 with nothing sent)
+int dfs_index_send_inventory(int sock, uint32_t request_id, const char *base, const char *path,
+                             const char *extension) {
+    DfsIndexBatch batch;
+    dfs_index_batch_init(&batch);
+    char *frame = malloc(INVENTORY_FRAME_SIZE);
+    if (!frame || dfs_index_scan(&batch, base, path, extension) != 0) {
+        free(frame);
+        dfs_index_batch_free(&batch);
+        return -1;
+    }
+
+    int result = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < batch.count && result == 0; i++) {
+        const DfsIndexFile *file = &batch.records[i].file;
+        char crc[DFS_CRC32C_HEX_LEN + 1] = "-";
+        char line[INDEX_PATH_MAX + 64];
+        if (file->has_crc) {
+            snprintf(crc, sizeof(crc), "%08x", file->crc);
+        }
+        int len = snprintf(line, sizeof(line), "%llu %lld %s %s\n", (unsigned long long)file->size,
+                           (long long)file->mtime, crc, batch.text + batch.records[i].path);
+        if (len >= (int)sizeof(line)) {
+            continue;
+        }
+        if (used + len > INVENTORY_FRAME_SIZE) {
+            result = dfs_send_frame(sock, DFS_OP_DATA, DFS_STATUS_READY, request_id, frame, used);
+            used = 0;
+        }
+        memcpy(frame + used, line, len);
+        used += len;
+    }
+    if (result == 0 && used > 0) {
+        result = dfs_send_frame(sock, DFS_OP_DATA, DFS_STATUS_READY, request_id, frame, used);
+    }
+    if (result == 0) {
+        result = dfs_send_frame(sock, DFS_OP_DATA, DFS_STATUS_OK, request_id, NULL, 0);
+    }
+    int files = batch.count;
+    free(frame);
+    dfs_index_batch_free(&batch);
+    return result == 0 ? files : -1;
+}
+
+// Function to read an INVENTORY answer into a batch (returns 0 once the closing OK frame arrived)
+int dfs_index_recv_inventory(int sock, DfsIndexBatch *batch) {
+    char *frame = malloc(INVENTORY_FRAME_SIZE + 1);
+    if (!frame) {
+        return -1;
+    }
+
+    // Files that cannot be held are still read past, so the connection stays in step
+    int result = -1;
+    int dropped = 0;
+    while (1) {
+        DfsHeader header;
+        if (dfs_recv_header(sock, &header) != 0) {
+            break;
+        }
+        if (header.opcode != DFS_OP_DATA ||
+            (header.status != DFS_STATUS_READY && header.status != DFS_STATUS_OK) ||
+            header.payload_len > INVENTORY_FRAME_SIZE) {
+            // The server's reason it could not answer
+            dfs_discard(sock, header.payload_len);
+            break;
+        }
+        if (dfs_recv_all(sock, frame, header.payload_len) != 0) {
+            break;
+        }
+        if (header.status == DFS_STATUS_OK) {
+            result = dropped ? -1 : 0;
+            break;
+        }
+
+        // <size> <mtime> <crc32c hex|-> <path>; the path runs to the end of the line
+        frame[header.payload_len] = '\0';
+        char *line = frame;
+        char *end;
+        while ((end = strchr(line, '\n')) != NULL) {
+            *end = '\0';
+            unsigned long long size;
+            long long mtime;
+            char crc[DFS_CRC32C_HEX_LEN + 1];
+            int consumed = 0;
+            if (sscanf(line, "%llu %lld %8s %n", &size, &mtime, crc, &consumed) == 3 && consumed > 0 &&
+                line[consumed] != '\0') {
+                DfsIndexFile file = {size, mtime, 0, 0};
+                if (strcmp(crc, "-") != 0) {
+                    file.crc = (uint32_t)strtoul(crc, NULL, 16);
+                    file.has_crc = 1;
+                }
+                if (batch_add(batch, line + consumed, &file) != 0) {
+                    dropped = 1;
+                }
+            }
+            line = end + 1;
+        }
+    }
+    free(frame);
+    return result;
+}
+
+// Function to describe a file just stored, for a server's OK reply to RECEIVE, as
+// " size=<n> mtime=<t> crc32c=<hex|->" (left empty when the file cannot be read)
+void dfs_index_describe(const char *path, char *text, size_t size) {
+    struct stat st;
+    text[0] = '\0';
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) == 0) {
+        uint32_t value;
+        char crc[DFS_CRC32C_HEX_LEN + 1] = "-";
+        if (dfs_crc32c_get_attr(fd, &value) == 0) {
+            snprintf(crc, sizeof(crc), "%08x", value);
+        }
+        if (snprintf(text, size, " size=%llu mtime=%lld crc32c=%s", (unsigned long long)st.st_size,
+                     (long long)st.st_mtime, crc) >= (int)size) {
+            text[0] = '\0';
+        }
+    }
+    close(fd);
+}
+
+// Function to read back what dfs_index_describe() put in a reply (returns -1 when it has no description)
+int dfs_index_parse_description(const char *reply, DfsIndexFile *file) {
+    const char *described = strstr(reply, " size=");
+    unsigned long long size;
+    long long mtime;
+    char crc[DFS_CRC32C_HEX_LEN + 1];
+    if (!described || sscanf(described, " size=%llu mtime=%lld crc32c=%8s", &size, &mtime, crc) != 3) {
+        return -1;
+    }
+    file->size = size;
+    file->mtime = mtime;
+    file->crc = 0;
+    file->has_crc = strcmp(crc, "-") != 0;
+    if (file->has_crc) {
+        file->crc = (uint32_t)strtoul(crc, NULL, 16);
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef DFS_INDEX_H
+#define DFS_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Namespace index: S1's record of every file it serves, wherever it is kept.
+ *
+ * One entry per stored file (path, server, size, mtime, CRC32C) lives in
+ * anonymous MAP_SHARED memory set up before S1 forks, so forked children
+ * and worker threads read and update the same copy. Files are hashed on
+ * directory, server and name, and each directory chains its files, so an
+ * existence check, an upload and a removal each cost one probe; a
+ * dispfnames page walks its directory's chain and sorts what it keeps.
+ * Names live in a string heap that is compacted when it fills. A
+ * process-shared rwlock guards it all. Paths are kept relative to S1's base
+ * directory; a path with ".." in it is never answered from the index.
+ *
+ * A restart serves from the last snapshot written by dfs_index_save(): a
+ * header, one 32-byte record per file and the path text, read back with
+ * mmap. Every upload or removal since is appended to "<snapshot>.journal"
+ * and replayed over it. A whole inventory is not journaled; it is kept once
+ * the next snapshot is written, and until then a restart loads it again.
+ *
+ * Servers are numbered as S1 names them: 1 for S1's own .c files, 2 to 4
+ * for S2, S3 and S4. A server's entries are only answered from once they
+ * have been loaded whole, from the local tree for S1 or from an inventory
+ * for the others (or from a snapshot that held them). Until then, or once
+ * the index runs out of room for a server's files, lookups return -1 and
+ * callers ask the server as before. dfs_index_replace() loads a server's
+ * inventory only if no upload or removal touched that server since the
+ * caller read dfs_index_epoch(); otherwise the caller reads it again.
+ *
+ * INVENTORY (S1 -> S2/S3/S4) takes one path on the server. It is answered
+ * with DATA frames of status READY holding lines
+ * "<size> <mtime> <crc32c hex|-> <path>", the path relative to the
+ * server's base directory: the path itself when it is a file of the
+ * server's type, or every such file under it when it is a directory.
+ * Lines never span frames. An empty DATA frame of status OK closes the
+ * inventory; any other final frame means it could not be read.
+ *
+ * A RECEIVE that stores a file is answered OK with the stored file's details
+ * appended as " size=<n> mtime=<t> crc32c=<hex|->" (dfs_index_describe()),
+ * so S1 records the upload without asking the server again.
+ */
+
+#define DFS_INDEX_SERVERS 4
+#define DFS_INDEX_MAX_FILES (1 << 20)          /* entries the index has room for */
+#define DFS_INDEX_HEAP_SIZE (64 * 1024 * 1024) /* bytes of path text it has room for */
+
+// What the index knows about one file
+typedef struct {
+    uint64_t size;
+    int64_t mtime;
+    uint32_t crc;
+    int has_crc;          // Set when crc is the CRC32C stored with the file
+} DfsIndexFile;
+
+// S1's mapping of the index
+typedef struct {
+    struct DfsIndexHeader *header;   // NULL when the index could not be mapped
+    struct DfsIndexEntry *entries;
+    struct DfsIndexDir *dirs;
+    uint32_t *slots;                 // Entry + 1 per used hash slot, 0 when free
+    uint32_t *dir_slots;
+    char *heap;
+    size_t map_size;
+    char base[1024];
+    char snapshot[1024];
+} DfsIndex;
+
+// One file of an inventory
+typedef struct {
+    size_t path;          // Offset of its relative path in the batch text
+    DfsIndexFile file;
+} DfsIndexRecord;
+
+// Files gathered from a tree walk or received as an inventory
+typedef struct {
+    DfsIndexRecord *records;
+    size_t count;
+    size_t capacity;
+    char *text;
+    size_t text_len;
+    size_t text_capacity;
+} DfsIndexBatch;
+
+int dfs_index_open(DfsIndex *index, const char *snapshot, const char *base);
+int dfs_index_save(DfsIndex *index);
+int dfs_index_ready(DfsIndex *index, int server);
+uint64_t dfs_index_epoch(DfsIndex *index, int server);
+void dfs_index_invalidate(DfsIndex *index, int server);
+int dfs_index_lookup(DfsIndex *index, const char *path, int server, DfsIndexFile *file);
+char **dfs_index_page(DfsIndex *index, const char *dirpath, int server, const char *after, int limit, int *count);
+int dfs_index_put(DfsIndex *index, const char *path, int server, const DfsIndexFile *file);
+int dfs_index_remove(DfsIndex *index, const char *path, int server);
+int dfs_index_replace(DfsIndex *index, int server, const DfsIndexBatch *batch, uint64_t epoch);
+
+int dfs_index_relative(const char *base, const char *path, char *relative, size_t size);
+
+void dfs_index_batch_init(DfsIndexBatch *batch);
+void dfs_index_batch_free(DfsIndexBatch *batch);
+int dfs_index_scan(DfsIndexBatch *batch, const char *base, const char *path, const char *extension);
+int dfs_index_send_inventory(int sock, uint32_t request_id, const char *base, const char *path,
+                             const char *extension);
+int dfs_index_recv_inventory(int sock, DfsIndexBatch *batch);
+void dfs_index_describe(const char *path, char *text, size_t size);
+int dfs_index_parse_description(const char *reply, DfsIndexFile *file);
+
+#endif
@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "dfs_protocol.h"
+#include "dfs_crc32c.h"
+
+#define DFS_BUFFER_SIZE 4096
+#define DFS_BODY_BUFFER (64 * 1024)
+
+static uint32_t request_counter = 0;
+
+// Function to write a 64-bit value in network byte order
+static void put_u64(unsigned char *p, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+// Function to read a 64-bit value in network byte order
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// Function to send a whole buffer, retrying on partial sends
+int dfs_send_all(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t sent = send(sock, p, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Function to receive exactly len bytes
+int dfs_recv_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t received = recv(sock, p, len, 0);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (received == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        p += received;
+        len -= received;
+    }
+    return 0;
+}
+
+// Function to skip len bytes of payload we do not want
+int dfs_discard(int sock, uint64_t len) {
+    char buffer[DFS_BUFFER_SIZE];
+    while (len > 0) {
+        size_t chunk = len < DFS_BUFFER_SIZE ? len : DFS_BUFFER_SIZE;
+        if (dfs_recv_all(sock, buffer, chunk) != 0) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to allocate a request ID for an outgoing command
+uint32_t dfs_next_request_id(void) {
+    return __atomic_add_fetch(&request_counter, 1, __ATOMIC_RELAXED);
+}
+
+// Function to serialize a frame header
+static void encode_header(unsigned char *raw, uint8_t opcode, uint16_t status,
+                          uint32_t request_id, uint32_t flags, uint64_t payload_len) {
+    uint32_t magic = htonl(DFS_PROTOCOL_MAGIC);
+    uint16_t net_status = htons(status);
+    uint32_t net_request_id = htonl(request_id);
+    uint32_t net_flags = htonl(flags);
+
+    memcpy(raw, &magic, 4);
+    raw[4] = DFS_PROTOCOL_VERSION;
+    raw[5] = opcode;
+    memcpy(raw + 6, &net_status, 2);
+    memcpy(raw + 8, &net_request_id, 4);
+    memcpy(raw + 12, &net_flags, 4);
+    put_u64(raw + 16, payload_len);
+}
+
+// Function to send a frame header
+int dfs_send_header(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, uint64_t payload_len) {
+    return dfs_send_header_flags(sock, opcode, status, request_id, 0, payload_len);
+}
+
+// Function to send a frame header with flags describing the payload
+int dfs_send_header_flags(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, uint32_t flags,
+                          uint64_t payload_len) {
+    unsigned char raw[DFS_HEADER_SIZE];
+    encode_header(raw, opcode, status, request_id, flags, payload_len);
+    return dfs_send_all(sock, raw, DFS_HEADER_SIZE);
+}
+
+// Function to parse a raw frame header (returns -1 on a bad magic or version)
+int dfs_decode_header(const unsigned char *raw, DfsHeader *header) {
+    uint32_t magic;
+    uint16_t status;
+    uint32_t request_id;
+    uint32_t flags;
+    memcpy(&magic, raw, 4);
+    memcpy(&status, raw + 6, 2);
+    memcpy(&request_id, raw + 8, 4);
+    memcpy(&flags, raw + 12, 4);
+
+    if (ntohl(magic) != DFS_PROTOCOL_MAGIC || raw[4] != DFS_PROTOCOL_VERSION) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    header->version = raw[4];
+    header->opcode = raw[5];
+    header->status = ntohs(status);
+    header->request_id = ntohl(request_id);
+    header->flags = ntohl(flags);
+    header->payload_len = get_u64(raw + 16);
+    return 0;
+}
+
+// Function to receive a frame header (returns 1 if the peer closed cleanly)
+int dfs_recv_header(int sock, DfsHeader *header) {
+    unsigned char raw[DFS_HEADER_SIZE];
+    ssize_t received;
+
+    // Distinguish an orderly close between frames from a truncated header
+    do {
+        received = recv(sock, raw, 1, 0);
+    } while (received < 0 && errno == EINTR);
+
+    if (received == 0) {
+        return 1;
+    }
+    if (received < 0 || dfs_recv_all(sock, raw + 1, DFS_HEADER_SIZE - 1) != 0) {
+        return -1;
+    }
+
+    return dfs_decode_header(raw, header);
+}
+
+// Function to send a complete frame with an in-memory payload
+int dfs_send_frame(int sock, uint8_t opcode, uint16_t status, uint32_t request_id,
+                   const void *payload, uint64_t payload_len) {
+    // Small frames go out in a single send so header and payload share a segment
+    if (payload_len > 0 && payload_len <= DFS_BUFFER_SIZE - DFS_HEADER_SIZE) {
+        unsigned char raw[DFS_BUFFER_SIZE];
+        encode_header(raw, opcode, status, request_id, 0, payload_len);
+        memcpy(raw + DFS_HEADER_SIZE, payload, payload_len);
+        return dfs_send_all(sock, raw, DFS_HEADER_SIZE + payload_len);
+    }
+
+    if (dfs_send_header(sock, opcode, status, request_id, payload_len) != 0) {
+        return -1;
+    }
+    if (payload_len > 0 && dfs_send_all(sock, payload, payload_len) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to send a text message frame
+int dfs_send_message(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, const char *message) {
+    return dfs_send_frame(sock, opcode, status, request_id, message, strlen(message));
+}
+
+// Function to answer a request with a status and message
+int dfs_reply(int sock, const DfsHeader *request, uint16_t status, const char *message) {
+    return dfs_send_message(sock, request->opcode, status, request->request_id, message);
+}
+
+// Function to send a list of names as one newline-separated frame without building it in memory
+int dfs_send_lines(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, char **lines, int count) {
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += strlen(lines[i]) + 1;
+    }
+    if (dfs_send_header(sock, opcode, status, request_id, total) != 0) {
+        return -1;
+    }
+
+    // Coalesce short lines into buffer-sized sends
+    char buffer[DFS_BUFFER_SIZE];
+    size_t used = 0;
+    for (int i = 0; i < count; i++) {
+        size_t len = strlen(lines[i]);
+        if (used + len + 1 > sizeof(buffer)) {
+            if (dfs_send_all(sock, buffer, used) != 0) {
+                return -1;
+            }
+            used = 0;
+        }
+        if (len + 1 > sizeof(buffer)) {
+            if (dfs_send_all(sock, lines[i], len) != 0 || dfs_send_all(sock, "\n", 1) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        memcpy(buffer + used, lines[i], len);
+        buffer[used + len] = '\n';
+        used += len + 1;
+    }
+    if (used > 0 && dfs_send_all(sock, buffer, used) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to receive a text payload into a NUL-terminated buffer
+int dfs_recv_payload(int sock, const DfsHeader *header, char *buf, size_t buf_size) {
+    if (header->payload_len >= buf_size) {
+        // Too large for the caller; drain it so the stream stays in sync
+        dfs_discard(sock, header->payload_len);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (dfs_recv_all(sock, buf, header->payload_len) != 0) {
+        return -1;
+    }
+    buf[header->payload_len] = '\0';
+    return 0;
+}
+
+// Function to send the CHECKSUM frame that closes a file body
+int dfs_send_checksum(int sock, uint32_t request_id, uint32_t crc) {
+    char text[16];
+    snprintf(text, sizeof(text), "%08x", crc);
+    return dfs_send_message(sock, DFS_OP_CHECKSUM, DFS_STATUS_OK, request_id, text);
+}
+
+// Function to read the CHECKSUM frame that closes a file body
+int dfs_recv_checksum(int sock, uint32_t *crc) {
+    DfsHeader header;
+    char text[32];
+    if (dfs_recv_header(sock, &header) != 0 || dfs_recv_payload(sock, &header, text, sizeof(text)) != 0) {
+        return -1;
+    }
+    char *end;
+    unsigned long value = strtoul(text, &end, 16);
+    if (header.opcode != DFS_OP_CHECKSUM || header.status != DFS_STATUS_OK || end == text || *end != '\0') {
+        errno = EPROTO;
+        return -1;
+    }
+    *crc = (uint32_t)value;
+    return 0;
+}
+
+// Function to pass the CHECKSUM frame that closes a relayed body on under another request ID
+// (returns DFS_RELAY_SINK_FAILED if only the destination broke)
+int dfs_relay_checksum(int from_sock, int to_sock, uint32_t request_id) {
+    uint32_t crc;
+    if (dfs_recv_checksum(from_sock, &crc) != 0) {
+        return -1;
+    }
+    return dfs_send_checksum(to_sock, request_id, crc) == 0 ? 0 : DFS_RELAY_SINK_FAILED;
+}
+
+// Function to receive exactly len body bytes into a file and check them against the CHECKSUM frame
+// that follows (returns DFS_CHECKSUM_MISMATCH if they differ). The frame is read even when a write
+// fails so the connection stays usable
+int dfs_recv_body(int sock, FILE *fp, uint64_t len) {
+    char buffer[DFS_BODY_BUFFER];
+    uint32_t crc = 0;
+    int result = 0;
+    while (len > 0) {
+        size_t chunk = len < DFS_BODY_BUFFER ? len : DFS_BODY_BUFFER;
+        if (dfs_recv_all(sock, buffer, chunk) != 0) {
+            return -1;
+        }
+        len -= chunk;
+        crc = dfs_crc32c(crc, buffer, chunk);
+        if (fwrite(buffer, 1, chunk, fp) != chunk) {
+            if (dfs_discard(sock, len) != 0) {
+                return -1;
+            }
+            result = -1;
+            break;
+        }
+    }
+
+    uint32_t expected;
+    if (dfs_recv_checksum(sock, &expected) != 0) {
+        return -1;
+    }
+    if (result == 0 && crc != expected) {
+        result = DFS_CHECKSUM_MISMATCH;
+    }
+    return result;
+}
+
+// Function to set or clear TCP_CORK so a header and body leave in full segments
+void dfs_set_cork(int sock, int on) {
+#ifdef TCP_CORK
+    // Fails harmlessly on sockets that are not TCP
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
+
+// Function to send exactly len body bytes from a file descriptor's current offset
+int dfs_send_file(int sock, int fd, uint64_t len) {
+#ifdef __linux__
+    // Straight from the page cache; the chunk grows while the socket keeps up
+    size_t chunk = DFS_SENDFILE_MIN_CHUNK;
+    while (len > 0) {
+        size_t want = len < chunk ? len : chunk;
+        ssize_t sent = sendfile(sock, fd, NULL, want);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                struct pollfd pfd = {sock, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                // Descriptor cannot be sendfile'd; copy the rest instead
+                break;
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            // File shrank underneath us; the peer expects len bytes
+            errno = EIO;
+            return -1;
+        }
+        len -= sent;
+
+        if ((size_t)sent == want && chunk < DFS_SENDFILE_MAX_CHUNK) {
+            chunk *= 2;
+        } else if ((size_t)sent < want && chunk > DFS_SENDFILE_MIN_CHUNK) {
+            chunk /= 2;
+        }
+    }
+#endif
+
+    char buffer[DFS_BUFFER_SIZE * 16];
+    while (len > 0) {
+        size_t want = len < sizeof(buffer) ? len : sizeof(buffer);
+        ssize_t bytes_read = read(fd, buffer, want);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            if (bytes_read == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        if (dfs_send_all(sock, buffer, bytes_read) != 0) {
+            return -1;
+        }
+        len -= bytes_read;
+    }
+    return 0;
+}
+
+// Function to send a file as one frame, corking so the header rides with the first body bytes
+int dfs_send_file_frame(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, int fd, uint64_t len) {
+    dfs_set_cork(sock, 1);
+    int result = 0;
+    if (dfs_send_header(sock, opcode, status, request_id, len) != 0 ||
+        dfs_send_file(sock, fd, len) != 0) {
+        result = -1;
+    }
+    dfs_set_cork(sock, 0);
+    return result;
+}
+
+// Function to send a file body as one DATA frame followed by its CHECKSUM frame. crc is the stored
+// checksum of exactly these bytes, which lets the body go out with sendfile; without one the body is
+// read through a buffer and the checksum computed on the way
+int dfs_send_body(int sock, uint32_t request_id, int fd, uint64_t len, const uint32_t *crc) {
+    dfs_set_cork(sock, 1);
+    int result = 0;
+    if (crc) {
+        if (dfs_send_header(sock, DFS_OP_DATA, DFS_STATUS_OK, request_id, len) != 0 ||
+            dfs_send_file(sock, fd, len) != 0 || dfs_send_checksum(sock, request_id, *crc) != 0) {
+            result = -1;
+        }
+        dfs_set_cork(sock, 0);
+        return result;
+    }
+
+    char buffer[DFS_BODY_BUFFER];
+    uint32_t sum = 0;
+    if (dfs_send_header(sock, DFS_OP_DATA, DFS_STATUS_OK, request_id, len) != 0) {
+        result = -1;
+    }
+    while (result == 0 && len > 0) {
+        size_t want = len < DFS_BODY_BUFFER ? len : DFS_BODY_BUFFER;
+        ssize_t bytes_read = read(fd, buffer, want);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            if (bytes_read == 0) {
+                errno = EIO;   // file shrank underneath us; the peer expects len bytes
+            }
+            result = -1;
+            break;
+        }
+        sum = dfs_crc32c(sum, buffer, bytes_read);
+        if (dfs_send_all(sock, buffer, bytes_read) != 0) {
+            result = -1;
+            break;
+        }
+        len -= bytes_read;
+    }
+    if (result == 0 && dfs_send_checksum(sock, request_id, sum) != 0) {
+        result = -1;
+    }
+    dfs_set_cork(sock, 0);
+    return result;
+}
+
+// Function to drain what is left of a relay once the destination has failed
+static int relay_drain_source(int from_sock, uint64_t len) {
+    if (dfs_discard(from_sock, len) != 0) {
+        return -1;
+    }
+    return DFS_RELAY_SINK_FAILED;
+}
+
+#ifdef __linux__
+// Function to relay through a kernel pipe with splice (returns 1 if unsupported)
+static int relay_splice(int from_sock, int to_sock, uint64_t *len) {
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        return 1;
+    }
+
+    // A larger pipe lets each splice move more than the default 64 KiB
+    int capacity = fcntl(pipefd[1], F_SETPIPE_SZ, DFS_RELAY_PIPE_SIZE);
+    if (capacity <= 0) {
+        capacity = 65536;
+    }
+
+    int result = 0;
+    int first = 1;
+    while (*len > 0) {
+        size_t want = *len < (uint64_t)capacity ? *len : (size_t)capacity;
+        ssize_t in = splice(from_sock, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in < 0 && first && (errno == EINVAL || errno == ENOSYS)) {
+            // Socket type without splice support; let the caller copy instead
+            result = 1;
+            break;
+        }
+        if (in <= 0) {
+            if (in == 0) {
+                errno = ECONNRESET;
+            }
+            result = -1;
+            break;
+        }
+        first = 0;
+        *len -= in;
+
+        // Push everything now sitting in the pipe out to the destination
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, to_sock, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                break;
+            }
+            in -= out;
+        }
+        if (in > 0) {
+            result = relay_drain_source(from_sock, *len);
+            break;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return result;
+}
+#endif
+
+// Function to relay through a bounded ring buffer, reading and writing as each side allows
+static int relay_buffered(int from_sock, int to_sock, uint64_t len) {
+    char *ring = malloc(DFS_RELAY_RING_SIZE);
+    if (!ring) {
+        return -1;
+    }
+
+    size_t head = 0;   // Next byte to send
+    size_t fill = 0;   // Bytes buffered and not yet sent
+    int result = 0;
+
+    while (len > 0 || fill > 0) {
+        struct pollfd fds[2];
+        int nfds = 0;
+        int from_idx = -1;
+        int to_idx = -1;
+
+        if (len > 0 && fill < DFS_RELAY_RING_SIZE) {
+            fds[nfds].fd = from_sock;
+            fds[nfds].events = POLLIN;
+            from_idx = nfds++;
+        }
+        if (fill > 0) {
+            fds[nfds].fd = to_sock;
+            fds[nfds].events = POLLOUT;
+            to_idx = nfds++;
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+
+        if (from_idx >= 0 && fds[from_idx].revents) {
+            // Fill the contiguous free region after the buffered data
+            size_t tail = (head + fill) % DFS_RELAY_RING_SIZE;
+            size_t space = tail >= head ? DFS_RELAY_RING_SIZE - tail : head - tail;
+            if (space > len) {
+                space = len;
+            }
+            ssize_t received = recv(from_sock, ring + tail, space, MSG_DONTWAIT);
+            if (received == 0 || (received < 0 && errno != EINTR && errno != EAGAIN)) {
+                if (received == 0) {
+                    errno = ECONNRESET;
+                }
+                result = -1;
+                break;
+            }
+            if (received > 0) {
+                fill += received;
+                len -= received;
+            }
+        }
+
+        if (to_idx >= 0 && fds[to_idx].revents) {
+            // Send the contiguous buffered region starting at head
+            size_t chunk = head + fill > DFS_RELAY_RING_SIZE ? DFS_RELAY_RING_SIZE - head : fill;
+            ssize_t sent = send(to_sock, ring + head, chunk, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0 && errno != EINTR && errno != EAGAIN) {
+                result = relay_drain_source(from_sock, len);
+                break;
+            }
+            if (sent > 0) {
+                head = (head + sent) % DFS_RELAY_RING_SIZE;
+                fill -= sent;
+            }
+        }
+    }
+
+    free(ring);
+    return result;
+}
+
+// Function to copy exactly len bytes from one socket to another
+// (returns DFS_RELAY_SINK_FAILED if only the destination broke and the source was drained)
+int dfs_relay(int from_sock, int to_sock, uint64_t len) {
+#ifdef __linux__
+    int result = relay_splice(from_sock, to_sock, &len);
+    if (result != 1) {
+        return result;
+    }
+#endif
+    return relay_buffered(from_sock, to_sock, len);
+}
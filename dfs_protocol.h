@@ -0,0 +1,152 @@
+#ifndef DFS_PROTOCOL_H
+#define DFS_PROTOCOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Wire protocol shared by S1, S2, S3, S4 and w25clients.
+ *
+ * Every message starts with a fixed 24-byte header (network byte order):
+ *
+ *   magic(4) version(1) opcode(1) status(2) request_id(4) flags(4) payload_len(8)
+ *
+ * followed by exactly payload_len bytes of payload. Commands carry their
+ * arguments as text ("uploadf name ~/S1/dir"), file bodies travel in
+ * DFS_OP_DATA frames whose payload is streamed against the announced
+ * length, so one connection can carry any number of back-to-back commands.
+ *
+ * dispfnames is paged: S1 answers with DATA frames of status READY, each a
+ * batch of newline-separated names, then a final DATA frame of status OK
+ * whose payload is the cursor for the next page ("type:name", empty when
+ * the listing is complete). The client sends the cursor back as a third
+ * argument to continue.
+ *
+ * downltar is chunked the same way: DATA frames of status READY carry the
+ * archive as it is built, and a final DATA frame of status OK carries the
+ * trailer "<total bytes> <crc32c hex>" plus any deleted member names (see
+ * dfs_tar.h). Any other final frame is the reason the archive stopped. A
+ * "manifest" option is followed by one DATA frame listing the files the
+ * client already holds. A "gzip" word asks S1 for a gzipped archive; the
+ * trailer then reads "<total bytes> <crc32c hex> gzip" (see dfs_gzip.h).
+ *
+ * A file body may instead be a run of DATA frames flagged DFS_FLAG_DEFLATE
+ * (READY pieces of a zlib stream, then OK) when the receiver offered
+ * "z=<level>" on the command (see dfs_deflate.h). uploadf and downlf bodies
+ * may also start part way into the file when a transfer resumes (see
+ * dfs_session.h).
+ *
+ * statf (STAT between servers) answers OK with "<size> <sha256 hex>", the
+ * digest being "-" when the server cannot tell (S1 only hashes its own .c
+ * files from DFS_PARALLEL_MIN_SIZE up). A client uses it to split a large
+ * downlf into byte ranges fetched over several connections at once and to
+ * check the file it put back together. A downlf of the whole file carrying
+ * a "split" word is answered that way instead of with the body when the
+ * file is that large, or when S1 cannot tell its size without asking.
+ *
+ * Every uploadf/downlf body, raw or deflated, is closed by a CHECKSUM
+ * frame of status OK whose payload is the CRC32C of the uncompressed body
+ * bytes as 8 hex digits (see dfs_crc32c.h). Each receiver checks it before
+ * keeping the bytes; S1 passes it on untouched when it relays a body.
+ *
+ * INVENTORY asks a backend for the files it holds under a path, with size,
+ * mtime and stored CRC32C, so S1 can answer listings and existence checks
+ * from its namespace index (see dfs_index.h).
+ *
+ * WATCH asks a backend for its presence filter: a snapshot of counters
+ * then, for as long as the connection stays open, each change as it
+ * happens, so S1 can answer downlf/removef for a missing file without a
+ * round trip (see dfs_filter.h).
+ */
+
+#define DFS_PROTOCOL_MAGIC 0x44465331u  /* "DFS1" */
+#define DFS_PROTOCOL_VERSION 1
+#define DFS_HEADER_SIZE 24
+
+// Opcodes
+#define DFS_OP_UPLOADF     1   /* client -> S1 */
+#define DFS_OP_DOWNLF      2
+#define DFS_OP_REMOVEF     3
+#define DFS_OP_DOWNLTAR    4
+#define DFS_OP_DISPFNAMES  5
+#define DFS_OP_STATF       6
+#define DFS_OP_RECEIVE     16  /* S1 -> S2/S3/S4 */
+#define DFS_OP_SEND        17
+#define DFS_OP_REMOVE      18
+#define DFS_OP_LIST        19
+#define DFS_OP_CREATETAR   20
+#define DFS_OP_PING        21  /* connection health check */
+#define DFS_OP_STAT        22
+#define DFS_OP_INVENTORY   23  /* every stored file, for S1's namespace index */
+#define DFS_OP_WATCH       24  /* presence filter, pushed for as long as the connection lasts */
+#define DFS_OP_DATA        32  /* file body, listing or archive */
+#define DFS_OP_CHECKSUM    33  /* CRC32C closing an uploadf/downlf body */
+
+// Status codes
+#define DFS_STATUS_OK        0
+#define DFS_STATUS_READY     1
+#define DFS_STATUS_ERROR     2
+#define DFS_STATUS_NOT_FOUND 3
+#define DFS_STATUS_NO_FILES  4
+#define DFS_STATUS_INVALID   5
+
+// Frame flags
+#define DFS_FLAG_DEFLATE 0x1   /* DATA payload is part of a zlib stream (see dfs_deflate.h) */
+
+// Listing limits
+#define DFS_LIST_PAGE_SIZE 1000     /* names per dispfnames page */
+#define DFS_LIST_MAX_PAGE 10000     /* most names a backend returns for one LIST */
+#define DFS_PARALLEL_MIN_SIZE (64 * 1024 * 1024)  /* smallest file a downlf is split into ranges for */
+
+// Transfer tuning
+#define DFS_SENDFILE_MIN_CHUNK (64 * 1024)       /* first sendfile chunk, grows while the socket keeps up */
+#define DFS_SENDFILE_MAX_CHUNK (8 * 1024 * 1024)
+#define DFS_RELAY_PIPE_SIZE (1024 * 1024)   /* splice pipe capacity requested from the kernel */
+#define DFS_RELAY_RING_SIZE (128 * 1024)    /* bounded buffer when splice is unavailable */
+#define DFS_RELAY_SINK_FAILED -2            /* destination broke, source drained and still in sync */
+#define DFS_CHECKSUM_MISMATCH -3            /* body arrived whole but does not match its CHECKSUM frame */
+
+// Frame header
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t status;
+    uint32_t request_id;
+    uint32_t flags;
+    uint64_t payload_len;
+} DfsHeader;
+
+// Socket helpers that handle partial transfers and EINTR
+int dfs_send_all(int sock, const void *buf, size_t len);
+int dfs_recv_all(int sock, void *buf, size_t len);
+int dfs_discard(int sock, uint64_t len);
+
+// Frame helpers
+uint32_t dfs_next_request_id(void);
+int dfs_send_header(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, uint64_t payload_len);
+int dfs_send_header_flags(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, uint32_t flags,
+                          uint64_t payload_len);
+int dfs_decode_header(const unsigned char *raw, DfsHeader *header);
+int dfs_recv_header(int sock, DfsHeader *header);
+int dfs_send_frame(int sock, uint8_t opcode, uint16_t status, uint32_t request_id,
+                   const void *payload, uint64_t payload_len);
+int dfs_send_message(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, const char *message);
+int dfs_reply(int sock, const DfsHeader *request, uint16_t status, const char *message);
+int dfs_send_lines(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, char **lines, int count);
+int dfs_recv_payload(int sock, const DfsHeader *header, char *buf, size_t buf_size);
+
+// Body streaming against a known length
+int dfs_send_file(int sock, int fd, uint64_t len);
+int dfs_send_file_frame(int sock, uint8_t opcode, uint16_t status, uint32_t request_id, int fd, uint64_t len);
+
+// File bodies closed by a CHECKSUM frame
+int dfs_send_body(int sock, uint32_t request_id, int fd, uint64_t len, const uint32_t *crc);
+int dfs_recv_body(int sock, FILE *fp, uint64_t len);
+int dfs_send_checksum(int sock, uint32_t request_id, uint32_t crc);
+int dfs_recv_checksum(int sock, uint32_t *crc);
+int dfs_relay_checksum(int from_sock, int to_sock, uint32_t request_id);
+int dfs_relay(int from_sock, int to_sock, uint64_t len);
+void dfs_set_cork(int sock, int on);
+
+#endif
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "dfs_session.h"
+#include "dfs_protocol.h"
+#include "dfs_sha256.h"
+#include "dfs_crc32c.h"
+
+#define SESSION_PART_SUFFIX ".part"
+#define SESSION_PART_BUFFER (256 * 1024)
+
+// Function to read the value of a "<key><value>" word of a command into out; returns its length
+static size_t find_word(const char *command, const char *key, const char *accept, char *out, size_t size) {
+    const char *word = strstr(command, key);
+    if (!word) {
+        return 0;
+    }
+    word += strlen(key);
+    size_t len = strspn(word, accept);
+    if (len == 0 || len >= size || (word[len] != '\0' && word[len] != ' ')) {
+        return 0;
+    }
+    memcpy(out, word, len);
+    out[len] = '\0';
+    return len;
+}
+
+// Function to read the session named by a " resume=<id>" word; returns 1 if there is one
+int dfs_session_find_id(const char *command, char id[DFS_SESSION_ID_LEN + 1]) {
+    return find_word(command, " resume=", "0123456789abcdef", id, DFS_SESSION_ID_LEN + 1) ==
+           DFS_SESSION_ID_LEN;
+}
+
+// Function to read a "<key><n>" number word; returns 1 if there is one
+static int find_number(const char *command, const char *key, uint64_t *value) {
+    char digits[24];
+    if (find_word(command, key, "0123456789", digits, sizeof(digits)) == 0) {
+        return 0;
+    }
+    *value = strtoull(digits, NULL, 10);
+    return 1;
+}
+
+// Function to read an " offset=<n>" word; returns 1 if there is one
+int dfs_session_find_offset(const char *command, uint64_t *offset) {
+    return find_number(command, " offset=", offset);
+}
+
+// Function to read the " multipart=<size>" word that opens a multipart upload; returns 1 if there is one
+int dfs_session_find_multipart(const char *command, uint64_t *size) {
+    return find_number(command, " multipart=", size);
+}
+
+// Function to read the " part=<offset>" word of one part of a multipart upload; returns 1 if there is one
+int dfs_session_find_part(const char *command, uint64_t *offset) {
+    return find_number(command, " part=", offset);
+}
+
+// Function to tell whether a command ends a multipart upload with a " commit" word
+int dfs_session_is_commit(const char *command) {
+    const char *word = strstr(command, " commit");
+    return word && (word[7] == '\0' || word[7] == ' ');
+}
+
+// Function to tell whether a downlf asks to be answered with the file's size and digest when it is worth
+// fetching in ranges
+int dfs_session_wants_split(const char *command) {
+    const char *word = strstr(command, " split");
+    return word && (word[6] == '\0' || word[6] == ' ');
+}
+
+// Function to make up a new session ID
+static void new_session_id(char id[DFS_SESSION_ID_LEN + 1]) {
+    uint64_t value = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, &value, sizeof(value)) != (ssize_t)sizeof(value)) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        value = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ ((uint64_t)getpid() << 16);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    snprintf(id, DFS_SESSION_ID_LEN + 1, "%016" PRIx64, value);
+}
+
+// Function to remove part files that have not been touched for DFS_SESSION_MAX_AGE
+static void sweep_stale_parts(const char *dir) {
+    DIR *dp = opendir(dir);
+    if (!dp) {
+        return;
+    }
+    time_t cutoff = time(NULL) - DFS_SESSION_MAX_AGE;
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len != DFS_SESSION_ID_LEN + strlen(SESSION_PART_SUFFIX) ||
+            strcmp(entry->d_name + DFS_SESSION_ID_LEN, SESSION_PART_SUFFIX) != 0) {
+            continue;
+        }
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime < cutoff) {
+            unlink(path);
+        }
+    }
+    closedir(dp);
+}
+
+// Function to continue the session resume_id, or start a new one when it is NULL or its part is gone.
+// Fills in the session ID, its part file and the bytes the part already holds
+int dfs_session_open(const char *dir, const char *resume_id, char id[DFS_SESSION_ID_LEN + 1],
+                     char *part, size_t size, uint64_t *offset) {
+    mkdir(dir, 0755);
+
+    struct stat st;
+    if (resume_id) {
+        snprintf(part, size, "%s/%s%s", dir, resume_id, SESSION_PART_SUFFIX);
+        if (stat(part, &st) == 0 && S_ISREG(st.st_mode)) {
+            snprintf(id, DFS_SESSION_ID_LEN + 1, "%s", resume_id);
+            *offset = st.st_size;
+            return 0;
+        }
+    }
+
+    sweep_stale_parts(dir);
+    for (int attempt = 0; attempt < 8; attempt++) {
+        new_session_id(id);
+        snprintf(part, size, "%s/%s%s", dir, id, SESSION_PART_SUFFIX);
+        int fd = open(part, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            close(fd);
+            *offset = 0;
+            return 0;
+        }
+        if (errno != EEXIST) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Function to start a multipart upload: a new session whose part file is reserved at the full size
+int dfs_session_begin(const char *dir, uint64_t total, char id[DFS_SESSION_ID_LEN + 1], char *part, size_t size) {
+    uint64_t offset;
+    if (dfs_session_open(dir, NULL, id, part, size, &offset) != 0) {
+        return -1;
+    }
+    int fd = open(part, O_WRONLY);
+    if (fd < 0 || (posix_fallocate(fd, 0, total) != 0 && ftruncate(fd, total) != 0)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(part);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to find the part file of an existing session; -1 if there is none
+int dfs_session_lookup(const char *dir, const char *id, char *part, size_t size) {
+    struct stat st;
+    snprintf(part, size, "%s/%s%s", dir, id, SESSION_PART_SUFFIX);
+    return stat(part, &st) == 0 && S_ISREG(st.st_mode) ? 0 : -1;
+}
+
+// Function to write one part of a multipart upload, a raw DATA frame, at its offset in the session's
+// part file. The part has to fit in the size the upload was opened with; writes land with pwrite, so
+// parts arriving on other connections at the same time do not disturb each other. Returns
+// DFS_CHECKSUM_MISMATCH when the part does not match its CHECKSUM frame
+int dfs_session_receive_part(int sock, const DfsHeader *data, const char *part, uint64_t offset) {
+    uint32_t expected;
+    if (data->flags & DFS_FLAG_DEFLATE) {
+        // Parts are taken raw only; a compressed run is read to its end to keep the connection in sync
+        DfsHeader frame = *data;
+        while (dfs_discard(sock, frame.payload_len) == 0) {
+            if (frame.status != DFS_STATUS_READY) {
+                dfs_recv_checksum(sock, &expected);
+                break;
+            }
+            if (dfs_recv_header(sock, &frame) != 0) {
+                break;
+            }
+        }
+        return -1;
+    }
+
+    int fd = open(part, O_WRONLY);
+    struct stat st;
+    char *buffer = malloc(SESSION_PART_BUFFER);
+    int result = fd >= 0 && buffer && fstat(fd, &st) == 0 && offset <= (uint64_t)st.st_size &&
+                 data->payload_len <= (uint64_t)st.st_size - offset ? 0 : -1;
+
+    uint64_t remaining = data->payload_len;
+    uint64_t position = offset;
+    uint32_t crc = 0;
+    int connected = 1;
+    while (result == 0 && remaining > 0) {
+        size_t want = remaining < SESSION_PART_BUFFER ? remaining : SESSION_PART_BUFFER;
+        if (dfs_recv_all(sock, buffer, want) != 0) {
+            result = -1;
+            connected = 0;
+            break;
+        }
+        remaining -= want;
+        crc = dfs_crc32c(crc, buffer, want);
+        for (size_t written = 0; written < want;) {
+            ssize_t n = pwrite(fd, buffer + written, want - written, position + written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                result = -1;
+                break;
+            }
+            written += n;
+        }
+        position += want;
+    }
+    if (connected && (dfs_discard(sock, remaining) != 0 || dfs_recv_checksum(sock, &expected) != 0)) {
+        result = -1;
+    } else if (connected && result == 0 && crc != expected) {
+        result = DFS_CHECKSUM_MISMATCH;   // the sender resends the part over the same bytes
+    }
+
+    // The part is durable before the sender is told it arrived
+    if (result == 0 && fdatasync(fd) != 0) {
+        result = -1;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buffer);
+    return result;
+}
+
+// Function to check that a finished part file has the digest the sender named (if it named one),
+// keeping the file's CRC32C with it from the same pass so it can be sent without rehashing
+int dfs_session_verify(const char *part, const char *hex) {
+    int fd = open(part, O_RDONLY);
+    unsigned char *buffer = malloc(SESSION_PART_BUFFER);
+    int result = fd >= 0 && buffer ? 0 : -1;
+    DfsSha256 ctx;
+    dfs_sha256_init(&ctx);
+    uint32_t crc = 0;
+    while (result == 0) {
+        ssize_t bytes_read = read(fd, buffer, SESSION_PART_BUFFER);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            result = bytes_read < 0 ? -1 : 0;
+            break;
+        }
+        dfs_sha256_update(&ctx, buffer, bytes_read);
+        crc = dfs_crc32c(crc, buffer, bytes_read);
+    }
+
+    char actual[DFS_SHA256_HEX_LEN + 1];
+    dfs_sha256_hex(&ctx, actual);
+    if (result == 0 && hex && strcmp(actual, hex) != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        dfs_crc32c_set_attr(fd, crc);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buffer);
+    return result;
+}
+
+// Function to read a " range=" word; the whole file when there is none. Returns -1 if it is malformed
+int dfs_session_parse_range(const char *command, DfsRange *range) {
+    range->suffix = 0;
+    range->first = 0;
+    range->last = DFS_RANGE_TO_END;
+
+    char spec[48];
+    if (find_word(command, " range=", "0123456789-", spec, sizeof(spec)) == 0) {
+        return strstr(command, " range=") ? -1 : 0;
+    }
+
+    char *dash = strchr(spec, '-');
+    if (!dash || strchr(dash + 1, '-')) {
+        return -1;
+    }
+    *dash = '\0';
+    if (spec[0] == '\0') {
+        // -<n>: the last n bytes
+        if (dash[1] == '\0') {
+            return -1;
+        }
+        range->suffix = 1;
+        range->last = strtoull(dash + 1, NULL, 10);
+        return 0;
+    }
+    range->first = strtoull(spec, NULL, 10);
+    if (dash[1] != '\0') {
+        range->last = strtoull(dash + 1, NULL, 10);
+        if (range->last < range->first) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to write a range back as a " range=" word, or nothing for the whole file (returns the
+// length it needed, as snprintf does)
+int dfs_session_format_range(const DfsRange *range, char *word, size_t size) {
+    if (range->suffix) {
+        return snprintf(word, size, " range=-%" PRIu64, range->last);
+    }
+    if (range->last != DFS_RANGE_TO_END) {
+        return snprintf(word, size, " range=%" PRIu64 "-%" PRIu64, range->first, range->last);
+    }
+    if (range->first > 0) {
+        return snprintf(word, size, " range=%" PRIu64 "-", range->first);
+    }
+    if (size > 0) {
+        word[0] = '\0';
+    }
+    return 0;
+}
+
+// Function to turn a range into the offset and length to send from a file of this size; -1 if it starts
+// past the end
+int dfs_session_resolve_range(const DfsRange *range, uint64_t size, uint64_t *offset, uint64_t *length) {
+    if (range->suffix) {
+        *length = range->last < size ? range->last : size;
+        *offset = size - *length;
+        return 0;
+    }
+    if (range->first > size) {
+        return -1;
+    }
+    uint64_t end = range->last != DFS_RANGE_TO_END && range->last < size ? range->last + 1 : size;
+    *offset = range->first;
+    *length = end > range->first ? end - range->first : 0;
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef DFS_SESSION_H
+#define DFS_SESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dfs_protocol.h"
+
+/*
+ * Resumable uploadf/downlf transfers.
+ *
+ * Whoever receives an upload (S1 for .c, S2/S3/S4 for the rest) keeps the
+ * body in <dir>/<session id>.part until it is complete and only then
+ * renames it into place, so a broken transfer never leaves a partial file
+ * at the destination. The READY reply names the session and the bytes it
+ * already holds ("READY_TO_RECEIVE session=<id> offset=<n>"); the sender
+ * sends the file from that offset on. A later attempt that repeats the
+ * command with "resume=<id>" continues the same part file, and one whose
+ * part is gone simply starts a new session at offset 0. Parts left behind
+ * for DFS_SESSION_MAX_AGE seconds are removed when a new session starts.
+ *
+ * A large upload can instead go up as a multipart upload, its parts sent
+ * side by side over separate connections. "multipart=<size>" (with the
+ * file's sha256=) opens a session whose part file is reserved at the full
+ * size, answered OK with "MULTIPART session=<id>" (or stored outright when
+ * the content is already held). Each "resume=<id> part=<offset>" is then
+ * answered READY and followed by one raw DATA frame written at that offset.
+ * "resume=<id> commit" with the sha256= word publishes the file in one
+ * rename once the part file hashes to that digest; a mismatch discards it.
+ * Each part's DATA frame is closed by a CHECKSUM frame like any other body,
+ * and a part that does not match it is refused so the sender can resend it.
+ *
+ * downlf resumes from the client's side by asking for a byte range that
+ * starts where its copy ends. A "range=" word on downlf (passed on to the
+ * backend's SEND) takes the HTTP forms: <first>-<last> (inclusive),
+ * <first>- for the rest of the file, or -<n> for the last n bytes. Only
+ * the range is read and sent, as one DATA frame or compressed run; a
+ * range starting past the end of the file is refused as INVALID.
+ */
+
+#define DFS_SESSION_ID_LEN 16
+#define DFS_SESSION_MAX_AGE (24 * 60 * 60)
+#define DFS_RANGE_TO_END UINT64_MAX
+
+// Requested byte range; suffix means the last 'last' bytes
+typedef struct {
+    int suffix;
+    uint64_t first;
+    uint64_t last;                 /* inclusive, or DFS_RANGE_TO_END */
+} DfsRange;
+
+int dfs_session_find_id(const char *command, char id[DFS_SESSION_ID_LEN + 1]);
+int dfs_session_find_offset(const char *command, uint64_t *offset);
+int dfs_session_open(const char *dir, const char *resume_id, char id[DFS_SESSION_ID_LEN + 1],
+                     char *part, size_t size, uint64_t *offset);
+int dfs_session_find_multipart(const char *command, uint64_t *size);
+int dfs_session_find_part(const char *command, uint64_t *offset);
+int dfs_session_is_commit(const char *command);
+int dfs_session_wants_split(const char *command);
+int dfs_session_begin(const char *dir, uint64_t total, char id[DFS_SESSION_ID_LEN + 1], char *part, size_t size);
+int dfs_session_lookup(const char *dir, const char *id, char *part, size_t size);
+int dfs_session_receive_part(int sock, const DfsHeader *data, const char *part, uint64_t offset);
+int dfs_session_verify(const char *part, const char *hex);
+int dfs_session_parse_range(const char *command, DfsRange *range);
+int dfs_session_format_range(const DfsRange *range, char *word, size_t size);
+int dfs_session_resolve_range(const DfsRange *range, uint64_t size, uint64_t *offset, uint64_t *length);
+
+#endif
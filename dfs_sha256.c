@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "dfs_sha256.h"
+
+#define SHA256_READ_BUFFER (64 * 1024)
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Function to mix one 64-byte block into the state
+static void compress_block(uint32_t state[8], const unsigned char *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                      round_constants[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// Function to start a new digest
+void dfs_sha256_init(DfsSha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+// Function to hash another piece of the stream
+void dfs_sha256_update(DfsSha256 *ctx, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    ctx->length += len;
+
+    // Top up a partial block first, then take whole blocks straight from the buffer
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used < 64) {
+            return;
+        }
+        compress_block(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    while (len >= 64) {
+        compress_block(ctx->state, p);
+        p += 64;
+        len -= 64;
+    }
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
+}
+
+// Function to finish the digest and write it as hex
+void dfs_sha256_hex(DfsSha256 *ctx, char hex[DFS_SHA256_HEX_LEN + 1]) {
+    uint64_t bits = ctx->length * 8;
+
+    // Pad with 0x80 and zeros to 56 bytes mod 64, then the big-endian bit length
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = ctx->used < 56 ? 56 - ctx->used : 120 - ctx->used;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    dfs_sha256_update(ctx, pad, pad_len + 8);
+
+    for (int i = 0; i < 8; i++) {
+        snprintf(hex + 8 * i, 9, "%08x", ctx->state[i]);
+    }
+}
+
+// Function to hash an open file from its current offset to the end
+int dfs_sha256_file(int fd, char hex[DFS_SHA256_HEX_LEN + 1]) {
+    unsigned char buffer[SHA256_READ_BUFFER];
+    DfsSha256 ctx;
+    dfs_sha256_init(&ctx);
+    while (1) {
+        ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        dfs_sha256_update(&ctx, buffer, bytes_read);
+    }
+    dfs_sha256_hex(&ctx, hex);
+    return 0;
+}
+
+// Function to read the digest from a "sha256=<hex>" word of a command; returns 1 if one is there
+int dfs_sha256_find_word(const char *command, char hex[DFS_SHA256_HEX_LEN + 1]) {
+    const char *word = strstr(command, " sha256=");
+    if (!word) {
+        return 0;
+    }
+    word += strlen(" sha256=");
+    size_t len = strspn(word, "0123456789abcdef");
+    if (len != DFS_SHA256_HEX_LEN || (word[len] != '\0' && word[len] != ' ')) {
+        return 0;
+    }
+    memcpy(hex, word, len);
+    hex[len] = '\0';
+    return 1;
+}
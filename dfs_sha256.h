@@ -0,0 +1,29 @@
+#ifndef DFS_SHA256_H
+#define DFS_SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * SHA-256 (FIPS 180-4), the content key of the backends' blob store.
+ *
+ * Feed the stream in any number of pieces with dfs_sha256_update(), then
+ * dfs_sha256_hex() writes the digest as 64 lowercase hex digits.
+ */
+
+#define DFS_SHA256_HEX_LEN 64
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;               /* bytes hashed so far */
+    unsigned char block[64];
+    size_t used;                   /* bytes waiting in block */
+} DfsSha256;
+
+void dfs_sha256_init(DfsSha256 *ctx);
+void dfs_sha256_update(DfsSha256 *ctx, const void *buf, size_t len);
+void dfs_sha256_hex(DfsSha256 *ctx, char hex[DFS_SHA256_HEX_LEN + 1]);
+int dfs_sha256_file(int fd, char hex[DFS_SHA256_HEX_LEN + 1]);
+int dfs_sha256_find_word(const char *command, char hex[DFS_SHA256_HEX_LEN + 1]);
+
+#endif
@@ -0,0 +1,1027 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "dfs_tar.h"
+#include "dfs_protocol.h"
+#include "dfs_crc32c.h"
+
+#define TAR_PATH_MAX 4096
+#define TAR_NAME_LEN 100
+#define TAR_PREFIX_LEN 155
+#define TAR_MAX_OCTAL_SIZE 077777777777ULL   /* largest size an 11-digit ustar field holds */
+#define TAR_COPY_BUFFER (64 * 1024)
+
+typedef int (*TarVisitFn)(void *ctx, const char *path, const char *name, const struct stat *st);
+
+// Chunked stream state: pending bytes plus the running length and checksum
+typedef struct {
+    int sock;
+    uint32_t request_id;
+    char *buffer;
+    size_t used;
+    uint64_t total;
+    uint32_t crc;
+    int files;
+    DfsTarFilter *filter;
+} TarChunkStream;
+
+// Growable text buffer for trailers
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} TarText;
+
+// Cached archive file being written, doubling as its index record
+typedef struct {
+    int fd;
+    uint64_t size;
+    uint32_t crc;
+    int files;
+} TarCacheWriter;
+
+// Function to round a length up to a whole number of tar blocks
+static uint64_t pad_to_block(uint64_t len) {
+    return (len + DFS_TAR_BLOCK_SIZE - 1) / DFS_TAR_BLOCK_SIZE * DFS_TAR_BLOCK_SIZE;
+}
+
+// Function to write a zero-padded octal number into a header field (callers keep the value within
+// width - 1 digits; larger ones go in pax records)
+static void put_octal(char *field, size_t width, uint64_t value) {
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i > 0; i--) {
+        field[i - 1] = (char)('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+// Function to find where a long name can be split into ustar prefix and name (-1 if nowhere)
+static int find_ustar_split(const char *name) {
+    size_t len = strlen(name);
+    if (len <= TAR_NAME_LEN) {
+        return 0;
+    }
+    for (size_t i = 0; i < len && i <= TAR_PREFIX_LEN; i++) {
+        if (name[i] == '/' && len - i - 1 <= TAR_NAME_LEN && len - i - 1 > 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Function to append one self-describing "<len> key=value\n" pax record
+static size_t add_pax_record(char *buf, size_t used, size_t size, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;   // space, '=' and newline
+    size_t total = body + 1;
+    char digits[24];
+
+    // The length prefix counts its own digits
+    while (snprintf(digits, sizeof(digits), "%zu", total) + body != total) {
+        total = snprintf(digits, sizeof(digits), "%zu", total) + body;
+    }
+    if (used + total <= size) {
+        snprintf(buf + used, size - used, "%zu %s=%s\n", total, key, value);
+    }
+    return used + total;
+}
+
+// Function to build the pax records an entry needs (returns 0 if plain ustar will do)
+static size_t build_pax_records(const DfsTarEntry *entry, char *buf, size_t size) {
+    size_t used = 0;
+    if (find_ustar_split(entry->name) < 0) {
+        used = add_pax_record(buf, used, size, "path", entry->name);
+    }
+    if (entry->size > TAR_MAX_OCTAL_SIZE) {
+        char value[24];
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)entry->size);
+        used = add_pax_record(buf, used, size, "size", value);
+    }
+    return used;
+}
+
+// Function to fill in a ustar header block
+static void build_header(unsigned char *block, const char *name, uint64_t size, uint32_t mode,
+                         uint32_t uid, uint32_t gid, int64_t mtime, char typeflag) {
+    char *h = (char *)block;
+    memset(block, 0, DFS_TAR_BLOCK_SIZE);
+
+    int split = find_ustar_split(name);
+    if (split > 0) {
+        memcpy(h + 345, name, split);
+        memcpy(h, name + split + 1, strlen(name) - split - 1);
+    } else {
+        // Too long for ustar: the pax header carries the real name
+        strncpy(h, name, TAR_NAME_LEN);
+    }
+
+    put_octal(h + 100, 8, mode & 07777);
+    put_octal(h + 108, 8, uid <= 07777777 ? uid : 0);
+    put_octal(h + 116, 8, gid <= 07777777 ? gid : 0);
+    put_octal(h + 124, 12, size <= TAR_MAX_OCTAL_SIZE ? size : 0);
+    put_octal(h + 136, 12, mtime > 0 ? (uint64_t)mtime : 0);
+    h[156] = typeflag;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    // Checksum is computed with its own field read as spaces
+    memset(h + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < DFS_TAR_BLOCK_SIZE; i++) {
+        sum += block[i];
+    }
+    snprintf(h + 148, 8, "%06o", sum);
+    h[155] = ' ';
+}
+
+// Function to write zero bytes to the sink
+static int write_zeros(DfsTarSink *sink, uint64_t len) {
+    static const char zeros[DFS_TAR_BLOCK_SIZE * 2];
+    while (len > 0) {
+        size_t chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (sink->write(sink->ctx, zeros, chunk) != 0) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to copy a file body through the sink's write callback
+static int copy_file_body(DfsTarSink *sink, int fd, uint64_t len) {
+    char *buffer = malloc(TAR_COPY_BUFFER);
+    if (!buffer) {
+        return -1;
+    }
+
+    // A whole body is checked against the checksum stored when it arrived, so a file damaged at rest
+    // fails the archive instead of going out under a checksum computed over the damage
+    struct stat st;
+    uint32_t stored;
+    int check = fstat(fd, &st) == 0 && (uint64_t)st.st_size == len && dfs_crc32c_get_attr(fd, &stored) == 0;
+    uint32_t crc = 0;
+    while (len > 0) {
+        size_t want = len < TAR_COPY_BUFFER ? len : TAR_COPY_BUFFER;
+        ssize_t bytes_read = read(fd, buffer, want);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0 || sink->write(sink->ctx, buffer, bytes_read) != 0) {
+            free(buffer);
+            return -1;
+        }
+        if (check) {
+            crc = dfs_crc32c(crc, buffer, bytes_read);
+        }
+        len -= bytes_read;
+    }
+    free(buffer);
+    return check && crc != stored ? -1 : 0;
+}
+
+// Function to add one file to the archive list
+static int add_entry(void *ctx, const char *path, const char *name, const struct stat *st) {
+    DfsTarArchive *tar = ctx;
+    if (tar->count == tar->capacity) {
+        int capacity = tar->capacity ? tar->capacity * 2 : 64;
+        DfsTarEntry *entries = realloc(tar->entries, capacity * sizeof(DfsTarEntry));
+        if (!entries) {
+            return -1;
+        }
+        tar->entries = entries;
+        tar->capacity = capacity;
+    }
+
+    DfsTarEntry *entry = &tar->entries[tar->count];
+    entry->path = strdup(path);
+    entry->name = strdup(name);
+    if (!entry->path || !entry->name) {
+        free(entry->path);
+        free(entry->name);
+        return -1;
+    }
+    entry->size = st->st_size;
+    entry->mode = st->st_mode;
+    entry->uid = st->st_uid;
+    entry->gid = st->st_gid;
+    entry->mtime = st->st_mtime;
+    tar->count++;
+    return 0;
+}
+
+// Function to walk a directory tree, visiting regular files with the extension
+static int walk_directory(const char *dir_path, const char *name_prefix, const char *extension,
+                          TarVisitFn visit, void *ctx) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char path[TAR_PATH_MAX];
+        char name[TAR_PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(path) ||
+            snprintf(name, sizeof(name), "%s/%s", name_prefix, entry->d_name) >= (int)sizeof(name) ||
+            lstat(path, &st) != 0) {
+            continue;
+        }
+
+        // Like find -type f: symlinks are neither followed nor archived
+        if (S_ISDIR(st.st_mode)) {
+            result = walk_directory(path, name, extension, visit, ctx);
+        } else if (S_ISREG(st.st_mode)) {
+            const char *dot = strrchr(entry->d_name, '.');
+            if (dot && dot != entry->d_name && strcmp(dot + 1, extension) == 0) {
+                result = visit(ctx, path, name, &st);
+            }
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+// Compare function for sorting entries by member name
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const DfsTarEntry *)a)->name, ((const DfsTarEntry *)b)->name);
+}
+
+// Function to prepare an empty archive list
+void dfs_tar_init(DfsTarArchive *tar) {
+    tar->entries = NULL;
+    tar->count = 0;
+    tar->capacity = 0;
+}
+
+// Function to collect every *.extension file under root as prefix/<relative path>
+int dfs_tar_collect(DfsTarArchive *tar, const char *root, const char *extension, const char *prefix) {
+    if (walk_directory(root, prefix, extension, add_entry, tar) != 0) {
+        return -1;
+    }
+    qsort(tar->entries, tar->count, sizeof(DfsTarEntry), compare_entries);
+    return 0;
+}
+
+// Function to compute the exact archive size from the collected metadata
+uint64_t dfs_tar_size(const DfsTarArchive *tar) {
+    uint64_t total = 0;
+    for (int i = 0; i < tar->count; i++) {
+        const DfsTarEntry *entry = &tar->entries[i];
+        size_t pax_len = build_pax_records(entry, NULL, 0);
+        if (pax_len > 0) {
+            total += DFS_TAR_BLOCK_SIZE + pad_to_block(pax_len);
+        }
+        total += DFS_TAR_BLOCK_SIZE + pad_to_block(entry->size);
+    }
+    // End-of-archive marker
+    return total + 2 * DFS_TAR_BLOCK_SIZE;
+}
+
+// Function to write one member: optional pax header, ustar header, body and padding
+static int write_entry(const DfsTarEntry *entry, DfsTarSink *sink) {
+    unsigned char block[DFS_TAR_BLOCK_SIZE];
+    char pax[TAR_PATH_MAX + 128];
+
+    // Names or sizes ustar cannot hold go in a pax extended header first
+    size_t pax_len = build_pax_records(entry, pax, sizeof(pax));
+    if (pax_len > 0) {
+        char pax_name[TAR_NAME_LEN];
+        const char *base = strrchr(entry->name, '/');
+        snprintf(pax_name, sizeof(pax_name), "PaxHeaders/%.80s", base ? base + 1 : entry->name);
+        build_header(block, pax_name, pax_len, 0644, 0, 0, entry->mtime, 'x');
+        if (sink->write(sink->ctx, block, DFS_TAR_BLOCK_SIZE) != 0 ||
+            sink->write(sink->ctx, pax, pax_len) != 0 ||
+            write_zeros(sink, pad_to_block(pax_len) - pax_len) != 0) {
+            return -1;
+        }
+    }
+
+    build_header(block, entry->name, entry->size, entry->mode, entry->uid, entry->gid,
+                 entry->mtime, '0');
+    if (sink->write(sink->ctx, block, DFS_TAR_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+
+    // Send what the file still holds; anything it lost since it was stat'ed becomes zeros
+    uint64_t available = 0;
+    int fd = open(entry->path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        available = (uint64_t)st.st_size < entry->size ? (uint64_t)st.st_size : entry->size;
+    }
+    int result = 0;
+    if (available > 0) {
+        result = sink->write_file ? sink->write_file(sink->ctx, fd, available)
+                                  : copy_file_body(sink, fd, available);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (result != 0) {
+        return -1;
+    }
+    return write_zeros(sink, pad_to_block(entry->size) - available);
+}
+
+// Function to write the whole archive to a sink, exactly dfs_tar_size() bytes long
+int dfs_tar_write(const DfsTarArchive *tar, DfsTarSink *sink) {
+    for (int i = 0; i < tar->count; i++) {
+        if (write_entry(&tar->entries[i], sink) != 0) {
+            return -1;
+        }
+    }
+    return write_zeros(sink, 2 * DFS_TAR_BLOCK_SIZE);
+}
+
+// Function to read a numeric header field, octal or GNU base-256
+static uint64_t parse_number(const unsigned char *field, size_t width) {
+    uint64_t value = 0;
+    if (field[0] & 0x80) {
+        for (size_t i = 1; i < width; i++) {
+            value = value << 8 | field[i];
+        }
+        return value;
+    }
+    for (size_t i = 0; i < width && field[i] != '\0'; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value << 3 | (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+// Function to decode a header block: 0 for a header, 1 for an end-of-archive block, -1 if corrupt
+int dfs_tar_parse_header(const unsigned char *block, char *typeflag, uint64_t *size) {
+    unsigned int sum = 0;
+    int zero = 1;
+    for (int i = 0; i < DFS_TAR_BLOCK_SIZE; i++) {
+        zero &= block[i] == 0;
+        sum += i >= 148 && i < 156 ? ' ' : block[i];
+    }
+    if (zero) {
+        return 1;
+    }
+    if (parse_number(block + 148, 8) != sum) {
+        return -1;
+    }
+    *typeflag = block[156];
+    *size = parse_number(block + 124, 12);
+    return 0;
+}
+
+// Function to find a size= record in pax extended header data (1 if found)
+int dfs_tar_pax_size(const char *records, size_t len, uint64_t *size) {
+    size_t offset = 0;
+    while (offset < len) {
+        char *end;
+        unsigned long long record_len = strtoull(records + offset, &end, 10);
+        if (record_len == 0 || offset + record_len > len || *end != ' ') {
+            return 0;
+        }
+        if ((size_t)(end + 1 - records) + 5 <= offset + record_len && strncmp(end + 1, "size=", 5) == 0) {
+            *size = strtoull(end + 6, NULL, 10);
+            return 1;
+        }
+        offset += record_len;
+    }
+    return 0;
+}
+
+// Function to send the pending bytes as one READY chunk
+static int chunk_flush(TarChunkStream *stream) {
+    if (stream->used == 0) {
+        return 0;
+    }
+    int result = dfs_send_frame(stream->sock, DFS_OP_DATA, DFS_STATUS_READY, stream->request_id,
+                                stream->buffer, stream->used);
+    stream->used = 0;
+    return result;
+}
+
+// Function to append archive bytes to the chunk stream
+static int chunk_write(void *ctx, const void *buf, size_t len) {
+    TarChunkStream *stream = ctx;
+    const char *p = buf;
+    stream->crc = dfs_crc32c(stream->crc, buf, len);
+    stream->total += len;
+
+    while (len > 0) {
+        size_t room = DFS_TAR_CHUNK_SIZE - stream->used;
+        size_t take = len < room ? len : room;
+        memcpy(stream->buffer + stream->used, p, take);
+        stream->used += take;
+        p += take;
+        len -= take;
+        if (stream->used == DFS_TAR_CHUNK_SIZE && chunk_flush(stream) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to put a file body on the chunk stream; large bodies become their own sendfile chunk
+static int chunk_write_file(void *ctx, int fd, uint64_t len) {
+    TarChunkStream *stream = ctx;
+    DfsTarSink sink = {chunk_write, NULL, stream};
+    if (len <= DFS_TAR_INLINE_MAX) {
+        return copy_file_body(&sink, fd, len);
+    }
+
+    if (chunk_flush(stream) != 0) {
+        return -1;
+    }
+
+    // A file that arrived with its checksum stored is folded into the stream's CRC without reading it;
+    // otherwise checksum the range first (the emptied chunk buffer is scratch space). Either way the
+    // body is then sent untouched
+    struct stat st;
+    uint32_t stored;
+    uint64_t offset = 0;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size == len && dfs_crc32c_get_attr(fd, &stored) == 0) {
+        stream->crc = dfs_crc32c_combine(stream->crc, stored, len);
+        offset = len;
+    }
+    while (offset < len) {
+        size_t want = len - offset < DFS_TAR_CHUNK_SIZE ? len - offset : DFS_TAR_CHUNK_SIZE;
+        ssize_t bytes_read = pread(fd, stream->buffer, want, offset);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        stream->crc = dfs_crc32c(stream->crc, stream->buffer, bytes_read);
+        offset += bytes_read;
+    }
+    stream->total += len;
+
+    return dfs_send_file_frame(stream->sock, DFS_OP_DATA, DFS_STATUS_READY, stream->request_id, fd, len);
+}
+
+// Function to append one line to a text buffer
+static int text_append(TarText *text, const char *line) {
+    size_t len = strlen(line);
+    if (text->len + len + 2 > text->capacity) {
+        size_t capacity = text->capacity ? text->capacity * 2 : 4096;
+        while (capacity < text->len + len + 2) {
+            capacity *= 2;
+        }
+        char *data = realloc(text->data, capacity);
+        if (!data) {
+            return -1;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+    memcpy(text->data + text->len, line, len);
+    text->len += len;
+    text->data[text->len++] = '\n';
+    text->data[text->len] = '\0';
+    return 0;
+}
+
+// Compare function for manifest entries by member name
+static int compare_manifest(const void *a, const void *b) {
+    return strcmp(((const DfsManifestEntry *)a)->name, ((const DfsManifestEntry *)b)->name);
+}
+
+// Compare function for sorting deleted names
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to decide whether the filter lets a file into an incremental archive
+static int filter_accepts(DfsTarFilter *filter, const char *name, const struct stat *st) {
+    if (!filter) {
+        return 1;
+    }
+    if (filter->since >= 0 && st->st_mtime < filter->since) {
+        return 0;
+    }
+    if (filter->manifest_count > 0) {
+        DfsManifestEntry key = {(char *)name, 0, 0, 0};
+        DfsManifestEntry *known = bsearch(&key, filter->manifest, filter->manifest_count,
+                                          sizeof(DfsManifestEntry), compare_manifest);
+        if (known) {
+            known->seen = 1;
+            return known->size != (uint64_t)st->st_size || known->mtime != (int64_t)st->st_mtime;
+        }
+    }
+    return 1;
+}
+
+// Function to list the members removed since the client's copy, one name per line
+static int collect_deletions(DfsTarFilter *filter, const char *root, const char *extension,
+                             const char *prefix, TarText *trailer) {
+    int count = 0;
+    size_t prefix_len = strlen(prefix);
+
+    // Manifest entries of this type that the walk never met are gone
+    for (int i = 0; filter && i < filter->manifest_count; i++) {
+        const char *name = filter->manifest[i].name;
+        const char *dot = strrchr(name, '.');
+        if (filter->manifest[i].seen || strncmp(name, prefix, prefix_len) != 0 || name[prefix_len] != '/' ||
+            !dot || strcmp(dot + 1, extension) != 0) {
+            continue;
+        }
+        if (text_append(trailer, name) != 0) {
+            return -1;
+        }
+        count++;
+    }
+    if (!filter || filter->since < 0 || !filter->deletion_log) {
+        return count;
+    }
+
+    // Otherwise consult the removal log, skipping names that exist again
+    FILE *log = fopen(filter->deletion_log, "r");
+    if (!log) {
+        return count;
+    }
+    char line[TAR_PATH_MAX + 32];
+    char **names = NULL;
+    int name_count = 0;
+    int name_capacity = 0;
+    while (fgets(line, sizeof(line), log)) {
+        long long removed_at;
+        int offset;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%lld %n", &removed_at, &offset) != 1 || removed_at < filter->since) {
+            continue;
+        }
+        const char *name = line + offset;
+
+        char path[TAR_PATH_MAX];
+        struct stat st;
+        if (strncmp(name, prefix, prefix_len) != 0 ||
+            snprintf(path, sizeof(path), "%s%s", root, name + prefix_len) >= (int)sizeof(path) ||
+            lstat(path, &st) == 0) {
+            continue;
+        }
+        if (name_count == name_capacity) {
+            name_capacity = name_capacity ? name_capacity * 2 : 64;
+            char **grown = realloc(names, name_capacity * sizeof(char *));
+            if (!grown) {
+                break;
+            }
+            names = grown;
+        }
+        if ((names[name_count] = strdup(name)) != NULL) {
+            name_count++;
+        }
+    }
+    fclose(log);
+
+    // A file removed several times is reported once
+    qsort(names, name_count, sizeof(char *), compare_names);
+    int result = count;
+    for (int i = 0; i < name_count; i++) {
+        if (result >= 0 && (i == 0 || strcmp(names[i], names[i - 1]) != 0)) {
+            result = text_append(trailer, names[i]) == 0 ? result + 1 : -1;
+        }
+        free(names[i]);
+    }
+    free(names);
+    return result;
+}
+
+// Function to archive one file as soon as the walk reaches it
+static int stream_entry(void *ctx, const char *path, const char *name, const struct stat *st) {
+    TarChunkStream *stream = ctx;
+    if (!filter_accepts(stream->filter, name, st)) {
+        return 0;
+    }
+    DfsTarEntry entry = {(char *)path, (char *)name, st->st_size, st->st_mode,
+                         st->st_uid, st->st_gid, st->st_mtime};
+    DfsTarSink sink = {chunk_write, chunk_write_file, stream};
+    if (write_entry(&entry, &sink) != 0) {
+        return -1;
+    }
+    stream->files++;
+    return 0;
+}
+
+// Function to stream an archive of root as READY chunks plus an OK trailer; returns members
+// plus deletions sent (0 means nothing was sent)
+int dfs_tar_stream(int sock, uint32_t request_id, const char *root, const char *extension,
+                   const char *prefix, DfsTarFilter *filter) {
+    TarChunkStream stream = {sock, request_id, malloc(DFS_TAR_CHUNK_SIZE), 0, 0, 0, 0, filter};
+    if (!stream.buffer) {
+        return -1;
+    }
+
+    TarText trailer = {NULL, 0, 0};
+    DfsTarSink sink = {chunk_write, NULL, &stream};
+    int result = walk_directory(root, prefix, extension, stream_entry, &stream);
+    int deleted = result == 0 ? collect_deletions(filter, root, extension, prefix, &trailer) : 0;
+    if (deleted < 0) {
+        result = -1;
+    }
+    if (result == 0 && stream.files + deleted > 0) {
+        // End-of-archive marker, then the trailer the receiver checks against what it got
+        char summary[64];
+        result = write_zeros(&sink, 2 * DFS_TAR_BLOCK_SIZE);
+        if (result == 0) {
+            result = chunk_flush(&stream);
+        }
+        if (result == 0) {
+            snprintf(summary, sizeof(summary), "%llu %08x\n", (unsigned long long)stream.total, stream.crc);
+            struct iovec parts[2] = {{summary, strlen(summary)}, {trailer.data, trailer.len}};
+            result = dfs_send_header(sock, DFS_OP_DATA, DFS_STATUS_OK, request_id,
+                                     parts[0].iov_len + parts[1].iov_len);
+            for (int i = 0; result == 0 && i < 2; i++) {
+                result = parts[i].iov_len ? dfs_send_all(sock, parts[i].iov_base, parts[i].iov_len) : 0;
+            }
+        }
+    }
+    free(trailer.data);
+    free(stream.buffer);
+    return result == 0 ? stream.files + deleted : -1;
+}
+
+// Function to read a downltar option: 0 for since=<time>, 1 when a manifest frame follows, -1 if invalid
+int dfs_tar_parse_option(const char *option, DfsTarFilter *filter) {
+    long long since;
+    char extra;
+    if (sscanf(option, "since=%lld%c", &since, &extra) == 1 && since >= 0) {
+        filter->since = since;
+        return 0;
+    }
+    return strcmp(option, "manifest") == 0 ? 1 : -1;
+}
+
+// Function to narrow an archive to the subtree path of base, filling the walk root and member
+// prefix; returns 1 for a subtree, 0 for the whole store (path NULL or base itself), -1 if invalid
+int dfs_tar_scope(const char *base, const char *path, char *root, char *prefix, size_t size) {
+    size_t base_len = strlen(base);
+    char relative[TAR_PATH_MAX];
+    if (path && (strncmp(path, base, base_len) != 0 || (path[base_len] != '\0' && path[base_len] != '/'))) {
+        return -1;
+    }
+    if (snprintf(relative, sizeof(relative), "%s", path ? path + base_len : "") >= (int)sizeof(relative)) {
+        return -1;
+    }
+
+    // "~/S1/dir/" names the same subtree as "~/S1/dir"; ".." must not climb out of it
+    size_t len = strlen(relative);
+    while (len > 0 && relative[len - 1] == '/') {
+        relative[--len] = '\0';
+    }
+    for (const char *p = strstr(relative, "/."); p; p = strstr(p + 1, "/.")) {
+        if (p[2] == '\0' || p[2] == '/' || (p[2] == '.' && (p[3] == '\0' || p[3] == '/'))) {
+            return -1;
+        }
+    }
+    if (strstr(relative, "//") != NULL ||
+        snprintf(root, size, "%s%s", base, relative) >= (int)size ||
+        snprintf(prefix, size, "S1%s", relative) >= (int)size) {
+        return -1;
+    }
+    return len > 0;
+}
+
+// Function to receive a manifest DATA frame as a NUL-terminated string
+char *dfs_tar_recv_manifest(int sock, uint64_t *len) {
+    DfsHeader header;
+    if (dfs_recv_header(sock, &header) != 0 || header.opcode != DFS_OP_DATA) {
+        return NULL;
+    }
+    char *text = header.payload_len <= DFS_TAR_MANIFEST_MAX ? malloc(header.payload_len + 1) : NULL;
+    if (!text) {
+        dfs_discard(sock, header.payload_len);
+        return NULL;
+    }
+    if (dfs_recv_all(sock, text, header.payload_len) != 0) {
+        free(text);
+        return NULL;
+    }
+    text[header.payload_len] = '\0';
+    *len = header.payload_len;
+    return text;
+}
+
+// Function to parse a client manifest ("<size> <mtime> <member name>" per line) in place
+int dfs_tar_load_manifest(DfsTarFilter *filter, char *text) {
+    int capacity = 0;
+    filter->manifest = NULL;
+    filter->manifest_count = 0;
+
+    char *saveptr;
+    for (char *line = strtok_r(text, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        unsigned long long size;
+        long long mtime;
+        int offset;
+        if (sscanf(line, "%llu %lld %n", &size, &mtime, &offset) != 2 || line[offset] == '\0') {
+            continue;
+        }
+        if (filter->manifest_count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            DfsManifestEntry *grown = realloc(filter->manifest, capacity * sizeof(DfsManifestEntry));
+            if (!grown) {
+                dfs_tar_free_filter(filter);
+                return -1;
+            }
+            filter->manifest = grown;
+        }
+        DfsManifestEntry *entry = &filter->manifest[filter->manifest_count++];
+        entry->name = line + offset;
+        entry->size = size;
+        entry->mtime = mtime;
+        entry->seen = 0;
+    }
+    qsort(filter->manifest, filter->manifest_count, sizeof(DfsManifestEntry), compare_manifest);
+    return 0;
+}
+
+// Function to release the manifest a filter holds
+void dfs_tar_free_filter(DfsTarFilter *filter) {
+    free(filter->manifest);
+    filter->manifest = NULL;
+    filter->manifest_count = 0;
+}
+
+// Function to record a removal so since= archives can report it
+int dfs_tar_log_deletion(const char *cache_dir, const char *root, const char *extension,
+                         const char *prefix, const char *path) {
+    size_t root_len = strlen(root);
+    if (strncmp(path, root, root_len) != 0 || path[root_len] != '/') {
+        return 0;
+    }
+
+    char log_path[TAR_PATH_MAX];
+    mkdir(cache_dir, 0700);
+    snprintf(log_path, sizeof(log_path), "%s/%s.deleted", cache_dir, extension);
+    FILE *log = fopen(log_path, "a");
+    if (!log) {
+        return -1;
+    }
+    fprintf(log, "%lld %s%s\n", (long long)time(NULL), prefix, path + root_len);
+    return fclose(log);
+}
+
+// Function to release everything an archive list holds
+void dfs_tar_free(DfsTarArchive *tar) {
+    for (int i = 0; i < tar->count; i++) {
+        free(tar->entries[i].path);
+        free(tar->entries[i].name);
+    }
+    free(tar->entries);
+    dfs_tar_init(tar);
+}
+
+// Function to write archive bytes to a cache file, tracking its length and checksum
+static int cache_write(void *ctx, const void *buf, size_t len) {
+    TarCacheWriter *writer = ctx;
+    const char *p = buf;
+    writer->crc = dfs_crc32c(writer->crc, buf, len);
+    writer->size += len;
+    while (len > 0) {
+        ssize_t written = write(writer->fd, p, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Function to take the per-type cache lock (returns the lock descriptor)
+static int cache_lock(const char *cache_dir, const char *extension, int operation) {
+    char lock_path[TAR_PATH_MAX];
+    mkdir(cache_dir, 0700);
+    snprintf(lock_path, sizeof(lock_path), "%s/%s.lock", cache_dir, extension);
+    int fd = open(lock_path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    while (flock(fd, operation) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// Function to release the cache lock
+static void cache_unlock(int lock_fd) {
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+// Function to read the cache index ("<files> <member bytes> <crc32c>"); -1 when there is no cache
+static int cache_read_index(const char *cache_dir, const char *extension, TarCacheWriter *index) {
+    char index_path[TAR_PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s.idx", cache_dir, extension);
+    FILE *fp = fopen(index_path, "r");
+    if (!fp) {
+        return -1;
+    }
+    unsigned long long size;
+    unsigned int crc;
+    int parsed = fscanf(fp, "%d %llu %x", &index->files, &size, &crc);
+    fclose(fp);
+    if (parsed != 3) {
+        return -1;
+    }
+    index->size = size;
+    index->crc = crc;
+    return 0;
+}
+
+// Function to replace the cache index atomically
+static int cache_write_index(const char *cache_dir, const char *extension, const TarCacheWriter *index) {
+    char index_path[TAR_PATH_MAX];
+    char temp_path[TAR_PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s.idx", cache_dir, extension);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.idx.tmp", cache_dir, extension);
+
+    FILE *fp = fopen(temp_path, "w");
+    if (!fp) {
+        return -1;
+    }
+    fprintf(fp, "%d %llu %08x\n", index->files, (unsigned long long)index->size, index->crc);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fclose(fp);
+        unlink(temp_path);
+        return -1;
+    }
+    fclose(fp);
+    return rename(temp_path, index_path);
+}
+
+// Function to build the cached archive from scratch; caller holds the exclusive lock
+static int cache_build(const char *cache_dir, const char *root, const char *extension, const char *prefix) {
+    char tar_path[TAR_PATH_MAX];
+    char temp_path[TAR_PATH_MAX];
+    snprintf(tar_path, sizeof(tar_path), "%s/%s.tar", cache_dir, extension);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.tar.tmp", cache_dir, extension);
+
+    DfsTarArchive tar;
+    dfs_tar_init(&tar);
+    if (dfs_tar_collect(&tar, root, extension, prefix) != 0) {
+        dfs_tar_free(&tar);
+        return -1;
+    }
+
+    // The file holds members only; the end-of-archive marker is added when it is served
+    TarCacheWriter writer = {open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600), 0, 0, tar.count};
+    DfsTarSink sink = {cache_write, NULL, &writer};
+    int result = writer.fd < 0 ? -1 : 0;
+    for (int i = 0; result == 0 && i < tar.count; i++) {
+        result = write_entry(&tar.entries[i], &sink);
+    }
+    dfs_tar_free(&tar);
+    if (writer.fd >= 0) {
+        if (result == 0 && fsync(writer.fd) != 0) {
+            result = -1;
+        }
+        close(writer.fd);
+    }
+
+    // A new inode, so readers still sending the old archive are not disturbed
+    if (result != 0 || rename(temp_path, tar_path) != 0 ||
+        cache_write_index(cache_dir, extension, &writer) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to send the cached archive for a type, building it first if needed; returns files sent
+int dfs_tar_cache_send(int sock, uint32_t request_id, const char *cache_dir, const char *root,
+                       const char *extension, const char *prefix) {
+    TarCacheWriter index;
+    char tar_path[TAR_PATH_MAX];
+    snprintf(tar_path, sizeof(tar_path), "%s/%s.tar", cache_dir, extension);
+
+    int lock_fd = cache_lock(cache_dir, extension, LOCK_SH);
+    if (lock_fd < 0) {
+        return dfs_tar_stream(sock, request_id, root, extension, prefix, NULL);
+    }
+    if (cache_read_index(cache_dir, extension, &index) != 0) {
+        // Trade the shared lock for an exclusive one; someone else may have built it meanwhile
+        cache_unlock(lock_fd);
+        lock_fd = cache_lock(cache_dir, extension, LOCK_EX);
+        if (lock_fd < 0 ||
+            (cache_read_index(cache_dir, extension, &index) != 0 &&
+             (cache_build(cache_dir, root, extension, prefix) != 0 ||
+              cache_read_index(cache_dir, extension, &index) != 0))) {
+            if (lock_fd >= 0) {
+                cache_unlock(lock_fd);
+            }
+            return dfs_tar_stream(sock, request_id, root, extension, prefix, NULL);
+        }
+    }
+
+    // Appends only ever write past index.size, so the lock is not needed once the file is open
+    int fd = open(tar_path, O_RDONLY);
+    cache_unlock(lock_fd);
+    if (fd < 0) {
+        return dfs_tar_stream(sock, request_id, root, extension, prefix, NULL);
+    }
+    if (index.files == 0) {
+        close(fd);
+        return 0;
+    }
+
+    // One sendfile of the ready-made members, then the end marker and the trailer
+    static const char end_marker[2 * DFS_TAR_BLOCK_SIZE];
+    char trailer[64];
+    uint32_t crc = dfs_crc32c(index.crc, end_marker, sizeof(end_marker));
+    snprintf(trailer, sizeof(trailer), "%llu %08x",
+             (unsigned long long)(index.size + sizeof(end_marker)), crc);
+    int result = dfs_send_file_frame(sock, DFS_OP_DATA, DFS_STATUS_READY, request_id, fd, index.size);
+    close(fd);
+    if (result != 0 ||
+        dfs_send_frame(sock, DFS_OP_DATA, DFS_STATUS_READY, request_id, end_marker, sizeof(end_marker)) != 0 ||
+        dfs_send_message(sock, DFS_OP_DATA, DFS_STATUS_OK, request_id, trailer) != 0) {
+        return -1;
+    }
+    return index.files;
+}
+
+// Function to append a newly stored file to an existing cached archive
+int dfs_tar_cache_append(const char *cache_dir, const char *root, const char *extension,
+                         const char *prefix, const char *path) {
+    // Only files of this type under root belong in the archive
+    size_t root_len = strlen(root);
+    const char *dot = strrchr(path, '.');
+    if (strncmp(path, root, root_len) != 0 || path[root_len] != '/' || !dot || strcmp(dot + 1, extension) != 0) {
+        return 0;
+    }
+
+    struct stat st;
+    char name[TAR_PATH_MAX];
+    if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+        snprintf(name, sizeof(name), "%s%s", prefix, path + root_len) >= (int)sizeof(name)) {
+        return dfs_tar_cache_invalidate(cache_dir, extension);
+    }
+
+    int lock_fd = cache_lock(cache_dir, extension, LOCK_EX);
+    if (lock_fd < 0) {
+        return -1;
+    }
+
+    // Without a cache there is nothing to maintain; the next downltar builds one
+    TarCacheWriter index;
+    if (cache_read_index(cache_dir, extension, &index) != 0) {
+        cache_unlock(lock_fd);
+        return 0;
+    }
+
+    char tar_path[TAR_PATH_MAX];
+    snprintf(tar_path, sizeof(tar_path), "%s/%s.tar", cache_dir, extension);
+    index.fd = open(tar_path, O_WRONLY);
+
+    // Drop anything a crashed append left past the indexed end, then add the member there
+    DfsTarEntry entry = {(char *)path, name, st.st_size, st.st_mode, st.st_uid, st.st_gid, st.st_mtime};
+    DfsTarSink sink = {cache_write, NULL, &index};
+    int result = -1;
+    if (index.fd >= 0 && ftruncate(index.fd, index.size) == 0 &&
+        lseek(index.fd, index.size, SEEK_SET) == (off_t)index.size &&
+        write_entry(&entry, &sink) == 0 && fsync(index.fd) == 0) {
+        index.files++;
+        result = cache_write_index(cache_dir, extension, &index);
+    }
+    if (index.fd >= 0) {
+        close(index.fd);
+    }
+    cache_unlock(lock_fd);
+
+    return result == 0 ? 0 : dfs_tar_cache_invalidate(cache_dir, extension);
+}
+
+// Function to drop the cached archive for a type so the next downltar rebuilds it
+int dfs_tar_cache_invalidate(const char *cache_dir, const char *extension) {
+    char path[TAR_PATH_MAX];
+    int lock_fd = cache_lock(cache_dir, extension, LOCK_EX);
+    if (lock_fd < 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s.idx", cache_dir, extension);
+    int result = unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+    snprintf(path, sizeof(path), "%s/%s.tar", cache_dir, extension);
+    unlink(path);
+    cache_unlock(lock_fd);
+    return result;
+}
@@ -0,0 +1,116 @@
+#ifndef DFS_TAR_H
+#define DFS_TAR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Native tar writer used by S1, S2, S3 and S4 for downltar.
+ *
+ * The tree is walked once to collect file metadata, which is enough to
+ * know the exact archive size before the first byte is sent. The archive
+ * is then written in a single pass: ustar headers (with a pax extended
+ * header for names or sizes ustar cannot hold), file bodies straight from
+ * the page cache, zero padding to 512-byte blocks and the two-block
+ * end-of-archive marker. Member names are relative to the storage root
+ * and prefixed with the client-visible root ("S1/dir/file.pdf").
+ *
+ * dfs_tar_stream() skips the collection pass: each file is archived as
+ * soon as the walk reaches it, so the first bytes leave immediately. The
+ * archive travels as DATA frames of status READY (up to DFS_TAR_CHUNK_SIZE
+ * of headers and small bodies, or one whole large body sent with
+ * sendfile) followed by a DATA frame of status OK whose payload is the
+ * trailer: a first line "<total bytes> <crc32c hex>" followed by the names
+ * of members deleted since the client's copy, one per line.
+ *
+ * A DfsTarFilter makes the archive incremental: only files modified since
+ * a time, or differing in size or mtime from a client manifest, are sent.
+ * Deletions come from manifest entries the walk did not meet or, for
+ * since=, from the <ext>.deleted removal log in the cache directory.
+ *
+ * dfs_tar_scope() narrows either kind of archive to one directory: the
+ * walk starts there and member names keep their full "S1/dir/..." form,
+ * so manifest entries and logged removals outside it are ignored.
+ *
+ * Each server also keeps a materialized archive per type in its cache
+ * directory (<ext>.tar holding the members, <ext>.idx recording file
+ * count, length and CRC32C of those members), guarded by an flock on
+ * <ext>.lock. dfs_tar_cache_send() builds it on first use and afterwards
+ * serves it with a single sendfile. Stores append the new member in
+ * place; removals and overwrites invalidate it. Files changed behind the
+ * server's back are not noticed until the next invalidation.
+ */
+
+#define DFS_TAR_BLOCK_SIZE 512
+#define DFS_TAR_CHUNK_SIZE (256 * 1024)   /* most bytes buffered before a chunk is sent */
+#define DFS_TAR_INLINE_MAX (64 * 1024)    /* bodies up to this size are copied into the chunk */
+#define DFS_TAR_MANIFEST_MAX (64 * 1024 * 1024)   /* largest manifest accepted from a client */
+
+// One regular file to be archived
+typedef struct {
+    char *path;        /* location on disk */
+    char *name;        /* member name inside the archive */
+    uint64_t size;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t mtime;
+} DfsTarEntry;
+
+// Files collected for one archive, sorted by member name
+typedef struct {
+    DfsTarEntry *entries;
+    int count;
+    int capacity;
+} DfsTarArchive;
+
+// One file the client already holds
+typedef struct {
+    char *name;        /* member name, "S1/dir/file.txt" */
+    uint64_t size;
+    int64_t mtime;
+    int seen;
+} DfsManifestEntry;
+
+// Restricts a streamed archive to what the client is missing
+typedef struct {
+    int64_t since;                /* only files modified at or after this time; -1 for any */
+    DfsManifestEntry *manifest;   /* sorted by name; unchanged files are skipped */
+    int manifest_count;
+    const char *deletion_log;     /* removal log consulted for since= deletions */
+} DfsTarFilter;
+
+// Destination for archive bytes; write_file may be NULL to fall back to read + write
+typedef struct {
+    int (*write)(void *ctx, const void *buf, size_t len);
+    int (*write_file)(void *ctx, int fd, uint64_t len);
+    void *ctx;
+} DfsTarSink;
+
+void dfs_tar_init(DfsTarArchive *tar);
+int dfs_tar_collect(DfsTarArchive *tar, const char *root, const char *extension, const char *prefix);
+uint64_t dfs_tar_size(const DfsTarArchive *tar);
+int dfs_tar_write(const DfsTarArchive *tar, DfsTarSink *sink);
+int dfs_tar_stream(int sock, uint32_t request_id, const char *root, const char *extension,
+                   const char *prefix, DfsTarFilter *filter);
+int dfs_tar_parse_option(const char *option, DfsTarFilter *filter);
+int dfs_tar_scope(const char *base, const char *path, char *root, char *prefix, size_t size);
+char *dfs_tar_recv_manifest(int sock, uint64_t *len);
+int dfs_tar_load_manifest(DfsTarFilter *filter, char *text);
+void dfs_tar_free_filter(DfsTarFilter *filter);
+void dfs_tar_free(DfsTarArchive *tar);
+
+// Reading archives back (S1 merges backend streams member by member)
+int dfs_tar_parse_header(const unsigned char *block, char *typeflag, uint64_t *size);
+int dfs_tar_pax_size(const char *records, size_t len, uint64_t *size);
+
+// Materialized per-type archives
+int dfs_tar_cache_send(int sock, uint32_t request_id, const char *cache_dir, const char *root,
+                       const char *extension, const char *prefix);
+int dfs_tar_cache_append(const char *cache_dir, const char *root, const char *extension,
+                         const char *prefix, const char *path);
+int dfs_tar_cache_invalidate(const char *cache_dir, const char *extension);
+int dfs_tar_log_deletion(const char *cache_dir, const char *root, const char *extension,
+                         const char *prefix, const char *path);
+
+#endif
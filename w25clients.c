@@ -9,12 +9,45 @@
 #include <errno.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#include <pthread.h>
+
+#include "dfs_protocol.h"
+#include "dfs_crc32c.h"
+#include "dfs_deflate.h"
+#include "dfs_sha256.h"
+#include "dfs_session.h"
 
 #define BUFFER_SIZE 4096
 #define CMD_SIZE 1024
+#define TAR_RECV_BUFFER (64 * 1024)
 #define MAX_PATH 1024
 #define S1_IP "127.0.0.1"
 #define S1_PORT 8386
+#define PARALLEL_STREAMS 4                   /* connections a large uploadf/downlf is split over by default */
+#define PARALLEL_MAX_STREAMS 16
+#define PARALLEL_MIN_SIZE DFS_PARALLEL_MIN_SIZE  /* smaller files go over one connection */
+#define RANGE_RECV_BUFFER (256 * 1024)
+
+/* One byte range of a parallel download */
+typedef struct {
+    const char *filepath;     /* ~/S1 path asked for */
+    const char *local_path;   /* preallocated file the range is written into */
+    int fd;
+    int level;
+    uint64_t offset;
+    uint64_t length;
+    int result;
+} RangeStream;
+
+/* One part of a multipart upload */
+typedef struct {
+    const char *filename;
+    const char *destination;
+    const char *session;
+    uint64_t offset;
+    uint64_t length;
+    int result;
+} UploadPart;
 
 /* Function to validate if a file exists in current directory */
 int validate_file_existence(const char *filename) {
@@ -50,73 +83,193 @@ int validate_s1_path(const char *path) {
     return 0;
 }
 
-/* Function to validate file type for tar download */
+/* Function to validate file type for tar download: one type, a comma-separated list, or "all" */
 int validate_tar_filetype(const char *filetype) {
-    if (strcmp(filetype, "c") == 0 || 
-        strcmp(filetype, "pdf") == 0 || 
-        strcmp(filetype, "txt") == 0) {
+    if (strcmp(filetype, "all") == 0) {
         return 1;
     }
-    return 0;
+    
+    char list[CMD_SIZE];
+    snprintf(list, sizeof(list), "%s", filetype);
+    int count = 0;
+    char *saveptr;
+    for (char *type = strtok_r(list, ",", &saveptr); type; type = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(type, "c") != 0 && strcmp(type, "pdf") != 0 &&
+            strcmp(type, "txt") != 0 && strcmp(type, "zip") != 0) {
+            return 0;
+        }
+        count++;
+    }
+    return count > 0;
+}
+
+/* Function to read the compression word of uploadf/downlf: fast (default), ratio or raw */
+int parse_compression(const char *word) {
+    if (word == NULL || strcmp(word, "fast") == 0) {
+        return DFS_DEFLATE_FAST;
+    }
+    if (strcmp(word, "ratio") == 0) {
+        return DFS_DEFLATE_RATIO;
+    }
+    return strcmp(word, "raw") == 0 ? 0 : -1;
+}
+
+/* Function to build the path of the file recording an unfinished upload: .<name>.dfs-upload beside it */
+void upload_state_path(const char *filename, char *path, size_t size) {
+    const char *slash = strrchr(filename, '/');
+    if (slash) {
+        snprintf(path, size, "%.*s/.%s.dfs-upload", (int)(slash - filename), filename, slash + 1);
+    } else {
+        snprintf(path, size, ".%s.dfs-upload", filename);
+    }
+}
+
+/* Function to find the session of an unfinished upload of this file, unchanged since, to this destination */
+int load_upload_session(const char *filename, const char *destination, char id[DFS_SESSION_ID_LEN + 1]) {
+    char state_path[MAX_PATH];
+    upload_state_path(filename, state_path, sizeof(state_path));
+    FILE *state = fopen(state_path, "r");
+    if (!state) {
+        return 0;
+    }
+    
+    // One line: <session> <size> <mtime> <destination>
+    char saved_dest[MAX_PATH];
+    long long size, mtime;
+    struct stat file_stat;
+    int found = fscanf(state, "%16s %lld %lld %1023s", id, &size, &mtime, saved_dest) == 4 &&
+                stat(filename, &file_stat) == 0 && size == (long long)file_stat.st_size &&
+                mtime == (long long)file_stat.st_mtime && strcmp(saved_dest, destination) == 0;
+    fclose(state);
+    return found;
 }
 
-/* Function to send a file to the server */
-int send_file_to_server(int sock, const char *filename) {
+/* Function to record the session of an upload in progress so a later attempt can resume it */
+void save_upload_session(const char *filename, const char *destination, const char *id) {
+    char state_path[MAX_PATH];
+    struct stat file_stat;
+    upload_state_path(filename, state_path, sizeof(state_path));
+    FILE *state = fopen(state_path, "w");
+    if (!state || stat(filename, &file_stat) != 0) {
+        if (state) {
+            fclose(state);
+        }
+        return;
+    }
+    fprintf(state, "%s %lld %lld %s\n", id, (long long)file_stat.st_size, (long long)file_stat.st_mtime,
+            destination);
+    fclose(state);
+}
+
+/* Function to send a file from an offset to the server as a DATA frame, or as compressed frames when level is set,
+   closed by the checksum of the bytes sent */
+int send_file_to_server(int sock, const char *filename, uint32_t request_id, int level, uint64_t offset) {
     FILE *file = fopen(filename, "rb");
     if (!file) {
         perror("Error opening file for upload");
         return -1;
     }
     
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
+    struct stat file_stat;
+    if (fstat(fileno(file), &file_stat) != 0) {
+        perror("Error reading file size");
+        fclose(file);
+        return -1;
+    }
     
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        if (send(sock, buffer, bytes_read, 0) < 0) {
-            perror("Error sending file data");
-            fclose(file);
-            return -1;
-        }
+    // The server already holds everything before offset
+    if (offset > (uint64_t)file_stat.st_size || lseek(fileno(file), offset, SEEK_SET) < 0) {
+        printf("Error: Resume offset %llu is beyond the end of '%s'\n", (unsigned long long)offset, filename);
+        fclose(file);
+        return -1;
+    }
+    
+    int sent = level > 0 ? dfs_send_file_deflate(sock, DFS_OP_DATA, request_id, fileno(file),
+                                                 file_stat.st_size - offset, level)
+                         : dfs_send_body(sock, request_id, fileno(file), file_stat.st_size - offset, NULL);
+    if (sent != 0) {
+        perror("Error sending file data");
+        fclose(file);
+        return -1;
     }
     
     fclose(file);
     return 0;
 }
 
-/* Function to receive a file from the server */
-int receive_file_from_server(int sock, const char *filename) {
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
+/* Function to append a file body from the server to a file, raw or as compressed frames. A body that does not
+   match its checksum is cut off again, so the next attempt resumes from the last bytes known to be good */
+int receive_file_from_server(int sock, const char *filename, const DfsHeader *data) {
+    FILE *file = fopen(filename, "ab");
+    struct stat file_stat;
+    int compressed = data->flags & DFS_FLAG_DEFLATE;
+    if (!file || fstat(fileno(file), &file_stat) != 0) {
         perror("Error creating file for download");
+        if (compressed) {
+            dfs_recv_deflate_to_file(sock, data, NULL);
+        } else {
+            uint32_t crc;
+            dfs_discard(sock, data->payload_len);
+            dfs_recv_checksum(sock, &crc);
+        }
+        if (file) {
+            fclose(file);
+        }
         return -1;
     }
     
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    
-    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        if (fwrite(buffer, 1, bytes_received, file) != bytes_received) {
-            perror("Error writing received data to file");
-            fclose(file);
-            return -1;
-        }
-        
-        // If we received less than the buffer size, we're done
-        if (bytes_received < BUFFER_SIZE) {
-            break;
+    int received = compressed ? dfs_recv_deflate_to_file(sock, data, file)
+                              : dfs_recv_body(sock, file, data->payload_len);
+    if (received == DFS_CHECKSUM_MISMATCH) {
+        printf("Error: Checksum mismatch in the data received for '%s'\n", filename);
+        if (fflush(file) != 0 || ftruncate(fileno(file), file_stat.st_size) != 0) {
+            perror("Error discarding corrupt data");
         }
+        fclose(file);
+        return -1;
+    }
+    if (received != 0) {
+        perror("Error receiving file data");
+        fclose(file);
+        return -1;
     }
     
-    fclose(file);
+    if (fclose(file) != 0) {
+        perror("Error writing received data to file");
+        return -1;
+    }
     
-    if (bytes_received < 0) {
-        perror("Error receiving file data");
+    return 0;
+}
+
+/* Function to send a command and read the server's reply header */
+int send_command(int sock, uint8_t opcode, const char *command, DfsHeader *reply) {
+    if (dfs_send_message(sock, opcode, DFS_STATUS_OK, dfs_next_request_id(), command) != 0) {
+        perror("Error sending command to server");
+        return -1;
+    }
+    
+    if (dfs_recv_header(sock, reply) != 0) {
+        perror("Error receiving response from server");
         return -1;
     }
     
     return 0;
 }
 
+/* Function to read and print a text reply from the server */
+int print_server_message(int sock, const DfsHeader *reply) {
+    char response[BUFFER_SIZE];
+    
+    if (dfs_recv_payload(sock, reply, response, BUFFER_SIZE) != 0) {
+        perror("Error receiving response from server");
+        return -1;
+    }
+    
+    printf("%s\n", response);
+    return reply->status == DFS_STATUS_OK ? 0 : -1;
+}
+
 /* Function to connect to S1 server */
 int connect_to_s1_server() {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -145,8 +298,113 @@ int connect_to_s1_server() {
     return sock;
 }
 
-/* Function to handle uploadf command */
-int handle_uploadf(int sock, const char *filename, const char *destination) {
+/* Function to send one part of a multipart upload over its own connection to S1 */
+void *upload_part_worker(void *arg) {
+    UploadPart *part = arg;
+    part->result = -1;
+    int sock = connect_to_s1_server();
+    if (sock < 0) {
+        return NULL;
+    }
+    
+    char command[CMD_SIZE];
+    char response[BUFFER_SIZE];
+    DfsHeader reply;
+    snprintf(command, CMD_SIZE, "uploadf %s %s resume=%s part=%llu", basename((char *)part->filename),
+             part->destination, part->session, (unsigned long long)part->offset);
+    if (send_command(sock, DFS_OP_UPLOADF, command, &reply) != 0) {
+        close(sock);
+        return NULL;
+    }
+    if (reply.status != DFS_STATUS_READY) {
+        print_server_message(sock, &reply);
+        close(sock);
+        return NULL;
+    }
+    if (dfs_recv_payload(sock, &reply, response, BUFFER_SIZE) != 0) {
+        close(sock);
+        return NULL;
+    }
+    
+    // The part goes raw, straight from its place in the file, with its checksum
+    int fd = open(part->filename, O_RDONLY);
+    if (fd >= 0 && lseek(fd, part->offset, SEEK_SET) == (off_t)part->offset &&
+        dfs_send_body(sock, reply.request_id, fd, part->length, NULL) == 0 &&
+        dfs_recv_header(sock, &reply) == 0 && dfs_recv_payload(sock, &reply, response, BUFFER_SIZE) == 0) {
+        if (reply.status == DFS_STATUS_OK) {
+            part->result = 0;
+        } else {
+            printf("%s\n", response);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    close(sock);
+    return NULL;
+}
+
+/* Function to upload a large file as parts sent over several connections at once, then commit it */
+int upload_in_parts(int sock, const char *filename, const char *destination, const char *hex, uint64_t size,
+                    int streams) {
+    // Open the upload; a server already holding the content stores it outright
+    char command[CMD_SIZE];
+    char response[BUFFER_SIZE];
+    DfsHeader reply;
+    snprintf(command, CMD_SIZE, "uploadf %s %s sha256=%s multipart=%llu", basename((char *)filename), destination,
+             hex, (unsigned long long)size);
+    if (send_command(sock, DFS_OP_UPLOADF, command, &reply) != 0 ||
+        dfs_recv_payload(sock, &reply, response, BUFFER_SIZE) != 0) {
+        return -1;
+    }
+    char session[DFS_SESSION_ID_LEN + 1];
+    if (reply.status != DFS_STATUS_OK || sscanf(response, "MULTIPART session=%16[0-9a-f]", session) != 1) {
+        printf("%s\n", response);
+        return reply.status == DFS_STATUS_OK ? 0 : -1;
+    }
+    
+    UploadPart parts[PARALLEL_MAX_STREAMS];
+    pthread_t threads[PARALLEL_MAX_STREAMS];
+    int started[PARALLEL_MAX_STREAMS];
+    for (int i = 0; i < streams; i++) {
+        uint64_t start = size / streams * i;
+        uint64_t end = i == streams - 1 ? size : size / streams * (i + 1);
+        parts[i] = (UploadPart){filename, destination, session, start, end - start, -1};
+        started[i] = pthread_create(&threads[i], NULL, upload_part_worker, &parts[i]) == 0;
+        if (!started[i]) {
+            upload_part_worker(&parts[i]);
+        }
+    }
+    
+    for (int i = 0; i < streams; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    
+    // Parts are independent, so one that failed is simply sent again
+    for (int i = 0; i < streams; i++) {
+        if (parts[i].result != 0) {
+            upload_part_worker(&parts[i]);
+        }
+        if (parts[i].result != 0) {
+            printf("Error: Part at byte %llu of '%s' could not be uploaded\n", (unsigned long long)parts[i].offset,
+                   filename);
+            return -1;
+        }
+    }
+    
+    // The server publishes the file once the parts add up to the digest
+    snprintf(command, CMD_SIZE, "uploadf %s %s sha256=%s resume=%s commit", basename((char *)filename), destination,
+             hex, session);
+    if (send_command(sock, DFS_OP_UPLOADF, command, &reply) != 0) {
+        return -1;
+    }
+    return print_server_message(sock, &reply);
+}
+
+/* Function to handle uploadf command; a large file goes up in parts over several connections at once */
+int handle_uploadf(int sock, const char *filename, const char *destination, int level, int streams) {
     // Validate file exists
     if (!validate_file_existence(filename)) {
         printf("Error: File '%s' does not exist in current directory\n", filename);
@@ -167,79 +425,344 @@ int handle_uploadf(int sock, const char *filename, const char *destination) {
     
     // Send command to server
     char command[CMD_SIZE];
-    snprintf(command, CMD_SIZE, "uploadf %s %s", basename((char*)filename), destination);
+    char response[BUFFER_SIZE];
+    DfsHeader reply;
+    // Offer to compress the body unless its type is compressed already
+    int used = snprintf(command, CMD_SIZE, "uploadf %s %s", basename((char*)filename), destination);
+    if (level > 0 && dfs_deflate_worthwhile(filename)) {
+        used += snprintf(command + used, CMD_SIZE - used, " z=%d", level);
+    }
     
-    if (send(sock, command, strlen(command), 0) < 0) {
-        perror("Error sending command to server");
-        return -1;
+    // Send the content digest first so a server holding the same content can skip the body
+    char hex[DFS_SHA256_HEX_LEN + 1];
+    struct stat file_stat;
+    int fd = open(filename, O_RDONLY);
+    int hashed = fd >= 0 && fstat(fd, &file_stat) == 0 && dfs_sha256_file(fd, hex) == 0;
+    if (hashed) {
+        used += snprintf(command + used, CMD_SIZE - used, " sha256=%s", hex);
+    }
+    if (fd >= 0) {
+        close(fd);
     }
     
-    // Wait for server response
-    char response[BUFFER_SIZE];
-    memset(response, 0, BUFFER_SIZE);
+    // Continue an earlier attempt that broke off, if the file has not changed since; otherwise a large
+    // file goes up in parts side by side
+    char session[DFS_SESSION_ID_LEN + 1];
+    if (load_upload_session(filename, destination, session)) {
+        snprintf(command + used, CMD_SIZE - used, " resume=%s", session);
+    } else if (hashed && streams > 1 && (uint64_t)file_stat.st_size >= PARALLEL_MIN_SIZE) {
+        return upload_in_parts(sock, filename, destination, hex, file_stat.st_size, streams);
+    }
+    
+    if (send_command(sock, DFS_OP_UPLOADF, command, &reply) != 0) {
+        return -1;
+    }
     
-    if (recv(sock, response, BUFFER_SIZE - 1, 0) <= 0) {
+    if (dfs_recv_payload(sock, &reply, response, BUFFER_SIZE) != 0) {
         perror("Error receiving response from server");
         return -1;
     }
     
-    if (strcmp(response, "READY_TO_RECEIVE") != 0) {
+    // OK straight away means the content was already stored and no body is wanted
+    char state_path[MAX_PATH];
+    upload_state_path(filename, state_path, sizeof(state_path));
+    if (reply.status != DFS_STATUS_READY) {
         printf("%s\n", response);
+        if (reply.status == DFS_STATUS_OK) {
+            remove(state_path);
+            return 0;
+        }
         return -1;
     }
     
-    // Send file to server
-    if (send_file_to_server(sock, filename) != 0) {
+    // The server names the session and how much of the body it already holds
+    uint64_t offset = 0;
+    char *session_word = strstr(response, " session=");
+    if (session_word && sscanf(session_word, " session=%16[0-9a-f]", session) == 1) {
+        save_upload_session(filename, destination, session);
+        dfs_session_find_offset(response, &offset);
+        if (offset > 0) {
+            printf("Resuming upload of '%s' at byte %llu\n", filename, (unsigned long long)offset);
+        }
+    }
+    
+    // Send file to server, compressed only if the server took up the offer
+    char *accepted = strstr(response, " z=");
+    if (send_file_to_server(sock, filename, reply.request_id, accepted ? dfs_deflate_parse_offer(accepted + 1) : 0,
+                            offset) != 0) {
+        printf("Upload interrupted; run the same uploadf again to resume it\n");
         return -1;
     }
     
     // Get final response from server
-    memset(response, 0, BUFFER_SIZE);
-    if (recv(sock, response, BUFFER_SIZE - 1, 0) <= 0) {
+    if (dfs_recv_header(sock, &reply) != 0) {
         perror("Error receiving response from server");
+        printf("Upload interrupted; run the same uploadf again to resume it\n");
         return -1;
     }
     
-    printf("%s\n", response);
+    int result = print_server_message(sock, &reply);
+    if (result == 0) {
+        remove(state_path);
+    }
+    return result;
+}
+
+/* Function to read S1's statf answer: a file's size and content digest ("-" when unknown) */
+int read_file_stat(int sock, const DfsHeader *reply, uint64_t *size, char hex[DFS_SHA256_HEX_LEN + 1]) {
+    char response[BUFFER_SIZE];
+    unsigned long long parsed;
+    if (dfs_recv_payload(sock, reply, response, BUFFER_SIZE) != 0 ||
+        sscanf(response, "%llu %64s", &parsed, hex) != 2) {
+        printf("Error: Unexpected statf reply\n");
+        return -1;
+    }
+    *size = parsed;
     return 0;
 }
 
-/* Function to handle downlf command */
-int handle_downlf(int sock, const char *filepath) {
+/* Function to fetch one byte range over its own connection to S1 and write it at its place in the file */
+void *download_range_worker(void *arg) {
+    RangeStream *stream = arg;
+    stream->result = -1;
+    int sock = connect_to_s1_server();
+    if (sock < 0) {
+        return NULL;
+    }
+    
+    char command[CMD_SIZE];
+    DfsHeader reply;
+    int used = snprintf(command, CMD_SIZE, "downlf %s", stream->filepath);
+    if (stream->level > 0) {
+        used += snprintf(command + used, CMD_SIZE - used, " z=%d", stream->level);
+    }
+    snprintf(command + used, CMD_SIZE - used, " range=%llu-%llu", (unsigned long long)stream->offset,
+             (unsigned long long)(stream->offset + stream->length - 1));
+    if (send_command(sock, DFS_OP_DOWNLF, command, &reply) != 0) {
+        close(sock);
+        return NULL;
+    }
+    if (reply.opcode != DFS_OP_DATA) {
+        print_server_message(sock, &reply);
+        close(sock);
+        return NULL;
+    }
+    
+    if (reply.flags & DFS_FLAG_DEFLATE) {
+        // Inflated bytes go through a descriptor of this stream's own, positioned at the range
+        int fd = open(stream->local_path, O_WRONLY);
+        FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (file && fseeko(file, stream->offset, SEEK_SET) == 0 &&
+            dfs_recv_deflate_to_file(sock, &reply, file) == 0 && fflush(file) == 0 &&
+            (uint64_t)ftello(file) == stream->offset + stream->length) {
+            stream->result = 0;
+        }
+        if (file) {
+            fclose(file);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        close(sock);
+        return NULL;
+    }
+    
+    // A raw range is written where it belongs with pwrite, so the streams never share a file position,
+    // and checked against the checksum that follows it
+    char *buffer = malloc(RANGE_RECV_BUFFER);
+    uint64_t done = 0;
+    uint32_t crc = 0;
+    if (buffer && reply.payload_len == stream->length) {
+        while (done < stream->length) {
+            size_t want = stream->length - done < RANGE_RECV_BUFFER ? stream->length - done : RANGE_RECV_BUFFER;
+            if (dfs_recv_all(sock, buffer, want) != 0) {
+                break;
+            }
+            crc = dfs_crc32c(crc, buffer, want);
+            size_t written = 0;
+            while (written < want) {
+                ssize_t n = pwrite(stream->fd, buffer + written, want - written, stream->offset + done + written);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                written += n;
+            }
+            if (written < want) {
+                break;
+            }
+            done += want;
+        }
+    }
+    uint32_t expected;
+    if (done != stream->length || dfs_recv_checksum(sock, &expected) != 0) {
+        perror("Error receiving file range");
+    } else if (crc != expected) {
+        printf("Error: Checksum mismatch in bytes %llu-%llu\n", (unsigned long long)stream->offset,
+               (unsigned long long)(stream->offset + stream->length - 1));
+    } else {
+        stream->result = 0;
+    }
+    free(buffer);
+    close(sock);
+    return NULL;
+}
+
+/* Function to download a large file as byte ranges over several connections at once, then check it */
+int download_in_ranges(const char *filepath, const char *filename, uint64_t size, const char *hex, int level,
+                       int streams) {
+    char temp_path[MAX_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.streams", filename);
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Error creating file for download");
+        return -1;
+    }
+    
+    // The whole file is reserved first so every range lands in place without growing it
+    if (posix_fallocate(fd, 0, size) != 0 && ftruncate(fd, size) != 0) {
+        perror("Error allocating file for download");
+        close(fd);
+        remove(temp_path);
+        return -1;
+    }
+    
+    RangeStream ranges[PARALLEL_MAX_STREAMS];
+    pthread_t threads[PARALLEL_MAX_STREAMS];
+    int started[PARALLEL_MAX_STREAMS];
+    for (int i = 0; i < streams; i++) {
+        uint64_t start = size / streams * i;
+        uint64_t end = i == streams - 1 ? size : size / streams * (i + 1);
+        ranges[i] = (RangeStream){filepath, temp_path, fd, level, start, end - start, -1};
+        started[i] = pthread_create(&threads[i], NULL, download_range_worker, &ranges[i]) == 0;
+        if (!started[i]) {
+            download_range_worker(&ranges[i]);
+        }
+    }
+    
+    int result = 0;
+    for (int i = 0; i < streams; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (ranges[i].result != 0) {
+            result = -1;
+        }
+    }
+    
+    // Check the assembled file against the digest the server holds
+    char assembled[DFS_SHA256_HEX_LEN + 1];
+    if (result == 0 && strcmp(hex, "-") != 0 &&
+        (lseek(fd, 0, SEEK_SET) != 0 || dfs_sha256_file(fd, assembled) != 0 || strcmp(assembled, hex) != 0)) {
+        printf("Error: Downloaded file does not match the server's copy\n");
+        result = -1;
+    }
+    if (close(fd) != 0) {
+        result = -1;
+    }
+    
+    if (result != 0) {
+        printf("Download of '%s' failed\n", filename);
+        remove(temp_path);
+        return -1;
+    }
+    if (rename(temp_path, filename) != 0) {
+        perror("Error moving downloaded file into place");
+        return -1;
+    }
+    
+    printf("File '%s' downloaded successfully over %d connections\n", filename, streams);
+    return 0;
+}
+
+/* Function to handle downlf command; with a range only those bytes are fetched, into <filename>.<range>.
+ * A large file is fetched over several connections at once */
+int handle_downlf(int sock, const char *filepath, int level, const char *range, int streams) {
     // Validate path format
     if (!validate_s1_path(filepath)) {
         printf("Error: File path must be within ~/S1\n");
         return -1;
     }
     
-    // Send command to server
+    // Extract filename from path; the body goes to <filename>.part until it is complete
+    char filename[MAX_PATH];
+    char part_path[MAX_PATH + sizeof(".part")];
+    const char *slash = strrchr(filepath, '/');
+    snprintf(filename, sizeof(filename), "%s", slash ? slash + 1 : filepath);
+    if (range) {
+        // A range is cheap to fetch again, so it replaces any earlier copy rather than resuming
+        snprintf(filename + strlen(filename), sizeof(filename) - strlen(filename), ".%s", range);
+        snprintf(part_path, sizeof(part_path), "%s", filename);
+        remove(part_path);
+    } else {
+        snprintf(part_path, sizeof(part_path), "%s.part", filename);
+    }
+    
+    // A part left by an earlier attempt is continued from where it ends
+    struct stat part_stat;
+    uint64_t offset = !range && stat(part_path, &part_stat) == 0 ? (uint64_t)part_stat.st_size : 0;
+    
+    // Send command to server; resuming asks for the range from the end of the part on, and a fresh
+    // download that may be split says so
+    int split = !range && offset == 0 && streams > 1;
     char command[CMD_SIZE];
-    snprintf(command, CMD_SIZE, "downlf %s", filepath);
+    DfsHeader reply;
+    int used = snprintf(command, CMD_SIZE, "downlf %s", filepath);
+    if (used < CMD_SIZE && level > 0) {
+        used += snprintf(command + used, CMD_SIZE - used, " z=%d", level);
+    }
+    if (used < CMD_SIZE && range) {
+        used += snprintf(command + used, CMD_SIZE - used, " range=%s", range);
+    } else if (used < CMD_SIZE && offset > 0) {
+        used += snprintf(command + used, CMD_SIZE - used, " range=%llu-", (unsigned long long)offset);
+        printf("Resuming download of '%s' at byte %llu\n", filename, (unsigned long long)offset);
+    } else if (used < CMD_SIZE && split) {
+        used += snprintf(command + used, CMD_SIZE - used, " split");
+    }
+    if (used >= CMD_SIZE) {
+        printf("Error: File path too long\n");
+        return -1;
+    }
     
-    if (send(sock, command, strlen(command), 0) < 0) {
-        perror("Error sending command to server");
+    if (send_command(sock, DFS_OP_DOWNLF, command, &reply) != 0) {
         return -1;
     }
     
-    // Wait for server response
-    char response[BUFFER_SIZE];
-    memset(response, 0, BUFFER_SIZE);
+    // A file worth splitting is answered with its size and digest instead, and fetched in ranges side by side
+    if (split && reply.opcode != DFS_OP_DATA && reply.status == DFS_STATUS_OK) {
+        uint64_t size;
+        char hex[DFS_SHA256_HEX_LEN + 1];
+        if (read_file_stat(sock, &reply, &size, hex) != 0) {
+            return -1;
+        }
+        if (size >= PARALLEL_MIN_SIZE) {
+            return download_in_ranges(filepath, filename, size, hex, level, streams);
+        }
+        // S1 had to ask the server for the size, and the file is small after all
+        return handle_downlf(sock, filepath, level, range, 1);
+    }
     
-    if (recv(sock, response, BUFFER_SIZE - 1, 0) <= 0) {
-        perror("Error receiving response from server");
+    // Anything other than a DATA frame is an error message
+    if (reply.opcode != DFS_OP_DATA) {
+        print_server_message(sock, &reply);
+        if (reply.status == DFS_STATUS_INVALID && offset > 0) {
+            // The file is shorter than the part, so it changed; start over next time
+            remove(part_path);
+        }
         return -1;
     }
     
-    if (strcmp(response, "READY_TO_SEND") != 0) {
-        printf("%s\n", response);
+    // Receive file from server
+    if (receive_file_from_server(sock, part_path, &reply) != 0) {
+        if (!range) {
+            printf("Download interrupted; run the same downlf again to resume it\n");
+        }
         return -1;
     }
     
-    // Extract filename from path
-    char *filename = basename((char*)filepath);
-    
-    // Receive file from server
-    if (receive_file_from_server(sock, filename) != 0) {
+    if (!range && rename(part_path, filename) != 0) {
+        perror("Error moving downloaded file into place");
         return -1;
     }
     
@@ -257,71 +780,210 @@ int handle_removef(int sock, const char *filepath) {
     
     // Send command to server
     char command[CMD_SIZE];
+    DfsHeader reply;
     snprintf(command, CMD_SIZE, "removef %s", filepath);
     
-    if (send(sock, command, strlen(command), 0) < 0) {
-        perror("Error sending command to server");
+    if (send_command(sock, DFS_OP_REMOVEF, command, &reply) != 0) {
         return -1;
     }
     
-    // Wait for server response
-    char response[BUFFER_SIZE];
-    memset(response, 0, BUFFER_SIZE);
-    
-    if (recv(sock, response, BUFFER_SIZE - 1, 0) <= 0) {
-        perror("Error receiving response from server");
-        return -1;
-    }
-    
-    printf("%s\n", response);
-    return 0;
+    return print_server_message(sock, &reply);
 }
 
 /* Function to handle downltar command */
-int handle_downltar(int sock, const char *filetype) {
+int handle_downltar(int sock, const char *filetype, const char *dirpath, const char *option, int compress) {
     // Validate file type
     if (!validate_tar_filetype(filetype)) {
-        printf("Error: Invalid file type. Only c, pdf, and txt are supported for tar download\n");
+        printf("Error: Invalid file type. Use c, pdf, txt, zip, a comma-separated list of them, or all\n");
         return -1;
     }
     
-    // Send command to server
-    char command[CMD_SIZE];
-    snprintf(command, CMD_SIZE, "downltar %s", filetype);
+    // A directory limits the archive to that subtree
+    if (dirpath == NULL) {
+        dirpath = "";
+    } else if (!validate_s1_path(dirpath)) {
+        printf("Error: Path must be within ~/S1\n");
+        return -1;
+    }
     
-    if (send(sock, command, strlen(command), 0) < 0) {
-        perror("Error sending command to server");
+    // An incremental download names a time (since=<unix time>) or a manifest file (manifest=<file>)
+    char command[CMD_SIZE];
+    DfsHeader reply;
+    const char *manifest_file = NULL;
+    const char *encoding = compress ? "gzip" : "";
+    if (option == NULL) {
+        snprintf(command, CMD_SIZE, "downltar %s %s %s", filetype, dirpath, encoding);
+    } else if (strncmp(option, "since=", 6) == 0) {
+        snprintf(command, CMD_SIZE, "downltar %s %s %s %s", filetype, dirpath, option, encoding);
+    } else if (strncmp(option, "manifest=", 9) == 0 && option[9] != '\0') {
+        manifest_file = option + 9;
+        snprintf(command, CMD_SIZE, "downltar %s %s manifest %s", filetype, dirpath, encoding);
+    } else {
+        printf("Error: Option must be since=<unix time> or manifest=<file>\n");
         return -1;
     }
     
-    // Wait for server response
-    char response[BUFFER_SIZE];
-    memset(response, 0, BUFFER_SIZE);
+    if (manifest_file == NULL) {
+        if (send_command(sock, DFS_OP_DOWNLTAR, command, &reply) != 0) {
+            return -1;
+        }
+    } else {
+        // The manifest ("<size> <mtime> <member name>" per line) follows the command as a DATA frame
+        FILE *manifest = fopen(manifest_file, "rb");
+        struct stat st;
+        if (!manifest || fstat(fileno(manifest), &st) != 0) {
+            perror("Error opening manifest");
+            if (manifest) {
+                fclose(manifest);
+            }
+            return -1;
+        }
+        uint32_t request_id = dfs_next_request_id();
+        int sent = dfs_send_message(sock, DFS_OP_DOWNLTAR, DFS_STATUS_OK, request_id, command) == 0 &&
+                   dfs_send_file_frame(sock, DFS_OP_DATA, DFS_STATUS_OK, request_id,
+                                       fileno(manifest), st.st_size) == 0;
+        fclose(manifest);
+        if (!sent || dfs_recv_header(sock, &reply) != 0) {
+            perror("Error sending command to server");
+            return -1;
+        }
+    }
     
-    if (recv(sock, response, BUFFER_SIZE - 1, 0) <= 0) {
-        perror("Error receiving response from server");
+    // Check if server is sending the archive
+    if (reply.opcode != DFS_OP_DATA) {
+        print_server_message(sock, &reply);
         return -1;
     }
     
-    // Check if server is ready to send tar
-    char tar_filename[256];
-    if (sscanf(response, "READY_TO_SEND_TAR %s", tar_filename) != 1) {
-        printf("%s\n", response);
+    // Write chunks to disk as they arrive, checksumming along the way
+    char base_name[256];
+    char tar_filename[sizeof(base_name) + 8];
+    snprintf(base_name, sizeof(base_name), "%s", filetype);
+    for (char *comma = strchr(base_name, ','); comma; comma = strchr(comma, ',')) {
+        *comma = '_';   // "pdf,txt" is saved as pdf_txt.tar
+    }
+    snprintf(tar_filename, sizeof(tar_filename), "%s%s", base_name, compress ? ".tar.gz" : ".tar");
+    FILE *file = fopen(tar_filename, "wb");
+    if (!file) {
+        perror("Error creating tar file");
         return -1;
     }
     
-    // Send ready signal
-    if (send(sock, "READY", 5, 0) < 0) {
-        perror("Error sending ready signal");
+    char *buffer = malloc(TAR_RECV_BUFFER);
+    if (!buffer) {
+        perror("Error allocating receive buffer");
+        fclose(file);
+        remove(tar_filename);
         return -1;
     }
     
-    // Receive tar file from server
-    if (receive_file_from_server(sock, tar_filename) != 0) {
+    uint64_t total = 0;
+    uint32_t crc = 0;
+    int failed = 0;
+    while (reply.opcode == DFS_OP_DATA && reply.status == DFS_STATUS_READY) {
+        uint64_t remaining = reply.payload_len;
+        while (remaining > 0) {
+            size_t want = remaining < TAR_RECV_BUFFER ? remaining : TAR_RECV_BUFFER;
+            if (dfs_recv_all(sock, buffer, want) != 0) {
+                perror("Error receiving tar data");
+                free(buffer);
+                fclose(file);
+                remove(tar_filename);
+                return -1;
+            }
+            if (!failed && fwrite(buffer, 1, want, file) != want) {
+                perror("Error writing tar file");
+                failed = 1;
+            }
+            crc = dfs_crc32c(crc, buffer, want);
+            remaining -= want;
+        }
+        total += reply.payload_len;
+        
+        if (dfs_recv_header(sock, &reply) != 0) {
+            perror("Error receiving tar data");
+            free(buffer);
+            fclose(file);
+            remove(tar_filename);
+            return -1;
+        }
+    }
+    free(buffer);
+    
+    // The final frame is either the trailer or the reason the archive stopped
+    if (fclose(file) != 0) {
+        perror("Error writing tar file");
+        failed = 1;
+    }
+    if (reply.opcode != DFS_OP_DATA || reply.status != DFS_STATUS_OK) {
+        print_server_message(sock, &reply);
+        remove(tar_filename);
+        return -1;
+    }
+    
+    // Trailer: "<size> <crc32c>" on the first line, then any deleted member names
+    char *trailer = malloc(reply.payload_len + 1);
+    unsigned long long expected_size = 0;
+    unsigned int expected_crc = 0;
+    if (!trailer || dfs_recv_all(sock, trailer, reply.payload_len) != 0) {
+        printf("Error: Malformed tar trailer\n");
+        free(trailer);
+        remove(tar_filename);
+        return -1;
+    }
+    trailer[reply.payload_len] = '\0';
+    char trailer_encoding[16] = "";
+    if (sscanf(trailer, "%llu %x %15[^\n]", &expected_size, &expected_crc, trailer_encoding) < 2) {
+        printf("Error: Malformed tar trailer\n");
+        free(trailer);
+        remove(tar_filename);
+        return -1;
+    }
+    if (failed) {
+        free(trailer);
+        remove(tar_filename);
         return -1;
     }
+    if (expected_size != total || expected_crc != crc) {
+        printf("Error: Tar file '%s' is corrupt (got %llu bytes, crc %08x; expected %llu bytes, crc %08x)\n",
+               tar_filename, (unsigned long long)total, crc, expected_size, expected_crc);
+        free(trailer);
+        remove(tar_filename);
+        return -1;
+    }
+    
+    // The trailer names the encoding the server actually used
+    if (compress && strcmp(trailer_encoding, "gzip") != 0) {
+        char plain_filename[sizeof(base_name) + 8];
+        snprintf(plain_filename, sizeof(plain_filename), "%s.tar", base_name);
+        if (rename(tar_filename, plain_filename) == 0) {
+            snprintf(tar_filename, sizeof(tar_filename), "%s", plain_filename);
+        }
+    }
     
     printf("Tar file '%s' downloaded successfully\n", tar_filename);
+    
+    // Deletions are saved next to the archive as <name>.deleted, one member name per line
+    char *deleted = strchr(trailer, '\n');
+    if (deleted && deleted[1] != '\0') {
+        char deleted_filename[sizeof(base_name) + 8];
+        snprintf(deleted_filename, sizeof(deleted_filename), "%s.deleted", base_name);
+        FILE *list = fopen(deleted_filename, "w");
+        int count = 0;
+        for (char *p = deleted + 1; *p; p++) {
+            count += *p == '\n';
+        }
+        int written = list && fputs(deleted + 1, list) != EOF;
+        if (list && fclose(list) != 0) {
+            written = 0;
+        }
+        if (!written) {
+            perror("Error writing deletion list");
+        } else {
+            printf("%d deleted files listed in '%s'\n", count, deleted_filename);
+        }
+    }
+    free(trailer);
     return 0;
 }
 
@@ -333,43 +995,69 @@ int handle_dispfnames(int sock, const char *pathname) {
         return -1;
     }
     
-    // Send command to server
     char command[CMD_SIZE];
-    snprintf(command, CMD_SIZE, "dispfnames %s", pathname);
+    char cursor[CMD_SIZE] = "";
+    DfsHeader reply;
+    uint64_t listed = 0;
     
-    if (send(sock, command, strlen(command), 0) < 0) {
-        perror("Error sending command to server");
-        return -1;
-    }
+    printf("Files in %s:\n", pathname);
     
-    // Wait for server response
-    char response[BUFFER_SIZE];
-    memset(response, 0, BUFFER_SIZE);
-    
-    if (recv(sock, response, BUFFER_SIZE - 1, 0) <= 0) {
-        perror("Error receiving response from server");
-        return -1;
-    }
-    
-    if (strcmp(response, "FILES_COMING") != 0) {
-        printf("%s\n", response);
-        return -1;
-    }
-    
-    // Send ready signal
-    if (send(sock, "READY", 5, 0) < 0) {
-        perror("Error sending ready signal");
-        return -1;
-    }
+    // Page through the listing, sending back the cursor S1 hands out after each page
+    do {
+        if (cursor[0] != '\0') {
+            snprintf(command, CMD_SIZE, "dispfnames %s %s", pathname, cursor);
+        } else {
+            snprintf(command, CMD_SIZE, "dispfnames %s", pathname);
+        }
+        
+        if (send_command(sock, DFS_OP_DISPFNAMES, command, &reply) != 0) {
+            return -1;
+        }
+        
+        if (reply.opcode != DFS_OP_DATA) {
+            print_server_message(sock, &reply);
+            return -1;
+        }
+        
+        // Batches of names arrive with status READY and are printed as they come
+        while (reply.status == DFS_STATUS_READY) {
+            char *batch = malloc(reply.payload_len + 1);
+            if (!batch) {
+                perror("Error allocating file list");
+                dfs_discard(sock, reply.payload_len);
+                return -1;
+            }
+            if (dfs_recv_payload(sock, &reply, batch, reply.payload_len + 1) != 0) {
+                perror("Error receiving file list");
+                free(batch);
+                return -1;
+            }
+            fputs(batch, stdout);
+            listed += reply.payload_len;
+            free(batch);
+            
+            if (dfs_recv_header(sock, &reply) != 0 || reply.opcode != DFS_OP_DATA) {
+                perror("Error receiving file list");
+                return -1;
+            }
+        }
+        
+        // The closing frame carries the cursor for the next page, empty when done, and then a line
+        // naming any server that did not answer, whose files this page left out
+        if (dfs_recv_payload(sock, &reply, cursor, CMD_SIZE) != 0) {
+            perror("Error receiving listing cursor");
+            return -1;
+        }
+        char *notice = strchr(cursor, '\n');
+        if (notice) {
+            *notice = '\0';
+            printf("Listing incomplete: %s\n", notice + 1);
+        }
+    } while (cursor[0] != '\0');
     
-    // Receive file list
-    memset(response, 0, BUFFER_SIZE);
-    if (recv(sock, response, BUFFER_SIZE - 1, 0) <= 0) {
-        perror("Error receiving file list");
-        return -1;
+    if (listed == 0) {
+        printf("No files found in this directory\n");
     }
-    
-    printf("Files in %s:\n%s\n", pathname, response);
     return 0;
 }
 
@@ -378,13 +1066,15 @@ int main() {
     char cmd[32];
     char arg1[MAX_PATH];
     char arg2[MAX_PATH];
+    char arg3[MAX_PATH];
+    int sock = -1;
     
     printf("W25 Distributed File System Client\n");
     printf("Available commands:\n");
-    printf("  uploadf <filename> <destination_path>\n");
-    printf("  downlf <filename>\n");
+    printf("  uploadf <filename> <destination_path> [fast|ratio|raw] [streams=<n>]\n");
+    printf("  downlf <filename> [fast|ratio|raw] [range=<first>-<last>|<first>-|-<n>] [streams=<n>]\n");
     printf("  removef <filename>\n");
-    printf("  downltar <filetype>\n");
+    printf("  downltar <filetype> [<pathname>] [since=<unix time>|manifest=<file>] [gzip]   (c, pdf, txt, zip, a list like pdf,txt, or all)\n");
     printf("  dispfnames <pathname>\n");
     printf("  exit\n");
     
@@ -407,66 +1097,137 @@ int main() {
         }
         
         // Parse command
-        int args = sscanf(input, "%s %s %s", cmd, arg1, arg2);
+        int args = sscanf(input, "%s %s %s %s", cmd, arg1, arg2, arg3);
         
         if (args < 1) {
             printf("Error: No command entered\n");
             continue;
         }
         
-        // Connect to S1 server
-        int sock = connect_to_s1_server();
+        // Connect to S1 server; the connection is reused across commands
         if (sock < 0) {
-            printf("Failed to connect to S1 server\n");
-            continue;
+            sock = connect_to_s1_server();
+            if (sock < 0) {
+                printf("Failed to connect to S1 server\n");
+                continue;
+            }
         }
         
+        int result = 0;
+        
         // Process command
         if (strcmp(cmd, "uploadf") == 0) {
-            if (args != 3) {
-                printf("Error: Usage: uploadf <filename> <destination_path>\n");
-                close(sock);
+            // Words after the destination: a compression choice and a streams=, each optional
+            const char *compression = NULL;
+            int streams = 0;
+            int valid = args >= 3;
+            char *saveptr;
+            strtok_r(input, " \t", &saveptr);
+            strtok_r(NULL, " \t", &saveptr);
+            strtok_r(NULL, " \t", &saveptr);
+            for (char *word = strtok_r(NULL, " \t", &saveptr); valid && word; word = strtok_r(NULL, " \t", &saveptr)) {
+                if (strncmp(word, "streams=", 8) == 0 && !streams) {
+                    streams = atoi(word + 8);
+                    valid = streams >= 1 && streams <= PARALLEL_MAX_STREAMS;
+                } else if (!compression) {
+                    compression = word;
+                } else {
+                    valid = 0;
+                }
+            }
+            int level = parse_compression(compression);
+            if (!valid || level < 0) {
+                printf("Error: Usage: uploadf <filename> <destination_path> [fast|ratio|raw] [streams=<1-%d>]\n",
+                       PARALLEL_MAX_STREAMS);
                 continue;
             }
-            handle_uploadf(sock, arg1, arg2);
+            result = handle_uploadf(sock, arg1, arg2, level, streams ? streams : PARALLEL_STREAMS);
         } 
         else if (strcmp(cmd, "downlf") == 0) {
-            if (args != 2) {
-                printf("Error: Usage: downlf <filename>\n");
-                close(sock);
+            // Words after the path: a compression choice, a range= and a streams=, each optional
+            const char *compression = NULL;
+            const char *range = NULL;
+            int streams = 0;
+            int valid = args >= 2;
+            char *saveptr;
+            strtok_r(input, " \t", &saveptr);
+            strtok_r(NULL, " \t", &saveptr);
+            for (char *word = strtok_r(NULL, " \t", &saveptr); valid && word; word = strtok_r(NULL, " \t", &saveptr)) {
+                DfsRange parsed;
+                char probe[CMD_SIZE];
+                snprintf(probe, sizeof(probe), " %s", word);
+                if (strncmp(word, "range=", 6) == 0 && !range) {
+                    valid = dfs_session_parse_range(probe, &parsed) == 0;
+                    range = word + 6;
+                } else if (strncmp(word, "streams=", 8) == 0 && !streams) {
+                    streams = atoi(word + 8);
+                    valid = streams >= 1 && streams <= PARALLEL_MAX_STREAMS;
+                } else if (!compression) {
+                    compression = word;
+                } else {
+                    valid = 0;
+                }
+            }
+            int level = parse_compression(compression);
+            if (!valid || level < 0) {
+                printf("Error: Usage: downlf <filename> [fast|ratio|raw] [range=<first>-<last>|<first>-|-<n>] [streams=<1-%d>]\n",
+                       PARALLEL_MAX_STREAMS);
                 continue;
             }
-            handle_downlf(sock, arg1);
+            result = handle_downlf(sock, arg1, level, range, streams ? streams : PARALLEL_STREAMS);
         } 
         else if (strcmp(cmd, "removef") == 0) {
             if (args != 2) {
                 printf("Error: Usage: removef <filename>\n");
-                close(sock);
                 continue;
             }
-            handle_removef(sock, arg1);
+            result = handle_removef(sock, arg1);
         } 
         else if (strcmp(cmd, "downltar") == 0) {
-            if (args != 2) {
-                printf("Error: Usage: downltar <filetype>\n");
-                close(sock);
+            // Words after the type: a ~/S1 directory, since= or manifest=, and gzip, each optional
+            const char *dirpath = NULL;
+            const char *option = NULL;
+            int compress = 0;
+            int valid = args >= 2;
+            char *saveptr;
+            strtok_r(input, " \t", &saveptr);
+            strtok_r(NULL, " \t", &saveptr);
+            for (char *word = strtok_r(NULL, " \t", &saveptr); valid && word; word = strtok_r(NULL, " \t", &saveptr)) {
+                if (strcmp(word, "gzip") == 0 && !compress) {
+                    compress = 1;
+                } else if (word[0] == '~' && !dirpath) {
+                    dirpath = word;
+                } else if (!option) {
+                    option = word;
+                } else {
+                    valid = 0;
+                }
+            }
+            if (!valid) {
+                printf("Error: Usage: downltar <filetype> [<pathname>] [since=<unix time>|manifest=<file>] [gzip]\n");
                 continue;
             }
-            handle_downltar(sock, arg1);
+            result = handle_downltar(sock, arg1, dirpath, option, compress);
         } 
         else if (strcmp(cmd, "dispfnames") == 0) {
             if (args != 2) {
                 printf("Error: Usage: dispfnames <pathname>\n");
-                close(sock);
                 continue;
             }
-            handle_dispfnames(sock, arg1);
+            result = handle_dispfnames(sock, arg1);
         } 
         else {
             printf("Error: Unknown command '%s'\n", cmd);
         }
         
-        // Close connection to server
+        // Start over with a fresh connection after a failed command
+        if (result != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    
+    if (sock >= 0) {
         close(sock);
     }
     